@@ -1,39 +1,132 @@
 #include "compilium.h"
 
-static int reg_used_table[NUM_OF_SCRATCH_REGS];
-static struct Node *reg_node_table[NUM_OF_SCRATCH_REGS];
+// Each value gets its own virtual register. Physical registers are assigned
+// later by the register allocator.
+static int num_of_vregs;
+static int local_var_size;
 
 static void AllocReg(struct Node *n) {
   assert(n);
-  for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-    if (!reg_used_table[i]) {
-      reg_used_table[i] = 1;
-      reg_node_table[i] = n;
-      n->reg = i;
-      return;
-    }
+  n->reg = ++num_of_vregs;
+}
+
+static struct Node *AddLocalVarOfFunc(struct SymbolEntry **ctx,
+                                      const char *key,
+                                      struct Node *var_type) {
+  struct Node *local_var = AddLocalVar(ctx, key, var_type);
+  // Scalar vars may be kept in a vreg unless their address is taken.
+  enum NodeType type = GetTypeWithoutAttr(var_type)->type;
+  if (type == kTypeBase || type == kTypePointer) AllocReg(local_var);
+  if (local_var->byte_offset > local_var_size)
+    local_var_size = local_var->byte_offset;
+  return local_var;
+}
+
+static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx);
+
+// Returns the local var which is the base of an lvalue like x, (x) or x.a.b
+static struct Node *GetBaseLocalVar(struct Node *n) {
+  while (n->type == kASTExpr && (IsEqualTokenWithCStr(n->op, "(") ||
+                                 IsEqualTokenWithCStr(n->op, "."))) {
+    n = IsEqualTokenWithCStr(n->op, "(") ? n->right : n->left;
+  }
+  return n->type == kASTExpr ? n->local_var : NULL;
+}
+
+// Scalar members of a struct local var may be replaced by a var for each
+// member, which can be kept in a vreg unless the struct escapes.
+static struct Node *GetMemberVar(struct Node *struct_var, struct Node *member) {
+  if (!struct_var->member_vars) struct_var->member_vars = AllocList();
+  for (int i = 0; i < GetSizeOfList(struct_var->member_vars); i++) {
+    struct Node *v = GetNodeAt(struct_var->member_vars, i);
+    if (v->struct_member_ent_ofs == member->struct_member_ent_ofs) return v;
   }
-  fprintf(stderr, "\n**** Allocated regs ****\n");
-  for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-    fprintf(stderr, "reg[%d]:\n", i);
-    if (reg_node_table[i]->op) {
-      PrintTokenLine(reg_node_table[i]->op);
-    } else {
-      fprintf(stderr, "Op info not found\n");
+  struct Node *v = CreateASTLocalVar(
+      struct_var->byte_offset - member->struct_member_ent_ofs,
+      GetTypeWithoutAttr(member->struct_member_ent_type));
+  v->struct_member_ent_ofs = member->struct_member_ent_ofs;
+  v->parent_var = struct_var;
+  AllocReg(v);
+  PushToList(struct_var->member_vars, v);
+  return v;
+}
+
+static int GetSethiUllmanNumber(struct Node *n) {
+  return n->sethi_ullman_number ? n->sethi_ullman_number : 1;
+}
+
+static bool CanEvalRightFirst(struct Node *n) {
+  // Operands of &&, || and , are sequenced and assignments are generated in
+  // their own way.
+  if (IsEqualTokenWithCStr(n->op, "[")) return true;
+  return IsLeftAssocBinOp(n) && !IsEqualTokenWithCStr(n->op, "&&") &&
+         !IsEqualTokenWithCStr(n->op, "||") &&
+         !IsEqualTokenWithCStr(n->op, ",");
+}
+
+// Labels an expr node with the number of registers needed to evaluate it
+// (Sethi-Ullman number) and decides which operand is evaluated first. The
+// order of evaluation of operands is unspecified in C, so the operand which
+// needs more registers is evaluated first to keep fewer values alive.
+static void CalcSethiUllmanNumber(struct Node *node) {
+  if (node->type == kASTExprFuncCall) {
+    // Args are evaluated in descending order of their numbers and stay alive
+    // until the call. The callee address is evaluated last.
+    int num_of_args = GetSizeOfList(node->arg_expr_list);
+    int *nums = malloc(sizeof(int) * (num_of_args + 1));
+    assert(nums);
+    for (int i = 0; i < num_of_args; i++) {
+      int v = GetSethiUllmanNumber(GetNodeAt(node->arg_expr_list, i));
+      int k;
+      for (k = i; k > 0 && nums[k - 1] < v; k--) nums[k] = nums[k - 1];
+      nums[k] = v;
     }
+    int need = num_of_args + GetSethiUllmanNumber(node->func_expr);
+    for (int i = 0; i < num_of_args; i++) {
+      if (nums[i] + i > need) need = nums[i] + i;
+    }
+    free(nums);
+    node->sethi_ullman_number = need;
+    return;
+  }
+  if (node->type != kASTExpr) return;
+  if (node->cond) {
+    int need = GetSethiUllmanNumber(node->cond);
+    if (GetSethiUllmanNumber(node->left) > need)
+      need = GetSethiUllmanNumber(node->left);
+    if (GetSethiUllmanNumber(node->right) > need)
+      need = GetSethiUllmanNumber(node->right);
+    node->sethi_ullman_number = need;
+  } else if (node->left && node->right && node->right->type != kNodeToken) {
+    int l = GetSethiUllmanNumber(node->left);
+    int r = GetSethiUllmanNumber(node->right);
+    node->sethi_ullman_number = l == r ? l + 1 : l > r ? l : r;
+    node->eval_right_first = r > l && CanEvalRightFirst(node);
+  } else if (node->left) {
+    node->sethi_ullman_number = GetSethiUllmanNumber(node->left);
+  } else if (node->right && !IsTokenWithType(node->op, kTokenKwSizeof)) {
+    node->sethi_ullman_number = GetSethiUllmanNumber(node->right);
+  } else {
+    node->sethi_ullman_number = 1;
   }
-  fprintf(stderr, "\n**** Tried to allocate reg for ****\n");
-  PrintASTNode(n);
-  ErrorWithToken(n->op, "No free registers found");
 }
 
-static void FreeReg(int reg) {
-  assert(1 <= reg && reg <= NUM_OF_SCRATCH_REGS);
-  reg_used_table[reg] = 0;
-  reg_node_table[reg] = NULL;
+// Analyzes the rest of binary op node whose left operand is analyzed already.
+static void AnalyzeBinOpRight(struct Node *node, struct SymbolEntry **ctx) {
+  AnalyzeNode(node->right, ctx);
+  if (IsEqualTokenWithCStr(node->op, "=") ||
+      IsEqualTokenWithCStr(node->op, ",")) {
+    node->reg = node->right->reg;
+    node->expr_type = GetRValueType(node->right->expr_type);
+    return;
+  }
+  node->reg = node->left->reg;
+  node->expr_type = GetRValueType(node->left->expr_type);
+  FoldExpr(node);
+  CalcSethiUllmanNumber(node);
 }
 
-static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
+static void AnalyzeNodeBody(struct Node *node, struct SymbolEntry **ctx) {
   assert(node);
   if (node->type == kASTList && !node->op) {
     for (int i = 0; i < GetSizeOfList(node); i++) {
@@ -42,21 +135,20 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     return;
   }
   if (node->type == kASTExprFuncCall) {
-    node->stack_size_needed = (GetLastLocalVarOffset(*ctx) + 0xF) & ~0xF;
     AllocReg(node);
     // TODO: support expe_type other than int
     node->expr_type = CreateTypeBase(CreateToken("int"));
     AnalyzeNode(node->func_expr, ctx);
-    FreeReg(node->func_expr->reg);
     for (int i = 0; i < GetSizeOfList(node->arg_expr_list); i++) {
       struct Node *n = GetNodeAt(node->arg_expr_list, i);
       AnalyzeNode(n, ctx);
-      FreeReg(n->reg);
     }
     return;
   } else if (node->type == kASTFuncDef) {
     AddFuncDef(ctx, CreateTokenStr(node->func_name_token), node);
     struct SymbolEntry *saved_ctx = *ctx;
+    num_of_vregs = 0;
+    local_var_size = 0;
     struct Node *arg_type_list = GetArgTypeList(node->func_type);
     assert(arg_type_list);
     node->arg_var_list = AllocList();
@@ -71,10 +163,12 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       struct Node *arg_type = GetTypeWithoutAttr(arg_type_with_attr);
       assert(arg_type);
       struct Node *local_var =
-          AddLocalVar(ctx, CreateTokenStr(arg_ident_token), arg_type);
+          AddLocalVarOfFunc(ctx, CreateTokenStr(arg_ident_token), arg_type);
       PushToList(node->arg_var_list, local_var);
     }
     AnalyzeNode(node->func_body, ctx);
+    node->num_of_vregs = num_of_vregs;
+    node->stack_size_needed = local_var_size;
     *ctx = saved_ctx;
     return;
   }
@@ -99,13 +193,22 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       AnalyzeNode(node->left, ctx);
       AnalyzeNode(node->right, ctx);
       node->reg = node->left->reg;
-      FreeReg(node->right->reg);
       node->expr_type = CreateTypeLValue(
           GetTypeWithoutAttr(node->left->expr_type)->type_array_type_of);
       return;
     } else if (IsEqualTokenWithCStr(node->op, ".") ||
                IsEqualTokenWithCStr(node->op, "->")) {
+      // Using a struct var as a value makes it escape, but accessing its
+      // member does not.
+      struct Node *base_var = NULL;
+      bool was_address_taken = false;
+      if (IsEqualTokenWithCStr(node->op, ".") && node->left->type == kASTExpr &&
+          IsTokenWithType(node->left->op, kTokenIdent)) {
+        base_var = FindLocalVar(*ctx, node->left->op);
+        if (base_var) was_address_taken = base_var->is_address_taken;
+      }
       AnalyzeNode(node->left, ctx);
+      if (base_var) base_var->is_address_taken = was_address_taken;
       node->reg = node->left->reg;
       PrintASTNode(node->left->expr_type);
       assert(node->right && node->right->type == kNodeToken);
@@ -118,6 +221,14 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
         node->byte_offset = member->struct_member_ent_ofs;
         node->expr_type = CreateTypeLValue(
             GetTypeWithoutAttr(member->struct_member_ent_type));
+        if (base_var) {
+          enum NodeType type = GetRValueType(node->expr_type)->type;
+          if (type == kTypeBase || type == kTypePointer) {
+            node->local_var = GetMemberVar(base_var, member);
+          } else {
+            base_var->is_address_taken = true;
+          }
+        }
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "->")) {
@@ -137,10 +248,12 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     } else if (IsTokenWithType(node->op, kTokenIdent)) {
       struct Node *ident_info = FindLocalVar(*ctx, node->op);
       if (ident_info) {
+        node->local_var = ident_info;
         node->byte_offset = ident_info->byte_offset;
         AllocReg(node);
         enum NodeType expr_type =
             GetTypeWithoutAttr(ident_info->expr_type)->type;
+        if (expr_type == kTypeStruct) ident_info->is_address_taken = true;
         if (expr_type == kTypeStruct || expr_type == kTypeArray) {
           node->expr_type = ident_info->expr_type;
           return;
@@ -165,8 +278,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       AnalyzeNode(node->cond, ctx);
       AnalyzeNode(node->left, ctx);
       AnalyzeNode(node->right, ctx);
-      FreeReg(node->left->reg);
-      FreeReg(node->right->reg);
       assert(
           IsSameTypeExceptAttr(node->left->expr_type, node->right->expr_type));
       node->reg = node->cond->reg;
@@ -175,13 +286,14 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     } else if (!node->left && node->right) {
       AnalyzeNode(node->right, ctx);
       if (IsTokenWithType(node->op, kTokenKwSizeof)) {
-        FreeReg(node->right->reg);
         AllocReg(node);
         node->expr_type = CreateTypeBase(CreateToken("int"));
         return;
       }
       node->reg = node->right->reg;
       if (IsEqualTokenWithCStr(node->op, "&")) {
+        struct Node *var = GetBaseLocalVar(node->right);
+        if (var) var->is_address_taken = true;
         node->expr_type =
             CreateTypePointer(GetRValueType(node->right->expr_type));
         return;
@@ -203,18 +315,21 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
         return;
       }
     } else if (node->left && node->right) {
-      AnalyzeNode(node->left, ctx);
-      AnalyzeNode(node->right, ctx);
-      if (IsEqualTokenWithCStr(node->op, "=") ||
-          IsEqualTokenWithCStr(node->op, ",")) {
-        FreeReg(node->left->reg);
-        node->reg = node->right->reg;
-        node->expr_type = GetRValueType(node->right->expr_type);
+      if (!IsLeftAssocBinOp(node->left)) {
+        AnalyzeNode(node->left, ctx);
+        AnalyzeBinOpRight(node, ctx);
         return;
       }
-      FreeReg(node->right->reg);
-      node->reg = node->left->reg;
-      node->expr_type = GetRValueType(node->left->expr_type);
+      // Walk the left spine of long chains like a + b + c + ... iteratively
+      struct Node *chain = AllocList();
+      struct Node *n;
+      for (n = node; n == node || IsLeftAssocBinOp(n); n = n->left) {
+        PushToList(chain, n);
+      }
+      AnalyzeNode(n, ctx);
+      for (int i = GetSizeOfList(chain) - 1; i >= 0; i--) {
+        AnalyzeBinOpRight(GetNodeAt(chain, i), ctx);
+      }
       return;
     }
     assert(false);
@@ -222,7 +337,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
   if (node->type == kASTExprStmt) {
     if (!node->left) return;
     AnalyzeNode(node->left, ctx);
-    if (node->left->reg) FreeReg(node->left->reg);
     return;
   } else if (node->type == kASTList) {
     struct SymbolEntry *saved_ctx = *ctx;
@@ -254,52 +368,64 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       return;
     }
     assert(type && type_ident);
-    AddLocalVar(ctx, CreateTokenStr(type_ident), type);
+    AddLocalVarOfFunc(ctx, CreateTokenStr(type_ident), type);
     assert(node->right->type == kASTDecltor);
     if (node->right->decltor_init_expr) {
       struct Node *left_expr = AllocNode(kASTExpr);
       left_expr->op = type_ident;
       node->right->decltor_init_expr->left = left_expr;
       AnalyzeNode(node->right->decltor_init_expr, ctx);
-      FreeReg(node->right->decltor_init_expr->reg);
     }
     return;
   } else if (node->type == kASTJumpStmt) {
     if (IsTokenWithType(node->op, kTokenKwReturn)) {
       if (!node->right) return;
       AnalyzeNode(node->right, ctx);
-      FreeReg(node->right->reg);
       return;
     }
   } else if (node->type == kASTSelectionStmt) {
     if (IsTokenWithType(node->op, kTokenKwIf)) {
-      AnalyzeNode(node->cond, ctx);
-      FreeReg(node->cond->reg);
-      AnalyzeNode(node->if_true_stmt, ctx);
-      if (node->if_else_stmt) {
-        AnalyzeNode(node->if_else_stmt, ctx);
+      // else-if chains are handled in this loop, not by recursion
+      struct Node *n = node;
+      while (true) {
+        AnalyzeNode(n->cond, ctx);
+        FoldCondition(n->cond);
+        AnalyzeNode(n->if_true_stmt, ctx);
+        n = n->if_else_stmt;
+        if (!n) break;
+        if (n->type != kASTSelectionStmt) {
+          AnalyzeNode(n, ctx);
+          break;
+        }
       }
       return;
     }
   } else if (node->type == kASTForStmt) {
     AnalyzeNode(node->init, ctx);
-    if (node->init->reg) FreeReg(node->init->reg);
     AnalyzeNode(node->cond, ctx);
-    FreeReg(node->cond->reg);
+    FoldCondition(node->cond);
     AnalyzeNode(node->updt, ctx);
-    FreeReg(node->updt->reg);
     AnalyzeNode(node->body, ctx);
     return;
   } else if (node->type == kASTWhileStmt) {
     AnalyzeNode(node->cond, ctx);
-    FreeReg(node->cond->reg);
+    FoldCondition(node->cond);
     AnalyzeNode(node->body, ctx);
     return;
   }
   ErrorWithToken(node->op, "AnalyzeNode: Not implemented");
 }
 
-void Analyze(struct Node *ast) {
-  struct SymbolEntry *root_ctx = NULL;
-  AnalyzeNode(ast, &root_ctx);
+static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
+  AnalyzeNodeBody(node, ctx);
+  FoldExpr(node);
+  CalcSethiUllmanNumber(node);
+}
+
+struct SymbolEntry *AnalyzeInContext(struct SymbolEntry *ctx,
+                                     struct Node *ast) {
+  AnalyzeNode(ast, &ctx);
+  return ctx;
 }
+
+void Analyze(struct Node *ast) { AnalyzeInContext(NULL, ast); }
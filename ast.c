@@ -16,6 +16,23 @@ struct Node *CreateASTBinOp(struct Node *t, struct Node *left,
   return op;
 }
 
+static bool IsAssignOpToken(struct Node *t) {
+  if (t->begin[t->length - 1] != '=') return false;
+  return !IsEqualTokenWithCStr(t, "==") && !IsEqualTokenWithCStr(t, "!=") &&
+         !IsEqualTokenWithCStr(t, "<=") && !IsEqualTokenWithCStr(t, ">=");
+}
+
+bool IsLeftAssocBinOp(struct Node *n) {
+  // true for a + b, a && b, a, b ... but not for assignments, a[b], a.b, a->b
+  if (!n || n->type != kASTExpr || !n->left || !n->right || n->cond)
+    return false;
+  if (!IsTokenWithType(n->op, kTokenPunctuator)) return false;
+  if (IsEqualTokenWithCStr(n->op, "[") || IsEqualTokenWithCStr(n->op, ".") ||
+      IsEqualTokenWithCStr(n->op, "->"))
+    return false;
+  return !IsAssignOpToken(n->op);
+}
+
 struct Node *CreateASTUnaryPrefixOp(struct Node *t, struct Node *right) {
   if (!right) ErrorWithToken(t, "Expected expression after prefix operator");
   struct Node *op = AllocNode(kASTExpr);
@@ -137,6 +154,21 @@ static void PrintPadding(int depth) {
   }
 }
 
+static void PrintASTNodeSub(struct Node *n, int depth);
+static void PrintASTExprHead(struct Node *n, int depth) {
+  fprintf(stderr, "(op=");
+  if (n->op) PrintTokenBrief(n->op);
+  if (n->expr_type) {
+    fprintf(stderr, ":");
+    PrintASTNodeSub(n->expr_type, depth + 1);
+  }
+  if (n->reg) fprintf(stderr, " reg: %d", n->reg);
+  if (n->cond) {
+    fprintf(stderr, " cond=");
+    PrintASTNodeSub(n->cond, depth + 1);
+  }
+}
+
 static void PrintASTNodeSub(struct Node *n, int depth) {
   if (!n) {
     fprintf(stderr, "(null)");
@@ -239,17 +271,23 @@ static void PrintASTNodeSub(struct Node *n, int depth) {
     fprintf(stderr, ")");
     return;
   }
-  fprintf(stderr, "(op=");
-  if (n->op) PrintTokenBrief(n->op);
-  if (n->expr_type) {
-    fprintf(stderr, ":");
-    PrintASTNodeSub(n->expr_type, depth + 1);
-  }
-  if (n->reg) fprintf(stderr, " reg: %d", n->reg);
-  if (n->cond) {
-    fprintf(stderr, " cond=");
-    PrintASTNodeSub(n->cond, depth + 1);
+  if (IsLeftAssocBinOp(n) && IsLeftAssocBinOp(n->left)) {
+    // Print long chains like a + b + c + ... without deep recursion
+    struct Node *chain = AllocList();
+    for (; IsLeftAssocBinOp(n); n = n->left) {
+      PushToList(chain, n);
+      PrintASTExprHead(n, depth);
+      fprintf(stderr, " L=");
+    }
+    PrintASTNodeSub(n, depth + 1);
+    for (int i = GetSizeOfList(chain) - 1; i >= 0; i--) {
+      fprintf(stderr, " R=");
+      PrintASTNodeSub(GetNodeAt(chain, i)->right, depth + 1);
+      fprintf(stderr, ")");
+    }
+    return;
   }
+  PrintASTExprHead(n, depth);
   if (n->left) {
     fprintf(stderr, " L=");
     PrintASTNodeSub(n->left, depth + 1);
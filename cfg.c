@@ -0,0 +1,190 @@
+#include "compilium.h"
+
+// CFG simplification after SSA form is removed
+//
+// Jumps to blocks which only jump or branch elsewhere are threaded to the
+// final target when the outcome of the branch is known on the edge, blocks
+// are merged into their only pred, and branches to the same block become
+// jumps. Copies made dead by threading are removed so that the blocks which
+// held them can be skipped too. Fall-through jumps are elided by the
+// lowering.
+
+#define MAX_THREADING_DEPTH 8
+#define BITS_PER_WORD 64
+#define WORDS_FOR_BITS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+static bool IsBitSet(const unsigned long long *bits, int i) {
+  return (bits[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+static void SetBit(unsigned long long *bits, int i) {
+  bits[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+}
+
+static void ClearBit(unsigned long long *bits, int i) {
+  bits[i / BITS_PER_WORD] &= ~(1ULL << (i % BITS_PER_WORD));
+}
+
+// Sets live to the live-out of b and walks b backward. Copies and consts
+// whose results are not live are removed if requested.
+static bool TransferLiveness(struct IRBlock *b, unsigned long long *live_ins,
+                             unsigned long long *live, int words,
+                             bool remove_dead) {
+  bool removed = false;
+  for (int w = 0; w < words; w++) live[w] = 0;
+  for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+    unsigned long long *succ_live_in =
+        &live_ins[GetIRSucc(b, s)->rpo_index * words];
+    for (int w = 0; w < words; w++) live[w] |= succ_live_in[w];
+  }
+  for (int k = b->num_of_insns - 1; k >= 0; k--) {
+    struct IRInsn *insn = b->insns[k];
+    if (insn->dst && !IsBitSet(live, insn->dst) && remove_dead &&
+        (insn->op == kIRCopy || insn->op == kIRConst)) {
+      RemoveIRInsn(b, k);
+      removed = true;
+      continue;
+    }
+    if (insn->dst) ClearBit(live, insn->dst);
+    for (int s = 0; s < insn->num_of_srcs; s++) SetBit(live, insn->srcs[s]);
+  }
+  return removed;
+}
+
+static bool RemoveDeadCopies(struct IRFunc *f) {
+  CalcIRDominators(f);
+  int n = f->num_of_blocks;
+  int words = WORDS_FOR_BITS(f->num_of_vregs + 1);
+  unsigned long long *live_ins = calloc((size_t)n * words, 8);
+  unsigned long long *live = calloc(words, 8);
+  assert(live_ins && live);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = n - 1; i >= 0; i--) {
+      struct IRBlock *b = f->blocks[i];
+      TransferLiveness(b, live_ins, live, words, false);
+      unsigned long long *live_in = &live_ins[b->rpo_index * words];
+      for (int w = 0; w < words; w++) {
+        if (live[w] == live_in[w]) continue;
+        live_in[w] = live[w];
+        changed = true;
+      }
+    }
+  }
+  bool removed = false;
+  for (int i = 0; i < n; i++) {
+    if (TransferLiveness(f->blocks[i], live_ins, live, words, true))
+      removed = true;
+  }
+  free(live);
+  free(live_ins);
+  return removed;
+}
+
+static int GetTruthOnEdge(struct IRBlock *from, struct IRBlock *to, int vreg,
+                          int depth);
+
+// Returns 1 if the vreg is known to be nonzero before the index-th insn of
+// b, 0 if known to be zero, or -1 if unknown.
+static int GetTruthBefore(struct IRBlock *b, int index, int vreg, int depth) {
+  for (int k = index - 1; k >= 0; k--) {
+    struct IRInsn *insn = b->insns[k];
+    if (insn->dst != vreg) continue;
+    if (insn->op == kIRConst) return insn->imm != 0;
+    if (insn->op != kIRCopy) return -1;
+    vreg = insn->srcs[0];
+  }
+  if (depth <= 0 || b->num_of_preds != 1) return -1;
+  return GetTruthOnEdge(b->preds[0], b, vreg, depth - 1);
+}
+
+static int GetTruthOnEdge(struct IRBlock *from, struct IRBlock *to, int vreg,
+                          int depth) {
+  struct IRInsn *t = GetIRTerminator(from);
+  if (t->op == kIRBranch && t->srcs[0] == vreg &&
+      t->targets[0] != t->targets[1])
+    return to == t->targets[0];
+  return GetTruthBefore(from, from->num_of_insns - 1, vreg, depth);
+}
+
+// Returns where control goes after entering to from b, skipping blocks which
+// only jump or branch in a known way.
+static struct IRBlock *GetThreadedTarget(struct IRBlock *b,
+                                         struct IRBlock *to) {
+  struct IRBlock *from = b;
+  for (int i = 0; i < MAX_THREADING_DEPTH; i++) {
+    if (to->num_of_insns != 1) break;
+    struct IRInsn *t = to->insns[0];
+    struct IRBlock *next = NULL;
+    if (t->op == kIRJump) {
+      next = t->targets[0];
+    } else if (t->op == kIRBranch) {
+      // Only the first step can use what is known on the edge from b.
+      int truth = from == b ? GetTruthOnEdge(b, to, t->srcs[0],
+                                             MAX_THREADING_DEPTH)
+                            : -1;
+      if (truth < 0) break;
+      next = t->targets[truth ? 0 : 1];
+    }
+    if (!next || next == to) break;
+    from = to;
+    to = next;
+  }
+  return to;
+}
+
+static bool ThreadJumps(struct IRFunc *f) {
+  bool changed = false;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    struct IRInsn *t = GetIRTerminator(b);
+    int num_of_targets =
+        t->op == kIRJump ? 1 : t->op == kIRBranch ? 2 : 0;
+    for (int k = 0; k < num_of_targets; k++) {
+      struct IRBlock *target = GetThreadedTarget(b, t->targets[k]);
+      if (target == t->targets[k]) continue;
+      t->targets[k] = target;
+      changed = true;
+    }
+    if (t->op == kIRBranch && t->targets[0] == t->targets[1]) {
+      ReplaceIRTerminatorWithJump(b, t->targets[0]);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Merges b and the block which b jumps to if b is its only pred.
+static bool MergeWithSucc(struct IRFunc *f, struct IRBlock *b) {
+  struct IRInsn *t = GetIRTerminator(b);
+  if (!t || t->op != kIRJump) return false;
+  struct IRBlock *succ = t->targets[0];
+  if (succ == b || succ == f->blocks[0] || succ->num_of_preds != 1)
+    return false;
+  RemoveIRInsn(b, b->num_of_insns - 1);
+  MoveIRInsnsToEnd(b, succ);
+  for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+    struct IRBlock *next = GetIRSucc(b, s);
+    for (int p = 0; p < next->num_of_preds; p++) {
+      if (next->preds[p] == succ) next->preds[p] = b;
+    }
+  }
+  // The emptied block is no longer reachable and removed later.
+  succ->num_of_preds = 0;
+  return true;
+}
+
+void SimplifyCFG(struct IRFunc *f) {
+  bool changed = true;
+  while (changed) {
+    CalcIRPreds(f);
+    changed = ThreadJumps(f);
+    RemoveUnreachableIRBlocks(f);
+    for (int i = 0; i < f->num_of_blocks; i++) {
+      while (MergeWithSucc(f, f->blocks[i])) changed = true;
+    }
+    RemoveUnreachableIRBlocks(f);
+    if (RemoveDeadCopies(f)) changed = true;
+  }
+}
@@ -1,6 +1,11 @@
+#include <limits.h>
+
 #include "compilium.h"
 
 const char *symbol_prefix;
+static const char *emit_pch_path;
+static const char *include_pch_path;
+static const char *incremental_cache_path;
 
 _Noreturn void Error(const char *fmt, ...) {
   fflush(stdout);
@@ -19,6 +24,7 @@ _Noreturn void __assert(const char *expr_str, const char *file, int line) {
 
 void TestList(void);
 void TestType(void);
+void BenchParser(void);
 void ParseCompilerArgs(int argc, char **argv) {
   symbol_prefix = "_";
   for (int i = 1; i < argc; i++) {
@@ -31,10 +37,28 @@ void ParseCompilerArgs(int argc, char **argv) {
       } else {
         Error("Unknown os type %s", argv[i]);
       }
+    } else if (strcmp(argv[i], "--emit-pch") == 0) {
+      if (++i >= argc) Error("--emit-pch needs an output path");
+      emit_pch_path = argv[i];
+    } else if (strcmp(argv[i], "--include-pch") == 0) {
+      if (++i >= argc) Error("--include-pch needs a path");
+      include_pch_path = argv[i];
+    } else if (strcmp(argv[i], "--incremental-cache") == 0) {
+      if (++i >= argc) Error("--incremental-cache needs a path");
+      incremental_cache_path = argv[i];
+    } else if (strcmp(argv[i], "--parse-threads") == 0) {
+      if (++i >= argc) Error("--parse-threads needs a number");
+      num_of_parse_threads = atoi(argv[i]);
+    } else if (strcmp(argv[i], "--dump=ir") == 0) {
+      dump_ir = true;
+    } else if (strcmp(argv[i], "--prefetch") == 0) {
+      insert_prefetches = true;
     } else if (strcmp(argv[i], "--run-unittest=List") == 0) {
       TestList();
     } else if (strcmp(argv[i], "--run-unittest=Type") == 0) {
       TestType();
+    } else if (strcmp(argv[i], "--run-bench=Parser") == 0) {
+      BenchParser();
     } else {
       Error("Unknown argument: %s", argv[i]);
     }
@@ -171,22 +195,72 @@ void TestList() {
   exit(EXIT_SUCCESS);
 }
 
-const char *reg_names_64[NUM_OF_SCRATCH_REGS + 1] = {NULL, "rdi", "rsi", "r8",
-                                                     "r9"};
-const char *reg_names_32[NUM_OF_SCRATCH_REGS + 1] = {NULL, "edi", "esi", "r8d",
-                                                     "r9d"};
-const char *reg_names_8[NUM_OF_SCRATCH_REGS + 1] = {NULL, "dil", "sil", "r8b",
-                                                    "r9b"};
+// rax, rcx and rdx are used implicitly by some instructions and r10, r11 are
+// reserved for reloading spilled values, so they are not allocatable.
+const char *reg_names_64[NUM_OF_ALLOCATABLE_REGS] = {
+    "rdi", "rsi", "r8", "r9", "rbx", "r12", "r13", "r14", "r15"};
+const char *reg_names_32[NUM_OF_ALLOCATABLE_REGS] = {
+    "edi", "esi", "r8d", "r9d", "ebx", "r12d", "r13d", "r14d", "r15d"};
+const char *reg_names_8[NUM_OF_ALLOCATABLE_REGS] = {
+    "dil", "sil", "r8b", "r9b", "bl", "r12b", "r13b", "r14b", "r15b"};
+const bool is_callee_saved_reg[NUM_OF_ALLOCATABLE_REGS] = {
+    false, false, false, false, true, true, true, true, true};
 const char *param_reg_names_64[NUM_OF_PARAM_REGISTERS] = {"rdi", "rsi", "rdx",
                                                           "rcx", "r8",  "r9"};
 const char *param_reg_names_32[NUM_OF_PARAM_REGISTERS] = {"edi", "esi", "edx",
                                                           "ecx", "r8d", "r9d"};
-const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS] = {"dl", "sil", "dl",
-                                                         "cl", "r8b", "r9b"};
+const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS] = {"dil", "sil", "dl",
+                                                         "cl",  "r8b", "r9b"};
+
+static bool IsEndOfLine(struct Node *t, int line) {
+  return !t || t->line != line || IsTokenWithType(t, kTokenLineComment);
+}
+
+// Reads #pragma name or #pragma name(N) which starts at t in the line.
+// Returns false if the pragma is not named so. The count is -1 if omitted.
+static bool ReadPragmaWithCount(struct Node *t, int line, const char *name,
+                                long *count) {
+  if (IsEndOfLine(t, line) || !IsEqualTokenWithCStr(t, name)) return false;
+  t = t->next_token;
+  *count = -1;
+  if (IsEndOfLine(t, line)) return true;
+  struct Node *n = t->next_token;
+  struct Node *close = n ? n->next_token : NULL;
+  if (!IsEqualTokenWithCStr(t, "(") || IsEndOfLine(n, line) ||
+      (!IsTokenWithType(n, kTokenDecimalNumber) &&
+       !IsTokenWithType(n, kTokenOctalNumber)) ||
+      IsEndOfLine(close, line) || !IsEqualTokenWithCStr(close, ")") ||
+      !IsEndOfLine(close->next_token, line))
+    ErrorWithToken(t, "Expected #pragma %s or #pragma %s(N)", name, name);
+  long value = strtol(n->begin, NULL, 0);
+  *count = value < INT_MAX ? value : INT_MAX;
+  return true;
+}
 
 void Preprocess(struct Node **p) {
   if (!p || !*p) return;
+  // Hints of #pragma unroll and #pragma prefetch for the next token
+  int unroll_hint = 0;
+  int prefetch_hint = 0;
   while (*p) {
+    if (IsTokenWithType(*p, kTokenPunctuator) &&
+        IsEqualTokenWithCStr(*p, "#")) {
+      struct Node *directive = *p;
+      int line = directive->line;
+      struct Node *n = directive->next_token;
+      if (!n || n->line != line || !IsEqualTokenWithCStr(n, "pragma"))
+        ErrorWithToken(directive, "Unsupported preprocessing directive");
+      // Other pragmas are ignored.
+      long count;
+      if (ReadPragmaWithCount(n->next_token, line, "unroll", &count) && count)
+        unroll_hint = count < 0 ? UNROLL_HINT_FULL : count;
+      if (ReadPragmaWithCount(n->next_token, line, "prefetch", &count))
+        prefetch_hint = count < 0 ? PREFETCH_HINT_AUTO
+                                  : count ? count : PREFETCH_HINT_OFF;
+      while (n && n->line == line) n = n->next_token;
+      *p = n;
+      continue;
+    }
     if (IsTokenWithType(*p, kTokenIdent) &&
         IsEqualTokenWithCStr(*p, "__LINE__")) {
       char s[32];
@@ -211,6 +285,14 @@ void Preprocess(struct Node **p) {
       *p = n->next_token;
       continue;
     }
+    if (unroll_hint) {
+      (*p)->unroll_hint = unroll_hint;
+      unroll_hint = 0;
+    }
+    if (prefetch_hint) {
+      (*p)->prefetch_hint = prefetch_hint;
+      prefetch_hint = 0;
+    }
     p = &(*p)->next_token;
   }
 }
@@ -239,14 +321,26 @@ int main(int argc, char *argv[]) {
   Preprocess(&tokens);
   PrintTokenSequence(tokens);
 
+  struct SymbolEntry *ctx = NULL;
+  if (include_pch_path) ctx = LoadPCH(include_pch_path);
+  if (incremental_cache_path && !emit_pch_path) {
+    CompileIncrementally(incremental_cache_path, tokens, include_pch_path, ctx);
+    return 0;
+  }
+
   struct Node *ast = Parse(tokens);
   PrintASTNode(ast);
   fputc('\n', stderr);
 
-  Analyze(ast);
+  ctx = AnalyzeInContext(ctx, ast);
   PrintASTNode(ast);
   fputc('\n', stderr);
 
+  if (emit_pch_path) {
+    EmitPCH(emit_pch_path, ast, ctx);
+    return 0;
+  }
+
   Generate(ast);
   return 0;
 }
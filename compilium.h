@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 char *strndup(const char *s, size_t n);
 char *strdup(const char *s);
@@ -49,6 +50,7 @@ enum TokenType {
   kTokenKwElse,
   kTokenKwFor,
   kTokenKwIf,
+  kTokenKwInline,
   kTokenKwInt,
   kTokenKwReturn,
   kTokenKwSizeof,
@@ -61,6 +63,7 @@ enum TokenType {
   kTokenLineComment,
   kTokenBlockCommentBegin,
   kTokenBlockCommentEnd,
+  kNumOfTokenTypes,
 };
 
 /*
@@ -81,6 +84,8 @@ Node expr-stmt:
 struct Node {
   enum NodeType type;
   int reg;
+  int sethi_ullman_number;  // registers needed to evaluate the expr
+  bool eval_right_first;
   struct Node *expr_type;
   struct Node *op;
   struct Node *left;
@@ -106,6 +111,10 @@ struct Node {
   struct Node *value;
   // for local var
   int byte_offset;
+  bool is_address_taken;
+  struct Node *local_var;  // kASTExpr of ident or member: its local var
+  struct Node *member_vars;  // struct local var: scalars of its members
+  struct Node *parent_var;   // scalar of a member: its struct local var
   // for string literal
   int label_number;
   // kASTExprFuncCall
@@ -114,6 +123,8 @@ struct Node {
   struct Node *arg_var_list;
   int stack_size_needed;
   // kASTFuncDef
+  int num_of_vregs;
+  int func_specs;  // FUNC_SPEC_* bits
   struct Node *func_body;
   struct Node *func_type;
   struct Node *func_name_token;
@@ -128,8 +139,22 @@ struct Node {
   int length;
   const char *src_str;
   int line;
+  int unroll_hint;    // given by #pragma unroll before the token, 0 if none
+  int prefetch_hint;  // given by #pragma prefetch before the token, 0 if none
 };
 
+// #pragma unroll without a count asks for full unrolling.
+#define UNROLL_HINT_FULL -1
+// #pragma prefetch without a distance asks for the estimated distance, and
+// #pragma prefetch(0) disables prefetching.
+#define PREFETCH_HINT_AUTO -1
+#define PREFETCH_HINT_OFF -2
+
+// Function specifiers which control inlining
+#define FUNC_SPEC_INLINE 1         // inline
+#define FUNC_SPEC_ALWAYS_INLINE 2  // __attribute__((always_inline))
+#define FUNC_SPEC_NOINLINE 4       // __attribute__((noinline))
+
 _Noreturn void Error(const char *fmt, ...);
 _Noreturn void __assert(const char *expr_str, const char *file, int line);
 
@@ -146,10 +171,11 @@ struct Node *GetNodeByTokenKey(struct Node *list, struct Node *key);
 
 extern const char *symbol_prefix;
 
-#define NUM_OF_SCRATCH_REGS 4
-extern const char *reg_names_64[NUM_OF_SCRATCH_REGS + 1];
-extern const char *reg_names_32[NUM_OF_SCRATCH_REGS + 1];
-extern const char *reg_names_8[NUM_OF_SCRATCH_REGS + 1];
+#define NUM_OF_ALLOCATABLE_REGS 9
+extern const char *reg_names_64[NUM_OF_ALLOCATABLE_REGS];
+extern const char *reg_names_32[NUM_OF_ALLOCATABLE_REGS];
+extern const char *reg_names_8[NUM_OF_ALLOCATABLE_REGS];
+extern const bool is_callee_saved_reg[NUM_OF_ALLOCATABLE_REGS];
 
 #define NUM_OF_PARAM_REGISTERS 6
 extern const char *param_reg_names_64[NUM_OF_PARAM_REGISTERS];
@@ -157,6 +183,9 @@ extern const char *param_reg_names_32[NUM_OF_PARAM_REGISTERS];
 extern const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS];
 
 // @analyzer.c
+struct SymbolEntry;
+struct SymbolEntry *AnalyzeInContext(struct SymbolEntry *ctx,
+                                     struct Node *ast);
 void Analyze(struct Node *node);
 
 // @ast.c
@@ -165,6 +194,7 @@ bool IsTokenWithType(struct Node *n, enum TokenType type);
 struct Node *AllocNode(enum NodeType type);
 struct Node *CreateASTBinOp(struct Node *t, struct Node *left,
                             struct Node *right);
+bool IsLeftAssocBinOp(struct Node *n);
 struct Node *CreateASTUnaryPrefixOp(struct Node *t, struct Node *right);
 struct Node *CreateASTUnaryPostfixOp(struct Node *left, struct Node *t);
 struct Node *CreateASTExprStmt(struct Node *t, struct Node *left);
@@ -188,14 +218,300 @@ struct Node *CreateASTIdent(struct Node *ident);
 struct Node *CreateTypeArray(struct Node *type_of, struct Node *index_decl);
 void PrintASTNode(struct Node *n);
 
+// @cfg.c
+struct IRFunc;
+void SimplifyCFG(struct IRFunc *f);
+
+// @dce.c
+void EliminateDeadCode(struct IRFunc *f);
+
+// @fold.c
+void FoldExpr(struct Node *n);
+void FoldCondition(struct Node *cond);
+
 // @generate.c
+void GenerateHeader(FILE *fp);
+void GenerateTopLevelItem(FILE *fp, struct Node *node);
 void Generate(struct Node *ast);
 
+// @gvn.c
+void RunGVN(struct IRFunc *f);
+
+// @incremental.c
+void CompileIncrementally(const char *cache_path, struct Node *tokens,
+                          const char *pch_path, struct SymbolEntry *ctx);
+
+// @inline.c
+struct IRFunc;
+void InlineCalls(struct IRFunc *f, struct Node *str_list);
+void SaveIRFuncForInlining(struct IRFunc *f, struct Node *func_def,
+                           struct Node *str_list);
+bool IsKeptForInlining(const char *name);
+
+// @ir.c
+enum IROp {
+  kIRConst,      // dst = imm
+  kIRCopy,       // dst = src0
+  kIRAdd,        // dst = src0 + src1
+  kIRSub,        // dst = src0 - src1
+  kIRMul,        // dst = src0 * src1
+  kIRDiv,        // dst = src0 / src1
+  kIRMod,        // dst = src0 % src1
+  kIRAnd,        // dst = src0 & src1
+  kIROr,         // dst = src0 | src1
+  kIRXor,        // dst = src0 ^ src1
+  kIRShl,        // dst = src0 << src1
+  kIRSar,        // dst = src0 >> src1
+  kIRCmpEq,      // dst = src0 == src1
+  kIRCmpNe,      // dst = src0 != src1
+  kIRCmpLt,      // dst = src0 < src1
+  kIRCmpLe,      // dst = src0 <= src1
+  kIRCmpGt,      // dst = src0 > src1
+  kIRCmpGe,      // dst = src0 >= src1
+  kIRNeg,        // dst = -src0
+  kIRNot,        // dst = ~src0
+  kIRMin,        // dst = min(src0, src1) in each lane of vectors
+  kIRMax,        // dst = max(src0, src1) in each lane of vectors
+  kIRBroadcast,  // dst = vector of src0 in every lane
+  kIRReduceAdd,  // dst = sum of the lanes of src0
+  kIRReduceMin,  // dst = min of the lanes of src0
+  kIRReduceMax,  // dst = max of the lanes of src0
+  kIRHasAVX2,    // dst = 1 if the CPU runs AVX2 insns, 0 otherwise
+  kIRSext,       // dst = src0 truncated to type and sign-extended
+  kIRParam,      // dst = imm-th param of the function
+  kIRFrameAddr,  // dst = rbp - imm
+  kIRSymAddr,    // dst = address of sym
+  kIRStrAddr,    // dst = address of the string literal labeled imm
+  kIRLoad,       // dst = *src0
+  kIRStore,      // *src0 = src1
+  kIRPrefetch,   // fetches the line at src0 with locality imm, 0 to 3
+  kIRZeroUpper,  // clears the upper halves of the ymm regs
+  kIRCall,       // dst = src0(src1, src2, ...)
+  kIRJump,       // goto targets[0]
+  kIRBranch,     // goto src0 ? targets[0] : targets[1]
+  kIRReturn,     // return src0 if any
+  kIRPhi,        // dst = srcs[i] if control came from src_blocks[i]
+  kNumOfIROps,
+};
+
+// Values are kept sign-extended to 64 bits. The type tells how many bits of
+// a value are meaningful and the size of memory accesses. Vector types hold
+// a value of the lane type in each lane, and ops on them are done lane by
+// lane, wrapping around in the lane type.
+enum IRType {
+  kIRTypeNone,
+  kIRTypeI8,
+  kIRTypeI32,
+  kIRTypeI64,
+  kIRTypePtr,
+  kIRTypeI8x16,  // SSE2
+  kIRTypeI32x4,  // SSE2
+  kIRTypeI8x32,  // AVX2
+  kIRTypeI32x8,  // AVX2
+};
+
+struct IRBlock;
+struct IRInsn {
+  enum IROp op;
+  enum IRType type;  // of dst, or of the value stored by kIRStore
+  int dst;           // 0 if the insn has no result
+  int num_of_srcs;
+  int *srcs;
+  struct IRBlock **src_blocks;  // kIRPhi: the pred where each src comes from
+  long imm;                     // kIRPhi: the vreg which the phi is placed for
+  const char *sym;
+  struct IRBlock *targets[2];
+};
+
+struct IRBlock {
+  int label;
+  int num_of_insns;
+  int insns_capacity;
+  struct IRInsn **insns;
+  int num_of_preds;
+  struct IRBlock **preds;  // valid after CalcIRPreds()
+  int rpo_index;           // valid after CalcIRDominators(), -1 if unreachable
+  struct IRBlock *idom;    // valid after CalcIRDominators()
+  int dom_pre;             // valid after CalcIRDominators(): preorder and
+  int dom_post;            // postorder numbers in the dominator tree
+  int unroll_hint;         // loop header: unroll_hint of the loop stmt
+  int prefetch_hint;       // loop header: prefetch_hint of the loop stmt
+};
+
+struct IRFunc {
+  const char *name;
+  int num_of_blocks;
+  int blocks_capacity;
+  struct IRBlock **blocks;  // blocks[0] is the entry
+  int num_of_vregs;
+  int vreg_types_capacity;
+  enum IRType *vreg_types;  // indexed by vreg
+  int num_of_labels;
+  int frame_size;  // bytes of the local vars below rbp
+};
+
+extern bool dump_ir;
+extern const char *prefetch_locality_names[4];
+struct IRFunc *AllocIRFunc(const char *name, int num_of_vregs);
+struct IRBlock *AllocIRBlock(struct IRFunc *f);
+void InsertIRBlock(struct IRFunc *f, int index, struct IRBlock *b);
+void PlaceIRBlock(struct IRFunc *f, struct IRBlock *b);
+int AllocIRVReg(struct IRFunc *f, enum IRType type);
+void SetIRVRegType(struct IRFunc *f, int vreg, enum IRType type);
+int AllocIRLabel(struct IRFunc *f);
+struct IRInsn *InsertIRInsn(struct IRBlock *b, int index, enum IROp op,
+                            enum IRType type, int dst);
+struct IRInsn *AppendIRInsn(struct IRBlock *b, enum IROp op,
+                            enum IRType type, int dst);
+void RemoveIRInsn(struct IRBlock *b, int index);
+void MoveIRInsnsToEnd(struct IRBlock *dst, struct IRBlock *src);
+void MoveIRInsn(struct IRBlock *src, int index, struct IRBlock *dst,
+                int dst_index);
+void AddIRSrc(struct IRInsn *insn, int vreg);
+void AddIRPhiSrc(struct IRInsn *phi, int vreg, struct IRBlock *from);
+struct IRInsn *AppendIRInsnCopy(struct IRBlock *b, struct IRInsn *insn);
+void RemoveIRPhiSrcsFrom(struct IRBlock *b, struct IRBlock *from);
+void ReplaceIRInsnWithConst(struct IRInsn *insn, long imm);
+void ReplaceIRTerminatorWithJump(struct IRBlock *b, struct IRBlock *target);
+bool IsIRTerminator(struct IRInsn *insn);
+struct IRInsn *GetIRTerminator(struct IRBlock *b);
+int GetNumOfIRSuccs(struct IRBlock *b);
+struct IRBlock *GetIRSucc(struct IRBlock *b, int index);
+int GetSizeOfIRType(enum IRType type);
+bool IsVectorIRType(enum IRType type);
+enum IRType GetIRLaneType(enum IRType type);
+enum IRType GetVectorIRType(enum IRType lane_type, int size);
+long TruncateToIRType(long value, enum IRType type);
+bool FoldIROp(enum IROp op, enum IRType type, long a, long b, long *result);
+void CalcIRPreds(struct IRFunc *f);
+void RemoveUnreachableIRBlocks(struct IRFunc *f);
+void PrintIRFunc(FILE *fp, struct IRFunc *f);
+void VerifyIRFunc(struct IRFunc *f);
+struct IRFunc *CopyIRFunc(struct IRFunc *f);
+void FreeIRFunc(struct IRFunc *f);
+
+// @iv.c
+void ReduceIVStrength(struct IRFunc *f);
+
+// @licm.c
+void RunLICM(struct IRFunc *f);
+
+// @loop.c
+struct IRLoop {
+  struct IRBlock *header;
+  struct IRBlock *preheader;  // only jumps to the header
+  int num_of_blocks;
+  struct IRBlock **blocks;  // in reverse postorder, blocks[0] is the header
+  int max_label;            // the largest label when the loop is found
+  bool *contains;           // indexed by label
+};
+
+struct IRLoop *FindIRLoops(struct IRFunc *f, int *num_of_loops);
+bool IsIRBlockInLoop(struct IRLoop *loop, struct IRBlock *b);
+void FreeIRLoops(struct IRLoop *loops, int num_of_loops);
+struct IRCountedLoop {
+  struct IRLoop *loop;
+  struct IRInsn *test;  // the compare in the header
+  int test_index;       // index of the test in the header
+  bool is_test_used;    // by others than the branch of the header
+  int limit;            // index of the limit in the srcs of the test
+  long step;
+  bool is_init_const;
+  long init;        // the const which the counter has on entry, if any
+  long trip_count;  // -1 if unknown
+  int size;         // number of insns in the loop
+  bool has_call;
+};
+
+bool IsIRVRegDefinedInLoop(struct IRLoop *loop, int vreg);
+bool AnalyzeIRCountedLoop(struct IRFunc *f, struct IRLoop *loop,
+                          struct IRCountedLoop *c);
+// Values of the form base + iv * scale + ofs, where iv is a phi in the loop
+// header which goes up by a const step in each iteration, and base is loop
+// invariant
+struct IRIVForm {
+  int iv;    // dst of the phi, 0 if the value is not of the form
+  int base;  // 0 if none
+  long scale;
+  long ofs;
+  bool has_mul;  // computed with a mul or a shift
+};
+struct IRLoopIVs {
+  struct IRFunc *func;
+  struct IRLoop *loop;
+  int max_vreg;  // vregs allocated after the analysis are not in the tables
+  struct IRInsn **def_insns;    // indexed by vreg
+  struct IRBlock **def_blocks;  // indexed by vreg
+  struct IRIVForm *forms;       // indexed by vreg
+  long *steps;                  // indexed by vreg: step of an iv phi
+};
+void AnalyzeIRLoopIVs(struct IRFunc *f, struct IRLoop *loop,
+                      struct IRLoopIVs *ivs);
+void FreeIRLoopIVs(struct IRLoopIVs *ivs);
+struct IRIVForm GetIRIVForm(struct IRLoopIVs *ivs, int vreg);
+bool GetIRConstOfVReg(struct IRLoopIVs *ivs, int vreg, long *value);
+bool IsIRVRegInvariant(struct IRLoopIVs *ivs, int vreg);
+
+// @nest.c
+void OptimizeLoopNests(struct IRFunc *f);
+
+// @prefetch.c
+extern bool insert_prefetches;
+int ScalePrefetchHint(int hint, int num_of_iterations);
+void InsertPrefetches(struct IRFunc *f);
+
+// @ssa.c
+void CalcIRDominators(struct IRFunc *f);
+bool DominatesIRBlock(struct IRBlock *a, struct IRBlock *b);
+void ConvertIRToSSA(struct IRFunc *f);
+void ConvertIRFromSSA(struct IRFunc *f);
+
+// @sccp.c
+void RunSCCP(struct IRFunc *f);
+
+// @unroll.c
+void UnrollLoops(struct IRFunc *f);
+
+// @vectorize.c
+void VectorizeLoops(struct IRFunc *f);
+
+// @lower.c
+void LowerIRFunc(struct IRFunc *f, const char *label_prefix);
+
+// @pch.c
+void EmitPCH(const char *path, struct Node *ast, struct SymbolEntry *ctx);
+struct SymbolEntry *LoadPCH(const char *path);
+
 // @parser.c
 extern struct Node *toplevel_names;
+extern int num_of_parse_threads;
+struct TopLevelItem {
+  struct Node *begin;      // first token of the item
+  struct Node *body;       // '{' of a function body, NULL for declarations
+  struct Node *end;        // first token of the next item
+  bool skip_body;          // parse the body as an empty compound stmt
+  int func_specs;          // FUNC_SPEC_* bits before the decl specs
+  struct Node *decl_body;  // parsed on the main thread
+  struct Node *comp_stmt;  // parsed on a worker thread
+};
 void InitParser(struct Node *head_token);
+struct Node *SkipFuncSpecs(struct Node *t);
+struct TopLevelItem *SplitTopLevelItems(struct Node *t, int *num_of_items);
+struct Node *ParseTopLevelItems(struct TopLevelItem *items, int num_of_items);
 struct Node *Parse(struct Node *passed_tokens);
 
+// @regalloc.c
+void InitMachineCode(int num_of_vregs_used);
+int AllocVReg(void);
+void EmitInsn(const char *fmt, ...);
+void EmitLabelInsn(int label);
+void EmitJumpInsn(const char *mnemonic, int label);
+void EmitCallInsn(int dst, int func, int num_of_args, const int *args);
+void EmitParamsInsn(int num_of_params, const int *params);
+void EmitReturnInsn(void);
+void PrintMachineCode(FILE *fp, const char *func_label_prefix,
+                      int local_var_size);
+
 // @struct.c
 struct SymbolEntry;
 int CalcStructSize(struct Node *spec);
@@ -211,7 +527,12 @@ enum SymbolType {
   kSymbolFuncDeclType,
   kSymbolStructType,
 };
-struct SymbolEntry;
+struct SymbolEntry {
+  enum SymbolType type;
+  struct SymbolEntry *prev;
+  const char *key;
+  struct Node *value;
+};
 int GetLastLocalVarOffset(struct SymbolEntry *);
 struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
                          struct Node *var_type);
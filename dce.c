@@ -0,0 +1,271 @@
+#include "compilium.h"
+
+// Dead code elimination on SSA form
+//
+// Stores to local slots which are never read afterwards are removed first.
+// Then insns without side effects are removed unless their results are used
+// by an insn which is kept. Unreachable blocks are removed by SCCP already.
+
+// A local slot is a range of the frame accessed at rbp - ofs with a fixed
+// size. Addresses of a slot are derived from kIRFrameAddr by copies and by
+// adding constants. Slots whose addresses are used in other ways escape, and
+// the object at rbp - base may then be accessed anywhere in [rbp - base, rbp).
+struct LocalAddr {
+  bool is_addr;
+  long base;  // imm of the frame addr which the addr is derived from
+  long ofs;   // the addr is rbp - ofs
+};
+
+struct LocalSlot {
+  long ofs;
+  int size;
+  bool is_tracked;
+};
+
+static struct IRFunc *func;
+static struct LocalAddr *addrs;  // indexed by vreg
+static long *const_values;       // indexed by vreg
+static bool *is_const_vreg;      // indexed by vreg
+static struct LocalSlot *slots;
+static int num_of_slots;
+static int slots_capacity;
+
+static bool HasSideEffects(struct IRInsn *insn) {
+  switch (insn->op) {
+    case kIRParam:
+    case kIRStore:
+    case kIRPrefetch:
+    case kIRZeroUpper:
+    case kIRCall:
+    case kIRJump:
+    case kIRBranch:
+    case kIRReturn:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Returns whether the addr of dst is derived from the addr of srcs[index].
+static bool IsAddrDerivation(struct IRInsn *insn, int index) {
+  if (insn->op == kIRCopy) return true;
+  return insn->op == kIRAdd && insn->type == kIRTypePtr &&
+         is_const_vreg[insn->srcs[1 - index]];
+}
+
+static bool IsLocalAccess(struct IRInsn *insn, int index) {
+  return index == 0 && (insn->op == kIRLoad || insn->op == kIRStore);
+}
+
+static void FindConstsAndAddrs(void) {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op == kIRConst) {
+        is_const_vreg[insn->dst] = true;
+        const_values[insn->dst] = insn->imm;
+      } else if (insn->op == kIRFrameAddr) {
+        addrs[insn->dst] = (struct LocalAddr){true, insn->imm, insn->imm};
+      }
+    }
+  }
+  // Defs of addrs may come after their uses in the block list.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < func->num_of_blocks; i++) {
+      struct IRBlock *b = func->blocks[i];
+      for (int k = 0; k < b->num_of_insns; k++) {
+        struct IRInsn *insn = b->insns[k];
+        if (!insn->dst || addrs[insn->dst].is_addr) continue;
+        for (int s = 0; s < insn->num_of_srcs; s++) {
+          struct LocalAddr a = addrs[insn->srcs[s]];
+          if (!a.is_addr || !IsAddrDerivation(insn, s)) continue;
+          if (insn->op == kIRAdd) a.ofs -= const_values[insn->srcs[1 - s]];
+          addrs[insn->dst] = a;
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+}
+
+static int FindSlot(long ofs) {
+  for (int i = 0; i < num_of_slots; i++) {
+    if (slots[i].ofs == ofs) return i;
+  }
+  return -1;
+}
+
+static void AddSlotAccess(long ofs, int size) {
+  int i = FindSlot(ofs);
+  if (i >= 0) {
+    if (slots[i].size != size) slots[i].is_tracked = false;
+    return;
+  }
+  if (num_of_slots >= slots_capacity) {
+    slots_capacity = slots_capacity * 2 + 8;
+    slots = realloc(slots, sizeof(struct LocalSlot) * slots_capacity);
+    assert(slots);
+  }
+  slots[num_of_slots++] = (struct LocalSlot){ofs, size, true};
+}
+
+static bool IsOverlapping(long ofs1, int size1, long ofs2, int size2) {
+  return -ofs1 < -ofs2 + size2 && -ofs2 < -ofs1 + size1;
+}
+
+static void FindTrackedSlots(void) {
+  long *escaped_bases = NULL;
+  int num_of_escaped_bases = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        struct LocalAddr a = addrs[insn->srcs[s]];
+        if (!a.is_addr) continue;
+        if (IsLocalAccess(insn, s)) {
+          AddSlotAccess(a.ofs, GetSizeOfIRType(insn->type));
+          continue;
+        }
+        if (insn->dst && addrs[insn->dst].is_addr && IsAddrDerivation(insn, s))
+          continue;
+        escaped_bases = realloc(escaped_bases,
+                                sizeof(long) * (num_of_escaped_bases + 1));
+        assert(escaped_bases);
+        escaped_bases[num_of_escaped_bases++] = a.base;
+      }
+    }
+  }
+  for (int i = 0; i < num_of_slots; i++) {
+    struct LocalSlot *slot = &slots[i];
+    for (int e = 0; e < num_of_escaped_bases; e++) {
+      if (IsOverlapping(slot->ofs, slot->size, escaped_bases[e],
+                        escaped_bases[e]))
+        slot->is_tracked = false;
+    }
+    for (int j = 0; j < num_of_slots; j++) {
+      if (i != j && IsOverlapping(slot->ofs, slot->size, slots[j].ofs,
+                                  slots[j].size))
+        slot->is_tracked = false;
+    }
+  }
+  free(escaped_bases);
+}
+
+// Returns the index of the tracked slot accessed by the insn, or -1.
+static int GetAccessedSlot(struct IRInsn *insn) {
+  if (insn->op != kIRLoad && insn->op != kIRStore) return -1;
+  struct LocalAddr a = addrs[insn->srcs[0]];
+  if (!a.is_addr) return -1;
+  int i = FindSlot(a.ofs);
+  return i >= 0 && slots[i].is_tracked ? i : -1;
+}
+
+// Slots are live where they may be loaded before being stored again. Walks
+// b backward from its live-out and removes dead stores if requested.
+static void TransferSlotLiveness(struct IRBlock *b, bool **live_ins,
+                                 bool *live, bool remove_dead_stores) {
+  for (int i = 0; i < num_of_slots; i++) live[i] = false;
+  for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+    bool *succ_live_in = live_ins[GetIRSucc(b, s)->rpo_index];
+    for (int i = 0; i < num_of_slots; i++) live[i] |= succ_live_in[i];
+  }
+  for (int k = b->num_of_insns - 1; k >= 0; k--) {
+    struct IRInsn *insn = b->insns[k];
+    int i = GetAccessedSlot(insn);
+    if (i < 0) continue;
+    if (insn->op == kIRLoad) {
+      live[i] = true;
+      continue;
+    }
+    if (!live[i] && remove_dead_stores) RemoveIRInsn(b, k);
+    live[i] = false;
+  }
+}
+
+static void EliminateDeadStores(void) {
+  FindConstsAndAddrs();
+  FindTrackedSlots();
+  if (!num_of_slots) return;
+  int n = func->num_of_blocks;
+  bool **live_ins = calloc(n, sizeof(bool *));
+  bool *live = calloc(num_of_slots, sizeof(bool));
+  assert(live_ins && live);
+  for (int i = 0; i < n; i++) {
+    live_ins[i] = calloc(num_of_slots, sizeof(bool));
+    assert(live_ins[i]);
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = n - 1; i >= 0; i--) {
+      struct IRBlock *b = func->blocks[i];
+      TransferSlotLiveness(b, live_ins, live, false);
+      bool *live_in = live_ins[b->rpo_index];
+      for (int s = 0; s < num_of_slots; s++) {
+        if (live[s] == live_in[s]) continue;
+        live_in[s] = live[s];
+        changed = true;
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    TransferSlotLiveness(func->blocks[i], live_ins, live, true);
+  }
+  for (int i = 0; i < n; i++) free(live_ins[i]);
+  free(live_ins);
+  free(live);
+}
+
+// Marks vregs used by the insns which are kept, from the insns with side
+// effects back to the defs of their srcs.
+static void EliminateUnusedInsns(void) {
+  bool *is_used = calloc(func->num_of_vregs + 1, sizeof(bool));
+  assert(is_used);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = func->num_of_blocks - 1; i >= 0; i--) {
+      struct IRBlock *b = func->blocks[i];
+      for (int k = b->num_of_insns - 1; k >= 0; k--) {
+        struct IRInsn *insn = b->insns[k];
+        if (!HasSideEffects(insn) && !is_used[insn->dst]) continue;
+        for (int s = 0; s < insn->num_of_srcs; s++) {
+          if (is_used[insn->srcs[s]]) continue;
+          is_used[insn->srcs[s]] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = b->num_of_insns - 1; k >= 0; k--) {
+      struct IRInsn *insn = b->insns[k];
+      if (!HasSideEffects(insn) && !is_used[insn->dst]) RemoveIRInsn(b, k);
+    }
+  }
+  free(is_used);
+}
+
+void EliminateDeadCode(struct IRFunc *f) {
+  func = f;
+  CalcIRDominators(f);
+  addrs = calloc(f->num_of_vregs + 1, sizeof(struct LocalAddr));
+  const_values = calloc(f->num_of_vregs + 1, sizeof(long));
+  is_const_vreg = calloc(f->num_of_vregs + 1, sizeof(bool));
+  assert(addrs && const_values && is_const_vreg);
+  num_of_slots = 0;
+  EliminateDeadStores();
+  EliminateUnusedInsns();
+  free(slots);
+  slots = NULL;
+  slots_capacity = 0;
+  free(is_const_vreg);
+  free(const_values);
+  free(addrs);
+}
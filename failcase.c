@@ -0,0 +1 @@
+int puts(char *s); int main(){puts("a");return 3;}
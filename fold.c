@@ -0,0 +1,217 @@
+#include "compilium.h"
+
+// Constant folding and algebraic simplification of analyzed exprs
+//
+// Exprs are folded bottom-up while they are analyzed, so the operands of an
+// expr are folded already when the expr is visited. Folded exprs are
+// rewritten in place to a literal or to one of their operands. Int exprs are
+// folded only if the result fits in int, so that exprs which overflow are
+// left to be evaluated in the same way as before.
+
+static bool GetIntLiteral(struct Node *n, long *value) {
+  if (n->type != kASTExpr || n->left || n->right) return false;
+  if (IsTokenWithType(n->op, kTokenDecimalNumber) ||
+      IsTokenWithType(n->op, kTokenOctalNumber)) {
+    *value = strtol(n->op->begin, NULL, 0);
+    return true;
+  }
+  if (!IsTokenWithType(n->op, kTokenCharLiteral)) return false;
+  if (n->op->length == (1 + 1 + 1)) {
+    *value = n->op->begin[1];
+    return true;
+  }
+  if (n->op->length == (1 + 2 + 1) && n->op->begin[1] == '\\' &&
+      n->op->begin[2] == 'n') {
+    *value = '\n';
+    return true;
+  }
+  return false;
+}
+
+static bool IsArithType(struct Node *type) {
+  return type && GetTypeWithoutAttr(GetRValueType(type))->type == kTypeBase;
+}
+
+static void ReplaceWithLiteral(struct Node *n, long value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%ld", value);
+  const char *s = strdup(buf);
+  assert(s);
+  n->op = AllocToken(s, n->op->line, s, strlen(s), kTokenDecimalNumber);
+  n->left = n->right = n->cond = NULL;
+  n->local_var = NULL;
+  n->expr_type = CreateTypeBase(CreateToken("int"));
+  n->sethi_ullman_number = 1;
+  n->eval_right_first = false;
+}
+
+static void ReplaceWithOperand(struct Node *n, struct Node *operand) {
+  *n = *operand;
+}
+
+// Exprs which can be removed without changing the behavior of the program
+static bool IsPureExpr(struct Node *n) {
+  long value;
+  if (GetIntLiteral(n, &value)) return true;
+  if (n->type != kASTExpr) return false;
+  if (IsEqualTokenWithCStr(n->op, "(")) return IsPureExpr(n->right);
+  return IsTokenWithType(n->op, kTokenIdent) && n->local_var;
+}
+
+static bool IsSameVar(struct Node *a, struct Node *b) {
+  return a->type == kASTExpr && b->type == kASTExpr &&
+         IsTokenWithType(a->op, kTokenIdent) &&
+         IsTokenWithType(b->op, kTokenIdent) && a->local_var &&
+         a->local_var == b->local_var;
+}
+
+static bool IsBoolExpr(struct Node *n) {
+  if (n->type != kASTExpr || !n->op) return false;
+  static const char *ops[] = {"==", "!=", "<", "<=", ">", ">=", "!", "&&",
+                              "||"};
+  for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (IsEqualTokenWithCStr(n->op, ops[i])) return true;
+  }
+  return false;
+}
+
+static bool IsDoubleNot(struct Node *n) {
+  return n->type == kASTExpr && !n->left && n->right &&
+         IsEqualTokenWithCStr(n->op, "!") && n->right->type == kASTExpr &&
+         !n->right->left && n->right->right &&
+         IsEqualTokenWithCStr(n->right->op, "!");
+}
+
+// !!c is the same as c where only whether c is zero or not matters.
+void FoldCondition(struct Node *cond) {
+  while (IsDoubleNot(cond)) ReplaceWithOperand(cond, cond->right->right);
+}
+
+static enum IROp GetIROpOfArithOp(struct Node *op) {
+  static const struct {
+    const char *op;
+    enum IROp ir_op;
+  } ops[] = {
+      {"+", kIRAdd},    {"-", kIRSub},    {"*", kIRMul},   {"/", kIRDiv},
+      {"%", kIRMod},    {"&", kIRAnd},    {"|", kIROr},    {"^", kIRXor},
+      {"<<", kIRShl},   {">>", kIRSar},   {"==", kIRCmpEq}, {"!=", kIRCmpNe},
+      {"<", kIRCmpLt},  {"<=", kIRCmpLe}, {">", kIRCmpGt}, {">=", kIRCmpGe},
+  };
+  for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (IsEqualTokenWithCStr(op, ops[i].op)) return ops[i].ir_op;
+  }
+  return kNumOfIROps;
+}
+
+// Folds an int op on int values. Returns false if the result is not an int.
+static bool FoldIntOp(enum IROp op, long a, long b, long *result) {
+  if ((op == kIRShl || op == kIRSar) && (b < 0 || 32 <= b)) return false;
+  if (!FoldIROp(op, kIRTypeI64, a, b, result)) return false;
+  return *result == TruncateToIRType(*result, kIRTypeI32);
+}
+
+static void FoldLogicalOp(struct Node *n) {
+  bool is_and = IsEqualTokenWithCStr(n->op, "&&");
+  long left, right;
+  FoldCondition(n->left);
+  FoldCondition(n->right);
+  if (!GetIntLiteral(n->left, &left)) return;
+  // 0 && x and 1 || x do not evaluate x.
+  if (is_and ? !left : left) {
+    ReplaceWithLiteral(n, !is_and);
+    return;
+  }
+  if (GetIntLiteral(n->right, &right)) ReplaceWithLiteral(n, right != 0);
+}
+
+// Returns the operand which x op y is the same as, or NULL.
+static struct Node *GetIdentityOperand(enum IROp op, struct Node *x,
+                                       struct Node *y) {
+  long value;
+  if (!GetIntLiteral(y, &value)) return NULL;
+  if (value == 0 && (op == kIRAdd || op == kIRSub || op == kIROr ||
+                     op == kIRXor || op == kIRShl || op == kIRSar))
+    return x;
+  if (value == 1 && (op == kIRMul || op == kIRDiv)) return x;
+  return NULL;
+}
+
+static void FoldBinOp(struct Node *n) {
+  if (IsEqualTokenWithCStr(n->op, "&&") || IsEqualTokenWithCStr(n->op, "||")) {
+    FoldLogicalOp(n);
+    return;
+  }
+  enum IROp op = GetIROpOfArithOp(n->op);
+  if (op == kNumOfIROps || !IsArithType(n->expr_type)) return;
+  long left, right, result;
+  if (GetIntLiteral(n->left, &left) && GetIntLiteral(n->right, &right)) {
+    if (FoldIntOp(op, left, right, &result)) ReplaceWithLiteral(n, result);
+    return;
+  }
+  struct Node *x = GetIdentityOperand(op, n->left, n->right);
+  bool is_commutative =
+      op == kIRAdd || op == kIRMul || op == kIROr || op == kIRXor;
+  if (!x && is_commutative) x = GetIdentityOperand(op, n->right, n->left);
+  if (x && IsSameTypeExceptAttr(GetRValueType(x->expr_type), n->expr_type)) {
+    ReplaceWithOperand(n, x);
+    return;
+  }
+  if ((op == kIRMul || op == kIRAnd) &&
+      ((GetIntLiteral(n->right, &right) && !right && IsPureExpr(n->left)) ||
+       (GetIntLiteral(n->left, &left) && !left && IsPureExpr(n->right)))) {
+    ReplaceWithLiteral(n, 0);
+    return;
+  }
+  if ((op == kIRSub || op == kIRXor) && IsSameVar(n->left, n->right)) {
+    ReplaceWithLiteral(n, 0);
+    return;
+  }
+}
+
+static void FoldUnaryOp(struct Node *n) {
+  long value, result;
+  if (IsTokenWithType(n->op, kTokenKwSizeof)) {
+    ReplaceWithLiteral(n, GetSizeOfType(n->right->expr_type));
+    return;
+  }
+  if (IsEqualTokenWithCStr(n->op, "!")) {
+    FoldCondition(n->right);
+    if (IsDoubleNot(n) && IsBoolExpr(n->right->right)) {
+      ReplaceWithOperand(n, n->right->right);
+      return;
+    }
+    if (GetIntLiteral(n->right, &value)) ReplaceWithLiteral(n, !value);
+    return;
+  }
+  if (!GetIntLiteral(n->right, &value)) return;
+  if (IsEqualTokenWithCStr(n->op, "(") || IsEqualTokenWithCStr(n->op, "+")) {
+    ReplaceWithLiteral(n, value);
+    return;
+  }
+  if (IsEqualTokenWithCStr(n->op, "-")) {
+    if (FoldIntOp(kIRSub, 0, value, &result)) ReplaceWithLiteral(n, result);
+    return;
+  }
+  if (IsEqualTokenWithCStr(n->op, "~")) ReplaceWithLiteral(n, ~value);
+}
+
+static void FoldCondOp(struct Node *n) {
+  long value;
+  FoldCondition(n->cond);
+  if (!GetIntLiteral(n->cond, &value)) return;
+  struct Node *taken = value ? n->left : n->right;
+  if (!IsSameTypeExceptAttr(GetRValueType(taken->expr_type), n->expr_type))
+    return;
+  ReplaceWithOperand(n, taken);
+}
+
+void FoldExpr(struct Node *n) {
+  if (n->type != kASTExpr || !n->op) return;
+  if (n->cond) {
+    FoldCondOp(n);
+  } else if (n->left && n->right && n->right->type != kNodeToken) {
+    FoldBinOp(n);
+  } else if (!n->left && n->right) {
+    FoldUnaryOp(n);
+  }
+}
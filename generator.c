@@ -1,154 +1,296 @@
 #include "compilium.h"
 
+// The analyzed AST of each function is translated to the three-address IR
+// (see ir.c), which is then lowered to machine code by lower.c.
+
+static void GenerateForNode(struct Node *node);
 static void GenerateForNodeRValue(struct Node *node);
 
+static FILE *asm_out;
 static struct Node *str_list;
+static const char *label_prefix;
+static struct IRFunc *ir_func;
+static struct IRBlock *cur_block;
+
+static void Emit(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(asm_out, fmt, ap);
+  va_end(ap);
+}
+
+static enum IRType GetIRTypeOf(struct Node *type) {
+  type = GetTypeWithoutAttr(type);
+  if (type->type == kTypeBase)
+    return GetSizeOfType(type) == 1 ? kIRTypeI8 : kIRTypeI32;
+  // Arrays, structs and functions are represented by their address.
+  return kIRTypePtr;
+}
+
+// Integers narrower than int are promoted in arithmetic.
+static enum IRType GetIRTypeOfArith(struct Node *type) {
+  enum IRType ir_type = GetIRTypeOf(type);
+  return ir_type == kIRTypeI8 ? kIRTypeI32 : ir_type;
+}
+
+static struct IRInsn *EmitIR(enum IROp op, enum IRType type, int dst) {
+  return AppendIRInsn(cur_block, op, type, dst);
+}
+
+static int EmitIRConst(enum IRType type, long value) {
+  int dst = AllocIRVReg(ir_func, type);
+  EmitIR(kIRConst, type, dst)->imm = value;
+  return dst;
+}
+
+static int EmitIRUnary(enum IROp op, enum IRType type, int src) {
+  int dst = AllocIRVReg(ir_func, type);
+  AddIRSrc(EmitIR(op, type, dst), src);
+  return dst;
+}
+
+static int EmitIRBinary(enum IROp op, enum IRType type, int left, int right) {
+  int dst = AllocIRVReg(ir_func, type);
+  struct IRInsn *insn = EmitIR(op, type, dst);
+  AddIRSrc(insn, left);
+  AddIRSrc(insn, right);
+  return dst;
+}
+
+static void EmitIRCopy(int dst, int src) {
+  AddIRSrc(EmitIR(kIRCopy, ir_func->vreg_types[dst], dst), src);
+}
 
-static int GetLabelNumber() {
-  static int label_number;
-  return ++label_number;
+static void EmitIRStore(enum IRType type, int addr, int value) {
+  struct IRInsn *insn = EmitIR(kIRStore, type, 0);
+  AddIRSrc(insn, addr);
+  AddIRSrc(insn, value);
 }
 
 static void EmitConvertToBool(int dst, int src) {
-  // This code also sets zero flag as boolean value
-  printf("cmp %s, 0\n", reg_names_64[src]);
-  printf("setnz %s\n", reg_names_8[src]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[src]);
+  int zero = EmitIRConst(kIRTypeI32, 0);
+  struct IRInsn *insn = EmitIR(kIRCmpNe, kIRTypeI32, dst);
+  AddIRSrc(insn, src);
+  AddIRSrc(insn, zero);
 }
 
-static void EmitCompareIntegers(int dst, int left, int right, const char *cc) {
-  printf("cmp %s, %s\n", reg_names_64[left], reg_names_64[right]);
-  printf("set%s %s\n", cc, reg_names_8[dst]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[dst]);
+static void EmitIRJump(struct IRBlock *target) {
+  EmitIR(kIRJump, kIRTypeNone, 0)->targets[0] = target;
 }
 
-static void EmitMoveToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
-  }
-  if (size == 4) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
-    return;
-  }
-  if (size == 1) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
-    return;
-  }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+static void EmitIRBranch(int cond, struct IRBlock *if_true,
+                         struct IRBlock *if_false) {
+  struct IRInsn *insn = EmitIR(kIRBranch, kIRTypeNone, 0);
+  AddIRSrc(insn, cond);
+  insn->targets[0] = if_true;
+  insn->targets[1] = if_false;
 }
 
-static void EmitAddToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("add qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
-  }
-  if (size == 4) {
-    printf("add dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
-    return;
-  }
-  if (size == 1) {
-    printf("add byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
-    return;
-  }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+// Places b after the current block. The current block falls through to b
+// unless it is terminated already.
+static void StartBlock(struct IRBlock *b) {
+  if (!GetIRTerminator(cur_block)) EmitIRJump(b);
+  PlaceIRBlock(ir_func, b);
+  cur_block = b;
 }
 
-static void EmitSubFromMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("sub qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
-  }
-  if (size == 4) {
-    printf("sub dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
+// Scalar local vars whose address is never taken are kept in their vreg
+// for their whole lifetime instead of in the stack frame. So are scalar
+// members of struct local vars which do not escape.
+static bool IsRegVar(struct Node *var) {
+  if (var->parent_var && var->parent_var->is_address_taken) return false;
+  return var->reg && !var->is_address_taken;
+}
+
+static struct Node *GetRegVarOf(struct Node *node) {
+  while (node->type == kASTExpr && IsEqualTokenWithCStr(node->op, "("))
+    node = node->right;
+  if (node->type != kASTExpr || !node->local_var) return NULL;
+  if (!IsRegVar(node->local_var)) return NULL;
+  SetIRVRegType(ir_func, node->local_var->reg,
+                GetIRTypeOf(node->local_var->expr_type));
+  return node->local_var;
+}
+
+// Values of vregs are kept sign-extended to 64 bits, so values assigned to
+// narrow vars are truncated.
+static void EmitAssignToRegVar(struct Node *var, int value) {
+  enum IRType type = ir_func->vreg_types[var->reg];
+  if (type == kIRTypeI8 || type == kIRTypeI32) {
+    AddIRSrc(EmitIR(kIRSext, type, var->reg), value);
     return;
   }
-  if (size == 1) {
-    printf("sub byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
-    return;
+  EmitIRCopy(var->reg, value);
+}
+
+static enum IROp GetIROpOfBinOp(struct Node *op) {
+  static const struct {
+    const char *op;
+    enum IROp ir_op;
+  } ops[] = {
+      {"+", kIRAdd},   {"-", kIRSub},    {"*", kIRMul},    {"/", kIRDiv},
+      {"%", kIRMod},   {"&", kIRAnd},    {"|", kIROr},     {"^", kIRXor},
+      {"<<", kIRShl},  {">>", kIRSar},   {"==", kIRCmpEq}, {"!=", kIRCmpNe},
+      {"<", kIRCmpLt}, {"<=", kIRCmpLe}, {">", kIRCmpGt},  {">=", kIRCmpGe},
+      {"+=", kIRAdd},  {"-=", kIRSub},   {"*=", kIRMul},   {"/=", kIRDiv},
+      {"%=", kIRMod},  {"<<=", kIRShl},  {">>=", kIRSar},
+  };
+  for (unsigned i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (IsEqualTokenWithCStr(op, ops[i].op)) return ops[i].ir_op;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  ErrorWithToken(op, "GenerateForNode: Not implemented binary op");
 }
 
-static void EmitIncMemory(struct Node *op, int dst, int size) {
-  if (size == 8) {
-    printf("inc qword ptr [%s]\n", reg_names_64[dst]);
+static bool IsAssignOp(struct Node *op) {
+  return IsEqualTokenWithCStr(op, "=") || IsEqualTokenWithCStr(op, "+=") ||
+         IsEqualTokenWithCStr(op, "-=") || IsEqualTokenWithCStr(op, "*=") ||
+         IsEqualTokenWithCStr(op, "/=") || IsEqualTokenWithCStr(op, "%=") ||
+         IsEqualTokenWithCStr(op, "<<=") || IsEqualTokenWithCStr(op, ">>=");
+}
+
+// Compound assignments to memory are a load, an op and a store.
+static void GenerateForAssign(struct Node *node) {
+  struct Node *var = GetRegVarOf(node->left);
+  if (!var) GenerateForNode(node->left);
+  GenerateForNodeRValue(node->right);
+  struct Node *type = GetRValueType(node->left->expr_type);
+  int value = node->right->reg;
+  if (var) {
+    if (!IsEqualTokenWithCStr(node->op, "=")) {
+      value = EmitIRBinary(GetIROpOfBinOp(node->op), GetIRTypeOfArith(type),
+                           var->reg, value);
+    }
+    EmitAssignToRegVar(var, value);
+    node->reg = var->reg;
     return;
   }
-  if (size == 4) {
-    printf("inc dword ptr [%s]\n", reg_names_64[dst]);
-    return;
+  if (GetTypeWithoutAttr(type)->type == kTypeStruct) {
+    ErrorWithToken(node->op, "Assigning %d bytes is not implemented.",
+                   GetSizeOfType(type));
   }
-  if (size == 1) {
-    printf("inc byte ptr [%s]\n", reg_names_64[dst]);
-    return;
+  if (!IsEqualTokenWithCStr(node->op, "=")) {
+    int old_value = EmitIRUnary(kIRLoad, GetIRTypeOf(type), node->left->reg);
+    value = EmitIRBinary(GetIROpOfBinOp(node->op), GetIRTypeOfArith(type),
+                         old_value, value);
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  EmitIRStore(GetIRTypeOf(type), node->left->reg, value);
+  node->reg = value;
 }
 
-static void EmitMulToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rdx:rax <- rax * r/m
-    printf("xor rdx, rdx\n");
-    printf("mov rax, %s\n", reg_names_64[dst]);
-    printf("mov eax, [rax]\n");
-    printf("imul %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
+// Generates the rest of binary op node whose left operand is generated
+// already.
+static void GenerateForBinOpRight(struct Node *node) {
+  if (IsEqualTokenWithCStr(node->op, "&&") ||
+      IsEqualTokenWithCStr(node->op, "||")) {
+    struct IRBlock *right_block = AllocIRBlock(ir_func);
+    struct IRBlock *end_block = AllocIRBlock(ir_func);
+    node->reg = AllocIRVReg(ir_func, kIRTypeI32);
+    EmitConvertToBool(node->reg, node->left->reg);
+    if (IsEqualTokenWithCStr(node->op, "&&")) {
+      EmitIRBranch(node->reg, right_block, end_block);
+    } else {
+      EmitIRBranch(node->reg, end_block, right_block);
+    }
+    StartBlock(right_block);
+    GenerateForNodeRValue(node->right);
+    EmitConvertToBool(node->reg, node->right->reg);
+    StartBlock(end_block);
+    return;
+  } else if (IsEqualTokenWithCStr(node->op, ",")) {
+    GenerateForNodeRValue(node->right);
+    node->reg = node->right->reg;
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  if (!node->eval_right_first) GenerateForNodeRValue(node->right);
+  enum IROp op = GetIROpOfBinOp(node->op);
+  enum IRType type = kIRCmpEq <= op && op <= kIRCmpGe
+                         ? kIRTypeI32
+                         : GetIRTypeOfArith(node->expr_type);
+  node->reg = EmitIRBinary(op, type, node->left->reg, node->right->reg);
 }
 
-static void EmitDivToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rax <- rdx:rax / r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
+static void GenerateForBinOpLeft(struct Node *node) {
+  if (IsEqualTokenWithCStr(node->op, ",")) {
+    GenerateForNode(node->left);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  GenerateForNodeRValue(node->left);
 }
 
-static void EmitModToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rdx <- rdx:rax % r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], edx\n", reg_names_64[dst]);
-    return;
+// Args which need more registers are evaluated first (see analyzer.c).
+static void GetArgEvalOrder(struct Node *arg_expr_list, int *order) {
+  for (int i = 0; i < GetSizeOfList(arg_expr_list); i++) {
+    int need = GetNodeAt(arg_expr_list, i)->sethi_ullman_number;
+    int k;
+    for (k = i; k > 0; k--) {
+      if (GetNodeAt(arg_expr_list, order[k - 1])->sethi_ullman_number >= need)
+        break;
+      order[k] = order[k - 1];
+    }
+    order[k] = i;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitLShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shl dword ptr [%s], cl\n", reg_names_64[dst]);
-    return;
+static void GenerateForFuncCall(struct Node *node) {
+  int num_of_args = GetSizeOfList(node->arg_expr_list);
+  int *order = malloc(sizeof(int) * (num_of_args + 1));
+  int *args = malloc(sizeof(int) * (num_of_args + 1));
+  assert(order && args);
+  GetArgEvalOrder(node->arg_expr_list, order);
+  for (int i = 0; i < num_of_args; i++) {
+    struct Node *n = GetNodeAt(node->arg_expr_list, order[i]);
+    GenerateForNodeRValue(n);
+    args[order[i]] = n->reg;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  GenerateForNodeRValue(node->func_expr);
+  enum IRType type = GetIRTypeOf(node->expr_type);
+  node->reg = AllocIRVReg(ir_func, type);
+  struct IRInsn *insn = EmitIR(kIRCall, type, node->reg);
+  AddIRSrc(insn, node->func_expr->reg);
+  for (int i = 0; i < num_of_args; i++) AddIRSrc(insn, args[i]);
+  free(args);
+  free(order);
 }
 
-static void EmitRShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shr dword ptr [%s], cl\n", reg_names_64[dst]);
-    return;
+static void GenerateForIfStmt(struct Node *node) {
+  // else-if chains share the end block and are handled in this loop
+  struct IRBlock *end_block = AllocIRBlock(ir_func);
+  struct Node *n = node;
+  while (true) {
+    GenerateForNodeRValue(n->cond);
+    struct IRBlock *true_block = AllocIRBlock(ir_func);
+    struct IRBlock *false_block = AllocIRBlock(ir_func);
+    EmitIRBranch(n->cond->reg, true_block, false_block);
+    StartBlock(true_block);
+    GenerateForNodeRValue(n->if_true_stmt);
+    if (!GetIRTerminator(cur_block)) EmitIRJump(end_block);
+    StartBlock(false_block);
+    n = n->if_else_stmt;
+    if (!n) break;
+    if (n->type != kASTSelectionStmt) {
+      GenerateForNodeRValue(n);
+      break;
+    }
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  StartBlock(end_block);
 }
 
-const char *GetParamRegName(struct Node *type, int idx) {
-  assert(0 <= idx && idx < NUM_OF_PARAM_REGISTERS);
-  int size = GetSizeOfType(type);
-  if (size == 8) return param_reg_names_64[idx];
-  if (size == 4) return param_reg_names_32[idx];
-  if (size == 1) return param_reg_names_8[idx];
-  ErrorWithToken(GetIdentifierTokenFromTypeAttr(type),
-                 "Assigning %d bytes is not implemented.", size);
+// The updt of a while stmt is NULL.
+static void GenerateForLoop(struct Node *stmt) {
+  struct Node *cond = stmt->cond;
+  struct IRBlock *loop_block = AllocIRBlock(ir_func);
+  struct IRBlock *body_block = AllocIRBlock(ir_func);
+  struct IRBlock *end_block = AllocIRBlock(ir_func);
+  loop_block->unroll_hint = stmt->op->unroll_hint;
+  loop_block->prefetch_hint = stmt->op->prefetch_hint;
+  StartBlock(loop_block);
+  GenerateForNodeRValue(cond);
+  EmitIRBranch(cond->reg, body_block, end_block);
+  StartBlock(body_block);
+  GenerateForNode(stmt->body);
+  if (stmt->updt) GenerateForNode(stmt->updt);
+  if (!GetIRTerminator(cur_block)) EmitIRJump(loop_block);
+  StartBlock(end_block);
 }
 
 static void GenerateForNode(struct Node *node) {
@@ -159,310 +301,163 @@ static void GenerateForNode(struct Node *node) {
     return;
   }
   if (node->type == kASTExprFuncCall) {
-    GenerateForNodeRValue(node->func_expr);
-    printf("sub rsp, %d\n", node->stack_size_needed);
-    printf("push %s\n", reg_names_64[node->func_expr->reg]);
-    int i;
-    assert(GetSizeOfList(node->arg_expr_list) <= NUM_OF_PARAM_REGISTERS);
-    for (i = 0; i < GetSizeOfList(node->arg_expr_list); i++) {
-      struct Node *n = GetNodeAt(node->arg_expr_list, i);
-      GenerateForNodeRValue(n);
-      printf("push %s\n", reg_names_64[n->reg]);
-    }
-    for (i--; i >= 0; i--) {
-      printf("pop %s\n", param_reg_names_64[i]);
-    }
-    printf("pop rax\n");
-    for (i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-      printf("push %s\n", reg_names_64[i]);
-    }
-    printf("call rax\n");
-    for (i = NUM_OF_SCRATCH_REGS; i >= 1; i--) {
-      printf("pop %s\n", reg_names_64[i]);
-    }
-    printf("movsxd %s, eax\n", reg_names_64[node->reg]);
-    printf("add rsp, %d\n", node->stack_size_needed);
-    return;
-  } else if (node->type == kASTFuncDef) {
-    const char *func_name = CreateTokenStr(node->func_name_token);
-    printf(".global %s%s\n", symbol_prefix, func_name);
-    printf("%s%s:\n", symbol_prefix, func_name);
-    printf("push rbp\n");
-    printf("mov rbp, rsp\n");
-    struct Node *arg_var_list = node->arg_var_list;
-    assert(arg_var_list);
-    assert(GetSizeOfList(arg_var_list) <= NUM_OF_PARAM_REGISTERS);
-    for (int i = 0; i < GetSizeOfList(arg_var_list); i++) {
-      struct Node *arg_var = GetNodeAt(arg_var_list, i);
-      if (!arg_var) continue;
-      const char *param_reg_name = GetParamRegName(arg_var->expr_type, i);
-      printf("mov [rbp - %d], %s // arg[%d]\n", arg_var->byte_offset,
-             param_reg_name, i);
-    }
-    GenerateForNode(node->func_body);
-    printf("mov rsp, rbp\n");
-    printf("pop rbp\n");
-    printf("ret\n");
+    GenerateForFuncCall(node);
     return;
   }
   assert(node && node->op);
   if (node->type == kASTExpr) {
     if (IsTokenWithType(node->op, kTokenDecimalNumber) ||
         IsTokenWithType(node->op, kTokenOctalNumber)) {
-      printf("mov %s, %ld\n", reg_names_64[node->reg],
-             strtol(node->op->begin, NULL, 0));
+      node->reg = EmitIRConst(kIRTypeI32, strtol(node->op->begin, NULL, 0));
       return;
     } else if (IsTokenWithType(node->op, kTokenCharLiteral)) {
       if (node->op->length == (1 + 1 + 1)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg], node->op->begin[1]);
+        node->reg = EmitIRConst(kIRTypeI32, node->op->begin[1]);
         return;
       }
       if (node->op->length == (1 + 2 + 1) && node->op->begin[1] == '\\') {
         if (node->op->begin[2] == 'n') {
-          printf("mov %s, %d\n", reg_names_64[node->reg], '\n');
+          node->reg = EmitIRConst(kIRTypeI32, '\n');
           return;
         }
       }
       ErrorWithToken(node->op, "Not implemented char literal");
     } else if (IsEqualTokenWithCStr(node->op, "(")) {
       GenerateForNode(node->right);
+      node->reg = node->right->reg;
       return;
-    } else if (IsEqualTokenWithCStr(node->op, ".")) {
+    } else if (IsEqualTokenWithCStr(node->op, ".") ||
+               IsEqualTokenWithCStr(node->op, "->")) {
+      if (GetRegVarOf(node)) return;
       GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
-      return;
-    } else if (IsEqualTokenWithCStr(node->op, "->")) {
-      GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
+      int ofs = EmitIRConst(kIRTypeI64, node->byte_offset);
+      node->reg = EmitIRBinary(kIRAdd, kIRTypePtr, node->left->reg, ofs);
       return;
     } else if (IsEqualTokenWithCStr(node->op, "[")) {
+      if (node->eval_right_first) GenerateForNodeRValue(node->right);
       GenerateForNodeRValue(node->left);
-      GenerateForNodeRValue(node->right);
+      if (!node->eval_right_first) GenerateForNodeRValue(node->right);
       struct Node *left_type = GetTypeWithoutAttr(node->left->expr_type);
       assert(left_type->type == kTypeArray);
-      printf("imul %s, %s, %d\n", reg_names_64[node->right->reg],
-             reg_names_64[node->right->reg],
-             GetSizeOfType(left_type->type_array_type_of));
-      printf("add %s, %s\n", reg_names_64[node->left->reg],
-             reg_names_64[node->right->reg]);
+      int elem_size =
+          EmitIRConst(kIRTypeI64, GetSizeOfType(left_type->type_array_type_of));
+      int ofs = EmitIRBinary(kIRMul, kIRTypeI64, node->right->reg, elem_size);
+      node->reg = EmitIRBinary(kIRAdd, kIRTypePtr, node->left->reg, ofs);
       return;
     } else if (IsTokenWithType(node->op, kTokenIdent)) {
       if (node->expr_type->type == kTypeFunction) {
-        const char *label_name = CreateTokenStr(node->op);
-        printf(".global %s%s\n", symbol_prefix, label_name);
-        printf("mov %s, [rip + %s%s@GOTPCREL]\n", reg_names_64[node->reg],
-               symbol_prefix, label_name);
+        node->reg = AllocIRVReg(ir_func, kIRTypePtr);
+        EmitIR(kIRSymAddr, kIRTypePtr, node->reg)->sym =
+            CreateTokenStr(node->op);
         return;
       }
-      printf("lea %s, [rbp - %d]\n", reg_names_64[node->reg],
-             node->byte_offset);
+      if (GetRegVarOf(node)) return;
+      node->reg = AllocIRVReg(ir_func, kIRTypePtr);
+      EmitIR(kIRFrameAddr, kIRTypePtr, node->reg)->imm = node->byte_offset;
       return;
     } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
-      int str_label = GetLabelNumber();
-      printf("lea %s, [rip + L%d]\n", reg_names_64[node->reg], str_label);
-      node->label_number = str_label;
+      node->label_number = AllocIRLabel(ir_func);
+      node->reg = AllocIRVReg(ir_func, kIRTypePtr);
+      EmitIR(kIRStrAddr, kIRTypePtr, node->reg)->imm = node->label_number;
       PushToList(str_list, node);
       return;
     } else if (node->cond) {
       GenerateForNodeRValue(node->cond);
-      int false_label = GetLabelNumber();
-      int end_label = GetLabelNumber();
-      EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
+      struct IRBlock *true_block = AllocIRBlock(ir_func);
+      struct IRBlock *false_block = AllocIRBlock(ir_func);
+      struct IRBlock *end_block = AllocIRBlock(ir_func);
+      EmitIRBranch(node->cond->reg, true_block, false_block);
+      int result = AllocIRVReg(ir_func, GetIRTypeOfArith(node->expr_type));
+      StartBlock(true_block);
       GenerateForNodeRValue(node->left);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->left->reg]);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
+      EmitIRCopy(result, node->left->reg);
+      EmitIRJump(end_block);
+      StartBlock(false_block);
       GenerateForNodeRValue(node->right);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->right->reg]);
-      printf("L%d:\n", end_label);
+      EmitIRCopy(result, node->right->reg);
+      StartBlock(end_block);
+      node->reg = result;
       return;
     } else if (!node->left && node->right) {
       if (IsTokenWithType(node->op, kTokenKwSizeof)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg],
-               GetSizeOfType(node->right->expr_type));
+        node->reg =
+            EmitIRConst(kIRTypeI32, GetSizeOfType(node->right->expr_type));
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "&")) {
         GenerateForNode(node->right);
+        node->reg = node->right->reg;
         return;
       }
       GenerateForNodeRValue(node->right);
-      if (IsEqualTokenWithCStr(node->op, "+")) {
+      enum IRType type = GetIRTypeOfArith(node->expr_type);
+      if (IsEqualTokenWithCStr(node->op, "+") ||
+          IsEqualTokenWithCStr(node->op, "*")) {
+        node->reg = node->right->reg;
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("neg %s\n", reg_names_64[node->reg]);
+        node->reg = EmitIRUnary(kIRNeg, type, node->right->reg);
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "~")) {
-        printf("not %s\n", reg_names_64[node->reg]);
+        node->reg = EmitIRUnary(kIRNot, type, node->right->reg);
         return;
       }
       if (IsEqualTokenWithCStr(node->op, "!")) {
-        EmitConvertToBool(node->reg, node->reg);
-        printf("setz %s\n", reg_names_8[node->reg]);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "*")) {
+        int zero = EmitIRConst(kIRTypeI32, 0);
+        node->reg = EmitIRBinary(kIRCmpEq, kIRTypeI32, node->right->reg, zero);
         return;
       }
       ErrorWithToken(node->op,
                      "GenerateForNode: Not implemented unary prefix op");
     } else if (node->left && !node->right) {
       if (IsEqualTokenWithCStr(node->op, "++")) {
-        GenerateForNode(node->left);
-        EmitIncMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
-        printf("mov %s, [%s]\n", reg_names_64[node->reg],
-               reg_names_64[node->reg]);
+        // Evaluates to the incremented value.
+        struct Node *var = GetRegVarOf(node->left);
+        if (!var) GenerateForNode(node->left);
+        enum IRType type = GetIRTypeOf(node->expr_type);
+        int one = EmitIRConst(kIRTypeI32, 1);
+        if (var) {
+          int value =
+              EmitIRBinary(kIRAdd, GetIRTypeOfArith(node->expr_type),
+                           var->reg, one);
+          EmitAssignToRegVar(var, value);
+          node->reg = EmitIRUnary(kIRCopy, type, var->reg);
+          return;
+        }
+        int old_value = EmitIRUnary(kIRLoad, type, node->left->reg);
+        int value = EmitIRBinary(kIRAdd, GetIRTypeOfArith(node->expr_type),
+                                 old_value, one);
+        EmitIRStore(type, node->left->reg, value);
+        node->reg = EmitIRUnary(kIRLoad, type, node->left->reg);
         return;
       }
       ErrorWithToken(node->op,
                      "GenerateForNode: Not implemented unary postfix op");
     } else if (node->left && node->right) {
-      if (IsEqualTokenWithCStr(node->op, "&&")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "||")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jnz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
+      if (IsAssignOp(node->op)) {
+        GenerateForAssign(node);
         return;
-      } else if (IsEqualTokenWithCStr(node->op, ",")) {
-        GenerateForNode(node->left);
-        GenerateForNodeRValue(node->right);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "=") ||
-                 IsEqualTokenWithCStr(node->op, "+=") ||
-                 IsEqualTokenWithCStr(node->op, "-=") ||
-                 IsEqualTokenWithCStr(node->op, "*=") ||
-                 IsEqualTokenWithCStr(node->op, "/=") ||
-                 IsEqualTokenWithCStr(node->op, "%=") ||
-                 IsEqualTokenWithCStr(node->op, "<<=") ||
-                 IsEqualTokenWithCStr(node->op, ">>=")) {
-        GenerateForNode(node->left);
-        GenerateForNodeRValue(node->right);
-        int size = GetSizeOfType(node->right->expr_type);
-        if (IsEqualTokenWithCStr(node->op, "=")) {
-          EmitMoveToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "+=")) {
-          EmitAddToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "-=")) {
-          EmitSubFromMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "*=")) {
-          EmitMulToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "/=")) {
-          EmitDivToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "%=")) {
-          EmitModToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "<<=")) {
-          EmitLShiftMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, ">>=")) {
-          EmitRShiftMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        assert(false);
       }
-      GenerateForNodeRValue(node->left);
-      GenerateForNodeRValue(node->right);
-      if (IsEqualTokenWithCStr(node->op, "+")) {
-        printf("add %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("sub %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "*")) {
-        // rdx:rax <- rax * r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("imul %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "/")) {
-        // rax <- rdx:rax / r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "%")) {
-        // rdx <- rdx:rax % r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rdx\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<<")) {
-        // r/m <<= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sal %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">>")) {
-        // r/m >>= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sar %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "l");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "g");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "le");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ge");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "==")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "e");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "!=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ne");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "&")) {
-        printf("and %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "^")) {
-        printf("xor %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "|")) {
-        printf("or %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
+      if (node->eval_right_first) GenerateForNodeRValue(node->right);
+      if (node->eval_right_first || !IsLeftAssocBinOp(node->left)) {
+        GenerateForBinOpLeft(node);
+        GenerateForBinOpRight(node);
         return;
       }
+      // Walk the left spine of long chains like a + b + c + ... iteratively
+      struct Node *chain = AllocList();
+      struct Node *n;
+      for (n = node; IsLeftAssocBinOp(n) && !n->eval_right_first;
+           n = n->left) {
+        PushToList(chain, n);
+      }
+      GenerateForBinOpLeft(GetNodeAt(chain, GetSizeOfList(chain) - 1));
+      for (int i = GetSizeOfList(chain) - 1; i >= 0; i--) {
+        GenerateForBinOpRight(GetNodeAt(chain, i));
+      }
+      return;
     }
   }
   if (node->type == kASTExprStmt) {
@@ -480,96 +475,160 @@ static void GenerateForNode(struct Node *node) {
     return;
   } else if (node->type == kASTJumpStmt) {
     if (IsTokenWithType(node->op, kTokenKwReturn)) {
-      if (node->right) {
-        GenerateForNodeRValue(node->right);
-        printf("mov rax, %s\n", reg_names_64[node->right->reg]);
-      }
-      printf("mov rsp, rbp\n");
-      printf("pop rbp\n");
-      printf("ret\n");
+      if (node->right) GenerateForNodeRValue(node->right);
+      struct IRInsn *insn = EmitIR(kIRReturn, kIRTypeNone, 0);
+      if (node->right) AddIRSrc(insn, node->right->reg);
+      // Code after return is unreachable but still needs a block.
+      StartBlock(AllocIRBlock(ir_func));
       return;
     }
     ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
   } else if (node->type == kASTSelectionStmt) {
     if (IsTokenWithType(node->op, kTokenKwIf)) {
-      GenerateForNodeRValue(node->cond);
-      int false_label = GetLabelNumber();
-      int end_label = GetLabelNumber();
-      EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
-      GenerateForNodeRValue(node->if_true_stmt);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
-      if (node->if_else_stmt) {
-        GenerateForNodeRValue(node->if_else_stmt);
-      }
-      printf("L%d:\n", end_label);
+      GenerateForIfStmt(node);
       return;
     }
     ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
   } else if (node->type == kASTForStmt) {
-    int loop_label = GetLabelNumber();
-    int end_label = GetLabelNumber();
     GenerateForNode(node->init);
-    printf("L%d:\n", loop_label);
-    GenerateForNodeRValue(node->cond);
-    EmitConvertToBool(node->cond->reg, node->cond->reg);
-    printf("jz L%d\n", end_label);
-    GenerateForNode(node->body);
-    GenerateForNode(node->updt);
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
+    GenerateForLoop(node);
     return;
   } else if (node->type == kASTWhileStmt) {
-    int loop_label = GetLabelNumber();
-    int end_label = GetLabelNumber();
-    printf("L%d:\n", loop_label);
-    GenerateForNodeRValue(node->cond);
-    EmitConvertToBool(node->cond->reg, node->cond->reg);
-    printf("jz L%d\n", end_label);
-    GenerateForNode(node->body);
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
+    GenerateForLoop(node);
     return;
   }
   ErrorWithToken(node->op, "GenerateForNode: Not implemented");
 }
 
 static void GenerateForNodeRValue(struct Node *node) {
+  struct Node *var = GetRegVarOf(node);
+  if (var) {
+    node->reg = var->reg;
+    return;
+  }
   GenerateForNode(node);
   if (!node->expr_type) return;
   if (node->expr_type->type != kTypeLValue) return;
   if (node->expr_type->type == kTypeLValue &&
       node->expr_type->right->type == kTypeArray)
     return;
-  int size = GetSizeOfType(GetRValueType(node->expr_type));
-  if (size == 8) {
-    printf("mov %s, [%s]\n", reg_names_64[node->reg], reg_names_64[node->reg]);
-    return;
-  } else if (size == 4) {
-    printf("movsxd %s, dword ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
-    return;
-  } else if (size == 1) {
-    printf("movsx %s, byte ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
-    return;
+  struct Node *type = GetRValueType(node->expr_type);
+  if (GetTypeWithoutAttr(type)->type == kTypeStruct) {
+    ErrorWithToken(node->op, "Dereferencing %d bytes is not implemented.",
+                   GetSizeOfType(type));
   }
-  ErrorWithToken(node->op, "Dereferencing %d bytes is not implemented.", size);
+  node->reg = EmitIRUnary(kIRLoad, GetIRTypeOf(type), node->reg);
 }
 
-void Generate(struct Node *ast) {
-  str_list = AllocList();
-  printf(".intel_syntax noprefix\n");
-  printf(".text\n");
-  GenerateForNode(ast);
+static void GenerateForParams(struct Node *arg_var_list) {
+  // All params are received first. The ones which are not kept in vregs
+  // are stored to the stack.
+  int num_of_params = GetSizeOfList(arg_var_list);
+  int *params = malloc(sizeof(int) * (num_of_params + 1));
+  assert(params);
+  for (int i = 0; i < num_of_params; i++) {
+    struct Node *arg_var = GetNodeAt(arg_var_list, i);
+    if (!arg_var) continue;
+    enum NodeType type_of_type = GetTypeWithoutAttr(arg_var->expr_type)->type;
+    if (type_of_type != kTypeBase && type_of_type != kTypePointer) {
+      ErrorWithToken(GetIdentifierTokenFromTypeAttr(arg_var->expr_type),
+                     "Passing %d bytes is not implemented.",
+                     GetSizeOfType(arg_var->expr_type));
+    }
+    enum IRType type = GetIRTypeOf(arg_var->expr_type);
+    if (IsRegVar(arg_var)) {
+      params[i] = arg_var->reg;
+      SetIRVRegType(ir_func, params[i], type);
+    } else {
+      params[i] = AllocIRVReg(ir_func, type);
+    }
+    EmitIR(kIRParam, type, params[i])->imm = i;
+  }
+  for (int i = 0; i < num_of_params; i++) {
+    struct Node *arg_var = GetNodeAt(arg_var_list, i);
+    if (!arg_var || IsRegVar(arg_var)) continue;
+    int addr = AllocIRVReg(ir_func, kIRTypePtr);
+    EmitIR(kIRFrameAddr, kIRTypePtr, addr)->imm = arg_var->byte_offset;
+    EmitIRStore(GetIRTypeOf(arg_var->expr_type), addr, params[i]);
+  }
+  free(params);
+}
+
+static void GenerateFuncDef(struct Node *node) {
+  const char *func_name = CreateTokenStr(node->func_name_token);
+  ir_func = AllocIRFunc(func_name, node->num_of_vregs);
+  ir_func->frame_size = node->stack_size_needed;
+  cur_block = AllocIRBlock(ir_func);
+  PlaceIRBlock(ir_func, cur_block);
+  assert(node->arg_var_list);
+  GenerateForParams(node->arg_var_list);
+  GenerateForNode(node->func_body);
+  if (!GetIRTerminator(cur_block)) EmitIR(kIRReturn, kIRTypeNone, 0);
+  InlineCalls(ir_func, str_list);
+  VerifyIRFunc(ir_func);
+  SaveIRFuncForInlining(ir_func, node, str_list);
+  if (!asm_out) {
+    FreeIRFunc(ir_func);
+    return;
+  }
+  Emit(".global %s%s\n", symbol_prefix, func_name);
+  Emit("%s%s:\n", symbol_prefix, func_name);
+  OptimizeLoopNests(ir_func);
+  VectorizeLoops(ir_func);
+  UnrollLoops(ir_func);
+  ConvertIRToSSA(ir_func);
+  RunSCCP(ir_func);
+  RunGVN(ir_func);
+  RunLICM(ir_func);
+  ReduceIVStrength(ir_func);
+  InsertPrefetches(ir_func);
+  EliminateDeadCode(ir_func);
+  VerifyIRFunc(ir_func);
+  ConvertIRFromSSA(ir_func);
+  SimplifyCFG(ir_func);
+  VerifyIRFunc(ir_func);
+  if (dump_ir) PrintIRFunc(stderr, ir_func);
+  LowerIRFunc(ir_func, label_prefix);
+  PrintMachineCode(asm_out, label_prefix, ir_func->frame_size);
+  FreeIRFunc(ir_func);
+}
 
-  printf(".data\n");
+static void EmitStrLiterals() {
+  if (!GetSizeOfList(str_list)) return;
+  Emit(".data\n");
   for (int i = 0; i < GetSizeOfList(str_list); i++) {
     struct Node *n = GetNodeAt(str_list, i);
-    printf("L%d: ", n->label_number);
-    printf(".asciz ");
-    PrintTokenStrToFile(n->op, stdout);
-    putchar('\n');
+    Emit("L%s_%d: ", label_prefix, n->label_number);
+    Emit(".asciz ");
+    PrintTokenStrToFile(n->op, asm_out);
+    fputc('\n', asm_out);
+  }
+  Emit(".text\n");
+}
+
+// Labels and string literals are local to each top-level item, so the code
+// of an item depends only on the items it refers to. Functions are inlined
+// into the items after them. If fp is NULL, the item is generated only to be
+// inlined.
+void GenerateTopLevelItem(FILE *fp, struct Node *node) {
+  asm_out = fp;
+  str_list = AllocList();
+  // Only function definitions have code. Other top-level items are
+  // declarations.
+  if (node->type != kASTFuncDef) return;
+  label_prefix = CreateTokenStr(node->func_name_token);
+  GenerateFuncDef(node);
+  if (fp) EmitStrLiterals();
+}
+
+void GenerateHeader(FILE *fp) {
+  fprintf(fp, ".intel_syntax noprefix\n");
+  fprintf(fp, ".text\n");
+}
+
+void Generate(struct Node *ast) {
+  GenerateHeader(stdout);
+  for (int i = 0; i < GetSizeOfList(ast); i++) {
+    GenerateTopLevelItem(stdout, GetNodeAt(ast, i));
   }
 }
@@ -0,0 +1,376 @@
+#include "compilium.h"
+
+// Global value numbering on SSA form
+//
+// The dominator tree is walked in preorder with a scoped table of the values
+// computed so far. An insn which computes the same value as an insn in a
+// dominating block is removed and its uses are replaced, and so are copies.
+// Loads are reused until a store which may alias them or a call, and stores
+// make the stored value available to later loads from the same addr. Ops on
+// constants which are found by forwarding are folded.
+
+// Addrs are compared as base + ofs. The base is 0 for the frame, or the vreg
+// which the addr is derived from by adding constants.
+struct AddrInfo {
+  int base;
+  long ofs;
+};
+
+struct ValueKey {
+  enum IROp op;
+  enum IRType type;
+  int srcs[2];
+  long imm;
+  const char *sym;
+};
+
+struct ValueEntry {
+  struct ValueKey key;
+  int vreg;
+  int next;  // index of the next entry in the bucket, or -1
+  bool is_killed;
+};
+
+struct ScopeMark {
+  int num_of_entries;
+  int num_of_load_entries;
+  int kill_log_size;
+};
+
+#define MAX_BLOCKS_TO_CHECK_CLOBBER 64
+
+static struct IRFunc *func;
+static int *leaders;                 // indexed by vreg
+static bool *is_const_vreg;          // indexed by vreg
+static long *const_values;           // indexed by vreg
+static struct AddrInfo *addr_infos;  // indexed by vreg
+static bool *has_clobber;            // indexed by rpo_index
+static int *buckets;
+static int num_of_buckets;
+static struct ValueEntry *entries;
+static int num_of_entries;
+static int *load_entries;  // indices of the entries of loads
+static int num_of_load_entries;
+static int *kill_log;  // indices of the entries killed
+static int kill_log_size;
+static int entries_capacity;
+
+static int GetLeader(int vreg) {
+  while (leaders[vreg] != vreg) vreg = leaders[vreg];
+  return vreg;
+}
+
+static bool IsCommutativeIROp(enum IROp op) {
+  return op == kIRAdd || op == kIRMul || op == kIRAnd || op == kIROr ||
+         op == kIRXor || op == kIRCmpEq || op == kIRCmpNe;
+}
+
+static bool IsNumberedIROp(enum IROp op) {
+  return op == kIRConst || (kIRAdd <= op && op <= kIRSext) ||
+         op == kIRFrameAddr || op == kIRSymAddr || op == kIRStrAddr ||
+         op == kIRLoad;
+}
+
+static struct ValueKey MakeKey(struct IRInsn *insn) {
+  struct ValueKey key = {insn->op, insn->type, {0, 0}, 0, NULL};
+  for (int s = 0; s < insn->num_of_srcs; s++) key.srcs[s] = insn->srcs[s];
+  if (IsCommutativeIROp(insn->op) && key.srcs[0] > key.srcs[1]) {
+    key.srcs[0] = insn->srcs[1];
+    key.srcs[1] = insn->srcs[0];
+  }
+  if (insn->op == kIRConst || insn->op == kIRFrameAddr ||
+      insn->op == kIRStrAddr)
+    key.imm = insn->imm;
+  if (insn->op == kIRSymAddr) key.sym = insn->sym;
+  return key;
+}
+
+static int HashKey(struct ValueKey *key) {
+  unsigned long h = key->op;
+  h = h * 31 + key->type;
+  h = h * 31 + (unsigned)key->srcs[0];
+  h = h * 31 + (unsigned)key->srcs[1];
+  h = h * 31 + (unsigned long)key->imm;
+  for (const char *p = key->sym; p && *p; p++) h = h * 31 + *p;
+  return h % num_of_buckets;
+}
+
+static bool IsSameKey(struct ValueKey *a, struct ValueKey *b) {
+  if (a->op != b->op || a->type != b->type || a->srcs[0] != b->srcs[0] ||
+      a->srcs[1] != b->srcs[1] || a->imm != b->imm)
+    return false;
+  return a->sym == b->sym || (a->sym && b->sym && !strcmp(a->sym, b->sym));
+}
+
+static int FindEntry(struct ValueKey *key) {
+  for (int i = buckets[HashKey(key)]; i >= 0; i = entries[i].next) {
+    if (!entries[i].is_killed && IsSameKey(&entries[i].key, key)) return i;
+  }
+  return -1;
+}
+
+static void AddEntry(struct ValueKey key, int vreg) {
+  if (num_of_entries >= entries_capacity) {
+    entries_capacity = entries_capacity * 2 + 64;
+    entries = realloc(entries, sizeof(struct ValueEntry) * entries_capacity);
+    load_entries = realloc(load_entries, sizeof(int) * entries_capacity);
+    kill_log = realloc(kill_log, sizeof(int) * entries_capacity);
+    assert(entries && load_entries && kill_log);
+  }
+  int h = HashKey(&key);
+  int i = num_of_entries++;
+  entries[i] = (struct ValueEntry){key, vreg, buckets[h], false};
+  buckets[h] = i;
+  if (key.op == kIRLoad) load_entries[num_of_load_entries++] = i;
+}
+
+static struct ScopeMark GetScopeMark(void) {
+  return (struct ScopeMark){num_of_entries, num_of_load_entries,
+                            kill_log_size};
+}
+
+static void RestoreScopeMark(struct ScopeMark mark) {
+  while (kill_log_size > mark.kill_log_size) {
+    entries[kill_log[--kill_log_size]].is_killed = false;
+  }
+  while (num_of_entries > mark.num_of_entries) {
+    struct ValueEntry *e = &entries[--num_of_entries];
+    buckets[HashKey(&e->key)] = e->next;
+  }
+  num_of_load_entries = mark.num_of_load_entries;
+}
+
+static bool MayAlias(struct AddrInfo a, int a_size, struct AddrInfo b,
+                     int b_size) {
+  if (a.base != b.base) return true;
+  return a.ofs < b.ofs + b_size && b.ofs < a.ofs + a_size;
+}
+
+// Kills the loads which may read the addr, or all loads if addr is NULL.
+static void KillLoads(struct AddrInfo *addr, int size) {
+  for (int i = 0; i < num_of_load_entries; i++) {
+    struct ValueEntry *e = &entries[load_entries[i]];
+    if (e->is_killed) continue;
+    if (addr && !MayAlias(addr_infos[e->key.srcs[0]],
+                          GetSizeOfIRType(e->key.type), *addr, size))
+      continue;
+    e->is_killed = true;
+    kill_log[kill_log_size++] = load_entries[i];
+  }
+}
+
+static void CalcAddrInfo(struct IRInsn *insn) {
+  int dst = insn->dst;
+  addr_infos[dst] = (struct AddrInfo){dst, 0};
+  if (insn->op == kIRFrameAddr) {
+    addr_infos[dst] = (struct AddrInfo){0, -insn->imm};
+    return;
+  }
+  if (insn->op != kIRAdd) return;
+  for (int s = 0; s < 2; s++) {
+    int other = insn->srcs[1 - s];
+    if (!is_const_vreg[other]) continue;
+    addr_infos[dst] = addr_infos[insn->srcs[s]];
+    addr_infos[dst].ofs += const_values[other];
+    return;
+  }
+}
+
+// Returns whether a store or a call may run on a path from the end of d to
+// the beginning of b, where d dominates b.
+static bool HasClobberOnPathsTo(struct IRBlock *d, struct IRBlock *b) {
+  // The blocks found are walked in the order they are found.
+  struct IRBlock *found[MAX_BLOCKS_TO_CHECK_CLOBBER];
+  int num_of_found = 0;
+  for (int i = -1; i < num_of_found; i++) {
+    struct IRBlock *x = i < 0 ? b : found[i];
+    if (i >= 0 && has_clobber[x->rpo_index]) return true;
+    for (int p = 0; p < x->num_of_preds; p++) {
+      struct IRBlock *pred = x->preds[p];
+      bool is_found = pred == d;
+      for (int k = 0; k < num_of_found && !is_found; k++) {
+        is_found = found[k] == pred;
+      }
+      if (is_found) continue;
+      if (num_of_found >= MAX_BLOCKS_TO_CHECK_CLOBBER) return true;
+      found[num_of_found++] = pred;
+    }
+  }
+  return false;
+}
+
+// Stored values can be forwarded if loading them gives the same value.
+static bool CanForwardStore(struct IRInsn *store) {
+  enum IRType value_type = func->vreg_types[store->srcs[1]];
+  return GetSizeOfIRType(store->type) == 8 || value_type == store->type;
+}
+
+// Values forwarded from stores may make operands constant.
+static void FoldConstOperands(struct IRInsn *insn) {
+  if (insn->op < kIRAdd || kIRSext < insn->op) return;
+  long operands[2] = {0, 0};
+  for (int s = 0; s < insn->num_of_srcs; s++) {
+    if (!is_const_vreg[insn->srcs[s]]) return;
+    operands[s] = const_values[insn->srcs[s]];
+  }
+  long result;
+  if (FoldIROp(insn->op, insn->type, operands[0], operands[1], &result))
+    ReplaceIRInsnWithConst(insn, result);
+}
+
+static void VisitBlock(struct IRBlock *b) {
+  for (int k = 0; k < b->num_of_insns; k++) {
+    struct IRInsn *insn = b->insns[k];
+    if (insn->op == kIRPhi) {
+      addr_infos[insn->dst] = (struct AddrInfo){insn->dst, 0};
+      continue;
+    }
+    for (int s = 0; s < insn->num_of_srcs; s++) {
+      insn->srcs[s] = GetLeader(insn->srcs[s]);
+    }
+    if (insn->op == kIRCopy) {
+      leaders[insn->dst] = insn->srcs[0];
+      RemoveIRInsn(b, k--);
+      continue;
+    }
+    if (insn->op == kIRStore) {
+      struct AddrInfo addr = addr_infos[insn->srcs[0]];
+      KillLoads(&addr, GetSizeOfIRType(insn->type));
+      if (!CanForwardStore(insn)) continue;
+      struct ValueKey key = {kIRLoad, insn->type, {insn->srcs[0], 0}, 0, NULL};
+      AddEntry(key, insn->srcs[1]);
+      continue;
+    }
+    if (insn->op == kIRCall) KillLoads(NULL, 0);
+    if (!insn->dst) continue;
+    if (!IsNumberedIROp(insn->op)) {
+      addr_infos[insn->dst] = (struct AddrInfo){insn->dst, 0};
+      continue;
+    }
+    FoldConstOperands(insn);
+    struct ValueKey key = MakeKey(insn);
+    int i = FindEntry(&key);
+    if (i >= 0) {
+      leaders[insn->dst] = entries[i].vreg;
+      RemoveIRInsn(b, k--);
+      continue;
+    }
+    if (insn->op == kIRConst) {
+      is_const_vreg[insn->dst] = true;
+      const_values[insn->dst] = insn->imm;
+    }
+    CalcAddrInfo(insn);
+    AddEntry(key, insn->dst);
+  }
+}
+
+struct DomTreeFrame {
+  struct IRBlock *b;
+  int next_child;
+  struct ScopeMark mark;
+};
+
+// Walks the dominator tree in preorder without recursion.
+static void WalkDominatorTree(void) {
+  int n = func->num_of_blocks;
+  struct IRBlock **by_rpo = calloc(n, sizeof(struct IRBlock *));
+  int *num_of_children = calloc(n, sizeof(int));
+  int *first_child = calloc(n + 1, sizeof(int));
+  struct IRBlock **children = calloc(n, sizeof(struct IRBlock *));
+  struct DomTreeFrame *stack = calloc(n, sizeof(struct DomTreeFrame));
+  assert(by_rpo && num_of_children && first_child && children && stack);
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = func->blocks[i];
+    by_rpo[b->rpo_index] = b;
+    if (b->idom != b) num_of_children[b->idom->rpo_index]++;
+  }
+  for (int i = 0; i < n; i++) {
+    first_child[i + 1] = first_child[i] + num_of_children[i];
+    num_of_children[i] = 0;
+  }
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = by_rpo[i];
+    if (b->idom == b) continue;
+    int p = b->idom->rpo_index;
+    children[first_child[p] + num_of_children[p]++] = b;
+  }
+  int sp = 0;
+  stack[sp++] = (struct DomTreeFrame){func->blocks[0], 0, GetScopeMark()};
+  VisitBlock(func->blocks[0]);
+  while (sp) {
+    struct DomTreeFrame *frame = &stack[sp - 1];
+    int i = frame->b->rpo_index;
+    if (frame->next_child >= num_of_children[i]) {
+      RestoreScopeMark(frame->mark);
+      sp--;
+      continue;
+    }
+    struct IRBlock *child = children[first_child[i] + frame->next_child++];
+    stack[sp++] = (struct DomTreeFrame){child, 0, GetScopeMark()};
+    if (HasClobberOnPathsTo(frame->b, child)) KillLoads(NULL, 0);
+    VisitBlock(child);
+  }
+  free(stack);
+  free(children);
+  free(first_child);
+  free(num_of_children);
+  free(by_rpo);
+}
+
+void RunGVN(struct IRFunc *f) {
+  func = f;
+  CalcIRDominators(f);
+  int num_of_vregs = f->num_of_vregs;
+  leaders = calloc(num_of_vregs + 1, sizeof(int));
+  is_const_vreg = calloc(num_of_vregs + 1, sizeof(bool));
+  const_values = calloc(num_of_vregs + 1, sizeof(long));
+  addr_infos = calloc(num_of_vregs + 1, sizeof(struct AddrInfo));
+  has_clobber = calloc(f->num_of_blocks, sizeof(bool));
+  int num_of_insns = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    num_of_insns += f->blocks[i]->num_of_insns;
+  }
+  num_of_buckets = num_of_insns * 2 + 1;
+  buckets = malloc(sizeof(int) * num_of_buckets);
+  assert(leaders && is_const_vreg && const_values && addr_infos &&
+         has_clobber && buckets);
+  for (int v = 0; v <= num_of_vregs; v++) {
+    leaders[v] = v;
+    addr_infos[v] = (struct AddrInfo){v, 0};
+  }
+  for (int i = 0; i < num_of_buckets; i++) buckets[i] = -1;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      enum IROp op = b->insns[k]->op;
+      if (op == kIRStore || op == kIRCall) has_clobber[b->rpo_index] = true;
+    }
+  }
+  num_of_entries = 0;
+  num_of_load_entries = 0;
+  kill_log_size = 0;
+  WalkDominatorTree();
+  // Phis may use vregs defined later in the walk.
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        insn->srcs[s] = GetLeader(insn->srcs[s]);
+      }
+    }
+  }
+  free(entries);
+  entries = NULL;
+  free(load_entries);
+  load_entries = NULL;
+  free(kill_log);
+  kill_log = NULL;
+  entries_capacity = 0;
+  free(buckets);
+  free(has_clobber);
+  free(addr_infos);
+  free(const_values);
+  free(is_const_vreg);
+  free(leaders);
+}
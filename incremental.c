@@ -0,0 +1,412 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+
+#include "compilium.h"
+
+// Incremental compilation cache
+//
+// The cache file keeps the generated code of each function definition keyed
+// by a hash of the function's tokens and of the top-level items it refers to.
+// A function refers to the body of another function only if it may inline
+// it, i.e. the callee was kept for inlining when it was generated.
+// Functions whose key is found in the cache are parsed as empty bodies (so
+// that their declarations are still visible to the analyzer) and their code
+// is copied from the cache instead of being generated again. Functions which
+// may be inlined into a function being generated are still parsed and
+// generated for inlining, but their code is copied from the cache.
+//
+// Before parsing, changed functions are assumed to be inlinable unless they
+// are declared noinline. Keys are calculated again while generating, when
+// whether each function before is inlinable is known, so that callers of a
+// changed function which is too large to inline are reused as well.
+//
+// File layout (host endian):
+//   struct IncrementalCacheHeader
+//   num_of_entries * {
+//     uint64_t key; uint8_t may_be_inlined; uint32_t code_size; char code[];
+//   }
+
+#define INCREMENTAL_CACHE_VERSION 3
+
+struct IncrementalCacheHeader {
+  char magic[4];  // "CINC"
+  uint32_t version;
+  uint64_t config_hash;
+  uint32_t num_of_entries;
+};
+
+struct IncrementalCacheEntry {
+  uint64_t key;
+  uint8_t may_be_inlined;
+  uint32_t code_size;
+  char *code;
+};
+
+// Maps a non-zero 64-bit hash to an index. Key 0 marks an empty slot.
+struct HashIndex {
+  uint64_t *keys;
+  int *values;
+  int capacity;
+};
+
+static void InitHashIndex(struct HashIndex *m, int num_of_keys) {
+  m->capacity = 16;
+  while (m->capacity < num_of_keys * 2) m->capacity <<= 1;
+  m->keys = calloc(m->capacity, sizeof(uint64_t));
+  m->values = calloc(m->capacity, sizeof(int));
+  assert(m->keys && m->values);
+}
+
+static int *FindHashIndexSlot(struct HashIndex *m, uint64_t key, bool insert) {
+  int i = key & (m->capacity - 1);
+  while (m->keys[i] && m->keys[i] != key) i = (i + 1) & (m->capacity - 1);
+  if (!m->keys[i]) {
+    if (!insert) return NULL;
+    m->keys[i] = key;
+  }
+  return &m->values[i];
+}
+
+static void FreeHashIndex(struct HashIndex *m) {
+  free(m->keys);
+  free(m->values);
+}
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV1A_PRIME 0x100000001b3ULL
+
+static uint64_t HashBytes(uint64_t h, const void *p, size_t size) {
+  const unsigned char *s = p;
+  for (size_t i = 0; i < size; i++) {
+    h ^= s[i];
+    h *= FNV1A_PRIME;
+  }
+  return h;
+}
+
+static uint64_t HashU64(uint64_t h, uint64_t v) {
+  return HashBytes(h, &v, sizeof(v));
+}
+
+static uint64_t HashToken(uint64_t h, struct Node *t) {
+  h = HashU64(h, t->length);
+  return HashBytes(h, t->begin, t->length);
+}
+
+static uint64_t NonZeroHash(uint64_t h) { return h ? h : 1; }
+
+// Pragmas are removed from the tokens, so their hints are hashed instead.
+static uint64_t HashTokenRange(uint64_t h, struct Node *begin,
+                               struct Node *end) {
+  for (struct Node *t = begin; t != end; t = t->next_token) {
+    h = HashToken(h, t);
+    if (t->unroll_hint || t->prefetch_hint) {
+      h = HashU64(h, (uint64_t)t->unroll_hint);
+      h = HashU64(h, (uint64_t)t->prefetch_hint);
+    }
+  }
+  return h;
+}
+
+// Mixes the hashes of the preceding top-level items whose names appear in
+// [begin, end).
+static uint64_t HashDeps(uint64_t h, struct Node *begin, struct Node *end,
+                         struct HashIndex *names, uint64_t *item_hashes) {
+  for (struct Node *t = begin; t != end; t = t->next_token) {
+    if (!IsTokenWithType(t, kTokenIdent)) continue;
+    int *index = FindHashIndexSlot(
+        names, NonZeroHash(HashToken(FNV1A_OFFSET_BASIS, t)), false);
+    if (index) h = HashU64(h, item_hashes[*index]);
+  }
+  return h;
+}
+
+static void AddNameOfItem(struct HashIndex *names, struct Node *t,
+                          int item_index) {
+  *FindHashIndexSlot(names, NonZeroHash(HashToken(FNV1A_OFFSET_BASIS, t)),
+                     true) = item_index;
+}
+
+// A function definition is visible by the identifier just before '('.
+static struct Node *FindNameOfFuncDef(struct TopLevelItem *item) {
+  struct Node *last_ident = NULL;
+  for (struct Node *t = SkipFuncSpecs(item->begin); t && t != item->body;
+       t = t->next_token) {
+    if (IsEqualTokenWithCStr(t, "(")) break;
+    if (IsTokenWithType(t, kTokenIdent)) last_ident = t;
+  }
+  return last_ident;
+}
+
+static void AddNamesOfItem(struct HashIndex *names, struct TopLevelItem *item,
+                           int item_index) {
+  if (item->body) {
+    struct Node *name = FindNameOfFuncDef(item);
+    if (name) AddNameOfItem(names, name, item_index);
+    return;
+  }
+  // Declarations may introduce struct tags and members as well, so all of
+  // their identifiers are treated as names of the item.
+  for (struct Node *t = item->begin; t != item->end; t = t->next_token) {
+    if (IsTokenWithType(t, kTokenIdent)) AddNameOfItem(names, t, item_index);
+  }
+}
+
+// Keys are calculated in the order of the items, since an item refers only
+// to the items before it.
+struct ItemKeys {
+  struct HashIndex names;
+  uint64_t *item_hashes;
+};
+
+static void InitItemKeys(struct ItemKeys *k, int num_of_items) {
+  InitHashIndex(&k->names, num_of_items * 4);
+  k->item_hashes = calloc(num_of_items, sizeof(uint64_t));
+  assert(k->item_hashes || !num_of_items);
+}
+
+static void FreeItemKeys(struct ItemKeys *k) {
+  FreeHashIndex(&k->names);
+  free(k->item_hashes);
+}
+
+// Returns the cache key of items[i]. A function definition is keyed by its
+// tokens and the hashes of the items it refers to. Other items have key 0
+// and are always compiled. The items after it see only its declaration
+// unless SetItemMayBeInlined() is called.
+static uint64_t CalcKeyOfItem(struct ItemKeys *k, struct TopLevelItem *items,
+                              int i) {
+  struct TopLevelItem *item = &items[i];
+  struct Node *decl_end = item->body ? item->body : item->end;
+  uint64_t h = HashTokenRange(FNV1A_OFFSET_BASIS, item->begin, decl_end);
+  k->item_hashes[i] =
+      HashDeps(h, item->begin, decl_end, &k->names, k->item_hashes);
+  uint64_t key = 0;
+  if (item->body) {
+    h = HashTokenRange(k->item_hashes[i], item->body, item->end);
+    key = NonZeroHash(
+        HashDeps(h, item->body, item->end, &k->names, k->item_hashes));
+  }
+  AddNamesOfItem(&k->names, item, i);
+  return key;
+}
+
+// Callers of a function which may be inlined depend on its body as well.
+static void SetItemMayBeInlined(struct ItemKeys *k, int i, uint64_t key) {
+  k->item_hashes[i] = key;
+}
+
+// Function definitions which may be inlined into a function which is
+// generated are parsed, and so are the ones which may be inlined into them in
+// turn, so that they can be inlined as in a full compilation.
+static void ParseBodiesToInline(struct TopLevelItem *items, int num_of_items,
+                                const bool *may_be_inlined) {
+  struct HashIndex names;
+  InitHashIndex(&names, num_of_items);
+  for (int i = 0; i < num_of_items; i++) {
+    if (!may_be_inlined[i]) continue;
+    struct Node *name = FindNameOfFuncDef(&items[i]);
+    if (name) AddNameOfItem(&names, name, i);
+  }
+  for (int i = num_of_items - 1; i >= 0; i--) {
+    struct TopLevelItem *item = &items[i];
+    if (!item->body || item->skip_body) continue;
+    for (struct Node *t = item->body; t != item->end; t = t->next_token) {
+      if (!IsTokenWithType(t, kTokenIdent)) continue;
+      int *index = FindHashIndexSlot(
+          &names, NonZeroHash(HashToken(FNV1A_OFFSET_BASIS, t)), false);
+      if (index && *index < i) items[*index].skip_body = false;
+    }
+  }
+  FreeHashIndex(&names);
+}
+
+// Hashes the contents of the file, since functions built against a PCH
+// depend on its declarations.
+static uint64_t HashFile(uint64_t h, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) Error("Failed to open %s", path);
+  char buf[4096];
+  size_t size;
+  while ((size = fread(buf, 1, sizeof(buf), fp)) > 0)
+    h = HashBytes(h, buf, size);
+  fclose(fp);
+  return h;
+}
+
+static uint64_t CalcConfigHash(const char *pch_path) {
+  // Generated code also depends on the compiler itself and its options.
+  uint64_t h = HashU64(FNV1A_OFFSET_BASIS, INCREMENTAL_CACHE_VERSION);
+  h = HashBytes(h, __DATE__ __TIME__, strlen(__DATE__ __TIME__));
+  h = HashU64(h, insert_prefetches);
+  h = HashU64(h, pch_path != NULL);
+  if (pch_path) h = HashFile(h, pch_path);
+  return HashBytes(h, symbol_prefix, strlen(symbol_prefix));
+}
+
+static struct IncrementalCacheEntry *LoadIncrementalCache(
+    const char *path, uint64_t config_hash, int *num_of_entries) {
+  *num_of_entries = 0;
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return NULL;
+  struct IncrementalCacheHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, "CINC", 4) != 0 ||
+      header.version != INCREMENTAL_CACHE_VERSION ||
+      header.config_hash != config_hash) {
+    fclose(fp);
+    return NULL;
+  }
+  struct IncrementalCacheEntry *entries =
+      calloc(header.num_of_entries, sizeof(*entries));
+  assert(entries || !header.num_of_entries);
+  uint32_t i;
+  for (i = 0; i < header.num_of_entries; i++) {
+    struct IncrementalCacheEntry *e = &entries[i];
+    if (fread(&e->key, sizeof(e->key), 1, fp) != 1 ||
+        fread(&e->may_be_inlined, sizeof(e->may_be_inlined), 1, fp) != 1 ||
+        fread(&e->code_size, sizeof(e->code_size), 1, fp) != 1)
+      break;
+    e->code = malloc(e->code_size);
+    assert(e->code || !e->code_size);
+    if (fread(e->code, 1, e->code_size, fp) != e->code_size) {
+      free(e->code);
+      break;
+    }
+  }
+  fclose(fp);
+  // A broken cache is treated as empty.
+  if (i != header.num_of_entries) {
+    while (i--) free(entries[i].code);
+    free(entries);
+    return NULL;
+  }
+  *num_of_entries = header.num_of_entries;
+  return entries;
+}
+
+static void SaveIncrementalCache(const char *path, uint64_t config_hash,
+                                 struct IncrementalCacheEntry *entries,
+                                 int num_of_entries) {
+  char *tmp_path = malloc(strlen(path) + 5);
+  assert(tmp_path);
+  sprintf(tmp_path, "%s.tmp", path);
+  FILE *fp = fopen(tmp_path, "wb");
+  if (!fp) Error("Failed to open %s", tmp_path);
+  struct IncrementalCacheHeader header = {
+      .magic = {'C', 'I', 'N', 'C'},
+      .version = INCREMENTAL_CACHE_VERSION,
+      .config_hash = config_hash,
+      .num_of_entries = num_of_entries};
+  fwrite(&header, sizeof(header), 1, fp);
+  for (int i = 0; i < num_of_entries; i++) {
+    struct IncrementalCacheEntry *e = &entries[i];
+    fwrite(&e->key, sizeof(e->key), 1, fp);
+    fwrite(&e->may_be_inlined, sizeof(e->may_be_inlined), 1, fp);
+    fwrite(&e->code_size, sizeof(e->code_size), 1, fp);
+    fwrite(e->code, 1, e->code_size, fp);
+  }
+  if (fclose(fp) != 0) Error("Failed to write %s", tmp_path);
+  // Replace the cache atomically so that an interrupted build keeps the old
+  // one.
+  if (rename(tmp_path, path) != 0) Error("Failed to write %s", path);
+  free(tmp_path);
+}
+
+void CompileIncrementally(const char *cache_path, struct Node *tokens,
+                          const char *pch_path, struct SymbolEntry *ctx) {
+  int num_of_items;
+  struct TopLevelItem *items = SplitTopLevelItems(tokens, &num_of_items);
+
+  uint64_t config_hash = CalcConfigHash(pch_path);
+  int num_of_cached;
+  struct IncrementalCacheEntry *cached =
+      LoadIncrementalCache(cache_path, config_hash, &num_of_cached);
+  struct HashIndex cache_index;
+  InitHashIndex(&cache_index, num_of_cached);
+  for (int i = 0; i < num_of_cached; i++) {
+    *FindHashIndexSlot(&cache_index, cached[i].key, true) = i;
+  }
+
+  // Only the bodies of changed functions are parsed, analyzed and generated.
+  int *cached_index_of_item = malloc(sizeof(int) * num_of_items);
+  bool *may_be_inlined = calloc(num_of_items, sizeof(bool));
+  assert((cached_index_of_item && may_be_inlined) || !num_of_items);
+  struct ItemKeys keys;
+  InitItemKeys(&keys, num_of_items);
+  int num_of_func_defs = 0;
+  for (int i = 0; i < num_of_items; i++) {
+    cached_index_of_item[i] = -1;
+    uint64_t key = CalcKeyOfItem(&keys, items, i);
+    if (!items[i].body) continue;
+    num_of_func_defs++;
+    int *index = FindHashIndexSlot(&cache_index, key, false);
+    if (index) {
+      cached_index_of_item[i] = *index;
+      items[i].skip_body = true;
+      may_be_inlined[i] = cached[*index].may_be_inlined;
+    } else {
+      may_be_inlined[i] = !(items[i].func_specs & FUNC_SPEC_NOINLINE);
+    }
+    if (may_be_inlined[i]) SetItemMayBeInlined(&keys, i, key);
+  }
+  FreeItemKeys(&keys);
+  ParseBodiesToInline(items, num_of_items, may_be_inlined);
+  struct Node *ast = ParseTopLevelItems(items, num_of_items);
+  AnalyzeInContext(ctx, ast);
+
+  struct IncrementalCacheEntry *entries =
+      calloc(num_of_func_defs, sizeof(*entries));
+  assert(entries || !num_of_func_defs);
+  int num_of_entries = 0;
+  int num_of_reused = 0;
+  InitItemKeys(&keys, num_of_items);
+  GenerateHeader(stdout);
+  for (int i = 0; i < num_of_items; i++) {
+    struct Node *node = GetNodeAt(ast, i);
+    uint64_t key = CalcKeyOfItem(&keys, items, i);
+    if (!items[i].body) {
+      GenerateTopLevelItem(stdout, node);
+      continue;
+    }
+    struct IncrementalCacheEntry *e = &entries[num_of_entries++];
+    e->key = key;
+    // Skipped functions have the same key as before, since the functions
+    // they may inline are cached as well. The others may be found now that
+    // it is known which of the functions before them may be inlined.
+    int *index = items[i].skip_body
+                     ? &cached_index_of_item[i]
+                     : FindHashIndexSlot(&cache_index, key, false);
+    if (index) {
+      struct IncrementalCacheEntry *c = &cached[*index];
+      if (!items[i].skip_body && c->may_be_inlined)
+        GenerateTopLevelItem(NULL, node);
+      e->may_be_inlined = c->may_be_inlined;
+      e->code_size = c->code_size;
+      e->code = c->code;
+      num_of_reused++;
+    } else {
+      size_t size;
+      FILE *fp = open_memstream(&e->code, &size);
+      assert(fp);
+      GenerateTopLevelItem(fp, node);
+      fclose(fp);
+      e->may_be_inlined =
+          IsKeptForInlining(CreateTokenStr(node->func_name_token));
+      e->code_size = size;
+    }
+    if (e->may_be_inlined) SetItemMayBeInlined(&keys, i, key);
+    fwrite(e->code, 1, e->code_size, stdout);
+  }
+  fprintf(stderr, "Incremental: reused %d of %d functions\n", num_of_reused,
+          num_of_func_defs);
+  SaveIncrementalCache(cache_path, config_hash, entries, num_of_entries);
+
+  FreeItemKeys(&keys);
+  free(entries);
+  free(may_be_inlined);
+  free(cached_index_of_item);
+  FreeHashIndex(&cache_index);
+  free(cached);
+  free(items);
+}
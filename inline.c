@@ -0,0 +1,295 @@
+#include "compilium.h"
+
+// Function inlining before SSA form is built
+//
+// A copy of the IR of each function definition is kept before it is
+// optimized, so calls of the function in the items after it can be replaced
+// by the copy. The params of the copy are assigned the args, and its returns
+// assign the result and jump to the code after the call. Local vars of the
+// copy get their own part of the frame of the caller. Callees are inlined
+// into their own copy first, and calls of the function being generated are
+// never inlined, so recursion ends.
+//
+// Whether a call is inlined depends on the estimated size of the callee: it
+// should not exceed what the call costs, plus what may fold away when an arg
+// is known, such as a const or the addr of an object. Calls in loops may be
+// inlined with twice the size, and so may functions declared inline with a
+// larger limit. __attribute__((always_inline)) inlines a function regardless
+// of its size, and __attribute__((noinline)) never.
+
+#define INLINE_THRESHOLD 24          // insns which a call costs
+#define INLINE_HINT_THRESHOLD 96     // for functions declared inline
+#define KNOWN_ARG_BONUS 8            // insns which may fold for a known arg
+#define MAX_CALLER_SIZE 2048         // insns which a caller may grow to
+#define MAX_INLINED_FRAME_SIZE 4096  // bytes of the local vars of a callee
+
+struct InlineCandidate {
+  struct IRFunc *body;  // before it is optimized
+  struct Node *str_list;
+  int func_specs;
+  int num_of_args_used;  // args up to the last named param
+  int size;
+};
+
+struct CallSite {
+  struct IRInsn *call;
+  struct InlineCandidate *callee;
+  int num_of_known_args;
+  bool is_in_loop;
+};
+
+static struct InlineCandidate *candidates;
+static int num_of_candidates;
+
+static struct IRFunc *func;
+static struct Node *func_str_list;
+
+// Params, jumps and returns mostly disappear when the function is inlined.
+static int EstimateSize(struct IRFunc *f) {
+  int size = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      enum IROp op = b->insns[k]->op;
+      if (op != kIRParam && op != kIRJump && op != kIRReturn) size++;
+    }
+  }
+  return size;
+}
+
+static int GetThreshold(int func_specs, int num_of_known_args,
+                        bool is_in_loop) {
+  int threshold = func_specs & FUNC_SPEC_INLINE ? INLINE_HINT_THRESHOLD
+                                                : INLINE_THRESHOLD;
+  threshold += KNOWN_ARG_BONUS * num_of_known_args;
+  return is_in_loop ? threshold * 2 : threshold;
+}
+
+static struct InlineCandidate *FindCandidate(const char *name) {
+  for (int i = num_of_candidates - 1; i >= 0; i--) {
+    if (!strcmp(candidates[i].body->name, name)) return &candidates[i];
+  }
+  return NULL;
+}
+
+static bool ShouldInline(struct CallSite *site, int caller_size) {
+  struct InlineCandidate *c = site->callee;
+  if (site->call->num_of_srcs - 1 < c->num_of_args_used) return false;
+  if (c->func_specs & FUNC_SPEC_ALWAYS_INLINE) return true;
+  if (c->body->frame_size > MAX_INLINED_FRAME_SIZE ||
+      caller_size + c->size > MAX_CALLER_SIZE)
+    return false;
+  return c->size <= GetThreshold(c->func_specs, site->num_of_known_args,
+                                 site->is_in_loop);
+}
+
+// Returns the def of vreg if it is the only one.
+static struct IRInsn *GetOnlyDef(struct IRInsn **def_insns, int *num_of_defs,
+                                 int vreg) {
+  return num_of_defs[vreg] == 1 ? def_insns[vreg] : NULL;
+}
+
+static bool IsKnownValue(struct IRInsn *def) {
+  return def && (def->op == kIRConst || def->op == kIRFrameAddr ||
+                 def->op == kIRSymAddr || def->op == kIRStrAddr);
+}
+
+// Finds calls of the candidates in the blocks of func as generated.
+static struct CallSite *FindCallSites(int *num_of_sites) {
+  int n = func->num_of_vregs + 1;
+  struct IRInsn **def_insns = calloc(n, sizeof(struct IRInsn *));
+  int *num_of_defs = calloc(n, sizeof(int));
+  bool *is_in_loop = calloc(func->num_of_labels + 1, sizeof(bool));
+  assert(def_insns && num_of_defs && is_in_loop);
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!insn->dst) continue;
+      def_insns[insn->dst] = insn;
+      num_of_defs[insn->dst]++;
+    }
+  }
+  int num_of_loops;
+  struct IRLoop *loops = FindIRLoops(func, &num_of_loops);
+  for (int i = 0; i < num_of_loops; i++) {
+    for (int k = 0; k < loops[i].num_of_blocks; k++) {
+      is_in_loop[loops[i].blocks[k]->label] = true;
+    }
+  }
+  FreeIRLoops(loops, num_of_loops);
+  struct CallSite *sites = NULL;
+  *num_of_sites = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op != kIRCall) continue;
+      struct IRInsn *def = GetOnlyDef(def_insns, num_of_defs, insn->srcs[0]);
+      if (!def || def->op != kIRSymAddr) continue;
+      struct InlineCandidate *c = FindCandidate(def->sym);
+      if (!c) continue;
+      int num_of_known_args = 0;
+      for (int s = 1; s < insn->num_of_srcs; s++) {
+        if (IsKnownValue(GetOnlyDef(def_insns, num_of_defs, insn->srcs[s])))
+          num_of_known_args++;
+      }
+      sites = realloc(sites, sizeof(struct CallSite) * (*num_of_sites + 1));
+      assert(sites);
+      sites[(*num_of_sites)++] =
+          (struct CallSite){insn, c, num_of_known_args, is_in_loop[b->label]};
+    }
+  }
+  free(is_in_loop);
+  free(num_of_defs);
+  free(def_insns);
+  return sites;
+}
+
+// Appends dst = src converted to the type of dst, as a param or a result of
+// a call is.
+static void AppendConversion(struct IRBlock *b, int dst, int src) {
+  enum IRType type = func->vreg_types[dst];
+  bool is_narrowed =
+      (type == kIRTypeI8 || type == kIRTypeI32) &&
+      GetSizeOfIRType(type) < GetSizeOfIRType(func->vreg_types[src]);
+  AddIRSrc(AppendIRInsn(b, is_narrowed ? kIRSext : kIRCopy, type, dst), src);
+}
+
+// String literals are local to each function, so the caller gets its own
+// label for each string literal of the callee.
+static long CopyStrLiteral(struct InlineCandidate *c, long label) {
+  for (int i = 0; i < GetSizeOfList(c->str_list); i++) {
+    struct Node *n = GetNodeAt(c->str_list, i);
+    if (n->label_number != label) continue;
+    struct Node *copy = AllocNode(kASTExpr);
+    copy->op = n->op;
+    copy->label_number = AllocIRLabel(func);
+    PushToList(func_str_list, copy);
+    return copy->label_number;
+  }
+  assert(false);
+}
+
+static struct IRBlock *FindBlockOfInsn(struct IRInsn *insn, int *index) {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      if (b->insns[k] != insn) continue;
+      *index = k;
+      return b;
+    }
+  }
+  assert(false);
+}
+
+static int GetIndexInFunc(struct IRBlock *b) {
+  int i = 0;
+  while (func->blocks[i] != b) i++;
+  return i;
+}
+
+// The block of the call is split after the call, and the copy of the callee
+// is placed between the two halves.
+static void InlineCall(struct CallSite *site) {
+  struct IRInsn *call = site->call;
+  struct IRFunc *callee = site->callee->body;
+  int k;
+  struct IRBlock *b = FindBlockOfInsn(call, &k);
+  int index = GetIndexInFunc(b) + 1;
+  struct IRBlock *next = AllocIRBlock(func);
+  InsertIRBlock(func, index, next);
+  while (b->num_of_insns > k + 1) {
+    MoveIRInsn(b, k + 1, next, next->num_of_insns);
+  }
+  int *vregs = malloc(sizeof(int) * (callee->num_of_vregs + 1));
+  struct IRBlock **block_of_label =
+      calloc(callee->num_of_labels + 1, sizeof(struct IRBlock *));
+  assert(vregs && block_of_label);
+  vregs[0] = 0;
+  for (int v = 1; v <= callee->num_of_vregs; v++) {
+    vregs[v] = AllocIRVReg(func, callee->vreg_types[v]);
+  }
+  for (int i = 0; i < callee->num_of_blocks; i++) {
+    struct IRBlock *copy = AllocIRBlock(func);
+    copy->unroll_hint = callee->blocks[i]->unroll_hint;
+    copy->prefetch_hint = callee->blocks[i]->prefetch_hint;
+    block_of_label[callee->blocks[i]->label] = copy;
+    InsertIRBlock(func, index + i, copy);
+  }
+  int frame_base = (func->frame_size + 15) & ~15;
+  func->frame_size = frame_base + callee->frame_size;
+  for (int i = 0; i < callee->num_of_blocks; i++) {
+    struct IRBlock *from = callee->blocks[i];
+    struct IRBlock *copy = block_of_label[from->label];
+    for (int j = 0; j < from->num_of_insns; j++) {
+      struct IRInsn *insn = from->insns[j];
+      if (insn->op == kIRParam) {
+        AppendConversion(copy, vregs[insn->dst], call->srcs[1 + insn->imm]);
+        continue;
+      }
+      if (insn->op == kIRReturn) {
+        if (call->type != kIRTypeNone && insn->num_of_srcs)
+          AppendConversion(copy, call->dst, vregs[insn->srcs[0]]);
+        AppendIRInsn(copy, kIRJump, kIRTypeNone, 0)->targets[0] = next;
+        continue;
+      }
+      struct IRInsn *c = AppendIRInsnCopy(copy, insn);
+      c->dst = vregs[c->dst];
+      for (int s = 0; s < c->num_of_srcs; s++) c->srcs[s] = vregs[c->srcs[s]];
+      for (int t = 0; t < 2; t++) {
+        if (c->targets[t]) c->targets[t] = block_of_label[c->targets[t]->label];
+      }
+      if (c->op == kIRFrameAddr) c->imm += frame_base;
+      if (c->op == kIRStrAddr) c->imm = CopyStrLiteral(site->callee, c->imm);
+    }
+  }
+  RemoveIRInsn(b, k);
+  AppendIRInsn(b, kIRJump, kIRTypeNone, 0)->targets[0] =
+      block_of_label[callee->blocks[0]->label];
+  free(block_of_label);
+  free(vregs);
+}
+
+// str_list gets the string literals which the inlined code refers to.
+void InlineCalls(struct IRFunc *f, struct Node *str_list) {
+  func = f;
+  func_str_list = str_list;
+  int num_of_sites;
+  struct CallSite *sites = FindCallSites(&num_of_sites);
+  int size = EstimateSize(f);
+  bool changed = false;
+  for (int i = 0; i < num_of_sites; i++) {
+    if (!ShouldInline(&sites[i], size)) continue;
+    InlineCall(&sites[i]);
+    size += sites[i].callee->size;
+    changed = true;
+  }
+  free(sites);
+  if (changed) RemoveUnreachableIRBlocks(f);
+}
+
+bool IsKeptForInlining(const char *name) {
+  return FindCandidate(name) != NULL;
+}
+
+// Keeps a copy of f, whose calls are inlined already, for the functions
+// after it. Functions which are never inlined are not kept.
+void SaveIRFuncForInlining(struct IRFunc *f, struct Node *func_def,
+                           struct Node *str_list) {
+  int func_specs = func_def->func_specs;
+  int num_of_args_used = GetSizeOfList(func_def->arg_var_list);
+  while (num_of_args_used &&
+         !GetNodeAt(func_def->arg_var_list, num_of_args_used - 1))
+    num_of_args_used--;
+  int size = EstimateSize(f);
+  if (func_specs & FUNC_SPEC_NOINLINE) return;
+  if (!(func_specs & FUNC_SPEC_ALWAYS_INLINE) &&
+      size > GetThreshold(func_specs, num_of_args_used, true))
+    return;
+  candidates = realloc(candidates, sizeof(struct InlineCandidate) *
+                                       (num_of_candidates + 1));
+  assert(candidates);
+  candidates[num_of_candidates++] = (struct InlineCandidate){
+      CopyIRFunc(f), str_list, func_specs, num_of_args_used, size};
+}
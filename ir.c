@@ -0,0 +1,643 @@
+#include "compilium.h"
+
+// Three-address intermediate representation
+//
+// A function is a list of basic blocks. Each block is a list of
+// instructions which ends with exactly one terminator (jump, branch or
+// return). Instructions read and write virtual registers (vregs) and each
+// vreg has a type. Vregs of local vars may be written more than once.
+
+bool dump_ir;
+
+#define VARIADIC_SRCS -1
+
+static const struct {
+  const char *name;
+  int num_of_srcs;
+  bool has_dst;
+} ir_op_infos[kNumOfIROps] = {
+    [kIRConst] = {"const", 0, true},
+    [kIRCopy] = {"copy", 1, true},
+    [kIRAdd] = {"add", 2, true},
+    [kIRSub] = {"sub", 2, true},
+    [kIRMul] = {"mul", 2, true},
+    [kIRDiv] = {"div", 2, true},
+    [kIRMod] = {"mod", 2, true},
+    [kIRAnd] = {"and", 2, true},
+    [kIROr] = {"or", 2, true},
+    [kIRXor] = {"xor", 2, true},
+    [kIRShl] = {"shl", 2, true},
+    [kIRSar] = {"sar", 2, true},
+    [kIRCmpEq] = {"cmp_eq", 2, true},
+    [kIRCmpNe] = {"cmp_ne", 2, true},
+    [kIRCmpLt] = {"cmp_lt", 2, true},
+    [kIRCmpLe] = {"cmp_le", 2, true},
+    [kIRCmpGt] = {"cmp_gt", 2, true},
+    [kIRCmpGe] = {"cmp_ge", 2, true},
+    [kIRNeg] = {"neg", 1, true},
+    [kIRNot] = {"not", 1, true},
+    [kIRMin] = {"min", 2, true},
+    [kIRMax] = {"max", 2, true},
+    [kIRBroadcast] = {"broadcast", 1, true},
+    [kIRReduceAdd] = {"reduce_add", 1, true},
+    [kIRReduceMin] = {"reduce_min", 1, true},
+    [kIRReduceMax] = {"reduce_max", 1, true},
+    [kIRHasAVX2] = {"has_avx2", 0, true},
+    [kIRSext] = {"sext", 1, true},
+    [kIRParam] = {"param", 0, true},
+    [kIRFrameAddr] = {"frame_addr", 0, true},
+    [kIRSymAddr] = {"sym_addr", 0, true},
+    [kIRStrAddr] = {"str_addr", 0, true},
+    [kIRLoad] = {"load", 1, true},
+    [kIRStore] = {"store", 2, false},
+    [kIRPrefetch] = {"prefetch", 1, false},
+    [kIRZeroUpper] = {"zero_upper", 0, false},
+    [kIRCall] = {"call", VARIADIC_SRCS, true},
+    [kIRJump] = {"jmp", 0, false},
+    [kIRBranch] = {"br", 1, false},
+    [kIRReturn] = {"ret", VARIADIC_SRCS, false},
+    [kIRPhi] = {"phi", VARIADIC_SRCS, true},
+};
+
+static const char *ir_type_names[] = {
+    [kIRTypeNone] = "none",   [kIRTypeI8] = "i8",
+    [kIRTypeI32] = "i32",     [kIRTypeI64] = "i64",
+    [kIRTypePtr] = "ptr",     [kIRTypeI8x16] = "i8x16",
+    [kIRTypeI32x4] = "i32x4", [kIRTypeI8x32] = "i8x32",
+    [kIRTypeI32x8] = "i32x8",
+};
+
+// Suffixes of the prefetch insns of x86-64 for each locality
+const char *prefetch_locality_names[4] = {"nta", "t2", "t1", "t0"};
+
+struct IRFunc *AllocIRFunc(const char *name, int num_of_vregs) {
+  struct IRFunc *f = calloc(1, sizeof(struct IRFunc));
+  assert(f);
+  f->name = name;
+  for (int v = 1; v <= num_of_vregs; v++) AllocIRVReg(f, kIRTypeNone);
+  return f;
+}
+
+// Blocks are allocated before they are placed so that forward jump targets
+// can be created ahead of the code which precedes them.
+struct IRBlock *AllocIRBlock(struct IRFunc *f) {
+  struct IRBlock *b = calloc(1, sizeof(struct IRBlock));
+  assert(b);
+  b->label = AllocIRLabel(f);
+  return b;
+}
+
+// Places b before f->blocks[index] in the layout.
+void InsertIRBlock(struct IRFunc *f, int index, struct IRBlock *b) {
+  assert(0 <= index && index <= f->num_of_blocks);
+  if (f->num_of_blocks >= f->blocks_capacity) {
+    f->blocks_capacity = f->blocks_capacity ? f->blocks_capacity * 2 : 16;
+    f->blocks =
+        realloc(f->blocks, sizeof(struct IRBlock *) * f->blocks_capacity);
+    assert(f->blocks);
+  }
+  memmove(&f->blocks[index + 1], &f->blocks[index],
+          sizeof(struct IRBlock *) * (f->num_of_blocks - index));
+  f->blocks[index] = b;
+  f->num_of_blocks++;
+}
+
+void PlaceIRBlock(struct IRFunc *f, struct IRBlock *b) {
+  InsertIRBlock(f, f->num_of_blocks, b);
+}
+
+int AllocIRVReg(struct IRFunc *f, enum IRType type) {
+  int v = ++f->num_of_vregs;
+  if (v >= f->vreg_types_capacity) {
+    f->vreg_types_capacity = (v + 1) * 2;
+    f->vreg_types =
+        realloc(f->vreg_types, sizeof(enum IRType) * f->vreg_types_capacity);
+    assert(f->vreg_types);
+    f->vreg_types[0] = kIRTypeNone;
+  }
+  f->vreg_types[v] = type;
+  return v;
+}
+
+void SetIRVRegType(struct IRFunc *f, int vreg, enum IRType type) {
+  assert(1 <= vreg && vreg <= f->num_of_vregs);
+  f->vreg_types[vreg] = type;
+}
+
+int AllocIRLabel(struct IRFunc *f) { return ++f->num_of_labels; }
+
+// Inserts a new insn before b->insns[index].
+struct IRInsn *InsertIRInsn(struct IRBlock *b, int index, enum IROp op,
+                            enum IRType type, int dst) {
+  assert(0 <= index && index <= b->num_of_insns);
+  struct IRInsn *insn = calloc(1, sizeof(struct IRInsn));
+  assert(insn);
+  insn->op = op;
+  insn->type = type;
+  insn->dst = dst;
+  if (b->num_of_insns >= b->insns_capacity) {
+    b->insns_capacity = b->insns_capacity ? b->insns_capacity * 2 : 8;
+    b->insns = realloc(b->insns, sizeof(struct IRInsn *) * b->insns_capacity);
+    assert(b->insns);
+  }
+  memmove(&b->insns[index + 1], &b->insns[index],
+          sizeof(struct IRInsn *) * (b->num_of_insns - index));
+  b->insns[index] = insn;
+  b->num_of_insns++;
+  return insn;
+}
+
+struct IRInsn *AppendIRInsn(struct IRBlock *b, enum IROp op,
+                            enum IRType type, int dst) {
+  return InsertIRInsn(b, b->num_of_insns, op, type, dst);
+}
+
+static void FreeIRInsn(struct IRInsn *insn) {
+  free(insn->srcs);
+  free(insn->src_blocks);
+  free(insn);
+}
+
+// Removes b->insns[index] and frees it.
+void RemoveIRInsn(struct IRBlock *b, int index) {
+  assert(0 <= index && index < b->num_of_insns);
+  FreeIRInsn(b->insns[index]);
+  memmove(&b->insns[index], &b->insns[index + 1],
+          sizeof(struct IRInsn *) * (b->num_of_insns - index - 1));
+  b->num_of_insns--;
+}
+
+// Moves all insns of src to the end of dst. src is left empty.
+void MoveIRInsnsToEnd(struct IRBlock *dst, struct IRBlock *src) {
+  int n = dst->num_of_insns + src->num_of_insns;
+  if (n > dst->insns_capacity) {
+    dst->insns_capacity = n;
+    dst->insns = realloc(dst->insns, sizeof(struct IRInsn *) * n);
+    assert(dst->insns);
+  }
+  memcpy(&dst->insns[dst->num_of_insns], src->insns,
+         sizeof(struct IRInsn *) * src->num_of_insns);
+  dst->num_of_insns = n;
+  src->num_of_insns = 0;
+}
+
+// Moves src->insns[index] to before dst->insns[dst_index].
+void MoveIRInsn(struct IRBlock *src, int index, struct IRBlock *dst,
+                int dst_index) {
+  assert(0 <= index && index < src->num_of_insns);
+  struct IRInsn *insn = src->insns[index];
+  memmove(&src->insns[index], &src->insns[index + 1],
+          sizeof(struct IRInsn *) * (src->num_of_insns - index - 1));
+  src->num_of_insns--;
+  assert(0 <= dst_index && dst_index <= dst->num_of_insns);
+  if (dst->num_of_insns >= dst->insns_capacity) {
+    dst->insns_capacity = dst->insns_capacity ? dst->insns_capacity * 2 : 8;
+    dst->insns =
+        realloc(dst->insns, sizeof(struct IRInsn *) * dst->insns_capacity);
+    assert(dst->insns);
+  }
+  memmove(&dst->insns[dst_index + 1], &dst->insns[dst_index],
+          sizeof(struct IRInsn *) * (dst->num_of_insns - dst_index));
+  dst->insns[dst_index] = insn;
+  dst->num_of_insns++;
+}
+
+void AddIRSrc(struct IRInsn *insn, int vreg) {
+  insn->srcs = realloc(insn->srcs, sizeof(int) * (insn->num_of_srcs + 1));
+  assert(insn->srcs);
+  insn->srcs[insn->num_of_srcs++] = vreg;
+}
+
+void AddIRPhiSrc(struct IRInsn *phi, int vreg, struct IRBlock *from) {
+  assert(phi->op == kIRPhi);
+  phi->src_blocks = realloc(phi->src_blocks, sizeof(struct IRBlock *) *
+                                                 (phi->num_of_srcs + 1));
+  assert(phi->src_blocks);
+  phi->src_blocks[phi->num_of_srcs] = from;
+  AddIRSrc(phi, vreg);
+}
+
+// Appends a copy of insn to b. The copy has the same dst and targets.
+struct IRInsn *AppendIRInsnCopy(struct IRBlock *b, struct IRInsn *insn) {
+  struct IRInsn *copy = AppendIRInsn(b, insn->op, insn->type, insn->dst);
+  for (int s = 0; s < insn->num_of_srcs; s++) {
+    if (insn->op == kIRPhi) {
+      AddIRPhiSrc(copy, insn->srcs[s], insn->src_blocks[s]);
+    } else {
+      AddIRSrc(copy, insn->srcs[s]);
+    }
+  }
+  copy->imm = insn->imm;
+  copy->sym = insn->sym;
+  copy->targets[0] = insn->targets[0];
+  copy->targets[1] = insn->targets[1];
+  return copy;
+}
+
+// Removes the srcs of the phis in b which come from the block from.
+void RemoveIRPhiSrcsFrom(struct IRBlock *b, struct IRBlock *from) {
+  for (int i = 0; i < b->num_of_insns && b->insns[i]->op == kIRPhi; i++) {
+    struct IRInsn *phi = b->insns[i];
+    int n = 0;
+    for (int k = 0; k < phi->num_of_srcs; k++) {
+      if (phi->src_blocks[k] == from) continue;
+      phi->srcs[n] = phi->srcs[k];
+      phi->src_blocks[n] = phi->src_blocks[k];
+      n++;
+    }
+    phi->num_of_srcs = n;
+  }
+}
+
+// Turns insn into dst = imm keeping its dst and type.
+void ReplaceIRInsnWithConst(struct IRInsn *insn, long imm) {
+  insn->op = kIRConst;
+  insn->num_of_srcs = 0;
+  free(insn->srcs);
+  insn->srcs = NULL;
+  free(insn->src_blocks);
+  insn->src_blocks = NULL;
+  insn->imm = imm;
+}
+
+// Turns the terminator of b into a jump to target.
+void ReplaceIRTerminatorWithJump(struct IRBlock *b, struct IRBlock *target) {
+  struct IRInsn *insn = GetIRTerminator(b);
+  assert(insn);
+  insn->op = kIRJump;
+  insn->num_of_srcs = 0;
+  insn->targets[0] = target;
+  insn->targets[1] = NULL;
+}
+
+bool IsIRTerminator(struct IRInsn *insn) {
+  return insn->op == kIRJump || insn->op == kIRBranch ||
+         insn->op == kIRReturn;
+}
+
+struct IRInsn *GetIRTerminator(struct IRBlock *b) {
+  if (!b->num_of_insns) return NULL;
+  struct IRInsn *last = b->insns[b->num_of_insns - 1];
+  return IsIRTerminator(last) ? last : NULL;
+}
+
+int GetSizeOfIRType(enum IRType type) {
+  if (type == kIRTypeI8) return 1;
+  if (type == kIRTypeI32) return 4;
+  if (type == kIRTypeI8x16 || type == kIRTypeI32x4) return 16;
+  if (type == kIRTypeI8x32 || type == kIRTypeI32x8) return 32;
+  assert(type == kIRTypeI64 || type == kIRTypePtr);
+  return 8;
+}
+
+bool IsVectorIRType(enum IRType type) { return type >= kIRTypeI8x16; }
+
+enum IRType GetIRLaneType(enum IRType type) {
+  assert(IsVectorIRType(type));
+  return type == kIRTypeI8x16 || type == kIRTypeI8x32 ? kIRTypeI8 : kIRTypeI32;
+}
+
+// Returns the vector type of size bytes with lanes of lane_type.
+enum IRType GetVectorIRType(enum IRType lane_type, int size) {
+  assert(lane_type == kIRTypeI8 || lane_type == kIRTypeI32);
+  assert(size == 16 || size == 32);
+  if (lane_type == kIRTypeI8) return size == 16 ? kIRTypeI8x16 : kIRTypeI8x32;
+  return size == 16 ? kIRTypeI32x4 : kIRTypeI32x8;
+}
+
+static int GetNumOfIRTargets(struct IRInsn *insn) {
+  return insn->op == kIRBranch ? 2 : insn->op == kIRJump ? 1 : 0;
+}
+
+int GetNumOfIRSuccs(struct IRBlock *b) {
+  struct IRInsn *t = GetIRTerminator(b);
+  return t ? GetNumOfIRTargets(t) : 0;
+}
+
+struct IRBlock *GetIRSucc(struct IRBlock *b, int index) {
+  assert(0 <= index && index < GetNumOfIRSuccs(b));
+  return GetIRTerminator(b)->targets[index];
+}
+
+// Returns the value truncated to the type and sign-extended to 64 bits.
+long TruncateToIRType(long value, enum IRType type) {
+  int bits = GetSizeOfIRType(type) * 8;
+  if (bits == 64) return value;
+  unsigned long mask = (1UL << bits) - 1;
+  unsigned long v = (unsigned long)value & mask;
+  if (v & (1UL << (bits - 1))) return -(long)(mask - v) - 1;
+  return (long)v;
+}
+
+// Evaluates op on constants as the lowered code does, wrapping around on
+// overflow. Returns false if the result is undefined (e.g. division by 0).
+bool FoldIROp(enum IROp op, enum IRType type, long a, long b, long *result) {
+  unsigned long ua = a, ub = b;
+  int bits = GetSizeOfIRType(type) * 8;
+  long r;
+  switch (op) {
+    case kIRCopy:
+      r = a;
+      break;
+    case kIRSext:
+      r = TruncateToIRType(a, type);
+      break;
+    case kIRAdd:
+      r = (long)(ua + ub);
+      break;
+    case kIRSub:
+      r = (long)(ua - ub);
+      break;
+    case kIRMul:
+      r = (long)(ua * ub);
+      break;
+    case kIRDiv:
+    case kIRMod:
+      if (b == 0 || (b == -1 && a == TruncateToIRType(1UL << (bits - 1), type)))
+        return false;
+      r = op == kIRDiv ? a / b : a % b;
+      break;
+    case kIRAnd:
+      r = a & b;
+      break;
+    case kIROr:
+      r = a | b;
+      break;
+    case kIRXor:
+      r = a ^ b;
+      break;
+    case kIRShl:
+      if (b < 0 || bits <= b) return false;
+      r = (long)(ua << b);
+      break;
+    case kIRSar:
+      if (b < 0 || bits <= b) return false;
+      r = a < 0 ? ~(~a >> b) : a >> b;
+      break;
+    case kIRCmpEq:
+      r = a == b;
+      break;
+    case kIRCmpNe:
+      r = a != b;
+      break;
+    case kIRCmpLt:
+      r = a < b;
+      break;
+    case kIRCmpLe:
+      r = a <= b;
+      break;
+    case kIRCmpGt:
+      r = a > b;
+      break;
+    case kIRCmpGe:
+      r = a >= b;
+      break;
+    case kIRNeg:
+      r = (long)(0 - ua);
+      break;
+    case kIRNot:
+      r = ~a;
+      break;
+    default:
+      return false;
+  }
+  *result = TruncateToIRType(r, type);
+  return true;
+}
+
+static void FreeIRBlock(struct IRBlock *b) {
+  for (int k = 0; k < b->num_of_insns; k++) FreeIRInsn(b->insns[k]);
+  free(b->insns);
+  free(b->preds);
+  free(b);
+}
+
+void CalcIRPreds(struct IRFunc *f) {
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    f->blocks[i]->num_of_preds = 0;
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRInsn *t = GetIRTerminator(f->blocks[i]);
+    for (int k = 0; t && k < GetNumOfIRTargets(t); k++) {
+      struct IRBlock *succ = t->targets[k];
+      succ->preds = realloc(succ->preds, sizeof(struct IRBlock *) *
+                                             (succ->num_of_preds + 1));
+      assert(succ->preds);
+      succ->preds[succ->num_of_preds++] = f->blocks[i];
+    }
+  }
+}
+
+// Removes the blocks which are not reachable from the entry and updates
+// preds of the rest.
+void RemoveUnreachableIRBlocks(struct IRFunc *f) {
+  bool *is_reachable = calloc(f->num_of_labels + 1, sizeof(bool));
+  struct IRBlock **stack = malloc(sizeof(struct IRBlock *) * f->num_of_blocks);
+  assert(is_reachable && stack);
+  int sp = 0;
+  stack[sp++] = f->blocks[0];
+  is_reachable[f->blocks[0]->label] = true;
+  while (sp) {
+    struct IRBlock *b = stack[--sp];
+    for (int k = 0; k < GetNumOfIRSuccs(b); k++) {
+      struct IRBlock *succ = GetIRSucc(b, k);
+      if (is_reachable[succ->label]) continue;
+      is_reachable[succ->label] = true;
+      stack[sp++] = succ;
+    }
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    if (is_reachable[b->label]) continue;
+    for (int k = 0; k < GetNumOfIRSuccs(b); k++) {
+      RemoveIRPhiSrcsFrom(GetIRSucc(b, k), b);
+    }
+  }
+  int n = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    if (is_reachable[b->label]) {
+      f->blocks[n++] = b;
+    } else {
+      FreeIRBlock(b);
+    }
+  }
+  f->num_of_blocks = n;
+  free(stack);
+  free(is_reachable);
+  CalcIRPreds(f);
+}
+
+static void PrintIRInsn(FILE *fp, struct IRInsn *insn) {
+  fprintf(fp, "  ");
+  if (insn->dst)
+    fprintf(fp, "%%%d:%s = ", insn->dst, ir_type_names[insn->type]);
+  fprintf(fp, "%s", ir_op_infos[insn->op].name);
+  if (insn->op == kIRStore) fprintf(fp, ".%s", ir_type_names[insn->type]);
+  if (insn->op == kIRPrefetch)
+    fprintf(fp, ".%s", prefetch_locality_names[insn->imm]);
+  const char *sep = " ";
+  for (int i = 0; i < insn->num_of_srcs; i++) {
+    if (insn->op == kIRPhi) {
+      fprintf(fp, "%s[%%%d, B%d]", sep, insn->srcs[i],
+              insn->src_blocks[i]->label);
+    } else {
+      fprintf(fp, "%s%%%d", sep, insn->srcs[i]);
+    }
+    sep = ", ";
+  }
+  if (insn->op == kIRConst || insn->op == kIRParam ||
+      insn->op == kIRFrameAddr) {
+    fprintf(fp, "%s%ld", sep, insn->imm);
+  } else if (insn->op == kIRStrAddr) {
+    fprintf(fp, "%sL%ld", sep, insn->imm);
+  } else if (insn->op == kIRSymAddr) {
+    fprintf(fp, "%s%s", sep, insn->sym);
+  }
+  for (int k = 0; k < GetNumOfIRTargets(insn); k++) {
+    fprintf(fp, "%sB%d", sep, insn->targets[k]->label);
+    sep = ", ";
+  }
+  fputc('\n', fp);
+}
+
+void PrintIRFunc(FILE *fp, struct IRFunc *f) {
+  fprintf(fp, "function %s\n", f->name);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    fprintf(fp, "B%d:\n", b->label);
+    for (int k = 0; k < b->num_of_insns; k++) PrintIRInsn(fp, b->insns[k]);
+  }
+}
+
+static bool IsValidIRVReg(struct IRFunc *f, int vreg) {
+  return 1 <= vreg && vreg <= f->num_of_vregs &&
+         f->vreg_types[vreg] != kIRTypeNone;
+}
+
+_Noreturn static void ErrorInIR(struct IRFunc *f, struct IRBlock *b,
+                                struct IRInsn *insn, const char *msg) {
+  PrintIRFunc(stderr, f);
+  fprintf(stderr, "In B%d:\n", b->label);
+  if (insn) PrintIRInsn(stderr, insn);
+  Error("Broken IR: %s", msg);
+}
+
+static void VerifyIRPhi(struct IRFunc *f, struct IRBlock *b, int index) {
+  struct IRInsn *phi = b->insns[index];
+  if (index && b->insns[index - 1]->op != kIRPhi)
+    ErrorInIR(f, b, phi, "phi after a non-phi insn");
+  if (phi->num_of_srcs != b->num_of_preds)
+    ErrorInIR(f, b, phi, "phi does not have a src for each pred");
+  for (int i = 0; i < phi->num_of_srcs; i++) {
+    int k;
+    for (k = 0; k < b->num_of_preds; k++) {
+      if (b->preds[k] == phi->src_blocks[i]) break;
+    }
+    if (k == b->num_of_preds)
+      ErrorInIR(f, b, phi, "phi has a src from a block which is not a pred");
+  }
+}
+
+// Checks the structure of blocks, the number of operands of each insn and
+// that every vreg used has a type.
+void VerifyIRFunc(struct IRFunc *f) {
+  if (!f->num_of_blocks) Error("Broken IR: %s has no blocks", f->name);
+  CalcIRPreds(f);
+  struct IRBlock **block_of_label =
+      calloc(f->num_of_labels + 1, sizeof(struct IRBlock *));
+  assert(block_of_label);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    if (b->label < 1 || f->num_of_labels < b->label ||
+        block_of_label[b->label])
+      ErrorInIR(f, b, NULL, "duplicated label");
+    block_of_label[b->label] = b;
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    if (!GetIRTerminator(b))
+      ErrorInIR(f, b, NULL, "block does not end with a terminator");
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op < 0 || kNumOfIROps <= insn->op)
+        ErrorInIR(f, b, NULL, "unknown op");
+      if (IsIRTerminator(insn) && k != b->num_of_insns - 1)
+        ErrorInIR(f, b, insn, "terminator in the middle of a block");
+      if (insn->op == kIRPhi) VerifyIRPhi(f, b, k);
+      int num_of_srcs = ir_op_infos[insn->op].num_of_srcs;
+      if (num_of_srcs != VARIADIC_SRCS && insn->num_of_srcs != num_of_srcs)
+        ErrorInIR(f, b, insn, "wrong number of operands");
+      if (insn->op == kIRCall && insn->num_of_srcs < 1)
+        ErrorInIR(f, b, insn, "call without callee");
+      if (insn->op == kIRReturn && insn->num_of_srcs > 1)
+        ErrorInIR(f, b, insn, "return with multiple values");
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (!IsValidIRVReg(f, insn->srcs[s]))
+          ErrorInIR(f, b, insn, "use of an unknown vreg");
+      }
+      if (ir_op_infos[insn->op].has_dst) {
+        if (!IsValidIRVReg(f, insn->dst))
+          ErrorInIR(f, b, insn, "def of an unknown vreg");
+        if (f->vreg_types[insn->dst] != insn->type)
+          ErrorInIR(f, b, insn, "type of the insn differs from its dst");
+      } else if (insn->dst) {
+        ErrorInIR(f, b, insn, "unexpected dst");
+      }
+      if ((insn->op == kIRStore || ir_op_infos[insn->op].has_dst) &&
+          insn->type == kIRTypeNone)
+        ErrorInIR(f, b, insn, "missing type");
+      for (int t = 0; t < GetNumOfIRTargets(insn); t++) {
+        struct IRBlock *target = insn->targets[t];
+        if (!target || target->label < 1 || f->num_of_labels < target->label ||
+            block_of_label[target->label] != target)
+          ErrorInIR(f, b, insn, "jump to a block of another function");
+      }
+    }
+  }
+  free(block_of_label);
+}
+
+// Returns a copy of f with the same vregs and labels.
+struct IRFunc *CopyIRFunc(struct IRFunc *f) {
+  struct IRFunc *copy = AllocIRFunc(f->name, 0);
+  for (int v = 1; v <= f->num_of_vregs; v++) {
+    AllocIRVReg(copy, f->vreg_types[v]);
+  }
+  copy->num_of_labels = f->num_of_labels;
+  copy->frame_size = f->frame_size;
+  struct IRBlock **block_of_label =
+      calloc(f->num_of_labels + 1, sizeof(struct IRBlock *));
+  assert(block_of_label);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = calloc(1, sizeof(struct IRBlock));
+    assert(b);
+    b->label = f->blocks[i]->label;
+    b->unroll_hint = f->blocks[i]->unroll_hint;
+    b->prefetch_hint = f->blocks[i]->prefetch_hint;
+    block_of_label[b->label] = b;
+    PlaceIRBlock(copy, b);
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = AppendIRInsnCopy(copy->blocks[i], b->insns[k]);
+      for (int t = 0; t < 2; t++) {
+        if (insn->targets[t])
+          insn->targets[t] = block_of_label[insn->targets[t]->label];
+      }
+      for (int s = 0; insn->src_blocks && s < insn->num_of_srcs; s++) {
+        insn->src_blocks[s] = block_of_label[insn->src_blocks[s]->label];
+      }
+    }
+  }
+  free(block_of_label);
+  return copy;
+}
+
+void FreeIRFunc(struct IRFunc *f) {
+  for (int i = 0; i < f->num_of_blocks; i++) FreeIRBlock(f->blocks[i]);
+  free(f->blocks);
+  free(f->vreg_types);
+  free(f);
+}
@@ -0,0 +1,253 @@
+#include "compilium.h"
+
+// Strength reduction of induction variables on SSA form
+//
+// A basic induction variable (IV) is a phi in a loop header which is
+// incremented by a const in each iteration, possibly in several steps as in
+// unrolled loops. Addrs and ints computed as base + iv * scale + ofs in the
+// loop, where base is loop invariant and ofs is a const, are derived IVs.
+// Derived IVs which need multiplications are replaced by new phis which are
+// incremented by step * scale, plus ofs if any, so that array accesses in
+// counted loops bump pointers instead of computing the addr from the index.
+// If the basic IV is used only for the exit test after that, the test is
+// rewritten to compare the new phi with base + limit * scale, and the basic
+// IV dies.
+//
+// Ints are assumed not to overflow, as signed overflow is undefined in C.
+
+struct BasicIV {
+  struct IRInsn *phi;
+  int next;  // the value from the latch: phi + step
+  int init;  // the value from the preheader
+  long step;
+};
+
+// New phis which replace derived IVs, and the sums of them and ofs
+struct ReducedIV {
+  struct IRIVForm form;
+  enum IRType type;
+  int vreg;
+};
+
+static struct IRFunc *func;
+static struct IRLoopIVs ivs;
+static struct BasicIV *basic_ivs;
+static int num_of_basic_ivs;
+static struct ReducedIV *reduced_ivs;
+static int num_of_reduced_ivs;
+
+static struct IRIVForm GetForm(int vreg) { return GetIRIVForm(&ivs, vreg); }
+
+static struct IRInsn *InsertInPreheader(struct IRLoop *loop, enum IROp op,
+                                        enum IRType type) {
+  struct IRBlock *preheader = loop->preheader;
+  return InsertIRInsn(preheader, preheader->num_of_insns - 1, op, type,
+                      AllocIRVReg(func, type));
+}
+
+static int InsertConst(struct IRLoop *loop, enum IRType type, long value) {
+  struct IRInsn *insn = InsertInPreheader(loop, kIRConst, type);
+  insn->imm = value;
+  return insn->dst;
+}
+
+static int InsertBinOp(struct IRLoop *loop, enum IROp op, enum IRType type,
+                       int left, int right) {
+  struct IRInsn *insn = InsertInPreheader(loop, op, type);
+  AddIRSrc(insn, left);
+  AddIRSrc(insn, right);
+  return insn->dst;
+}
+
+// Returns the type of the ints which are added to values of the type.
+static enum IRType GetOffsetType(enum IRType type) {
+  return type == kIRTypePtr ? kIRTypeI64 : type;
+}
+
+// Inserts base + value * scale in the preheader.
+static int InsertLinearValue(struct IRLoop *loop, enum IRType type, int base,
+                             int value, long scale) {
+  enum IRType offset_type = base ? GetOffsetType(type) : type;
+  long c;
+  int product = 0;
+  if (GetIRConstOfVReg(&ivs, value, &c)) {
+    if (c * scale != 0 || !base)
+      product = InsertConst(loop, offset_type, c * scale);
+  } else {
+    product = InsertBinOp(loop, kIRMul, offset_type, value,
+                          InsertConst(loop, offset_type, scale));
+  }
+  if (!base) return product;
+  if (!product) return base;
+  return InsertBinOp(loop, kIRAdd, type, base, product);
+}
+
+// Basic IVs are ints which the analysis of the loop found to go up by a
+// const step.
+static void FindBasicIV(struct IRLoop *loop, struct IRInsn *phi) {
+  long step = ivs.steps[phi->dst];
+  if (!step || (phi->type != kIRTypeI32 && phi->type != kIRTypeI64)) return;
+  int from_latch = phi->src_blocks[0] == loop->preheader ? 1 : 0;
+  basic_ivs = realloc(basic_ivs,
+                      sizeof(struct BasicIV) * (num_of_basic_ivs + 1));
+  assert(basic_ivs);
+  basic_ivs[num_of_basic_ivs++] = (struct BasicIV){
+      phi, phi->srcs[from_latch], phi->srcs[1 - from_latch], step};
+}
+
+static struct BasicIV *GetBasicIV(int phi) {
+  for (int i = 0; i < num_of_basic_ivs; i++) {
+    if (basic_ivs[i].phi->dst == phi) return &basic_ivs[i];
+  }
+  return NULL;
+}
+
+static int InsertReducedPhi(struct IRLoop *loop, struct IRIVForm form,
+                            enum IRType type) {
+  struct BasicIV *iv = GetBasicIV(form.iv);
+  int init = InsertLinearValue(loop, type, form.base, iv->init, form.scale);
+  int step = InsertConst(loop, GetOffsetType(type), iv->step * form.scale);
+  struct IRInsn *phi =
+      InsertIRInsn(loop->header, 0, kIRPhi, type, AllocIRVReg(func, type));
+  phi->imm = phi->dst;
+  struct IRBlock *latch = iv->phi->src_blocks[0] == loop->preheader
+                              ? iv->phi->src_blocks[1]
+                              : iv->phi->src_blocks[0];
+  struct IRBlock *b = ivs.def_blocks[iv->next];
+  int k = 0;
+  while (b->insns[k] != ivs.def_insns[iv->next]) k++;
+  struct IRInsn *next =
+      InsertIRInsn(b, k + 1, kIRAdd, type, AllocIRVReg(func, type));
+  AddIRSrc(next, phi->dst);
+  AddIRSrc(next, step);
+  AddIRPhiSrc(phi, init, loop->preheader);
+  AddIRPhiSrc(phi, next->dst, latch);
+  return phi->dst;
+}
+
+// Values with ofs are computed from the phi without ofs at the beginning of
+// the header, so that copies of an unrolled body share the phi.
+static int GetReducedIV(struct IRLoop *loop, struct IRIVForm form,
+                        enum IRType type) {
+  for (int i = 0; i < num_of_reduced_ivs; i++) {
+    struct ReducedIV *r = &reduced_ivs[i];
+    if (r->form.iv == form.iv && r->form.base == form.base &&
+        r->form.scale == form.scale && r->form.ofs == form.ofs &&
+        r->type == type)
+      return r->vreg;
+  }
+  int vreg;
+  if (form.ofs) {
+    struct IRIVForm phi_form = form;
+    phi_form.ofs = 0;
+    int phi = GetReducedIV(loop, phi_form, type);
+    int ofs = InsertConst(loop, GetOffsetType(type), form.ofs);
+    int k = 0;
+    while (loop->header->insns[k]->op == kIRPhi) k++;
+    vreg = AllocIRVReg(func, type);
+    struct IRInsn *sum = InsertIRInsn(loop->header, k, kIRAdd, type, vreg);
+    AddIRSrc(sum, phi);
+    AddIRSrc(sum, ofs);
+  } else {
+    vreg = InsertReducedPhi(loop, form, type);
+  }
+  reduced_ivs = realloc(reduced_ivs,
+                        sizeof(struct ReducedIV) * (num_of_reduced_ivs + 1));
+  assert(reduced_ivs);
+  reduced_ivs[num_of_reduced_ivs++] = (struct ReducedIV){form, type, vreg};
+  return vreg;
+}
+
+// Derived IVs which need muls and are used by insns other than derived IVs
+// are replaced in the loop. Uses by phis count where the value comes from.
+static void ReduceDerivedIVs(struct IRLoop *loop) {
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (GetForm(insn->dst).iv) continue;
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        int v = insn->srcs[s];
+        struct IRIVForm form = GetForm(v);
+        if (!form.has_mul || !GetBasicIV(form.iv)) continue;
+        if (insn->op == kIRPhi &&
+            !IsIRBlockInLoop(loop, insn->src_blocks[s]))
+          continue;
+        insn->srcs[s] = GetReducedIV(loop, form, func->vreg_types[v]);
+      }
+    }
+  }
+}
+
+// Returns the exit test on the basic IV if the IV and the values derived
+// from it have no other uses than the phi of the IV, derived IVs and the
+// test.
+static struct IRInsn *FindExitTest(struct IRLoop *loop, struct BasicIV *iv) {
+  int phi = iv->phi->dst;
+  struct IRInsn *test = NULL;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn == iv->phi || GetForm(insn->dst).iv == phi) continue;
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (GetForm(insn->srcs[s]).iv != phi) continue;
+        if (test || insn->srcs[s] != phi || !IsIRBlockInLoop(loop, b) ||
+            kIRCmpEq > insn->op || insn->op > kIRCmpGe ||
+            !IsIRVRegInvariant(&ivs, insn->srcs[1 - s]))
+          return NULL;
+        test = insn;
+      }
+    }
+  }
+  return test;
+}
+
+static void ReplaceExitTest(struct IRLoop *loop, struct BasicIV *iv) {
+  struct ReducedIV *r = NULL;
+  for (int i = 0; i < num_of_reduced_ivs && !r; i++) {
+    struct IRIVForm form = reduced_ivs[i].form;
+    if (form.iv == iv->phi->dst && form.scale > 0 && !form.ofs)
+      r = &reduced_ivs[i];
+  }
+  if (!r) return;
+  struct IRInsn *test = FindExitTest(loop, iv);
+  if (!test) return;
+  int s = test->srcs[0] == iv->phi->dst ? 0 : 1;
+  int limit = InsertLinearValue(loop, r->type, r->form.base,
+                                test->srcs[1 - s], r->form.scale);
+  test->srcs[s] = r->vreg;
+  test->srcs[1 - s] = limit;
+}
+
+static void ReduceIVsInLoop(struct IRLoop *loop) {
+  num_of_basic_ivs = 0;
+  num_of_reduced_ivs = 0;
+  for (int k = 0; k < loop->header->num_of_insns; k++) {
+    struct IRInsn *phi = loop->header->insns[k];
+    if (phi->op != kIRPhi) break;
+    FindBasicIV(loop, phi);
+  }
+  if (!num_of_basic_ivs) return;
+  ReduceDerivedIVs(loop);
+  if (!num_of_reduced_ivs) return;
+  for (int i = 0; i < num_of_basic_ivs; i++) {
+    ReplaceExitTest(loop, &basic_ivs[i]);
+  }
+}
+
+void ReduceIVStrength(struct IRFunc *f) {
+  func = f;
+  int num_of_loops;
+  struct IRLoop *loops = FindIRLoops(f, &num_of_loops);
+  for (int i = 0; i < num_of_loops; i++) {
+    AnalyzeIRLoopIVs(f, &loops[i], &ivs);
+    ReduceIVsInLoop(&loops[i]);
+    FreeIRLoopIVs(&ivs);
+  }
+  free(reduced_ivs);
+  reduced_ivs = NULL;
+  free(basic_ivs);
+  basic_ivs = NULL;
+  FreeIRLoops(loops, num_of_loops);
+}
@@ -0,0 +1,211 @@
+#include "compilium.h"
+
+// Loop-invariant code motion on SSA form
+//
+// Insns in a loop whose operands are all defined outside the loop compute
+// the same value in every iteration, and are moved to the preheader of the
+// loop. Inner loops are processed first so that code moved out of them can
+// be moved further. Since the loop body may not run at all, only insns which
+// cannot trap are moved. Loads are moved if the loop has no calls and no
+// stores which may write to the addr, and if the addr is known to be valid
+// or the load runs whenever the loop is entered.
+
+// Addrs are described by the root addr which they are derived from by
+// adding ints, and the offset from it. The offset is unknown if non-const
+// ints are added. Roots defined by kIRFrameAddr or kIRSymAddr are addrs of
+// distinct objects for each local var or symbol.
+struct AddrInfo {
+  int root;
+  long ofs;
+  bool is_ofs_known;
+};
+
+static struct IRFunc *func;
+static struct IRInsn **def_insns;    // indexed by vreg
+static struct IRBlock **def_blocks;  // indexed by vreg
+static struct AddrInfo *addr_infos;  // indexed by vreg
+static bool *is_addr_info_known;     // indexed by vreg
+
+static struct AddrInfo GetAddrInfo(int vreg) {
+  if (is_addr_info_known[vreg]) return addr_infos[vreg];
+  struct AddrInfo a = {vreg, 0, true};
+  struct IRInsn *insn = def_insns[vreg];
+  if (insn && (insn->op == kIRAdd || insn->op == kIRSub) &&
+      insn->type == kIRTypePtr) {
+    for (int s = 0; s < (insn->op == kIRAdd ? 2 : 1); s++) {
+      if (func->vreg_types[insn->srcs[s]] != kIRTypePtr) continue;
+      struct IRInsn *c = def_insns[insn->srcs[1 - s]];
+      a = GetAddrInfo(insn->srcs[s]);
+      if (c && c->op == kIRConst) {
+        a.ofs += insn->op == kIRAdd ? c->imm : -c->imm;
+      } else {
+        a.is_ofs_known = false;
+      }
+      break;
+    }
+  }
+  addr_infos[vreg] = a;
+  is_addr_info_known[vreg] = true;
+  return a;
+}
+
+static bool IsObjectAddr(int vreg) {
+  struct IRInsn *insn = def_insns[vreg];
+  return insn && (insn->op == kIRFrameAddr || insn->op == kIRSymAddr);
+}
+
+static bool IsSameObjectAddr(int a, int b) {
+  struct IRInsn *x = def_insns[a];
+  struct IRInsn *y = def_insns[b];
+  if (x->op != y->op) return false;
+  if (x->op == kIRFrameAddr) return x->imm == y->imm;
+  return !strcmp(x->sym, y->sym);
+}
+
+static bool MayAlias(struct AddrInfo a, int a_size, struct AddrInfo b,
+                     int b_size) {
+  bool are_objects = IsObjectAddr(a.root) && IsObjectAddr(b.root);
+  if (a.root != b.root && !(are_objects && IsSameObjectAddr(a.root, b.root)))
+    return !are_objects;
+  if (!a.is_ofs_known || !b.is_ofs_known) return true;
+  return a.ofs < b.ofs + b_size && b.ofs < a.ofs + a_size;
+}
+
+// Addrs in the frame can be read even if they are not read in the program.
+static bool IsDereferenceable(struct AddrInfo a, int size) {
+  struct IRInsn *root = def_insns[a.root];
+  return root && root->op == kIRFrameAddr && a.is_ofs_known && a.ofs >= 0 &&
+         a.ofs + size <= root->imm;
+}
+
+// Returns whether b runs whenever the loop is entered, i.e. dominates the
+// blocks which leave or repeat the loop.
+static bool IsRunOnLoopEntry(struct IRLoop *loop, struct IRBlock *b) {
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *e = loop->blocks[i];
+    bool is_exit_or_latch = !GetNumOfIRSuccs(e);
+    for (int s = 0; s < GetNumOfIRSuccs(e); s++) {
+      struct IRBlock *succ = GetIRSucc(e, s);
+      if (succ == loop->header || !IsIRBlockInLoop(loop, succ))
+        is_exit_or_latch = true;
+    }
+    if (is_exit_or_latch && !DominatesIRBlock(b, e)) return false;
+  }
+  return true;
+}
+
+static bool CanHoistLoad(struct IRLoop *loop, struct IRBlock *b,
+                         struct IRInsn *load) {
+  struct AddrInfo addr = GetAddrInfo(load->srcs[0]);
+  int size = GetSizeOfIRType(load->type);
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *x = loop->blocks[i];
+    for (int k = 0; k < x->num_of_insns; k++) {
+      struct IRInsn *insn = x->insns[k];
+      if (insn->op == kIRCall) return false;
+      if (insn->op == kIRStore &&
+          MayAlias(addr, size, GetAddrInfo(insn->srcs[0]),
+                   GetSizeOfIRType(insn->type)))
+        return false;
+    }
+  }
+  return IsDereferenceable(addr, size) || IsRunOnLoopEntry(loop, b);
+}
+
+// Insns which may trap are not moved, e.g. divisions by vars. Neither are
+// vector insns nor the check for AVX2, since they should stay on the path
+// which the check selects.
+static bool CanHoist(struct IRLoop *loop, struct IRBlock *b,
+                     struct IRInsn *insn) {
+  if (IsVectorIRType(insn->type)) return false;
+  switch (insn->op) {
+    case kIRLoad:
+      return CanHoistLoad(loop, b, insn);
+    case kIRDiv:
+    case kIRMod: {
+      struct IRInsn *divisor = def_insns[insn->srcs[1]];
+      return divisor && divisor->op == kIRConst && divisor->imm != 0 &&
+             divisor->imm != -1;
+    }
+    case kIRConst:
+    case kIRCopy:
+    case kIRAdd:
+    case kIRSub:
+    case kIRMul:
+    case kIRAnd:
+    case kIROr:
+    case kIRXor:
+    case kIRShl:
+    case kIRSar:
+    case kIRCmpEq:
+    case kIRCmpNe:
+    case kIRCmpLt:
+    case kIRCmpLe:
+    case kIRCmpGt:
+    case kIRCmpGe:
+    case kIRNeg:
+    case kIRNot:
+    case kIRSext:
+    case kIRFrameAddr:
+    case kIRSymAddr:
+    case kIRStrAddr:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool IsInvariant(struct IRLoop *loop, struct IRInsn *insn) {
+  for (int s = 0; s < insn->num_of_srcs; s++) {
+    struct IRBlock *b = def_blocks[insn->srcs[s]];
+    if (b && IsIRBlockInLoop(loop, b)) return false;
+  }
+  return true;
+}
+
+static void HoistInvariants(struct IRLoop *loop) {
+  struct IRBlock *preheader = loop->preheader;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < loop->num_of_blocks; i++) {
+      struct IRBlock *b = loop->blocks[i];
+      for (int k = 0; k < b->num_of_insns; k++) {
+        struct IRInsn *insn = b->insns[k];
+        if (!insn->dst || insn->op == kIRPhi || !IsInvariant(loop, insn) ||
+            !CanHoist(loop, b, insn))
+          continue;
+        MoveIRInsn(b, k--, preheader, preheader->num_of_insns - 1);
+        def_blocks[insn->dst] = preheader;
+        changed = true;
+      }
+    }
+  }
+}
+
+void RunLICM(struct IRFunc *f) {
+  func = f;
+  int num_of_loops;
+  struct IRLoop *loops = FindIRLoops(f, &num_of_loops);
+  int num_of_vregs = f->num_of_vregs;
+  def_insns = calloc(num_of_vregs + 1, sizeof(struct IRInsn *));
+  def_blocks = calloc(num_of_vregs + 1, sizeof(struct IRBlock *));
+  addr_infos = calloc(num_of_vregs + 1, sizeof(struct AddrInfo));
+  is_addr_info_known = calloc(num_of_vregs + 1, sizeof(bool));
+  assert(def_insns && def_blocks && addr_infos && is_addr_info_known);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!insn->dst) continue;
+      def_insns[insn->dst] = insn;
+      def_blocks[insn->dst] = b;
+    }
+  }
+  for (int i = 0; i < num_of_loops; i++) HoistInvariants(&loops[i]);
+  free(is_addr_info_known);
+  free(addr_infos);
+  free(def_blocks);
+  free(def_insns);
+  FreeIRLoops(loops, num_of_loops);
+}
@@ -0,0 +1,542 @@
+#include "compilium.h"
+
+// Natural loops in the IR
+//
+// An edge from a block to a block which dominates it is a back edge. The
+// loop of a header is the header and the blocks which reach one of its back
+// edges without passing through the header. Each loop is given a preheader,
+// a block which only jumps to the header and through which the loop is
+// always entered, so that code can be placed before the loop. Counted loops
+// are recognized for the passes which transform loops before SSA form, and
+// induction vars and the values derived from them for the passes on SSA form.
+
+static struct IRBlock **FindOutsidePreds(struct IRBlock *header,
+                                         int *num_of_outside_preds) {
+  struct IRBlock **preds =
+      malloc(sizeof(struct IRBlock *) * header->num_of_preds);
+  assert(preds);
+  int n = 0;
+  for (int p = 0; p < header->num_of_preds; p++) {
+    struct IRBlock *pred = header->preds[p];
+    if (DominatesIRBlock(header, pred)) continue;
+    bool is_found = false;
+    for (int k = 0; k < n && !is_found; k++) is_found = preds[k] == pred;
+    if (!is_found) preds[n++] = pred;
+  }
+  *num_of_outside_preds = n;
+  return preds;
+}
+
+static bool IsInList(struct IRBlock **list, int size, struct IRBlock *b) {
+  for (int i = 0; i < size; i++) {
+    if (list[i] == b) return true;
+  }
+  return false;
+}
+
+// Makes all the preds of the header outside the loop jump to a new block
+// which jumps to the header. Phis in the header take the values from
+// outside through phis in the new block.
+static void InsertPreheader(struct IRFunc *f, struct IRBlock *header,
+                            struct IRBlock **outside_preds,
+                            int num_of_outside_preds) {
+  struct IRBlock *preheader = AllocIRBlock(f);
+  int num_of_new_phis = 0;
+  for (int k = 0; k < header->num_of_insns; k++) {
+    struct IRInsn *phi = header->insns[k];
+    if (phi->op != kIRPhi) break;
+    struct IRInsn *new_phi = NULL;
+    if (num_of_outside_preds > 1) {
+      int vreg = AllocIRVReg(f, f->vreg_types[phi->dst]);
+      new_phi =
+          InsertIRInsn(preheader, num_of_new_phis++, kIRPhi, phi->type, vreg);
+      new_phi->imm = phi->imm;
+    }
+    int value = new_phi ? new_phi->dst : 0;
+    int n = 0;
+    for (int s = 0; s < phi->num_of_srcs; s++) {
+      if (!IsInList(outside_preds, num_of_outside_preds, phi->src_blocks[s])) {
+        phi->srcs[n] = phi->srcs[s];
+        phi->src_blocks[n++] = phi->src_blocks[s];
+      } else if (new_phi) {
+        AddIRPhiSrc(new_phi, phi->srcs[s], phi->src_blocks[s]);
+      } else {
+        value = phi->srcs[s];
+      }
+    }
+    phi->num_of_srcs = n;
+    if (value) AddIRPhiSrc(phi, value, preheader);
+  }
+  AppendIRInsn(preheader, kIRJump, kIRTypeNone, 0)->targets[0] = header;
+  for (int i = 0; i < num_of_outside_preds; i++) {
+    struct IRInsn *t = GetIRTerminator(outside_preds[i]);
+    for (int k = 0; k < GetNumOfIRSuccs(outside_preds[i]); k++) {
+      if (t->targets[k] == header) t->targets[k] = preheader;
+    }
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    if (f->blocks[i] != header) continue;
+    InsertIRBlock(f, i, preheader);
+    break;
+  }
+}
+
+// Inserts a preheader if the header has a back edge and is not entered only
+// from a block which jumps to it. Returns whether one is inserted. The entry
+// block is never a header since params are defined at the beginning of it.
+static bool InsertPreheaderIfNeeded(struct IRFunc *f,
+                                    struct IRBlock *header) {
+  if (header == f->blocks[0]) return false;
+  bool has_back_edge = false;
+  for (int p = 0; p < header->num_of_preds; p++) {
+    if (DominatesIRBlock(header, header->preds[p])) has_back_edge = true;
+  }
+  if (!has_back_edge) return false;
+  int n;
+  struct IRBlock **outside_preds = FindOutsidePreds(header, &n);
+  bool is_needed = n != 1 || GetNumOfIRSuccs(outside_preds[0]) != 1;
+  if (is_needed) InsertPreheader(f, header, outside_preds, n);
+  free(outside_preds);
+  return is_needed;
+}
+
+static void AddBlockToLoop(struct IRLoop *loop, struct IRBlock *b) {
+  loop->contains[b->label] = true;
+  loop->blocks[loop->num_of_blocks++] = b;
+}
+
+// Unreachable blocks may jump into the loop, but are not in it.
+static void FindLoopBlocks(struct IRFunc *f, struct IRLoop *loop) {
+  struct IRBlock *header = loop->header;
+  loop->max_label = f->num_of_labels;
+  loop->contains = calloc(f->num_of_labels + 1, sizeof(bool));
+  loop->blocks = malloc(sizeof(struct IRBlock *) * f->num_of_blocks);
+  struct IRBlock **stack =
+      malloc(sizeof(struct IRBlock *) * f->num_of_blocks);
+  assert(loop->contains && loop->blocks && stack);
+  AddBlockToLoop(loop, header);
+  int sp = 0;
+  for (int p = 0; p < header->num_of_preds; p++) {
+    struct IRBlock *pred = header->preds[p];
+    if (pred == loop->preheader || pred->rpo_index < 0 ||
+        loop->contains[pred->label])
+      continue;
+    AddBlockToLoop(loop, pred);
+    stack[sp++] = pred;
+  }
+  while (sp) {
+    struct IRBlock *b = stack[--sp];
+    for (int p = 0; p < b->num_of_preds; p++) {
+      struct IRBlock *pred = b->preds[p];
+      if (pred->rpo_index < 0 || loop->contains[pred->label]) continue;
+      AddBlockToLoop(loop, pred);
+      stack[sp++] = pred;
+    }
+  }
+  free(stack);
+  // Sorts the blocks in reverse postorder.
+  for (int i = 1; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    int k = i;
+    for (; k > 0 && loop->blocks[k - 1]->rpo_index > b->rpo_index; k--) {
+      loop->blocks[k] = loop->blocks[k - 1];
+    }
+    loop->blocks[k] = b;
+  }
+}
+
+// Returns the loops of f, inner loops first. Dominators are valid after
+// this.
+struct IRLoop *FindIRLoops(struct IRFunc *f, int *num_of_loops) {
+  CalcIRDominators(f);
+  bool is_changed = false;
+  int num_of_blocks = f->num_of_blocks;
+  struct IRBlock **headers = malloc(sizeof(struct IRBlock *) * num_of_blocks);
+  assert(headers);
+  for (int i = 0; i < num_of_blocks; i++) headers[i] = f->blocks[i];
+  for (int i = 0; i < num_of_blocks; i++) {
+    if (InsertPreheaderIfNeeded(f, headers[i])) is_changed = true;
+  }
+  free(headers);
+  if (is_changed) CalcIRDominators(f);
+  struct IRLoop *loops = calloc(f->num_of_blocks, sizeof(struct IRLoop));
+  assert(loops);
+  int n = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *header = f->blocks[i];
+    if (header == f->blocks[0]) continue;
+    struct IRBlock *preheader = NULL;
+    bool has_back_edge = false;
+    for (int p = 0; p < header->num_of_preds; p++) {
+      struct IRBlock *pred = header->preds[p];
+      if (DominatesIRBlock(header, pred)) {
+        has_back_edge = true;
+      } else {
+        preheader = pred;
+      }
+    }
+    if (!has_back_edge) continue;
+    loops[n].header = header;
+    loops[n].preheader = preheader;
+    FindLoopBlocks(f, &loops[n++]);
+  }
+  // Inner loops are subsets of the loops around them.
+  for (int i = 1; i < n; i++) {
+    struct IRLoop loop = loops[i];
+    int k = i;
+    for (; k > 0 && loops[k - 1].num_of_blocks > loop.num_of_blocks; k--) {
+      loops[k] = loops[k - 1];
+    }
+    loops[k] = loop;
+  }
+  *num_of_loops = n;
+  return loops;
+}
+
+bool IsIRBlockInLoop(struct IRLoop *loop, struct IRBlock *b) {
+  return b->label <= loop->max_label && loop->contains[b->label];
+}
+
+void FreeIRLoops(struct IRLoop *loops, int num_of_loops) {
+  for (int i = 0; i < num_of_loops; i++) {
+    free(loops[i].contains);
+    free(loops[i].blocks);
+  }
+  free(loops);
+}
+
+// Counted loops
+
+#define MAX_SEARCH_DEPTH 8
+
+static struct IRFunc *func;
+
+static int CountUses(int vreg) {
+  int n = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) n += insn->srcs[s] == vreg;
+    }
+  }
+  return n;
+}
+
+bool IsIRVRegDefinedInLoop(struct IRLoop *loop, int vreg) {
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      if (b->insns[k]->dst == vreg) return true;
+    }
+  }
+  return false;
+}
+
+// Finds the const which vreg has before the index-th insn of b, following
+// copies and going up to the only pred of blocks.
+static bool FindConstBefore(struct IRLoop *loop, struct IRBlock *b, int index,
+                            int vreg, long *value, int depth) {
+  if (depth > MAX_SEARCH_DEPTH) return false;
+  for (int k = index - 1; k >= 0; k--) {
+    struct IRInsn *insn = b->insns[k];
+    if (insn->dst != vreg) continue;
+    if (insn->op == kIRConst) {
+      *value = insn->imm;
+      return true;
+    }
+    if ((insn->op != kIRCopy && insn->op != kIRSext) ||
+        !FindConstBefore(loop, b, k, insn->srcs[0], value, depth + 1))
+      return false;
+    if (insn->op == kIRSext) *value = TruncateToIRType(*value, insn->type);
+    return true;
+  }
+  struct IRBlock *pred = b->num_of_preds == 1 ? b->preds[0] : NULL;
+  if (b == loop->header && !IsIRVRegDefinedInLoop(loop, vreg))
+    pred = loop->preheader;
+  return pred && FindConstBefore(loop, pred, pred->num_of_insns, vreg, value,
+                                 depth + 1);
+}
+
+// Vregs which are not defined in the loop, or only in the header from
+// invariants, are loop invariant. Loads are not since the loop may store.
+static bool IsInvariant(struct IRLoop *loop, int vreg, int depth) {
+  if (depth > MAX_SEARCH_DEPTH) return false;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->dst != vreg) continue;
+      if (b != loop->header || insn->op == kIRLoad || insn->op == kIRCall)
+        return false;
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (!IsInvariant(loop, insn->srcs[s], depth + 1)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Finds the step of the counter. Its only def in the loop must run once in
+// each iteration and add a const to it.
+static bool FindStep(struct IRLoop *loop, int counter, long *step) {
+  struct IRBlock *b = NULL;
+  int index = -1;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *x = loop->blocks[i];
+    for (int k = 0; k < x->num_of_insns; k++) {
+      if (x->insns[k]->dst != counter) continue;
+      if (b) return false;
+      b = x;
+      index = k;
+    }
+  }
+  if (!b || b == loop->header) return false;
+  for (int p = 0; p < loop->header->num_of_preds; p++) {
+    struct IRBlock *pred = loop->header->preds[p];
+    if (IsIRBlockInLoop(loop, pred) && !DominatesIRBlock(b, pred))
+      return false;
+  }
+  struct IRInsn *insn = b->insns[index];
+  if (insn->op == kIRCopy ||
+      (insn->op == kIRSext && insn->type == func->vreg_types[counter])) {
+    int src = insn->srcs[0];
+    while (--index >= 0 && b->insns[index]->dst != src) {
+    }
+    if (index < 0) return false;
+    insn = b->insns[index];
+  }
+  if (insn->op != kIRAdd && insn->op != kIRSub) return false;
+  int s = insn->srcs[0] == counter ? 1 : 0;
+  if (insn->srcs[1 - s] != counter || (insn->op == kIRSub && s == 0) ||
+      !FindConstBefore(loop, b, index, insn->srcs[s], step, 0))
+    return false;
+  if (insn->op == kIRSub) *step = -*step;
+  return *step != 0;
+}
+
+// Returns op for the compare with the operands swapped.
+static enum IROp GetSwappedCmpOp(enum IROp op) {
+  if (op == kIRCmpLt) return kIRCmpGt;
+  if (op == kIRCmpLe) return kIRCmpGe;
+  if (op == kIRCmpGt) return kIRCmpLt;
+  return kIRCmpLe;
+}
+
+// Returns how many times counter op limit holds for counter = init,
+// init + step, ... until it fails.
+static long CalcTripCount(enum IROp op, long init, long limit, long step) {
+  if (op == kIRCmpLe) limit++;
+  if (op == kIRCmpGe) limit--;
+  if (step > 0) return init < limit ? (limit - init + step - 1) / step : 0;
+  return init > limit ? (init - limit - step - 1) / -step : 0;
+}
+
+// Returns whether the loop is counted, i.e. the header leaves the loop when a
+// compare of a counter and a loop invariant limit fails, and the counter is
+// incremented by a const once in each iteration.
+bool AnalyzeIRCountedLoop(struct IRFunc *f, struct IRLoop *loop,
+                          struct IRCountedLoop *c) {
+  func = f;
+  struct IRBlock *header = loop->header;
+  struct IRInsn *t = GetIRTerminator(header);
+  if (!t || t->op != kIRBranch || !IsIRBlockInLoop(loop, t->targets[0]) ||
+      IsIRBlockInLoop(loop, t->targets[1]))
+    return false;
+  int index = header->num_of_insns - 1;
+  while (--index >= 0 && header->insns[index]->dst != t->srcs[0]) {
+  }
+  if (index < 0) return false;
+  struct IRInsn *test = header->insns[index];
+  if (test->op < kIRCmpLt || test->op > kIRCmpGe) return false;
+  // The header is run once more than the body, so it should have no effects.
+  for (int k = 0; k < header->num_of_insns; k++) {
+    enum IROp op = header->insns[k]->op;
+    if (op == kIRStore || op == kIRCall) return false;
+  }
+  c->loop = loop;
+  c->test = test;
+  c->test_index = index;
+  c->is_test_used = CountUses(test->dst) > 1;
+  c->size = 0;
+  c->has_call = false;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    c->size += b->num_of_insns;
+    for (int k = 0; k < b->num_of_insns; k++) {
+      if (b->insns[k]->op == kIRCall) c->has_call = true;
+    }
+  }
+  for (c->limit = 1; c->limit >= 0; c->limit--) {
+    int counter = test->srcs[1 - c->limit];
+    int limit = test->srcs[c->limit];
+    if (!IsInvariant(loop, limit, 0) || !FindStep(loop, counter, &c->step))
+      continue;
+    enum IROp op = c->limit ? test->op : GetSwappedCmpOp(test->op);
+    // Loops which count away from the limit are left as they are.
+    if ((op == kIRCmpLt || op == kIRCmpLe) != (c->step > 0)) return false;
+    long limit_value;
+    c->trip_count = -1;
+    c->is_init_const =
+        FindConstBefore(loop, loop->preheader, loop->preheader->num_of_insns,
+                        counter, &c->init, 0);
+    if (c->is_init_const &&
+        FindConstBefore(loop, header, index, limit, &limit_value, 0))
+      c->trip_count = CalcTripCount(op, c->init, limit_value, c->step);
+    return true;
+  }
+  return false;
+}
+
+// Induction vars on SSA form
+
+static struct IRInsn *GetDef(struct IRLoopIVs *ivs, int vreg) {
+  return vreg <= ivs->max_vreg ? ivs->def_insns[vreg] : NULL;
+}
+
+struct IRIVForm GetIRIVForm(struct IRLoopIVs *ivs, int vreg) {
+  return vreg <= ivs->max_vreg ? ivs->forms[vreg] : (struct IRIVForm){0};
+}
+
+bool GetIRConstOfVReg(struct IRLoopIVs *ivs, int vreg, long *value) {
+  struct IRInsn *insn = GetDef(ivs, vreg);
+  if (!insn || insn->op != kIRConst) return false;
+  *value = insn->imm;
+  return true;
+}
+
+bool IsIRVRegInvariant(struct IRLoopIVs *ivs, int vreg) {
+  if (vreg > ivs->max_vreg) return false;
+  return !ivs->def_blocks[vreg] ||
+         !IsIRBlockInLoop(ivs->loop, ivs->def_blocks[vreg]);
+}
+
+// Finds the sum of the consts which are added to or subtracted from phi to
+// get vreg in the loop by insns of the type.
+static bool FindStepToVReg(struct IRLoopIVs *ivs, int phi, int vreg,
+                           enum IRType type, long *step) {
+  *step = 0;
+  while (vreg != phi) {
+    struct IRInsn *insn = GetDef(ivs, vreg);
+    if (!insn || insn->type != type || IsIRVRegInvariant(ivs, vreg))
+      return false;
+    if (insn->op == kIRSext || insn->op == kIRCopy) {
+      vreg = insn->srcs[0];
+      continue;
+    }
+    long c;
+    if (insn->op == kIRSub && GetIRConstOfVReg(ivs, insn->srcs[1], &c)) {
+      *step -= c;
+      vreg = insn->srcs[0];
+      continue;
+    }
+    if (insn->op != kIRAdd) return false;
+    int s = GetIRConstOfVReg(ivs, insn->srcs[0], &c) ? 1 : 0;
+    if (!GetIRConstOfVReg(ivs, insn->srcs[1 - s], &c)) return false;
+    *step += c;
+    vreg = insn->srcs[s];
+  }
+  return true;
+}
+
+static void FindIV(struct IRLoopIVs *ivs, struct IRInsn *phi) {
+  struct IRLoop *loop = ivs->loop;
+  if (phi->num_of_srcs != 2 || IsVectorIRType(phi->type)) return;
+  int from_latch = phi->src_blocks[0] == loop->preheader ? 1 : 0;
+  if (phi->src_blocks[1 - from_latch] != loop->preheader) return;
+  long step;
+  if (!FindStepToVReg(ivs, phi->dst, phi->srcs[from_latch], phi->type,
+                      &step) ||
+      !step)
+    return;
+  ivs->steps[phi->dst] = step;
+  ivs->forms[phi->dst] = (struct IRIVForm){phi->dst, 0, 1, 0, false};
+}
+
+static void FindForm(struct IRLoopIVs *ivs, struct IRInsn *insn) {
+  struct IRIVForm *forms = ivs->forms;
+  if (insn->type == kIRTypeI8 || IsVectorIRType(insn->type)) return;
+  if (insn->op == kIRSext || insn->op == kIRCopy) {
+    int src = insn->srcs[0];
+    if (GetSizeOfIRType(insn->type) >=
+        GetSizeOfIRType(ivs->func->vreg_types[src]))
+      forms[insn->dst] = GetIRIVForm(ivs, src);
+    return;
+  }
+  long k;
+  if (insn->op == kIRSub) {
+    struct IRIVForm form = GetIRIVForm(ivs, insn->srcs[0]);
+    if (!form.iv || !GetIRConstOfVReg(ivs, insn->srcs[1], &k)) return;
+    form.ofs -= k;
+    forms[insn->dst] = form;
+    return;
+  }
+  if (insn->op != kIRAdd && insn->op != kIRMul && insn->op != kIRShl) return;
+  for (int s = 0; s < 2; s++) {
+    struct IRIVForm form = GetIRIVForm(ivs, insn->srcs[s]);
+    int other = insn->srcs[1 - s];
+    if (!form.iv) continue;
+    if (insn->op != kIRAdd) {
+      if (form.base || !GetIRConstOfVReg(ivs, other, &k)) continue;
+      if (insn->op == kIRShl) {
+        if (s || k < 0 || k > 32) return;
+        k = 1L << k;
+      }
+      forms[insn->dst] = (struct IRIVForm){form.iv, 0, form.scale * k,
+                                           form.ofs * k, true};
+      return;
+    }
+    if (GetIRConstOfVReg(ivs, other, &k)) {
+      form.ofs += k;
+      forms[insn->dst] = form;
+      return;
+    }
+    if (!form.base && IsIRVRegInvariant(ivs, other)) {
+      form.base = other;
+      forms[insn->dst] = form;
+      return;
+    }
+  }
+}
+
+// Finds the phis in the header which go up by a const step in each
+// iteration, and the values in the loop which are derived from them.
+void AnalyzeIRLoopIVs(struct IRFunc *f, struct IRLoop *loop,
+                      struct IRLoopIVs *ivs) {
+  ivs->func = f;
+  ivs->loop = loop;
+  ivs->max_vreg = f->num_of_vregs;
+  ivs->def_insns = calloc(ivs->max_vreg + 1, sizeof(struct IRInsn *));
+  ivs->def_blocks = calloc(ivs->max_vreg + 1, sizeof(struct IRBlock *));
+  ivs->forms = calloc(ivs->max_vreg + 1, sizeof(struct IRIVForm));
+  ivs->steps = calloc(ivs->max_vreg + 1, sizeof(long));
+  assert(ivs->def_insns && ivs->def_blocks && ivs->forms && ivs->steps);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!insn->dst) continue;
+      ivs->def_insns[insn->dst] = insn;
+      ivs->def_blocks[insn->dst] = b;
+    }
+  }
+  for (int k = 0; k < loop->header->num_of_insns; k++) {
+    struct IRInsn *phi = loop->header->insns[k];
+    if (phi->op != kIRPhi) break;
+    FindIV(ivs, phi);
+  }
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->dst && insn->op != kIRPhi) FindForm(ivs, insn);
+    }
+  }
+}
+
+void FreeIRLoopIVs(struct IRLoopIVs *ivs) {
+  free(ivs->steps);
+  free(ivs->forms);
+  free(ivs->def_blocks);
+  free(ivs->def_insns);
+}
@@ -0,0 +1,686 @@
+#include "compilium.h"
+
+// Lowering of the IR to x86-64 instructions on vregs (see regalloc.c). IR
+// vregs are used as machine vregs as they are, and each IR block starts
+// with a label numbered by the label of the block.
+//
+// Vectors of 16 bytes are handled by SSE2 insns, and those of 32 bytes by
+// AVX2 insns, which take three operands.
+
+#define CPU_FEATURES_SYMBOL "__compilium_cpu_features"
+
+static const char *label_prefix;
+static enum IRType *vreg_types;
+static bool *is_const_vreg;   // indexed by vreg: defined only by a const
+static long *const_values;    // indexed by vreg
+static int *num_of_reg_uses;  // indexed by vreg: uses not as an immediate
+
+// Constants are used as immediate operands where x86-64 allows it. Returns
+// whether the index-th src of the insn is used as an immediate.
+static bool GetImmOperand(struct IRInsn *insn, int index, long *imm) {
+  int v = insn->srcs[index];
+  if (!is_const_vreg[v]) return false;
+  *imm = const_values[v];
+  if (*imm != TruncateToIRType(*imm, kIRTypeI32)) return false;
+  switch (insn->op) {
+    case kIRAdd:
+    case kIRMul:
+    case kIRAnd:
+    case kIROr:
+    case kIRXor:
+      // Only one of the operands can be an immediate.
+      return index == 1 || !is_const_vreg[insn->srcs[1]];
+    case kIRShl:
+    case kIRSar:
+      return index == 1 && 0 <= *imm && *imm < 64;
+    case kIRSub:
+    case kIRCmpEq:
+    case kIRCmpNe:
+    case kIRCmpLt:
+    case kIRCmpLe:
+    case kIRCmpGt:
+    case kIRCmpGe:
+      return index == 1;
+    case kIRStore:
+      return index == 1 && (GetSizeOfIRType(insn->type) != 1 ||
+                            (-128 <= *imm && *imm < 256));
+    case kIRCopy:
+    case kIRReturn:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void LowerTwoAddressOp(const char *mnemonic, bool is_commutative,
+                              struct IRInsn *insn) {
+  int dst = insn->dst;
+  int left = insn->srcs[0];
+  int right = insn->srcs[1];
+  long imm;
+  bool has_imm = GetImmOperand(insn, 1, &imm);
+  if (!has_imm && GetImmOperand(insn, 0, &imm)) {
+    has_imm = true;
+    left = right;
+  }
+  if (has_imm) {
+    if (insn->op == kIRMul) {
+      EmitInsn("imul %=R, %R, %ld\n", dst, left, imm);
+      return;
+    }
+    if (dst != left) EmitInsn("mov %=R, %R\n", dst, left);
+    EmitInsn("%s %+R, %ld\n", mnemonic, dst, imm);
+    return;
+  }
+  if (dst == right && dst != left) {
+    if (is_commutative) {
+      EmitInsn("%s %+R, %R\n", mnemonic, dst, left);
+      return;
+    }
+    int tmp = AllocVReg();
+    EmitInsn("mov %=R, %R\n", tmp, left);
+    EmitInsn("%s %+R, %R\n", mnemonic, tmp, right);
+    EmitInsn("mov %=R, %R\n", dst, tmp);
+    return;
+  }
+  if (dst != left) EmitInsn("mov %=R, %R\n", dst, left);
+  EmitInsn("%s %+R, %R\n", mnemonic, dst, right);
+}
+
+static void LowerShift(const char *mnemonic, struct IRInsn *insn) {
+  long imm;
+  bool has_imm = GetImmOperand(insn, 1, &imm);
+  // r/m <<= CL, r/m >>= CL
+  if (!has_imm) EmitInsn("mov rcx, %R\n", insn->srcs[1]);
+  if (insn->dst != insn->srcs[0])
+    EmitInsn("mov %=R, %R\n", insn->dst, insn->srcs[0]);
+  if (has_imm) {
+    EmitInsn("%s %+R, %ld\n", mnemonic, insn->dst, imm);
+    return;
+  }
+  EmitInsn("%s %+R, cl\n", mnemonic, insn->dst);
+}
+
+static void LowerDivOrMod(struct IRInsn *insn) {
+  // rax <- rdx:rax / r/m, rdx <- rdx:rax % r/m
+  EmitInsn("mov rax, %R\n", insn->srcs[0]);
+  EmitInsn("cqo\n");
+  EmitInsn("idiv %R\n", insn->srcs[1]);
+  EmitInsn(insn->op == kIRDiv ? "mov %=R, rax\n" : "mov %=R, rdx\n",
+           insn->dst);
+}
+
+static void LowerCompare(const char *cc, struct IRInsn *insn) {
+  long imm;
+  if (GetImmOperand(insn, 1, &imm)) {
+    EmitInsn("cmp %R, %ld\n", insn->srcs[0], imm);
+  } else {
+    EmitInsn("cmp %R, %R\n", insn->srcs[0], insn->srcs[1]);
+  }
+  EmitInsn("set%s %=B\n", cc, insn->dst);
+  EmitInsn("movzx %=R, %B\n", insn->dst, insn->dst);
+}
+
+static void EmitSignExtend(enum IRType type, int dst, int src) {
+  if (type == kIRTypeI32) {
+    EmitInsn("movsxd %=R, %E\n", dst, src);
+    return;
+  }
+  if (type == kIRTypeI8) {
+    EmitInsn("movsx %=R, %B\n", dst, src);
+    return;
+  }
+  if (dst != src) EmitInsn("mov %=R, %R\n", dst, src);
+}
+
+static void LowerLoad(struct IRInsn *insn) {
+  int size = GetSizeOfIRType(insn->type);
+  if (size == 8) {
+    EmitInsn("mov %=R, [%R]\n", insn->dst, insn->srcs[0]);
+    return;
+  }
+  if (size == 4) {
+    EmitInsn("movsxd %=R, dword ptr [%R]\n", insn->dst, insn->srcs[0]);
+    return;
+  }
+  EmitInsn("movsx %=R, byte ptr [%R]\n", insn->dst, insn->srcs[0]);
+}
+
+static void LowerStore(struct IRInsn *insn) {
+  int size = GetSizeOfIRType(insn->type);
+  long imm;
+  if (GetImmOperand(insn, 1, &imm)) {
+    EmitInsn(size == 8   ? "mov qword ptr [%R], %ld\n"
+             : size == 4 ? "mov dword ptr [%R], %ld\n"
+                         : "mov byte ptr [%R], %ld\n",
+             insn->srcs[0], imm);
+    return;
+  }
+  if (size == 8) {
+    EmitInsn("mov [%R], %R\n", insn->srcs[0], insn->srcs[1]);
+    return;
+  }
+  if (size == 4) {
+    EmitInsn("mov [%R], %E\n", insn->srcs[0], insn->srcs[1]);
+    return;
+  }
+  EmitInsn("mov [%R], %B\n", insn->srcs[0], insn->srcs[1]);
+}
+
+// Params are defined at once by the leading param insns of the entry block.
+// Returns the number of the param insns.
+static int LowerParams(struct IRBlock *entry) {
+  int num_of_insns = 0;
+  int num_of_params = 0;
+  while (num_of_insns < entry->num_of_insns &&
+         entry->insns[num_of_insns]->op == kIRParam) {
+    struct IRInsn *insn = entry->insns[num_of_insns++];
+    if (insn->imm + 1 > num_of_params) num_of_params = insn->imm + 1;
+  }
+  int *params = malloc(sizeof(int) * (num_of_params + 1));
+  assert(params);
+  for (int i = 0; i < num_of_params; i++) params[i] = 0;
+  for (int i = 0; i < num_of_insns; i++) {
+    params[entry->insns[i]->imm] = entry->insns[i]->dst;
+  }
+  // Unnamed params are received in vregs which are never used.
+  for (int i = 0; i < num_of_params; i++) {
+    if (!params[i]) params[i] = AllocVReg();
+  }
+  EmitParamsInsn(num_of_params, params);
+  // Upper bits of narrow args are not defined by the ABI.
+  for (int i = 0; i < num_of_insns; i++) {
+    struct IRInsn *insn = entry->insns[i];
+    EmitSignExtend(insn->type, insn->dst, insn->dst);
+  }
+  free(params);
+  return num_of_insns;
+}
+
+static void LowerCall(struct IRInsn *insn) {
+  EmitCallInsn(insn->dst, insn->srcs[0], insn->num_of_srcs - 1,
+               insn->srcs + 1);
+}
+
+static void LowerBranch(struct IRInsn *insn, struct IRBlock *next) {
+  EmitInsn("cmp %R, 0\n", insn->srcs[0]);
+  if (insn->targets[0] == next) {
+    EmitJumpInsn("jz", insn->targets[1]->label);
+    return;
+  }
+  EmitJumpInsn("jnz", insn->targets[0]->label);
+  if (insn->targets[1] != next) EmitJumpInsn("jmp", insn->targets[1]->label);
+}
+
+// Returns fmt with the vector operands %V replaced by those of the size.
+static const char *FormatVectorInsn(const char *fmt, int size) {
+  static char buf[64];
+  assert(strlen(fmt) < sizeof(buf));
+  strcpy(buf, fmt);
+  for (char *p = buf; *p; p++) {
+    if (*p == 'V') *p = size == 32 ? 'Y' : 'X';
+  }
+  return buf;
+}
+
+// dst = left op right. VEX encoded insns take three operands.
+static void EmitVectorOp(const char *mnemonic, bool is_commutative, bool vex,
+                         int size, int dst, int left, int right) {
+  if (vex) {
+    EmitInsn(FormatVectorInsn("v%s %=V, %V, %V\n", size), mnemonic, dst, left,
+             right);
+    return;
+  }
+  if (dst == right && dst != left) {
+    if (is_commutative) {
+      EmitInsn("%s %+X, %X\n", mnemonic, dst, left);
+      return;
+    }
+    int tmp = AllocVReg();
+    EmitInsn("movdqa %=X, %X\n", tmp, left);
+    EmitInsn("%s %+X, %X\n", mnemonic, tmp, right);
+    EmitInsn("movdqa %=X, %X\n", dst, tmp);
+    return;
+  }
+  if (dst != left) EmitInsn("movdqa %=X, %X\n", dst, left);
+  EmitInsn("%s %+X, %X\n", mnemonic, dst, right);
+}
+
+// SSE2 has no signed min and max but pminsw and pmaxsw, so they are done by
+// selecting the lanes with a compare mask.
+static void EmitVectorMinOrMax(bool is_min, enum IRType lane_type, bool vex,
+                               int size, int dst, int left, int right) {
+  const char *suffix = lane_type == kIRTypeI8 ? "b" : "d";
+  if (vex) {
+    EmitInsn(FormatVectorInsn("v%s%s %=V, %V, %V\n", size),
+             is_min ? "pmins" : "pmaxs", suffix, dst, left, right);
+    return;
+  }
+  // mask = the lanes where right is selected
+  int mask = AllocVReg();
+  int tmp = AllocVReg();
+  EmitInsn("movdqa %=X, %X\n", mask, is_min ? left : right);
+  EmitInsn("pcmpgt%s %+X, %X\n", suffix, mask, is_min ? right : left);
+  EmitInsn("movdqa %=X, %X\n", tmp, right);
+  EmitInsn("pand %+X, %X\n", tmp, mask);
+  EmitInsn("pandn %+X, %X\n", mask, left);
+  EmitInsn("por %+X, %X\n", mask, tmp);
+  EmitInsn("movdqa %=X, %X\n", dst, mask);
+}
+
+// SSE2 multiplies only the even lanes into 64 bits, so the odd lanes are
+// shifted to the even ones and the low halves of the products are merged.
+static void EmitSSE2MulI32(int dst, int left, int right) {
+  int even = AllocVReg();
+  int odd = AllocVReg();
+  int tmp = AllocVReg();
+  EmitInsn("movdqa %=X, %X\n", even, left);
+  EmitInsn("pmuludq %+X, %X\n", even, right);
+  EmitInsn("movdqa %=X, %X\n", odd, left);
+  EmitInsn("psrlq %+X, 32\n", odd);
+  EmitInsn("movdqa %=X, %X\n", tmp, right);
+  EmitInsn("psrlq %+X, 32\n", tmp);
+  EmitInsn("pmuludq %+X, %X\n", odd, tmp);
+  EmitInsn("pshufd %=X, %X, 8\n", even, even);
+  EmitInsn("pshufd %=X, %X, 8\n", odd, odd);
+  EmitInsn("punpckldq %+X, %X\n", even, odd);
+  EmitInsn("movdqa %=X, %X\n", dst, even);
+}
+
+static void LowerVectorShift(const char *mnemonic, bool vex, int size,
+                             struct IRInsn *insn) {
+  long imm;
+  if (!GetImmOperand(insn, 1, &imm))
+    Error("LowerIRFunc: vector shift by a var");
+  if (vex) {
+    EmitInsn(FormatVectorInsn("v%s %=V, %V, %ld\n", size), mnemonic,
+             insn->dst, insn->srcs[0], imm);
+    return;
+  }
+  if (insn->dst != insn->srcs[0])
+    EmitInsn("movdqa %=X, %X\n", insn->dst, insn->srcs[0]);
+  EmitInsn("%s %+X, %ld\n", mnemonic, insn->dst, imm);
+}
+
+static void LowerBroadcast(enum IRType lane_type, bool vex,
+                           struct IRInsn *insn) {
+  int dst = insn->dst;
+  if (vex) {
+    EmitInsn("vmovd %=X, %E\n", dst, insn->srcs[0]);
+    EmitInsn(lane_type == kIRTypeI8 ? "vpbroadcastb %=Y, %X\n"
+                                    : "vpbroadcastd %=Y, %X\n",
+             dst, dst);
+    return;
+  }
+  EmitInsn("movd %=X, %E\n", dst, insn->srcs[0]);
+  if (lane_type == kIRTypeI8) {
+    EmitInsn("punpcklbw %+X, %X\n", dst, dst);
+    EmitInsn("punpcklwd %+X, %X\n", dst, dst);
+  }
+  EmitInsn("pshufd %=X, %X, 0\n", dst, dst);
+}
+
+static void LowerVectorInsn(struct IRInsn *insn) {
+  int size = GetSizeOfIRType(insn->type);
+  bool vex = size == 32;
+  enum IRType lane_type = GetIRLaneType(insn->type);
+  const char *suffix = lane_type == kIRTypeI8 ? "b" : "d";
+  char mnemonic[8];
+  int dst = insn->dst;
+  int left = insn->srcs[0];
+  int right = insn->num_of_srcs > 1 ? insn->srcs[1] : 0;
+  int tmp;
+  switch (insn->op) {
+    case kIRLoad:
+      EmitInsn(FormatVectorInsn(vex ? "vmovdqu %=V, [%R]\n"
+                                    : "movdqu %=V, [%R]\n",
+                                size),
+               dst, left);
+      return;
+    case kIRStore:
+      EmitInsn(FormatVectorInsn(vex ? "vmovdqu [%R], %V\n"
+                                    : "movdqu [%R], %V\n",
+                                size),
+               left, right);
+      return;
+    case kIRCopy:
+      if (dst == left) return;
+      EmitInsn(FormatVectorInsn(vex ? "vmovdqa %=V, %V\n" : "movdqa %=V, %V\n",
+                                size),
+               dst, left);
+      return;
+    case kIRAdd:
+    case kIRSub:
+      snprintf(mnemonic, sizeof(mnemonic), "p%s%s",
+               insn->op == kIRAdd ? "add" : "sub", suffix);
+      EmitVectorOp(mnemonic, insn->op == kIRAdd, vex, size, dst, left, right);
+      return;
+    case kIRMul:
+      if (lane_type != kIRTypeI32) break;
+      if (vex) {
+        EmitVectorOp("pmulld", true, vex, size, dst, left, right);
+        return;
+      }
+      EmitSSE2MulI32(dst, left, right);
+      return;
+    case kIRAnd:
+      EmitVectorOp("pand", true, vex, size, dst, left, right);
+      return;
+    case kIROr:
+      EmitVectorOp("por", true, vex, size, dst, left, right);
+      return;
+    case kIRXor:
+      EmitVectorOp("pxor", true, vex, size, dst, left, right);
+      return;
+    case kIRShl:
+    case kIRSar:
+      if (lane_type != kIRTypeI32) break;
+      LowerVectorShift(insn->op == kIRShl ? "pslld" : "psrad", vex, size,
+                       insn);
+      return;
+    case kIRNeg:
+    case kIRNot:
+      // -x = 0 - x, ~x = x ^ (all ones)
+      // The value of tmp does not depend on its old one.
+      tmp = AllocVReg();
+      EmitInsn(FormatVectorInsn(vex ? "v%s %=V, %=V, %=V\n" : "%s %=V, %=V\n",
+                                size),
+               insn->op == kIRNeg ? "pxor" : "pcmpeqd", tmp, tmp, tmp);
+      if (insn->op == kIRNeg) {
+        snprintf(mnemonic, sizeof(mnemonic), "psub%s", suffix);
+        EmitVectorOp(mnemonic, false, vex, size, dst, tmp, left);
+        return;
+      }
+      EmitVectorOp("pxor", true, vex, size, dst, left, tmp);
+      return;
+    case kIRMin:
+    case kIRMax:
+      EmitVectorMinOrMax(insn->op == kIRMin, lane_type, vex, size, dst, left,
+                         right);
+      return;
+    case kIRBroadcast:
+      LowerBroadcast(lane_type, vex, insn);
+      return;
+    default:
+      break;
+  }
+  Error("LowerIRFunc: unsupported op on vectors");
+}
+
+// The lanes are combined in halves until the lowest one has the result.
+static void LowerReduce(struct IRInsn *insn) {
+  enum IRType type = vreg_types[insn->srcs[0]];
+  enum IRType lane_type = GetIRLaneType(type);
+  bool vex = GetSizeOfIRType(type) == 32;
+  int x = insn->srcs[0];
+  for (int size = GetSizeOfIRType(type) / 2;
+       size >= GetSizeOfIRType(lane_type); size /= 2) {
+    int upper = AllocVReg();
+    if (size == 16) {
+      EmitInsn("vextracti128 %=X, %Y, 1\n", upper, x);
+    } else if (vex) {
+      EmitInsn("vpsrldq %=X, %X, %d\n", upper, x, size);
+    } else {
+      EmitInsn("movdqa %=X, %X\n", upper, x);
+      EmitInsn("psrldq %+X, %d\n", upper, size);
+    }
+    int y = AllocVReg();
+    if (insn->op == kIRReduceAdd) {
+      EmitVectorOp(lane_type == kIRTypeI8 ? "paddb" : "paddd", true, vex, 16,
+                   y, x, upper);
+    } else {
+      EmitVectorMinOrMax(insn->op == kIRReduceMin, lane_type, vex, 16, y, x,
+                         upper);
+    }
+    x = y;
+  }
+  EmitInsn(vex ? "vmovd %=E, %X\n" : "movd %=E, %X\n", insn->dst, x);
+  EmitSignExtend(lane_type, insn->dst, insn->dst);
+}
+
+// The result of the check by cpuid is cached in a common symbol: bit 0 is
+// set once it is checked, and bit 1 if AVX2 can be used, i.e. the CPU
+// supports AVX2 and the OS saves the ymm regs. rbx is saved around cpuid
+// since it may be allocated, and the other regs which cpuid writes are
+// never allocated.
+static void LowerHasAVX2(struct IRInsn *insn) {
+  int dst = insn->dst;
+  int addr = AllocVReg();
+  EmitInsn(".comm %s" CPU_FEATURES_SYMBOL ", 4\n", symbol_prefix);
+  EmitInsn("mov %=R, [rip + %s" CPU_FEATURES_SYMBOL "@GOTPCREL]\n", addr,
+           symbol_prefix);
+  EmitInsn("mov %=E, dword ptr [%R]\n", dst, addr);
+  EmitInsn(
+      "test %E, %E\n"
+      "jnz 1f\n"
+      "push rbx\n"
+      "xor eax, eax\n"
+      "cpuid\n"
+      "cmp eax, 7\n"
+      "jb 2f\n"
+      "mov eax, 1\n"
+      "cpuid\n"
+      "and ecx, 0x18000000\n"
+      "cmp ecx, 0x18000000\n"
+      "jne 2f\n"
+      "xor ecx, ecx\n"
+      "xgetbv\n"
+      "and eax, 6\n"
+      "cmp eax, 6\n"
+      "jne 2f\n"
+      "mov eax, 7\n"
+      "xor ecx, ecx\n"
+      "cpuid\n"
+      "test ebx, 0x20\n"
+      "jz 2f\n"
+      "mov eax, 3\n"
+      "jmp 3f\n"
+      "2:\n"
+      "mov eax, 1\n"
+      "3:\n"
+      "mov rcx, [rip + %s" CPU_FEATURES_SYMBOL "@GOTPCREL]\n"
+      "mov [rcx], eax\n"
+      "pop rbx\n"
+      "mov %=E, dword ptr [%R]\n"
+      "1:\n",
+      dst, dst, symbol_prefix, dst, addr);
+  EmitInsn("shr %+E, 1\n", dst);
+  EmitInsn("and %+E, 1\n", dst);
+}
+
+static void LowerInsn(struct IRInsn *insn, struct IRBlock *next) {
+  long imm;
+  if (IsVectorIRType(insn->type)) {
+    LowerVectorInsn(insn);
+    return;
+  }
+  switch (insn->op) {
+    case kIRConst:
+      // Consts only used as immediates are not needed in a register.
+      if (is_const_vreg[insn->dst] && !num_of_reg_uses[insn->dst]) return;
+      EmitInsn("mov %=R, %ld\n", insn->dst, insn->imm);
+      return;
+    case kIRCopy:
+      if (GetImmOperand(insn, 0, &imm)) {
+        EmitInsn("mov %=R, %ld\n", insn->dst, imm);
+        return;
+      }
+      if (insn->dst != insn->srcs[0])
+        EmitInsn("mov %=R, %R\n", insn->dst, insn->srcs[0]);
+      return;
+    case kIRAdd:
+      LowerTwoAddressOp("add", true, insn);
+      return;
+    case kIRSub:
+      LowerTwoAddressOp("sub", false, insn);
+      return;
+    case kIRMul:
+      LowerTwoAddressOp("imul", true, insn);
+      return;
+    case kIRAnd:
+      LowerTwoAddressOp("and", true, insn);
+      return;
+    case kIROr:
+      LowerTwoAddressOp("or", true, insn);
+      return;
+    case kIRXor:
+      LowerTwoAddressOp("xor", true, insn);
+      return;
+    case kIRDiv:
+    case kIRMod:
+      LowerDivOrMod(insn);
+      return;
+    case kIRShl:
+      LowerShift("sal", insn);
+      return;
+    case kIRSar:
+      LowerShift("sar", insn);
+      return;
+    case kIRCmpEq:
+      LowerCompare("e", insn);
+      return;
+    case kIRCmpNe:
+      LowerCompare("ne", insn);
+      return;
+    case kIRCmpLt:
+      LowerCompare("l", insn);
+      return;
+    case kIRCmpLe:
+      LowerCompare("le", insn);
+      return;
+    case kIRCmpGt:
+      LowerCompare("g", insn);
+      return;
+    case kIRCmpGe:
+      LowerCompare("ge", insn);
+      return;
+    case kIRNeg:
+    case kIRNot:
+      if (insn->dst != insn->srcs[0])
+        EmitInsn("mov %=R, %R\n", insn->dst, insn->srcs[0]);
+      EmitInsn(insn->op == kIRNeg ? "neg %+R\n" : "not %+R\n", insn->dst);
+      return;
+    case kIRSext:
+      EmitSignExtend(insn->type, insn->dst, insn->srcs[0]);
+      return;
+    case kIRFrameAddr:
+      EmitInsn("lea %=R, [rbp - %ld]\n", insn->dst, insn->imm);
+      return;
+    case kIRSymAddr:
+      EmitInsn(".global %s%s\n", symbol_prefix, insn->sym);
+      EmitInsn("mov %=R, [rip + %s%s@GOTPCREL]\n", insn->dst, symbol_prefix,
+               insn->sym);
+      return;
+    case kIRStrAddr:
+      EmitInsn("lea %=R, [rip + L%s_%ld]\n", insn->dst, label_prefix,
+               insn->imm);
+      return;
+    case kIRLoad:
+      LowerLoad(insn);
+      return;
+    case kIRStore:
+      LowerStore(insn);
+      return;
+    case kIRPrefetch:
+      EmitInsn("prefetch%s [%R]\n", prefetch_locality_names[insn->imm],
+               insn->srcs[0]);
+      return;
+    case kIRZeroUpper:
+      EmitInsn("vzeroupper\n");
+      return;
+    case kIRCall:
+      LowerCall(insn);
+      return;
+    case kIRJump:
+      if (insn->targets[0] != next)
+        EmitJumpInsn("jmp", insn->targets[0]->label);
+      return;
+    case kIRBranch:
+      LowerBranch(insn, next);
+      return;
+    case kIRReturn:
+      if (insn->num_of_srcs && GetImmOperand(insn, 0, &imm)) {
+        EmitInsn("mov rax, %ld\n", imm);
+      } else if (insn->num_of_srcs) {
+        EmitInsn("mov rax, %R\n", insn->srcs[0]);
+      }
+      EmitReturnInsn();
+      return;
+    case kIRMin:
+    case kIRMax:
+    case kIRBroadcast:
+      Error("LowerIRFunc: vector op on scalars");
+    case kIRReduceAdd:
+    case kIRReduceMin:
+    case kIRReduceMax:
+      LowerReduce(insn);
+      return;
+    case kIRHasAVX2:
+      LowerHasAVX2(insn);
+      return;
+    case kIRParam:
+      Error("LowerIRFunc: param is not at the beginning of the function");
+    case kIRPhi:
+      Error("LowerIRFunc: phi is not removed");
+    case kNumOfIROps:
+      break;
+  }
+  assert(false);
+}
+
+// Finds vregs defined only by a const and counts their uses which need the
+// value in a register.
+static void FindConstVRegs(struct IRFunc *f) {
+  int *num_of_defs = calloc(f->num_of_vregs + 1, sizeof(int));
+  is_const_vreg = calloc(f->num_of_vregs + 1, sizeof(bool));
+  const_values = calloc(f->num_of_vregs + 1, sizeof(long));
+  num_of_reg_uses = calloc(f->num_of_vregs + 1, sizeof(int));
+  assert(num_of_defs && is_const_vreg && const_values && num_of_reg_uses);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!insn->dst) continue;
+      num_of_defs[insn->dst]++;
+      if (insn->op == kIRConst) const_values[insn->dst] = insn->imm;
+    }
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op == kIRConst && num_of_defs[insn->dst] == 1)
+        is_const_vreg[insn->dst] = true;
+    }
+  }
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      long imm;
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (!GetImmOperand(insn, s, &imm)) num_of_reg_uses[insn->srcs[s]]++;
+      }
+    }
+  }
+  free(num_of_defs);
+}
+
+void LowerIRFunc(struct IRFunc *f, const char *func_label_prefix) {
+  label_prefix = func_label_prefix;
+  vreg_types = f->vreg_types;
+  FindConstVRegs(f);
+  InitMachineCode(f->num_of_vregs);
+  int num_of_params = LowerParams(f->blocks[0]);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    struct IRBlock *next = i + 1 < f->num_of_blocks ? f->blocks[i + 1] : NULL;
+    EmitLabelInsn(b->label);
+    for (int k = i ? 0 : num_of_params; k < b->num_of_insns; k++) {
+      LowerInsn(b->insns[k], next);
+    }
+  }
+  free(num_of_reg_uses);
+  free(const_values);
+  free(is_const_vreg);
+}
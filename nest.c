@@ -0,0 +1,697 @@
+#include "compilium.h"
+
+// Loop interchange and tiling before SSA form
+//
+// A nest of two counted loops is perfect if the outer loop runs nothing but
+// the inner loop: the block before the inner loop only sets the inner
+// counter, and the block after it only increments the outer counter. The
+// loops of a perfect nest are interchanged if the inner loop then accesses
+// memory with smaller strides, e.g. walks along the rows of a 2D array
+// instead of down its columns. If the inner loop still touches a cache line
+// in each iteration for some accesses, and the lines of a whole run of it do
+// not fit in L1, it is tiled: its iterations are split into tiles, and the
+// outer loop runs over each tile in turn, so that the lines are reused by
+// the next iteration of the outer loop before they are evicted.
+//
+// Both change the order of the iterations. It is legal if no two iterations
+// access overlapping addrs, one of them storing, where the outer counter
+// goes forward and the inner counter goes back from one to the other. Addrs
+// must be affine in the counters to check it, and accesses to the same
+// array need const trip counts. Vars carried from an iteration to another
+// must be sums, which do not depend on the order. Nests with calls or
+// unroll pragmas are left as they are.
+
+#define MAX_ACCESSES 32
+#define MAX_EVAL_DEPTH 16
+#define MAX_TRIP_COUNT_TO_CHECK 65536
+#define CACHE_LINE_SIZE 64
+#define L1_CACHE_SIZE 32768
+#define MIN_TILE_SIZE 8
+
+// An addr is root + coefs[0] * outer counter + coefs[1] * inner counter +
+// ofs. The root is root_insn if it defines the addr of an object, or else
+// the vreg root defined outside the nest, or nothing if both are 0.
+struct Addr {
+  int root;
+  struct IRInsn *root_insn;
+  long coefs[2];
+  long ofs;
+};
+
+struct Access {
+  struct IRInsn *insn;
+  bool is_addr_known;
+  struct Addr addr;
+};
+
+struct NestLoop {
+  struct IRBlock *header;
+  struct IRInsn *test;
+  int counter;
+  long init;
+  long step;
+  long trip_count;  // -1 if unknown
+};
+
+static struct IRFunc *func;
+static struct IRLoop *outer_loop;  // as found before the nest is changed
+static struct IRLoop *inner_loop;
+static struct NestLoop loops[2];         // [0] is the outer one
+static struct IRBlock *preheader;        // goes to the outer header
+static struct IRBlock *inner_preheader;  // sets the inner counter
+static struct IRBlock *body;             // the first block of the body
+static struct IRBlock *latch;            // goes back to the inner header
+static int latch_inc_index;  // the inner counter is incremented from here
+static struct IRBlock *outer_latch;  // increments the outer counter
+static struct IRBlock *exit_block;
+static struct Access accesses[MAX_ACCESSES];
+static int num_of_accesses;
+static bool has_store;
+
+static bool IsSumInsn(int var, struct IRBlock *b, int index, int depth);
+
+static int GetIndexInFunc(struct IRBlock *b) {
+  int i = 0;
+  while (func->blocks[i] != b) i++;
+  return i;
+}
+
+static int CountUses(int vreg) {
+  int n = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (insn->srcs[s] == vreg) n++;
+      }
+    }
+  }
+  return n;
+}
+
+static bool IsUsedOnlyAfter(struct IRBlock *b, int index, int vreg) {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *x = func->blocks[i];
+    for (int k = 0; k < x->num_of_insns; k++) {
+      struct IRInsn *insn = x->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (insn->srcs[s] == vreg && (x != b || k < index)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool IsPure(enum IROp op) {
+  return (op <= kIRNot && op != kIRDiv && op != kIRMod) || op == kIRSext;
+}
+
+// Returns whether the insns of b from the index-th one, except the
+// terminator, compute nothing but var, using temps which are not used
+// elsewhere.
+static bool ComputesOnly(struct IRBlock *b, int index, int var) {
+  for (int k = index; k < b->num_of_insns - 1; k++) {
+    struct IRInsn *insn = b->insns[k];
+    if (!IsPure(insn->op) ||
+        (insn->dst != var && !IsUsedOnlyAfter(b, index, insn->dst)))
+      return false;
+  }
+  return true;
+}
+
+// Returns whether the insns of b from the index-th one use only the counter,
+// vregs defined before by them, and vregs not defined in the nest.
+static bool UsesOnlyInvariants(struct IRBlock *b, int index, int counter) {
+  for (int k = index; k < b->num_of_insns; k++) {
+    struct IRInsn *insn = b->insns[k];
+    for (int s = 0; s < insn->num_of_srcs; s++) {
+      int src = insn->srcs[s];
+      int d = k;
+      while (--d >= index && b->insns[d]->dst != src) {
+      }
+      if (src != counter && d < index &&
+          IsIRVRegDefinedInLoop(outer_loop, src))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool IsLiveFrom(struct IRBlock *b, int index, int vreg,
+                       bool *visited) {
+  for (int k = index; k < b->num_of_insns; k++) {
+    struct IRInsn *insn = b->insns[k];
+    for (int s = 0; s < insn->num_of_srcs; s++) {
+      if (insn->srcs[s] == vreg) return true;
+    }
+    if (insn->dst == vreg) return false;
+  }
+  for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+    struct IRBlock *succ = GetIRSucc(b, s);
+    if (visited[succ->label]) continue;
+    visited[succ->label] = true;
+    if (IsLiveFrom(succ, 0, vreg, visited)) return true;
+  }
+  return false;
+}
+
+// Returns whether vreg may be used before it is defined from the beginning
+// of b.
+static bool IsLiveIn(struct IRBlock *b, int vreg) {
+  bool *visited = calloc(func->num_of_labels + 1, sizeof(bool));
+  assert(visited);
+  bool is_live = IsLiveFrom(b, 0, vreg, visited);
+  free(visited);
+  return is_live;
+}
+
+// Returns whether vreg is var plus some values, computed by adds, subs and
+// sexts to the type of var before the index-th insn of b. The temps in
+// between are used only once.
+static bool IsAddTo(int var, struct IRBlock *b, int index, int vreg,
+                    int depth) {
+  if (vreg == var) return true;
+  if (depth > MAX_EVAL_DEPTH) return false;
+  while (--index >= 0 && b->insns[index]->dst != vreg) {
+  }
+  if (index < 0 || CountUses(vreg) != 1) return false;
+  return IsSumInsn(var, b, index, depth + 1);
+}
+
+// Returns whether the index-th insn of b makes var plus some values.
+static bool IsSumInsn(int var, struct IRBlock *b, int index, int depth) {
+  struct IRInsn *insn = b->insns[index];
+  if (insn->op == kIRSext && insn->type == func->vreg_types[var])
+    return IsAddTo(var, b, index, insn->srcs[0], depth);
+  if (insn->op == kIRSub) return IsAddTo(var, b, index, insn->srcs[0], depth);
+  return insn->op == kIRAdd &&
+         (IsAddTo(var, b, index, insn->srcs[0], depth) ||
+          IsAddTo(var, b, index, insn->srcs[1], depth));
+}
+
+// Returns whether each def of var in the nest adds some values to it, and
+// var is used only once by each of them there.
+static bool IsSum(int var) {
+  int num_of_defs = 0;
+  int num_of_uses = 0;
+  for (int i = 0; i < outer_loop->num_of_blocks; i++) {
+    struct IRBlock *b = outer_loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (insn->srcs[s] == var) num_of_uses++;
+      }
+      if (insn->dst != var) continue;
+      if (!IsSumInsn(var, b, k, 0)) return false;
+      num_of_defs++;
+    }
+  }
+  return num_of_defs && num_of_uses == num_of_defs;
+}
+
+// Analysis of the nest
+
+static bool AnalyzeLoop(struct IRLoop *loop, struct NestLoop *x) {
+  struct IRCountedLoop c;
+  if (loop->header->unroll_hint || !AnalyzeIRCountedLoop(func, loop, &c) ||
+      c.is_test_used || c.has_call || !c.is_init_const)
+    return false;
+  x->header = loop->header;
+  x->test = c.test;
+  x->counter = c.test->srcs[1 - c.limit];
+  x->init = c.init;
+  x->step = c.step;
+  x->trip_count = c.trip_count;
+  return true;
+}
+
+// The latch is the only block which goes back to the inner header, and the
+// inner header is the only exit of the inner loop.
+static bool FindLatch() {
+  latch = NULL;
+  for (int i = 1; i < inner_loop->num_of_blocks; i++) {
+    struct IRBlock *b = inner_loop->blocks[i];
+    struct IRInsn *t = GetIRTerminator(b);
+    if (!t || t->op == kIRReturn) return false;
+    for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+      struct IRBlock *succ = GetIRSucc(b, s);
+      if (succ == loops[1].header) {
+        if (latch) return false;
+        latch = b;
+      } else if (!IsIRBlockInLoop(inner_loop, succ)) {
+        return false;
+      }
+    }
+  }
+  return latch != NULL;
+}
+
+// The inner counter is incremented at the end of the latch.
+static bool FindLatchInc() {
+  int counter = loops[1].counter;
+  int index = latch->num_of_insns - 1;
+  while (--index >= 0 && latch->insns[index]->dst != counter) {
+  }
+  for (latch_inc_index = index; latch_inc_index >= 0; latch_inc_index--) {
+    if (ComputesOnly(latch, latch_inc_index, counter) &&
+        UsesOnlyInvariants(latch, latch_inc_index, counter))
+      return true;
+  }
+  return false;
+}
+
+static bool IsPerfectNest() {
+  struct IRInsn *t = GetIRTerminator(loops[0].header);
+  inner_preheader = inner_loop->preheader;
+  exit_block = t->targets[1];
+  t = GetIRTerminator(loops[1].header);
+  body = t->targets[0];
+  outer_latch = t->targets[1];
+  preheader = outer_loop->preheader;
+  if (GetIRTerminator(loops[0].header)->targets[0] != inner_preheader ||
+      outer_loop->num_of_blocks != inner_loop->num_of_blocks + 3 ||
+      !IsIRBlockInLoop(outer_loop, outer_latch) ||
+      GetNumOfIRSuccs(outer_latch) != 1 ||
+      GetIRSucc(outer_latch, 0) != loops[0].header || !FindLatch() ||
+      !FindLatchInc())
+    return false;
+  for (int i = 0; i < 2; i++) {
+    if (!ComputesOnly(loops[i].header, 0, 0) ||
+        !UsesOnlyInvariants(loops[i].header, 0, loops[i].counter))
+      return false;
+  }
+  return ComputesOnly(inner_preheader, 0, loops[1].counter) &&
+         UsesOnlyInvariants(inner_preheader, 0, 0) &&
+         ComputesOnly(outer_latch, 0, loops[0].counter) &&
+         UsesOnlyInvariants(outer_latch, 0, loops[0].counter);
+}
+
+static bool HasRoot(struct Addr *a) { return a->root || a->root_insn; }
+
+static bool IsConstAddr(struct Addr *a) {
+  return !HasRoot(a) && !a->coefs[0] && !a->coefs[1];
+}
+
+static bool CombineAddrs(enum IROp op, struct Addr *x, struct Addr *y,
+                         struct Addr *a) {
+  if (op == kIRMul || op == kIRShl) {
+    if (op == kIRShl && (!IsConstAddr(y) || y->ofs < 0 || y->ofs > 32))
+      return false;
+    if (op == kIRMul && IsConstAddr(x)) {
+      struct Addr *t = x;
+      x = y;
+      y = t;
+    }
+    if (!IsConstAddr(y) || HasRoot(x)) return false;
+    long scale = op == kIRShl ? 1L << y->ofs : y->ofs;
+    *a = *x;
+    for (int i = 0; i < 2; i++) a->coefs[i] *= scale;
+    a->ofs *= scale;
+    return true;
+  }
+  if (HasRoot(y) && (op == kIRSub || HasRoot(x))) return false;
+  long sign = op == kIRSub ? -1 : 1;
+  *a = HasRoot(y) ? *y : *x;
+  for (int i = 0; i < 2; i++) a->coefs[i] = x->coefs[i] + sign * y->coefs[i];
+  a->ofs = x->ofs + sign * y->ofs;
+  return true;
+}
+
+// Evaluates vreg before the index-th insn of b. Temps are defined in the
+// block which uses them, and the counters are not changed before the
+// accesses in an iteration.
+static bool EvalAddr(struct IRBlock *b, int index, int vreg, struct Addr *a,
+                     int depth) {
+  *a = (struct Addr){0};
+  if (depth > MAX_EVAL_DEPTH) return false;
+  while (--index >= 0 && b->insns[index]->dst != vreg) {
+  }
+  if (index < 0) {
+    for (int i = 0; i < 2; i++) {
+      if (vreg != loops[i].counter) continue;
+      a->coefs[i] = 1;
+      return true;
+    }
+    a->root = vreg;
+    return func->vreg_types[vreg] == kIRTypePtr &&
+           !IsIRVRegDefinedInLoop(outer_loop, vreg);
+  }
+  struct IRInsn *insn = b->insns[index];
+  struct Addr x, y;
+  switch (insn->op) {
+    case kIRConst:
+      a->ofs = insn->imm;
+      return true;
+    case kIRFrameAddr:
+    case kIRSymAddr:
+    case kIRStrAddr:
+      a->root_insn = insn;
+      return true;
+    case kIRSext:
+      if (insn->type == kIRTypeI8) return false;
+      return EvalAddr(b, index, insn->srcs[0], a, depth + 1);
+    case kIRCopy:
+      return EvalAddr(b, index, insn->srcs[0], a, depth + 1);
+    case kIRAdd:
+    case kIRSub:
+    case kIRMul:
+    case kIRShl:
+      return EvalAddr(b, index, insn->srcs[0], &x, depth + 1) &&
+             EvalAddr(b, index, insn->srcs[1], &y, depth + 1) &&
+             CombineAddrs(insn->op, &x, &y, a);
+    default:
+      return false;
+  }
+}
+
+// Vars defined in the body must not be carried from an iteration to another
+// unless they are sums.
+static bool AnalyzeBody() {
+  num_of_accesses = 0;
+  has_store = false;
+  for (int i = 1; i < inner_loop->num_of_blocks; i++) {
+    struct IRBlock *b = inner_loop->blocks[i];
+    int n = b == latch ? latch_inc_index : b->num_of_insns;
+    for (int k = 0; k < n; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->dst && IsLiveIn(body, insn->dst) && !IsSum(insn->dst))
+        return false;
+      if (insn->op != kIRLoad && insn->op != kIRStore) continue;
+      if (num_of_accesses >= MAX_ACCESSES) return false;
+      struct Access *a = &accesses[num_of_accesses++];
+      a->insn = insn;
+      a->is_addr_known = EvalAddr(b, k, insn->srcs[0], &a->addr, 0);
+      if (insn->op == kIRStore) has_store = true;
+    }
+  }
+  return true;
+}
+
+static bool IsSameRoot(struct Addr *a, struct Addr *b) {
+  struct IRInsn *x = a->root_insn;
+  struct IRInsn *y = b->root_insn;
+  if (!x || !y) return !x && !y && a->root == b->root;
+  if (x->op != y->op) return false;
+  if (x->op == kIRSymAddr) return !strcmp(x->sym, y->sym);
+  return x->imm == y->imm;
+}
+
+static long FloorDiv(long a, long b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Returns whether x in an iteration and y in another access overlapping
+// addrs, and one of the iterations is after the other in the outer loop but
+// before it in the inner loop.
+static bool HasCrossingDependence(struct Access *x, struct Access *y) {
+  struct Addr *a = &x->addr;
+  struct Addr *b = &y->addr;
+  if (!IsSameRoot(a, b)) return !a->root_insn || !b->root_insn;
+  long n0 = loops[0].trip_count;
+  long n1 = loops[1].trip_count;
+  if (a->coefs[0] != b->coefs[0] || a->coefs[1] != b->coefs[1] || n0 < 0 ||
+      n1 < 0 || n0 > MAX_TRIP_COUNT_TO_CHECK || n1 > MAX_TRIP_COUNT_TO_CHECK)
+    return true;
+  // The addrs in iterations d0 and d1 apart differ by c0 * d0 + c1 * d1 +
+  // ofs, and they overlap if it is in (lo, hi).
+  long c0 = a->coefs[0] * loops[0].step;
+  long c1 = a->coefs[1] * loops[1].step;
+  long ofs = a->ofs - b->ofs;
+  long lo = -GetSizeOfIRType(x->insn->type);
+  long hi = GetSizeOfIRType(y->insn->type);
+  for (long d0 = 1 - n0; d0 < n0; d0++) {
+    if (!d0) continue;
+    // d1 is in [min, max] and has the other sign than d0.
+    long min = d0 > 0 ? 1 - n1 : 1;
+    long max = d0 > 0 ? -1 : n1 - 1;
+    long l = lo - c0 * d0 - ofs;
+    long h = hi - c0 * d0 - ofs;
+    if (!c1) {
+      if (l < 0 && 0 < h && min <= max) return true;
+      continue;
+    }
+    if (c1 < 0) {
+      long t = l;
+      l = -h;
+      h = -t;
+      t = min;
+      min = -max;
+      max = -t;
+    }
+    // c1 * d1 is in (l, h).
+    long first = FloorDiv(l, labs(c1)) + 1;
+    long last = -FloorDiv(-h, labs(c1)) - 1;
+    if (first < min) first = min;
+    if (last > max) last = max;
+    if (first <= last) return true;
+  }
+  return false;
+}
+
+static bool CheckDependences() {
+  if (!has_store) return true;
+  for (int i = 0; i < num_of_accesses; i++) {
+    if (!accesses[i].is_addr_known) return false;
+  }
+  for (int i = 0; i < num_of_accesses; i++) {
+    for (int k = i; k < num_of_accesses; k++) {
+      if ((accesses[i].insn->op == kIRStore ||
+           accesses[k].insn->op == kIRStore) &&
+          HasCrossingDependence(&accesses[i], &accesses[k]))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Returns roughly how many bytes of new cache lines the accesses touch in an
+// iteration if the i-th loop is the inner one.
+static long GetStrideCost(int i) {
+  long cost = 0;
+  for (int k = 0; k < num_of_accesses; k++) {
+    if (!accesses[k].is_addr_known) continue;
+    long stride = labs(accesses[k].addr.coefs[i] * loops[i].step);
+    cost += stride < CACHE_LINE_SIZE ? stride : CACHE_LINE_SIZE;
+  }
+  return cost;
+}
+
+// The final values of the counters change unless both loops run.
+static bool CanInterchange() {
+  if (loops[0].trip_count > 0 && loops[1].trip_count > 0) return true;
+  return !IsLiveIn(exit_block, loops[0].counter) &&
+         !IsLiveIn(exit_block, loops[1].counter);
+}
+
+// Returns the number of iterations of the inner loop in a tile, or 0 if it
+// should not be tiled. Tiles help accesses which touch a line in each
+// iteration of the inner loop and the same line in the next iteration of
+// the outer loop. Their lines are kept within a part of L1 since the other
+// accesses use the rest, and large strides map lines to few sets of it.
+static long ChooseTileSize() {
+  long trip_count = loops[1].trip_count;
+  long num_of_lines = 0;
+  for (int i = 0; i < num_of_accesses; i++) {
+    if (!accesses[i].is_addr_known) continue;
+    long *coefs = accesses[i].addr.coefs;
+    if (labs(coefs[1] * loops[1].step) >= CACHE_LINE_SIZE &&
+        labs(coefs[0] * loops[0].step) < CACHE_LINE_SIZE)
+      num_of_lines++;
+  }
+  if (!num_of_lines || loops[1].step <= 0 || trip_count < 0 ||
+      trip_count * num_of_lines * CACHE_LINE_SIZE <= L1_CACHE_SIZE / 2)
+    return 0;
+  long size = 1;
+  while (size * 2 * num_of_lines * CACHE_LINE_SIZE <= L1_CACHE_SIZE / 4 &&
+         trip_count % (size * 2) == 0)
+    size *= 2;
+  return MIN_TILE_SIZE <= size && size < trip_count ? size : 0;
+}
+
+// Changing the nest
+
+static void EmitJump(struct IRBlock *b, struct IRBlock *target) {
+  AppendIRInsn(b, kIRJump, kIRTypeNone, 0)->targets[0] = target;
+}
+
+static void Retarget(struct IRBlock *b, struct IRBlock *from,
+                     struct IRBlock *to) {
+  struct IRInsn *t = GetIRTerminator(b);
+  for (int i = 0; i < 2; i++) {
+    if (t->targets[i] == from) t->targets[i] = to;
+  }
+}
+
+static struct IRBlock *AddBlockBefore(struct IRBlock *b) {
+  struct IRBlock *added = AllocIRBlock(func);
+  InsertIRBlock(func, GetIndexInFunc(b), added);
+  return added;
+}
+
+static int EmitConst(struct IRBlock *b, int index, enum IRType type,
+                     long imm) {
+  int dst = AllocIRVReg(func, type);
+  InsertIRInsn(b, index, kIRConst, type, dst)->imm = imm;
+  return dst;
+}
+
+static int EmitOp(struct IRBlock *b, int index, enum IROp op,
+                  enum IRType type, int dst, int a, int c) {
+  struct IRInsn *insn = InsertIRInsn(b, index, op, type, dst);
+  AddIRSrc(insn, a);
+  AddIRSrc(insn, c);
+  return dst;
+}
+
+// The increments of the counters trade places, and the outer counter is set
+// in a new block between the headers, which also trade places.
+static void Interchange() {
+  struct IRBlock *outer_header = loops[0].header;
+  struct IRBlock *inner_header = loops[1].header;
+  int num_of_outer_incs = outer_latch->num_of_insns - 1;
+  while (latch_inc_index < latch->num_of_insns - 1) {
+    MoveIRInsn(latch, latch_inc_index, outer_latch,
+               outer_latch->num_of_insns - 1);
+  }
+  for (int k = 0; k < num_of_outer_incs; k++)
+    MoveIRInsn(outer_latch, 0, latch, latch->num_of_insns - 1);
+  latch_inc_index = latch->num_of_insns - 1 - num_of_outer_incs;
+  Retarget(latch, inner_header, outer_header);
+  Retarget(outer_latch, outer_header, inner_header);
+  struct IRBlock *init = AddBlockBefore(outer_header);
+  AppendIRInsn(init, kIRConst, func->vreg_types[loops[0].counter],
+               loops[0].counter)
+      ->imm = loops[0].init;
+  EmitJump(init, outer_header);
+  Retarget(preheader, outer_header, inner_preheader);
+  struct IRInsn *t = GetIRTerminator(inner_header);
+  t->targets[0] = init;
+  t->targets[1] = exit_block;
+  t = GetIRTerminator(outer_header);
+  t->targets[0] = body;
+  t->targets[1] = outer_latch;
+  preheader = inner_preheader;
+  inner_preheader = init;
+  // Prefetch hints stay with the innermost loop.
+  int hint = outer_header->prefetch_hint;
+  outer_header->prefetch_hint = inner_header->prefetch_hint;
+  inner_header->prefetch_hint = hint;
+  struct NestLoop outer = loops[0];
+  loops[0] = loops[1];
+  loops[1] = outer;
+  for (int i = 0; i < num_of_accesses; i++) {
+    long *coefs = accesses[i].addr.coefs;
+    long c = coefs[0];
+    coefs[0] = coefs[1];
+    coefs[1] = c;
+  }
+}
+
+// The nest is placed in a loop over the tiles, which sets the outer counter
+// to its init each time. The inner loop starts at the first iteration of the
+// tile and runs size iterations. The trip count of the inner loop is a
+// multiple of size, so that all the tiles are full.
+static void Tile(long size) {
+  struct NestLoop *outer = &loops[0];
+  struct NestLoop *inner = &loops[1];
+  enum IRType type = func->vreg_types[inner->counter];
+  int tile = AllocIRVReg(func, type);
+  struct IRBlock *tile_preheader = AddBlockBefore(outer->header);
+  struct IRBlock *tile_header = AddBlockBefore(outer->header);
+  struct IRBlock *init = AddBlockBefore(outer->header);
+  struct IRBlock *tile_latch = AllocIRBlock(func);
+  InsertIRBlock(func, GetIndexInFunc(outer_latch) + 1, tile_latch);
+  AppendIRInsn(tile_preheader, kIRConst, type, tile)->imm = 0;
+  EmitJump(tile_preheader, tile_header);
+  int num_of_tiles = EmitConst(tile_header, 0, type, inner->trip_count / size);
+  int test = EmitOp(tile_header, 1, kIRCmpLt, kIRTypeI32,
+                    AllocIRVReg(func, kIRTypeI32), tile, num_of_tiles);
+  struct IRInsn *br = AppendIRInsn(tile_header, kIRBranch, kIRTypeNone, 0);
+  AddIRSrc(br, test);
+  br->targets[0] = init;
+  br->targets[1] = exit_block;
+  AppendIRInsn(init, kIRConst, func->vreg_types[outer->counter],
+               outer->counter)
+      ->imm = outer->init;
+  EmitJump(init, outer->header);
+  int one = EmitConst(tile_latch, 0, type, 1);
+  EmitOp(tile_latch, 1, kIRAdd, type, tile, tile, one);
+  EmitJump(tile_latch, tile_header);
+  Retarget(preheader, outer->header, tile_preheader);
+  Retarget(outer->header, exit_block, tile_latch);
+  int k = inner_preheader->num_of_insns - 1;
+  int counter = inner->counter;
+  int delta = EmitConst(inner_preheader, k++, type, size * inner->step);
+  int ofs = EmitOp(inner_preheader, k++, kIRMul, type,
+                   AllocIRVReg(func, type), tile, delta);
+  EmitOp(inner_preheader, k++, kIRAdd, type, counter, counter, ofs);
+  int limit = EmitOp(inner_preheader, k++, kIRAdd, type,
+                     AllocIRVReg(func, type), counter, delta);
+  inner->test->op = kIRCmpLt;
+  inner->test->srcs[0] = counter;
+  inner->test->srcs[1] = limit;
+}
+
+static bool OptimizeNest(struct IRLoop *outer, struct IRLoop *inner) {
+  outer_loop = outer;
+  inner_loop = inner;
+  if (!AnalyzeLoop(outer, &loops[0]) || !AnalyzeLoop(inner, &loops[1]) ||
+      !IsPerfectNest() || !AnalyzeBody() || !CheckDependences())
+    return false;
+  bool is_changed = false;
+  if (GetStrideCost(0) < GetStrideCost(1) && CanInterchange()) {
+    Interchange();
+    is_changed = true;
+  }
+  long size = ChooseTileSize();
+  if (size) {
+    Tile(size);
+    is_changed = true;
+  }
+  return is_changed;
+}
+
+// Returns the index of the loop which directly contains the i-th loop, or
+// -1 if there is none or the i-th loop is not innermost.
+static int FindOuterLoop(struct IRLoop *loops_found, int num_of_loops,
+                         int i) {
+  int outer = -1;
+  for (int k = 0; k < num_of_loops; k++) {
+    if (k == i) continue;
+    if (IsIRBlockInLoop(&loops_found[i], loops_found[k].header)) return -1;
+    if (IsIRBlockInLoop(&loops_found[k], loops_found[i].header) &&
+        (outer < 0 || loops_found[k].num_of_blocks <
+                          loops_found[outer].num_of_blocks))
+      outer = k;
+  }
+  return outer;
+}
+
+// Loops are found again after each change. Each nest is tried once, which
+// is recorded by the labels of the headers.
+void OptimizeLoopNests(struct IRFunc *f) {
+  func = f;
+  int max_label = f->num_of_labels;
+  bool *is_tried = calloc(max_label + 1, sizeof(bool));
+  assert(is_tried);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int num_of_loops;
+    struct IRLoop *loops_found = FindIRLoops(f, &num_of_loops);
+    for (int i = 0; i < num_of_loops && !changed; i++) {
+      int outer = FindOuterLoop(loops_found, num_of_loops, i);
+      if (outer < 0) continue;
+      int label = loops_found[i].header->label;
+      int outer_label = loops_found[outer].header->label;
+      if (label > max_label || outer_label > max_label || is_tried[label] ||
+          is_tried[outer_label])
+        continue;
+      is_tried[label] = is_tried[outer_label] = true;
+      changed = OptimizeNest(&loops_found[outer], &loops_found[i]);
+    }
+    FreeIRLoops(loops_found, num_of_loops);
+  }
+  free(is_tried);
+}
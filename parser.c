@@ -1,10 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include "compilium.h"
 
 struct Node *ParseStmt();
 struct Node *ParseCompStmt();
 struct Node *ParseDeclBody();
 
-struct Node *next_token;
+_Thread_local struct Node *next_token;
+int num_of_parse_threads;
 
 static struct Node *ConsumeToken(enum TokenType type) {
   if (!next_token) return NULL;
@@ -121,110 +128,73 @@ struct Node *ParseCastExpr() {
   return ParseUnaryExpr();
 }
 
-struct Node *ParseMulExpr() {
+// Binary operators are parsed by a single precedence climbing loop.
+// Precedence is looked up by the spelling class of the punctuator
+// (one char / doubled char / char followed by '=') and its first char,
+// so no string comparison is needed. 0 means "not a binary operator".
+enum {
+  kBinOpSpellSingle,
+  kBinOpSpellDoubled,
+  kBinOpSpellWithEq,
+  kNumOfBinOpSpells,
+};
+
+static const unsigned char bin_op_prec_table[kNumOfBinOpSpells][128] = {
+    [kBinOpSpellSingle] =
+        {
+            ['*'] = 10,
+            ['/'] = 10,
+            ['%'] = 10,
+            ['+'] = 9,
+            ['-'] = 9,
+            ['<'] = 7,
+            ['>'] = 7,
+            ['&'] = 5,
+            ['^'] = 4,
+            ['|'] = 3,
+        },
+    [kBinOpSpellDoubled] =
+        {
+            ['<'] = 8,
+            ['>'] = 8,
+            ['&'] = 2,
+            ['|'] = 1,
+        },
+    [kBinOpSpellWithEq] =
+        {
+            ['<'] = 7,
+            ['>'] = 7,
+            ['='] = 6,
+            ['!'] = 6,
+        },
+};
+
+static int GetBinOpPrecedence(struct Node *t) {
+  if (!t || t->token_type != kTokenPunctuator) return 0;
+  const unsigned char *s = (const unsigned char *)t->begin;
+  if (s[0] >= 128) return 0;
+  if (t->length == 1) return bin_op_prec_table[kBinOpSpellSingle][s[0]];
+  if (t->length != 2) return 0;
+  if (s[1] == '=') return bin_op_prec_table[kBinOpSpellWithEq][s[0]];
+  if (s[1] == s[0]) return bin_op_prec_table[kBinOpSpellDoubled][s[0]];
+  return 0;
+}
+
+// Parses binary operators whose precedence is min_prec or higher.
+// All of them are left associative.
+static struct Node *ParseBinaryExpr(int min_prec) {
   struct Node *op = ParseCastExpr();
   if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("*")) || (t = ConsumePunctuator("/")) ||
-         (t = ConsumePunctuator("%"))) {
-    op = CreateASTBinOp(t, op, ParseCastExpr());
-  }
-  return op;
-}
-
-struct Node *ParseAddExpr() {
-  struct Node *op = ParseMulExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("+")) || (t = ConsumePunctuator("-"))) {
-    op = CreateASTBinOp(t, op, ParseMulExpr());
-  }
-  return op;
-}
-
-struct Node *ParseShiftExpr() {
-  struct Node *op = ParseAddExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("<<")) || (t = ConsumePunctuator(">>"))) {
-    op = CreateASTBinOp(t, op, ParseAddExpr());
-  }
-  return op;
-}
-
-struct Node *ParseRelExpr() {
-  struct Node *op = ParseShiftExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("<")) || (t = ConsumePunctuator(">")) ||
-         (t = ConsumePunctuator("<=")) || (t = ConsumePunctuator(">="))) {
-    op = CreateASTBinOp(t, op, ParseShiftExpr());
-  }
-  return op;
-}
-
-struct Node *ParseEqExpr() {
-  struct Node *op = ParseRelExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("==")) || (t = ConsumePunctuator("!="))) {
-    op = CreateASTBinOp(t, op, ParseRelExpr());
-  }
-  return op;
-}
-
-struct Node *ParseAndExpr() {
-  struct Node *op = ParseEqExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("&"))) {
-    op = CreateASTBinOp(t, op, ParseEqExpr());
-  }
-  return op;
-}
-
-struct Node *ParseXorExpr() {
-  struct Node *op = ParseAndExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("^"))) {
-    op = CreateASTBinOp(t, op, ParseAndExpr());
-  }
-  return op;
-}
-
-struct Node *ParseOrExpr() {
-  struct Node *op = ParseXorExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("|"))) {
-    op = CreateASTBinOp(t, op, ParseXorExpr());
-  }
-  return op;
-}
-
-struct Node *ParseBoolAndExpr() {
-  struct Node *op = ParseOrExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("&&"))) {
-    op = CreateASTBinOp(t, op, ParseOrExpr());
-  }
-  return op;
-}
-
-struct Node *ParseBoolOrExpr() {
-  struct Node *op = ParseBoolAndExpr();
-  if (!op) return NULL;
-  struct Node *t;
-  while ((t = ConsumePunctuator("||"))) {
-    op = CreateASTBinOp(t, op, ParseBoolAndExpr());
+  int prec;
+  while ((prec = GetBinOpPrecedence(next_token)) >= min_prec) {
+    struct Node *t = NextToken();
+    op = CreateASTBinOp(t, op, ParseBinaryExpr(prec + 1));
   }
   return op;
 }
 
 struct Node *ParseConditionalExpr() {
-  struct Node *expr = ParseBoolOrExpr();
+  struct Node *expr = ParseBinaryExpr(1);
   if (!expr) return NULL;
   struct Node *t;
   if ((t = ConsumePunctuator("?"))) {
@@ -281,7 +251,11 @@ struct Node *ParseExprStmt() {
 
 struct Node *ParseSelectionStmt() {
   struct Node *t;
-  if ((t = ConsumeToken(kTokenKwIf))) {
+  if (!(t = ConsumeToken(kTokenKwIf))) return NULL;
+  struct Node *head = NULL;
+  struct Node **last_else = &head;
+  // else-if chains are parsed iteratively to keep the stack depth constant
+  while (true) {
     ExpectPunctuator("(");
     struct Node *expr = ParseExpr();
     assert(expr);
@@ -292,12 +266,15 @@ struct Node *ParseSelectionStmt() {
     stmt->op = t;
     stmt->cond = expr;
     stmt->if_true_stmt = stmt_true;
-    if (ConsumeToken(kTokenKwElse)) {
-      stmt->if_else_stmt = ParseStmt();
+    *last_else = stmt;
+    last_else = &stmt->if_else_stmt;
+    if (!ConsumeToken(kTokenKwElse)) break;
+    if (!(t = ConsumeToken(kTokenKwIf))) {
+      *last_else = ParseStmt();
+      break;
     }
-    return stmt;
   }
-  return NULL;
+  return head;
 }
 
 struct Node *ParseJumpStmt() {
@@ -313,76 +290,91 @@ struct Node *ParseJumpStmt() {
   return NULL;
 }
 
-struct Node *ParseIterationStmt() {
+struct Node *ParseForStmt() {
   struct Node *t;
-  if ((t = ConsumeToken(kTokenKwFor))) {
-    ExpectPunctuator("(");
-    struct Node *init = ParseDeclBody();
-    if (!init) init = ParseExpr();
-    ExpectPunctuator(";");
-    struct Node *cond = ParseExpr();
-    ExpectPunctuator(";");
-    struct Node *updt = ParseExpr();
-    ExpectPunctuator(")");
-    struct Node *body = ParseStmt();
-    assert(body);
+  if (!(t = ConsumeToken(kTokenKwFor))) return NULL;
+  ExpectPunctuator("(");
+  struct Node *init = ParseDeclBody();
+  if (!init) init = ParseExpr();
+  ExpectPunctuator(";");
+  struct Node *cond = ParseExpr();
+  ExpectPunctuator(";");
+  struct Node *updt = ParseExpr();
+  ExpectPunctuator(")");
+  struct Node *body = ParseStmt();
+  assert(body);
 
-    struct Node *stmt = AllocNode(kASTForStmt);
-    stmt->op = t;
-    stmt->init = init;
-    stmt->cond = cond;
-    stmt->updt = updt;
-    stmt->body = body;
-    return stmt;
-  }
-  if ((t = ConsumeToken(kTokenKwWhile))) {
-    ExpectPunctuator("(");
-    struct Node *cond = ParseExpr();
-    assert(cond);
-    ExpectPunctuator(")");
-    struct Node *body = ParseStmt();
-    assert(body);
+  struct Node *stmt = AllocNode(kASTForStmt);
+  stmt->op = t;
+  stmt->init = init;
+  stmt->cond = cond;
+  stmt->updt = updt;
+  stmt->body = body;
+  return stmt;
+}
 
-    struct Node *stmt = AllocNode(kASTWhileStmt);
-    stmt->op = t;
-    stmt->cond = cond;
-    stmt->body = body;
-    return stmt;
-  }
-  return NULL;
+struct Node *ParseWhileStmt() {
+  struct Node *t;
+  if (!(t = ConsumeToken(kTokenKwWhile))) return NULL;
+  ExpectPunctuator("(");
+  struct Node *cond = ParseExpr();
+  assert(cond);
+  ExpectPunctuator(")");
+  struct Node *body = ParseStmt();
+  assert(body);
+
+  struct Node *stmt = AllocNode(kASTWhileStmt);
+  stmt->op = t;
+  stmt->cond = cond;
+  stmt->body = body;
+  return stmt;
+}
+
+// FIRST sets of statements, keyed by the kind of their first token.
+// Statements not listed here (and not starting with '{') are expr-stmts.
+static struct Node *(*const stmt_parser_table[kNumOfTokenTypes])(void) = {
+    [kTokenKwReturn] = ParseJumpStmt,
+    [kTokenKwIf] = ParseSelectionStmt,
+    [kTokenKwFor] = ParseForStmt,
+    [kTokenKwWhile] = ParseWhileStmt,
+};
+
+static const bool is_decl_spec_first[kNumOfTokenTypes] = {
+    [kTokenKwInt] = true,
+    [kTokenKwChar] = true,
+    [kTokenKwVoid] = true,
+    [kTokenKwStruct] = true,
+};
+
+static bool IsNextTokenPunctuator(char c) {
+  return next_token && next_token->token_type == kTokenPunctuator &&
+         next_token->length == 1 && next_token->begin[0] == c;
 }
 
 struct Node *ParseStmt() {
-  struct Node *stmt;
-  if ((stmt = ParseExprStmt()) || (stmt = ParseJumpStmt()) ||
-      (stmt = ParseSelectionStmt()) || (stmt = ParseCompStmt()) ||
-      (stmt = ParseIterationStmt()))
-    return stmt;
-  return NULL;
+  if (!next_token) return NULL;
+  if (IsNextTokenPunctuator('{')) return ParseCompStmt();
+  struct Node *(*parser)(void) = stmt_parser_table[next_token->token_type];
+  if (parser) return parser();
+  return ParseExprStmt();
 }
 
 struct Node *ParseDecl();
 struct Node *ParseDeclSpecs() {
-  struct Node *decl_spec;
-  (decl_spec = ConsumeToken(kTokenKwInt)) ||
-      (decl_spec = ConsumeToken(kTokenKwChar)) ||
-      (decl_spec = ConsumeToken(kTokenKwVoid));
-  if (decl_spec) return decl_spec;
-  if (ConsumeToken(kTokenKwStruct)) {
-    struct Node *struct_spec = AllocNode(kASTStructSpec);
-    struct_spec->tag = ConsumeToken(kTokenIdent);
-    assert(struct_spec->tag);
-    if (ConsumePunctuator("{")) {
-      struct_spec->struct_member_dict = AllocList();
-      struct Node *decl;
-      while ((decl = ParseDecl())) {
-        AddMemberOfStructFromDecl(struct_spec, decl);
-      }
-      ExpectPunctuator("}");
+  if (!next_token || !is_decl_spec_first[next_token->token_type]) return NULL;
+  if (!ConsumeToken(kTokenKwStruct)) return NextToken();
+  struct Node *struct_spec = AllocNode(kASTStructSpec);
+  struct_spec->tag = ConsumeToken(kTokenIdent);
+  assert(struct_spec->tag);
+  if (ConsumePunctuator("{")) {
+    struct_spec->struct_member_dict = AllocList();
+    struct Node *decl;
+    while ((decl = ParseDecl())) {
+      AddMemberOfStructFromDecl(struct_spec, decl);
     }
-    return struct_spec;
+    ExpectPunctuator("}");
   }
-  return NULL;
+  return struct_spec;
 }
 
 struct Node *ParseParamDecl();
@@ -486,38 +478,314 @@ struct Node *ParseCompStmt() {
   if (!(t = ConsumePunctuator("{"))) return NULL;
   struct Node *list = AllocList();
   list->op = t;
-  struct Node *stmt;
-  while ((stmt = ParseDecl()) || (stmt = ParseStmt())) {
+  while (next_token && !IsNextTokenPunctuator('}')) {
+    struct Node *stmt = is_decl_spec_first[next_token->token_type]
+                            ? ParseDecl()
+                            : ParseStmt();
+    if (!stmt) break;
     PushToList(list, stmt);
   }
   ExpectPunctuator("}");
   return list;
 }
 
-struct Node *ParseFuncDef(struct Node *decl_body) {
-  struct Node *comp_stmt = ParseCompStmt();
-  if (!comp_stmt) return NULL;
-  return CreateASTFuncDef(decl_body, comp_stmt);
+void InitParser(struct Node *head_token) { next_token = head_token; }
+
+static struct Node *SkipBraces(struct Node *t) {
+  // t should be '{'. Returns the token after the matching '}'.
+  int depth = 0;
+  for (; t; t = t->next_token) {
+    if (IsEqualTokenWithCStr(t, "{")) {
+      depth++;
+    } else if (IsEqualTokenWithCStr(t, "}")) {
+      if (--depth == 0) return t->next_token;
+    }
+  }
+  return NULL;
 }
 
-void InitParser(struct Node *head_token) { next_token = head_token; }
+// Function specifiers are accepted before the decl specs of a top-level
+// item. Each __attribute__ takes a single attribute.
+static int ParseFuncSpecs() {
+  int specs = 0;
+  while (next_token) {
+    if (ConsumeToken(kTokenKwInline)) {
+      specs |= FUNC_SPEC_INLINE;
+      continue;
+    }
+    if (!IsEqualTokenWithCStr(next_token, "__attribute__")) break;
+    NextToken();
+    ExpectPunctuator("(");
+    ExpectPunctuator("(");
+    struct Node *t = next_token;
+    if (!t) Error("Expect attribute but got EOF");
+    if (!ConsumeToken(kTokenIdent)) ErrorWithToken(t, "Expected attribute");
+    if (IsEqualTokenWithCStr(t, "always_inline")) {
+      specs |= FUNC_SPEC_ALWAYS_INLINE;
+    } else if (IsEqualTokenWithCStr(t, "noinline")) {
+      specs |= FUNC_SPEC_NOINLINE;
+    } else {
+      ErrorWithToken(t, "Unknown attribute");
+    }
+    ExpectPunctuator(")");
+    ExpectPunctuator(")");
+  }
+  return specs;
+}
+
+// Returns the first token after the function specifiers which begin at t.
+struct Node *SkipFuncSpecs(struct Node *t) {
+  InitParser(t);
+  ParseFuncSpecs();
+  return next_token;
+}
+
+struct TopLevelItem *SplitTopLevelItems(struct Node *t, int *num_of_items) {
+  // Splits tokens into top-level items by matching brackets only.
+  // A '{' on depth 0 just after ')' begins a function body.
+  struct TopLevelItem *items = NULL;
+  int size = 0, capacity = 0;
+  while (t) {
+    if (size >= capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      items = realloc(items, sizeof(*items) * capacity);
+      assert(items);
+    }
+    struct TopLevelItem *item = &items[size++];
+    memset(item, 0, sizeof(*item));
+    item->begin = t;
+    int depth = 0;
+    struct Node *prev = NULL;
+    while (t) {
+      if (IsTokenWithType(t, kTokenPunctuator) && t->length == 1) {
+        char c = t->begin[0];
+        if (c == '{' && depth == 0 && prev && IsEqualTokenWithCStr(prev, ")")) {
+          item->body = t;
+          t = SkipBraces(t);
+          break;
+        }
+        if (c == '(' || c == '[' || c == '{') depth++;
+        if (c == ')' || c == ']' || c == '}') depth--;
+        if (c == ';' && depth == 0) {
+          t = t->next_token;
+          break;
+        }
+      }
+      prev = t;
+      t = t->next_token;
+    }
+    item->end = t;
+    InitParser(item->begin);
+    item->func_specs = ParseFuncSpecs();
+  }
+  *num_of_items = size;
+  return items;
+}
+
+struct ParseJobs {
+  struct TopLevelItem *items;
+  int num_of_items;
+  atomic_int next_index;
+};
+
+static void *ParseFuncBodies(void *arg) {
+  struct ParseJobs *jobs = arg;
+  int i;
+  while ((i = atomic_fetch_add(&jobs->next_index, 1)) < jobs->num_of_items) {
+    struct TopLevelItem *item = &jobs->items[i];
+    if (!item->body) continue;
+    if (item->skip_body) {
+      item->comp_stmt = AllocList();
+      item->comp_stmt->op = item->body;
+      continue;
+    }
+    InitParser(item->body);
+    item->comp_stmt = ParseCompStmt();
+    assert(item->comp_stmt);
+    if (next_token != item->end) ErrorWithToken(next_token, "Unexpected token");
+  }
+  return NULL;
+}
 
-struct Node *Parse(struct Node *head_token) {
-  InitParser(head_token);
-  struct Node *list = AllocList();
-  struct Node *decl_body;
-  while ((decl_body = ParseDeclBody())) {
-    if (ConsumePunctuator(";")) {
-      PushToList(list, decl_body);
+static int GetNumOfParseThreads(int num_of_func_defs) {
+  int n = num_of_parse_threads;
+  if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > num_of_func_defs) n = num_of_func_defs;
+  return n < 1 ? 1 : n;
+}
+
+static void RunParseJobs(struct ParseJobs *jobs, int num_of_threads) {
+  if (num_of_threads <= 1) {
+    ParseFuncBodies(jobs);
+    return;
+  }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  // Give workers the same stack budget as the main thread.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    pthread_attr_setstacksize(&attr, limit.rlim_cur);
+  pthread_t *threads = malloc(sizeof(pthread_t) * (num_of_threads - 1));
+  assert(threads);
+  int num_of_started = 0;
+  for (; num_of_started < num_of_threads - 1; num_of_started++) {
+    if (pthread_create(&threads[num_of_started], &attr, ParseFuncBodies, jobs))
+      break;
+  }
+  ParseFuncBodies(jobs);
+  for (int i = 0; i < num_of_started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_attr_destroy(&attr);
+}
+
+struct Node *ParseTopLevelItems(struct TopLevelItem *items, int num_of_items) {
+  int num_of_func_defs = 0;
+  for (int i = 0; i < num_of_items; i++) {
+    struct TopLevelItem *item = &items[i];
+    InitParser(item->begin);
+    ParseFuncSpecs();  // item->func_specs is set by SplitTopLevelItems()
+    if (!(item->decl_body = ParseDeclBody()))
+      ErrorWithToken(item->begin, "Unexpected token");
+    if (item->body) {
+      if (next_token != item->body)
+        ErrorWithToken(NextToken(), "Unexpected token");
+      num_of_func_defs++;
       continue;
     }
-    struct Node *func_def = ParseFuncDef(decl_body);
-    if (!func_def) {
-      ErrorWithToken(NextToken(), "Unexpected token");
+    if (!ConsumePunctuator(";")) {
+      struct Node *t = NextToken();
+      if (!t) Error("Expect token ; but got EOF");
+      ErrorWithToken(t, "Unexpected token");
+    }
+  }
+  struct ParseJobs jobs = {.items = items, .num_of_items = num_of_items};
+  atomic_init(&jobs.next_index, 0);
+  RunParseJobs(&jobs, GetNumOfParseThreads(num_of_func_defs));
+  struct Node *list = AllocList();
+  for (int i = 0; i < num_of_items; i++) {
+    struct TopLevelItem *item = &items[i];
+    if (!item->body) {
+      PushToList(list, item->decl_body);
+      continue;
     }
+    struct Node *func_def = CreateASTFuncDef(item->decl_body, item->comp_stmt);
+    func_def->func_specs = item->func_specs;
     PushToList(list, func_def);
   }
-  struct Node *t;
-  if (!(t = NextToken())) return list;
-  ErrorWithToken(t, "Unexpected token");
+  return list;
+}
+
+struct Node *Parse(struct Node *head_token) {
+  int num_of_items;
+  struct TopLevelItem *items = SplitTopLevelItems(head_token, &num_of_items);
+  struct Node *list = ParseTopLevelItems(items, num_of_items);
+  free(items);
+  return list;
+}
+
+#define BENCH_NUM_OF_STMTS 4000
+#define BENCH_NUM_OF_ITERATIONS 5
+#define BENCH_NUM_OF_FUNCS 4000
+static double GetWallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double BenchParse(struct Node *tokens) {
+  double best = 0;
+  for (int i = 0; i < BENCH_NUM_OF_ITERATIONS; i++) {
+    double begin = GetWallTime();
+    Parse(tokens);
+    double elapsed = GetWallTime() - begin;
+    if (i == 0 || elapsed < best) best = elapsed;
+  }
+  return best;
+}
+
+static void BenchParallelParser() {
+  const char *func =
+      "int f%d(int a, int b) {\n"
+      "  int c;\n"
+      "  for (c = 0; c < a; c = c + 1) {\n"
+      "    if (a * c + b / 3 < a - b) b = b + c * 2; else b = b - 1;\n"
+      "  }\n"
+      "  return a * b + c;\n"
+      "}\n";
+  char *src = malloc((strlen(func) + 8) * BENCH_NUM_OF_FUNCS + 1);
+  assert(src);
+  char *p = src;
+  for (int i = 0; i < BENCH_NUM_OF_FUNCS; i++) p += sprintf(p, func, i);
+  struct Node *tokens = Tokenize(src);
+  int saved_num_of_parse_threads = num_of_parse_threads;
+  num_of_parse_threads = 1;
+  double single = BenchParse(tokens);
+  num_of_parse_threads = saved_num_of_parse_threads;
+  double multi = BenchParse(tokens);
+  fprintf(stderr,
+          "BenchParser: %d funcs, 1 thread %.3f ms, %d threads %.3f ms "
+          "(x%.2f)\n",
+          BENCH_NUM_OF_FUNCS, single * 1e3,
+          GetNumOfParseThreads(BENCH_NUM_OF_FUNCS), multi * 1e3,
+          single / multi);
+}
+
+static void BenchStmtParser() {
+  const char *block =
+      "  {\n"
+      "    int x%d;\n"
+      "    char c;\n"
+      "    struct S s;\n"
+      "    x%d = a + 1;\n"
+      "    if (x%d < b) x%d = b; else c = x%d;\n"
+      "    while (x%d < 10) x%d = x%d + 1;\n"
+      "    for (int i = 0; i < x%d; i = i + 1) { s.v = i; }\n"
+      "    return x%d;\n"
+      "  }\n";
+  char *src = malloc((strlen(block) + 80) * BENCH_NUM_OF_STMTS + 32);
+  assert(src);
+  char *p = src;
+  p += sprintf(p, "int f(int a, int b) {\n");
+  for (int i = 0; i < BENCH_NUM_OF_STMTS; i++) {
+    p += sprintf(p, block, i, i, i, i, i, i, i, i, i, i);
+  }
+  sprintf(p, "}\n");
+  struct Node *tokens = Tokenize(src);
+  double best = BenchParse(tokens);
+  fprintf(stderr,
+          "BenchParser: %d blocks of decls and stmts, best %.3f ms "
+          "(%.1f ns/block)\n",
+          BENCH_NUM_OF_STMTS, best * 1e3, best * 1e9 / BENCH_NUM_OF_STMTS);
+}
+
+_Noreturn void BenchParser() {
+  const char *stmt =
+      "v = a * 3 + b / (c - 7) % d << 2 < e == f & g ^ h | i && j || "
+      "k ? l + m * n : o - p;\n";
+  int stmt_len = strlen(stmt);
+  const char *header = "int f() {\n";
+  const char *footer = "}\n";
+  char *src = malloc(strlen(header) + stmt_len * BENCH_NUM_OF_STMTS +
+                     strlen(footer) + 1);
+  assert(src);
+  char *p = src;
+  p += sprintf(p, "%s", header);
+  for (int i = 0; i < BENCH_NUM_OF_STMTS; i++) p += sprintf(p, "%s", stmt);
+  sprintf(p, "%s", footer);
+  struct Node *tokens = Tokenize(src);
+  int num_of_primaries = 0;
+  for (struct Node *t = tokens; t; t = t->next_token) {
+    if (IsTokenWithType(t, kTokenIdent) ||
+        IsTokenWithType(t, kTokenDecimalNumber))
+      num_of_primaries++;
+  }
+  double best = BenchParse(tokens);
+  fprintf(stderr,
+          "BenchParser: %d stmts, %d primaries, best %.3f ms "
+          "(%.1f ns/primary)\n",
+          BENCH_NUM_OF_STMTS, num_of_primaries, best * 1e3,
+          best * 1e9 / num_of_primaries);
+  BenchStmtParser();
+  BenchParallelParser();
+  exit(EXIT_SUCCESS);
 }
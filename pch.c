@@ -0,0 +1,451 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compilium.h"
+
+// Precompiled header image layout (all pointers are stored as byte offsets
+// from the beginning of the image, 0 means NULL):
+//   struct PCHHeader
+//   struct Node[num_nodes]
+//   struct SymbolEntry[num_symbols]
+//   struct Node *[num_list_slots]   (contents of Node.nodes)
+//   char[]                          (NUL-terminated strings)
+// Tokens are not chained in the image: only the AST and the symbols refer to
+// them, so their next_token is NULL.
+//
+// Images which do not match this layout are ignored with a warning, and the
+// input is compiled without them.
+
+#define PCH_MAGIC "CPCH"
+#define PCH_VERSION 2
+
+struct PCHHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t node_size;
+  uint32_t symbol_entry_size;
+  uint64_t image_size;
+  uint64_t num_nodes;
+  uint64_t num_symbols;
+  uint64_t num_list_slots;
+  uint64_t ast;
+  uint64_t ctx;
+};
+
+// Keep in sync with struct Node when adding pointer fields. next_token is
+// not followed, since tokens are not chained in the image.
+static const size_t node_ptr_fields[] = {
+    offsetof(struct Node, expr_type),
+    offsetof(struct Node, op),
+    offsetof(struct Node, left),
+    offsetof(struct Node, right),
+    offsetof(struct Node, init),
+    offsetof(struct Node, cond),
+    offsetof(struct Node, updt),
+    offsetof(struct Node, body),
+    offsetof(struct Node, if_true_stmt),
+    offsetof(struct Node, if_else_stmt),
+    offsetof(struct Node, decltor_init_expr),
+    offsetof(struct Node, decltor_init_stmt),
+    offsetof(struct Node, struct_member_dict),
+    offsetof(struct Node, struct_member_ent_type),
+    offsetof(struct Node, struct_member_decl),
+    offsetof(struct Node, value),
+    offsetof(struct Node, local_var),
+    offsetof(struct Node, member_vars),
+    offsetof(struct Node, parent_var),
+    offsetof(struct Node, func_expr),
+    offsetof(struct Node, arg_expr_list),
+    offsetof(struct Node, arg_var_list),
+    offsetof(struct Node, func_body),
+    offsetof(struct Node, func_type),
+    offsetof(struct Node, func_name_token),
+    offsetof(struct Node, tag),
+    offsetof(struct Node, type_struct_spec),
+    offsetof(struct Node, type_array_type_of),
+    offsetof(struct Node, type_array_index_decl),
+};
+#define NUM_OF_NODE_PTR_FIELDS \
+  (sizeof(node_ptr_fields) / sizeof(node_ptr_fields[0]))
+
+static struct Node **NodePtrField(struct Node *n, int i) {
+  return (struct Node **)((char *)n + node_ptr_fields[i]);
+}
+
+// Open addressing map from object address to its index in the image
+struct PtrMap {
+  int capacity;
+  int size;
+  const void **keys;
+  int *values;
+};
+
+static unsigned HashPtr(const void *p) {
+  uintptr_t v = (uintptr_t)p;
+  v ^= v >> 17;
+  v *= 0x9E3779B1u;
+  return (unsigned)(v ^ (v >> 15));
+}
+
+static int *FindPtrMapSlot(struct PtrMap *m, const void *key) {
+  int mask = m->capacity - 1;
+  for (int i = HashPtr(key) & mask;; i = (i + 1) & mask) {
+    if (m->keys[i] == key) return &m->values[i];
+    if (!m->keys[i]) return NULL;
+  }
+}
+
+static void InsertToPtrMap(struct PtrMap *m, const void *key, int value);
+static void ExpandPtrMapIfNeeded(struct PtrMap *m) {
+  if ((m->size + 1) * 2 < m->capacity) return;
+  struct PtrMap old = *m;
+  m->capacity = old.capacity ? old.capacity * 2 : 256;
+  m->size = 0;
+  m->keys = calloc(m->capacity, sizeof(const void *));
+  m->values = calloc(m->capacity, sizeof(int));
+  assert(m->keys && m->values);
+  for (int i = 0; i < old.capacity; i++) {
+    if (old.keys[i]) InsertToPtrMap(m, old.keys[i], old.values[i]);
+  }
+  free(old.keys);
+  free(old.values);
+}
+
+static void InsertToPtrMap(struct PtrMap *m, const void *key, int value) {
+  ExpandPtrMapIfNeeded(m);
+  int mask = m->capacity - 1;
+  int i = HashPtr(key) & mask;
+  while (m->keys[i]) i = (i + 1) & mask;
+  m->keys[i] = key;
+  m->values[i] = value;
+  m->size++;
+}
+
+struct PCHWriter {
+  struct PtrMap node_map;
+  struct PtrMap str_map;
+  struct Node *node_list;  // kASTList of nodes in image order
+  struct Node **worklist;
+  int worklist_size;
+  int worklist_capacity;
+  const char **strs;
+  int num_strs;
+  uint64_t strs_size;
+  uint64_t num_list_slots;
+};
+
+static void VisitNode(struct PCHWriter *w, struct Node *n) {
+  if (!n) return;
+  if (!w->node_map.capacity) ExpandPtrMapIfNeeded(&w->node_map);
+  if (FindPtrMapSlot(&w->node_map, n)) return;
+  InsertToPtrMap(&w->node_map, n, GetSizeOfList(w->node_list));
+  PushToList(w->node_list, n);
+  if (w->worklist_size == w->worklist_capacity) {
+    w->worklist_capacity = (w->worklist_capacity + 1) * 2;
+    w->worklist =
+        realloc(w->worklist, sizeof(struct Node *) * w->worklist_capacity);
+    assert(w->worklist);
+  }
+  w->worklist[w->worklist_size++] = n;
+}
+
+static void VisitStr(struct PCHWriter *w, const char *s) {
+  if (!s) return;
+  if (!w->str_map.capacity) ExpandPtrMapIfNeeded(&w->str_map);
+  if (FindPtrMapSlot(&w->str_map, s)) return;
+  // store a byte offset into the string area of the image
+  InsertToPtrMap(&w->str_map, s, (int)w->strs_size);
+  w->strs = realloc(w->strs, sizeof(const char *) * (w->num_strs + 1));
+  assert(w->strs);
+  w->strs[w->num_strs++] = s;
+  w->strs_size += strlen(s) + 1;
+}
+
+static void CollectNodes(struct PCHWriter *w) {
+  // Walk with an explicit stack: token chains can be arbitrary long.
+  while (w->worklist_size) {
+    struct Node *n = w->worklist[--w->worklist_size];
+    for (unsigned i = 0; i < NUM_OF_NODE_PTR_FIELDS; i++) {
+      VisitNode(w, *NodePtrField(n, i));
+    }
+    for (int i = 0; i < n->size; i++) VisitNode(w, n->nodes[i]);
+    w->num_list_slots += n->size;
+    VisitStr(w, n->key);
+    VisitStr(w, n->src_str);
+    if (n->begin) {
+      if (!n->src_str || n->begin < n->src_str) {
+        Error("PCH: token without source string");
+      }
+    }
+  }
+}
+
+struct PCHLayout {
+  uint64_t nodes_ofs;
+  uint64_t symbols_ofs;
+  uint64_t list_slots_ofs;
+  uint64_t strs_ofs;
+};
+
+static uint64_t NodeOfs(struct PCHWriter *w, struct PCHLayout *l,
+                        struct Node *n) {
+  if (!n) return 0;
+  int *idx = FindPtrMapSlot(&w->node_map, n);
+  assert(idx);
+  return l->nodes_ofs + (uint64_t)*idx * sizeof(struct Node);
+}
+
+static uint64_t StrOfs(struct PCHWriter *w, struct PCHLayout *l,
+                       const char *s) {
+  if (!s) return 0;
+  int *ofs = FindPtrMapSlot(&w->str_map, s);
+  assert(ofs);
+  return l->strs_ofs + (uint64_t)*ofs;
+}
+
+static void WriteOrDie(FILE *fp, const void *p, size_t size) {
+  if (size && fwrite(p, size, 1, fp) != 1) Error("PCH: write failed");
+}
+
+void EmitPCH(const char *path, struct Node *ast, struct SymbolEntry *ctx) {
+  assert(path && ast && ast->type == kASTList);
+  for (int i = 0; i < GetSizeOfList(ast); i++) {
+    if (GetNodeAt(ast, i)->type == kASTFuncDef) {
+      ErrorWithToken(GetNodeAt(ast, i)->func_name_token,
+                     "Function definitions can not be precompiled");
+    }
+  }
+  struct PCHWriter w = {0};
+  w.node_list = AllocList();
+  int num_symbols = 0;
+  VisitNode(&w, ast);
+  for (struct SymbolEntry *e = ctx; e; e = e->prev) {
+    VisitNode(&w, e->value);
+    VisitStr(&w, e->key);
+    num_symbols++;
+  }
+  CollectNodes(&w);
+
+  struct PCHLayout l;
+  int num_nodes = GetSizeOfList(w.node_list);
+  l.nodes_ofs = sizeof(struct PCHHeader);
+  l.symbols_ofs = l.nodes_ofs + sizeof(struct Node) * num_nodes;
+  l.list_slots_ofs =
+      l.symbols_ofs + sizeof(struct SymbolEntry) * (uint64_t)num_symbols;
+  l.strs_ofs = l.list_slots_ofs + sizeof(struct Node *) * w.num_list_slots;
+
+  struct PCHHeader h = {.magic = PCH_MAGIC};
+  h.version = PCH_VERSION;
+  h.node_size = sizeof(struct Node);
+  h.symbol_entry_size = sizeof(struct SymbolEntry);
+  h.image_size = l.strs_ofs + w.strs_size;
+  h.num_nodes = num_nodes;
+  h.num_symbols = num_symbols;
+  h.num_list_slots = w.num_list_slots;
+  h.ast = NodeOfs(&w, &l, ast);
+  h.ctx = ctx ? l.symbols_ofs : 0;
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) Error("PCH: failed to open %s", path);
+  WriteOrDie(fp, &h, sizeof(h));
+
+  uint64_t list_slot = 0;
+  for (int i = 0; i < num_nodes; i++) {
+    struct Node *src = GetNodeAt(w.node_list, i);
+    struct Node n = *src;
+    for (unsigned k = 0; k < NUM_OF_NODE_PTR_FIELDS; k++) {
+      struct Node **p = NodePtrField(&n, k);
+      *p = (struct Node *)(uintptr_t)NodeOfs(&w, &l, *p);
+    }
+    n.next_token = NULL;
+    n.capacity = n.size;
+    n.nodes = n.size ? (struct Node **)(uintptr_t)(
+                           l.list_slots_ofs + list_slot * sizeof(struct Node *))
+                     : NULL;
+    list_slot += n.size;
+    n.key = (const char *)(uintptr_t)StrOfs(&w, &l, src->key);
+    n.src_str = (const char *)(uintptr_t)StrOfs(&w, &l, src->src_str);
+    n.begin = src->begin ? (const char *)(uintptr_t)(
+                               StrOfs(&w, &l, src->src_str) +
+                               (uint64_t)(src->begin - src->src_str))
+                         : NULL;
+    WriteOrDie(fp, &n, sizeof(n));
+  }
+  int sym_index = 0;
+  for (struct SymbolEntry *e = ctx; e; e = e->prev) {
+    struct SymbolEntry s = *e;
+    sym_index++;
+    s.prev = e->prev ? (struct SymbolEntry *)(uintptr_t)(
+                           l.symbols_ofs +
+                           (uint64_t)sym_index * sizeof(struct SymbolEntry))
+                     : NULL;
+    s.key = (const char *)(uintptr_t)StrOfs(&w, &l, e->key);
+    s.value = (struct Node *)(uintptr_t)NodeOfs(&w, &l, e->value);
+    WriteOrDie(fp, &s, sizeof(s));
+  }
+  for (int i = 0; i < num_nodes; i++) {
+    struct Node *src = GetNodeAt(w.node_list, i);
+    for (int k = 0; k < src->size; k++) {
+      uint64_t ofs = NodeOfs(&w, &l, src->nodes[k]);
+      WriteOrDie(fp, &ofs, sizeof(ofs));
+    }
+  }
+  for (int i = 0; i < w.num_strs; i++) {
+    WriteOrDie(fp, w.strs[i], strlen(w.strs[i]) + 1);
+  }
+  if (fclose(fp)) Error("PCH: failed to write %s", path);
+}
+
+static void *Relocate(char *base, const void *p) {
+  return p ? base + (uintptr_t)p : NULL;
+}
+
+// Offsets of the areas of an image, checked against its size
+struct PCHAreas {
+  uint64_t image_size;
+  uint64_t nodes_ofs;
+  uint64_t symbols_ofs;
+  uint64_t list_slots_ofs;
+  uint64_t strs_ofs;
+};
+
+// Returns whether count objects of size bytes fit in the image at ofs, and
+// sets *end to the offset after them.
+static bool FitsInImage(uint64_t image_size, uint64_t ofs, uint64_t count,
+                        uint64_t size, uint64_t *end) {
+  if (ofs > image_size || count > (image_size - ofs) / size) return false;
+  *end = ofs + count * size;
+  return true;
+}
+
+static bool IsObjectOfs(uint64_t ofs, uint64_t begin, uint64_t end,
+                        uint64_t size) {
+  return !ofs || (begin <= ofs && ofs < end && (ofs - begin) % size == 0);
+}
+
+static bool IsNodeOfs(struct PCHAreas *a, const void *p) {
+  return IsObjectOfs((uintptr_t)p, a->nodes_ofs, a->symbols_ofs,
+                     sizeof(struct Node));
+}
+
+static bool IsSymbolOfs(struct PCHAreas *a, const void *p) {
+  return IsObjectOfs((uintptr_t)p, a->symbols_ofs, a->list_slots_ofs,
+                     sizeof(struct SymbolEntry));
+}
+
+// Strings are NUL-terminated within the image, which ends with a NUL.
+static bool IsStrOfs(struct PCHAreas *a, const void *p) {
+  uint64_t ofs = (uintptr_t)p;
+  return !ofs || (a->strs_ofs <= ofs && ofs < a->image_size);
+}
+
+static bool IsValidNode(struct PCHAreas *a, char *base, struct Node *n) {
+  for (unsigned k = 0; k < NUM_OF_NODE_PTR_FIELDS; k++) {
+    if (!IsNodeOfs(a, *NodePtrField(n, k))) return false;
+  }
+  if (n->next_token || !IsStrOfs(a, n->key) || !IsStrOfs(a, n->src_str) ||
+      !IsStrOfs(a, n->begin) || n->length < 0 || n->size < 0)
+    return false;
+  uint64_t end;
+  if (n->begin && (!FitsInImage(a->image_size, (uintptr_t)n->begin,
+                                n->length, 1, &end) ||
+                   end > a->image_size - 1))
+    return false;
+  if (!n->size) return true;
+  uint64_t slots_ofs = (uintptr_t)n->nodes;
+  if (slots_ofs < a->list_slots_ofs ||
+      (slots_ofs - a->list_slots_ofs) % sizeof(struct Node *) ||
+      !FitsInImage(a->strs_ofs, slots_ofs, n->size, sizeof(struct Node *),
+                   &end))
+    return false;
+  struct Node **slots = (struct Node **)(base + slots_ofs);
+  for (int k = 0; k < n->size; k++) {
+    if (!IsNodeOfs(a, slots[k])) return false;
+  }
+  return true;
+}
+
+// Returns NULL if the image is valid, or the reason why it is not.
+static const char *ValidatePCH(char *base, uint64_t size) {
+  struct PCHHeader *h = (struct PCHHeader *)base;
+  if (size < sizeof(struct PCHHeader) ||
+      memcmp(h->magic, PCH_MAGIC, sizeof(h->magic)))
+    return "not a precompiled header";
+  if (h->version != PCH_VERSION || h->node_size != sizeof(struct Node) ||
+      h->symbol_entry_size != sizeof(struct SymbolEntry))
+    return "built by an incompatible compiler";
+  if (h->image_size != size) return "truncated";
+  struct PCHAreas a = {.image_size = size, .nodes_ofs = sizeof(*h)};
+  if (!FitsInImage(size, a.nodes_ofs, h->num_nodes, sizeof(struct Node),
+                   &a.symbols_ofs) ||
+      !FitsInImage(size, a.symbols_ofs, h->num_symbols,
+                   sizeof(struct SymbolEntry), &a.list_slots_ofs) ||
+      !FitsInImage(size, a.list_slots_ofs, h->num_list_slots,
+                   sizeof(struct Node *), &a.strs_ofs))
+    return "truncated";
+  if (a.strs_ofs < size && base[size - 1]) return "broken strings";
+  struct Node *nodes = (struct Node *)(base + a.nodes_ofs);
+  for (uint64_t i = 0; i < h->num_nodes; i++) {
+    if (!IsValidNode(&a, base, &nodes[i])) return "broken nodes";
+  }
+  struct SymbolEntry *symbols = (struct SymbolEntry *)(base + a.symbols_ofs);
+  for (uint64_t i = 0; i < h->num_symbols; i++) {
+    if (!IsSymbolOfs(&a, symbols[i].prev) || !IsStrOfs(&a, symbols[i].key) ||
+        !IsNodeOfs(&a, symbols[i].value))
+      return "broken symbols";
+  }
+  if (!IsNodeOfs(&a, (void *)(uintptr_t)h->ast) ||
+      !IsSymbolOfs(&a, (void *)(uintptr_t)h->ctx))
+    return "broken header";
+  return NULL;
+}
+
+struct SymbolEntry *LoadPCH(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) Error("PCH: failed to open %s", path);
+  struct stat st;
+  if (fstat(fd, &st)) Error("PCH: failed to stat %s", path);
+  // Private writable mapping: pointers are fixed up in place and the pages
+  // which only contain strings stay shared with the page cache.
+  char *base = st.st_size ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE, fd, 0)
+                          : MAP_FAILED;
+  close(fd);
+  const char *error = base == MAP_FAILED ? "empty or unreadable"
+                                         : ValidatePCH(base, st.st_size);
+  if (error) {
+    fprintf(stderr, "PCH: ignoring %s: %s\n", path, error);
+    if (base != MAP_FAILED) munmap(base, st.st_size);
+    return NULL;
+  }
+  struct PCHHeader *h = (struct PCHHeader *)base;
+  struct Node *nodes = (struct Node *)(base + sizeof(struct PCHHeader));
+  for (uint64_t i = 0; i < h->num_nodes; i++) {
+    struct Node *n = &nodes[i];
+    for (unsigned k = 0; k < NUM_OF_NODE_PTR_FIELDS; k++) {
+      struct Node **p = NodePtrField(n, k);
+      *p = Relocate(base, *p);
+    }
+    n->key = Relocate(base, n->key);
+    n->src_str = Relocate(base, n->src_str);
+    n->begin = Relocate(base, n->begin);
+    if (!n->size) continue;
+    // Lists may grow later, so move their slots out of the mapping.
+    struct Node **slots = Relocate(base, n->nodes);
+    n->nodes = malloc(sizeof(struct Node *) * n->size);
+    assert(n->nodes);
+    for (int k = 0; k < n->size; k++) n->nodes[k] = Relocate(base, slots[k]);
+  }
+  struct SymbolEntry *symbols = (struct SymbolEntry *)&nodes[h->num_nodes];
+  for (uint64_t i = 0; i < h->num_symbols; i++) {
+    symbols[i].prev = Relocate(base, symbols[i].prev);
+    symbols[i].key = Relocate(base, symbols[i].key);
+    symbols[i].value = Relocate(base, symbols[i].value);
+  }
+  return Relocate(base, (void *)(uintptr_t)h->ctx);
+}
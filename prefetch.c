@@ -0,0 +1,152 @@
+#include "compilium.h"
+
+// Software prefetching in loops on SSA form
+//
+// Hardware prefetchers follow a few streams of consecutive lines, but fall
+// behind when a loop walks many arrays at once or with large strides. Loads
+// and stores in innermost loops whose addrs go up by a const stride in each
+// iteration get a prefetch of the addr some iterations ahead, so that the
+// line arrives before it is used. The distance is the number of iterations
+// which cover the memory latency at the estimated cost of an iteration, and
+// at least a line ahead. Accesses within a line of an access to the same
+// stream share its prefetch. Lines are prefetched into all the caches, since
+// prefetchnta slows down streams which the hardware prefetchers also follow.
+//
+// Prefetches are inserted in innermost loops with #pragma prefetch, or in all
+// of them with --prefetch. #pragma prefetch(N) prefetches N iterations ahead,
+// and #pragma prefetch(0) disables prefetching in the loop.
+
+#define MEMORY_LATENCY 300  // in insns which run while a line is loaded
+#define CACHE_LINE_SIZE 64
+#define MAX_PREFETCH_DISTANCE 4096  // bytes, about a page
+#define LOCALITY_T0 3
+
+struct Access {
+  struct IRBlock *block;
+  struct IRInsn *insn;
+  struct IRIVForm form;
+};
+
+bool insert_prefetches;
+
+static struct IRFunc *func;
+static struct IRLoopIVs ivs;
+static struct Access *accesses;
+static int num_of_accesses;
+static int iteration_cost;  // insns which run in an iteration at most
+
+static bool IsSameStream(struct IRIVForm a, struct IRIVForm b) {
+  return a.iv == b.iv && a.base == b.base && a.scale == b.scale;
+}
+
+// Returns whether a prefetch for one of the first n accesses covers the
+// line of the i-th access.
+static bool IsCovered(int i, int n) {
+  struct IRIVForm form = accesses[i].form;
+  for (int k = 0; k < n; k++) {
+    if (IsSameStream(accesses[k].form, form) &&
+        labs(accesses[k].form.ofs - form.ofs) < CACHE_LINE_SIZE)
+      return true;
+  }
+  return false;
+}
+
+static void FindAccesses(struct IRLoop *loop) {
+  num_of_accesses = 0;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op != kIRLoad && insn->op != kIRStore) continue;
+      struct IRIVForm form = GetIRIVForm(&ivs, insn->srcs[0]);
+      if (!form.iv) continue;
+      accesses = realloc(accesses,
+                         sizeof(struct Access) * (num_of_accesses + 1));
+      assert(accesses);
+      accesses[num_of_accesses++] = (struct Access){b, insn, form};
+    }
+  }
+}
+
+static int EstimateCost(struct IRLoop *loop) {
+  int cost = 0;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      if (b->insns[k]->op != kIRPhi) cost++;
+    }
+  }
+  return cost;
+}
+
+// Returns how many bytes ahead of an access the line should be prefetched.
+static long GetDistance(struct IRLoop *loop, long stride) {
+  int hint = loop->header->prefetch_hint;
+  if (hint > 0) return hint * stride;
+  long iterations = (MEMORY_LATENCY + iteration_cost - 1) / iteration_cost;
+  long size = labs(stride);
+  if (iterations * size < CACHE_LINE_SIZE)
+    iterations = (CACHE_LINE_SIZE + size - 1) / size;
+  long distance = iterations * size;
+  if (distance > MAX_PREFETCH_DISTANCE) distance = MAX_PREFETCH_DISTANCE;
+  return stride < 0 ? -distance : distance;
+}
+
+static void InsertPrefetch(struct IRLoop *loop, struct Access *a) {
+  struct IRBlock *preheader = loop->preheader;
+  struct IRInsn *c = InsertIRInsn(preheader, preheader->num_of_insns - 1,
+                                  kIRConst, kIRTypeI64,
+                                  AllocIRVReg(func, kIRTypeI64));
+  c->imm = GetDistance(loop, ivs.steps[a->form.iv] * a->form.scale);
+  struct IRBlock *b = a->block;
+  int k = 0;
+  while (b->insns[k] != a->insn) k++;
+  int addr = AllocIRVReg(func, kIRTypePtr);
+  struct IRInsn *add = InsertIRInsn(b, k, kIRAdd, kIRTypePtr, addr);
+  AddIRSrc(add, a->insn->srcs[0]);
+  AddIRSrc(add, c->dst);
+  struct IRInsn *prefetch =
+      InsertIRInsn(b, k + 1, kIRPrefetch, kIRTypeNone, 0);
+  AddIRSrc(prefetch, addr);
+  prefetch->imm = LOCALITY_T0;
+}
+
+static void InsertPrefetchesInLoop(struct IRLoop *loop) {
+  FindAccesses(loop);
+  iteration_cost = EstimateCost(loop);
+  for (int i = 0; i < num_of_accesses; i++) {
+    if (!IsCovered(i, i)) InsertPrefetch(loop, &accesses[i]);
+  }
+}
+
+static bool IsInnermostLoop(struct IRLoop *loops, int num_of_loops, int i) {
+  for (int k = 0; k < num_of_loops; k++) {
+    if (k != i && IsIRBlockInLoop(&loops[i], loops[k].header)) return false;
+  }
+  return true;
+}
+
+// Returns the hint for a loop which runs num_of_iterations of the loop with
+// the hint in an iteration, so that the distance stays the same.
+int ScalePrefetchHint(int hint, int num_of_iterations) {
+  if (hint <= 0) return hint;
+  return (hint + num_of_iterations - 1) / num_of_iterations;
+}
+
+void InsertPrefetches(struct IRFunc *f) {
+  func = f;
+  int num_of_loops;
+  struct IRLoop *loops = FindIRLoops(f, &num_of_loops);
+  for (int i = 0; i < num_of_loops; i++) {
+    int hint = loops[i].header->prefetch_hint;
+    if (hint == PREFETCH_HINT_OFF || (!hint && !insert_prefetches) ||
+        !IsInnermostLoop(loops, num_of_loops, i))
+      continue;
+    AnalyzeIRLoopIVs(f, &loops[i], &ivs);
+    InsertPrefetchesInLoop(&loops[i]);
+    FreeIRLoopIVs(&ivs);
+  }
+  free(accesses);
+  accesses = NULL;
+  FreeIRLoops(loops, num_of_loops);
+}
@@ -0,0 +1,851 @@
+#include "compilium.h"
+
+// Machine code of a function is kept as a list of x86-64 instructions on
+// virtual registers (vregs) until all of it is generated. Then live
+// intervals are computed and physical registers are assigned by linear scan.
+// Vregs which do not fit are spilled to stack slots and reloaded through
+// spill_reg_names_* around each instruction that uses them. Vregs of vectors
+// are allocated to xmm/ymm registers in the same way, and are spilled if
+// they live across calls since all of those registers are caller-saved.
+
+enum MachineInsnType {
+  kInsnText,    // instruction or directive with register operands
+  kInsnLabel,   // label
+  kInsnJump,    // jmp or jcc to label
+  kInsnCall,    // operands: [0] = result, [1] = func, [2...] = args
+  kInsnReturn,  // epilogue
+  kInsnParams,  // operands: params of the function, defined at once
+};
+
+#define OPERAND_USE 1
+#define OPERAND_DEF 2
+
+struct MachineOperand {
+  int vreg;
+  int size;
+  int flags;
+};
+
+struct MachineInsn {
+  enum MachineInsnType type;
+  // kInsnText: "\x01" followed by '0' + operand index marks a register
+  // kInsnJump: mnemonic of the jump
+  const char *text;
+  int label;
+  unsigned live_regs;  // kInsnCall: caller-saved regs live across the call
+  int num_of_operands;
+  struct MachineOperand *operands;
+};
+
+#define NUM_OF_SPILL_REGS 2
+static const char *spill_reg_names_64[NUM_OF_SPILL_REGS] = {"r10", "r11"};
+static const char *spill_reg_names_32[NUM_OF_SPILL_REGS] = {"r10d", "r11d"};
+static const char *spill_reg_names_8[NUM_OF_SPILL_REGS] = {"r10b", "r11b"};
+
+// xmm14 and xmm15 are reserved for reloading spilled vectors.
+#define NUM_OF_VECTOR_REGS 14
+static const char *xmm_names[NUM_OF_VECTOR_REGS + NUM_OF_SPILL_REGS] = {
+    "xmm0", "xmm1", "xmm2",  "xmm3",  "xmm4",  "xmm5",  "xmm6",  "xmm7",
+    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"};
+static const char *ymm_names[NUM_OF_VECTOR_REGS + NUM_OF_SPILL_REGS] = {
+    "ymm0", "ymm1", "ymm2",  "ymm3",  "ymm4",  "ymm5",  "ymm6",  "ymm7",
+    "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15"};
+
+static struct MachineInsn *insns;
+static int num_of_insns;
+static int insns_capacity;
+static int num_of_vregs;
+
+void InitMachineCode(int num_of_vregs_used) {
+  num_of_insns = 0;
+  num_of_vregs = num_of_vregs_used;
+}
+
+int AllocVReg() { return ++num_of_vregs; }
+
+static struct MachineInsn *AppendInsn(enum MachineInsnType type) {
+  if (num_of_insns >= insns_capacity) {
+    insns_capacity = insns_capacity ? insns_capacity * 2 : 256;
+    insns = realloc(insns, sizeof(*insns) * insns_capacity);
+    assert(insns);
+  }
+  struct MachineInsn *insn = &insns[num_of_insns++];
+  memset(insn, 0, sizeof(*insn));
+  insn->type = type;
+  return insn;
+}
+
+static void AddOperand(struct MachineInsn *insn, int vreg, int size,
+                       int flags) {
+  assert(1 <= vreg && vreg <= num_of_vregs);
+  insn->operands = realloc(insn->operands, sizeof(struct MachineOperand) *
+                                               (insn->num_of_operands + 1));
+  assert(insn->operands);
+  insn->operands[insn->num_of_operands++] =
+      (struct MachineOperand){.vreg = vreg, .size = size, .flags = flags};
+}
+
+struct StrBuf {
+  char *s;
+  int size;
+  int capacity;
+};
+
+static void AppendToStrBuf(struct StrBuf *b, const char *s, int len) {
+  if (b->size + len + 1 > b->capacity) {
+    b->capacity = (b->size + len + 1) * 2;
+    b->s = realloc(b->s, b->capacity);
+    assert(b->s);
+  }
+  memcpy(&b->s[b->size], s, len);
+  b->size += len;
+  b->s[b->size] = 0;
+}
+
+// Formats an instruction. In addition to %d, %ld and %s, register operands
+// are written as %R (64bit), %E (32bit), %B (8bit), %X (xmm) or %Y (ymm)
+// with an optional prefix: '=' for a register which is only written, '+' for
+// one which is read and written. Registers without a prefix are only read.
+void EmitInsn(const char *fmt, ...) {
+  struct MachineInsn *insn = AppendInsn(kInsnText);
+  struct StrBuf buf = {NULL, 0, 0};
+  AppendToStrBuf(&buf, "", 0);
+  va_list ap;
+  va_start(ap, fmt);
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      AppendToStrBuf(&buf, p, 1);
+      continue;
+    }
+    p++;
+    char s[32];
+    if (*p == 'd') {
+      AppendToStrBuf(&buf, s, snprintf(s, sizeof(s), "%d", va_arg(ap, int)));
+      continue;
+    }
+    if (p[0] == 'l' && p[1] == 'd') {
+      p++;
+      AppendToStrBuf(&buf, s,
+                     snprintf(s, sizeof(s), "%ld", va_arg(ap, long)));
+      continue;
+    }
+    if (*p == 's') {
+      const char *arg = va_arg(ap, const char *);
+      AppendToStrBuf(&buf, arg, strlen(arg));
+      continue;
+    }
+    if (*p == '%') {
+      AppendToStrBuf(&buf, "%", 1);
+      continue;
+    }
+    int flags = OPERAND_USE;
+    if (*p == '=') {
+      flags = OPERAND_DEF;
+      p++;
+    } else if (*p == '+') {
+      flags = OPERAND_USE | OPERAND_DEF;
+      p++;
+    }
+    int size = *p == 'R'   ? 8
+               : *p == 'E' ? 4
+               : *p == 'B' ? 1
+               : *p == 'X' ? 16
+               : *p == 'Y' ? 32
+                           : 0;
+    if (!size) Error("EmitInsn: Unknown format %%%c in %s", *p, fmt);
+    assert(insn->num_of_operands < 10);
+    s[0] = '\x01';
+    s[1] = '0' + insn->num_of_operands;
+    AppendToStrBuf(&buf, s, 2);
+    AddOperand(insn, va_arg(ap, int), size, flags);
+  }
+  va_end(ap);
+  insn->text = buf.s;
+}
+
+void EmitLabelInsn(int label) { AppendInsn(kInsnLabel)->label = label; }
+
+void EmitJumpInsn(const char *mnemonic, int label) {
+  struct MachineInsn *insn = AppendInsn(kInsnJump);
+  insn->text = mnemonic;
+  insn->label = label;
+}
+
+void EmitCallInsn(int dst, int func, int num_of_args, const int *args) {
+  struct MachineInsn *insn = AppendInsn(kInsnCall);
+  AddOperand(insn, dst, 8, OPERAND_DEF);
+  AddOperand(insn, func, 8, OPERAND_USE);
+  for (int i = 0; i < num_of_args; i++) {
+    AddOperand(insn, args[i], 8, OPERAND_USE);
+  }
+}
+
+void EmitReturnInsn() { AppendInsn(kInsnReturn); }
+
+void EmitParamsInsn(int num_of_params, const int *params) {
+  struct MachineInsn *insn = AppendInsn(kInsnParams);
+  for (int i = 0; i < num_of_params; i++) {
+    AddOperand(insn, params[i], 8, OPERAND_DEF);
+  }
+}
+
+// Live intervals
+
+struct LiveInterval {
+  int vreg;
+  int start;
+  int end;
+};
+
+struct BasicBlock {
+  int begin;  // index of the first insn
+  int end;    // index of the last insn
+  int succs[2];
+  int num_of_succs;
+};
+
+static bool IsBlockTerminator(struct MachineInsn *insn) {
+  return insn->type == kInsnJump || insn->type == kInsnReturn;
+}
+
+static struct BasicBlock *SplitIntoBasicBlocks(int *block_of_insn,
+                                               int *num_of_blocks) {
+  int max_label = 0;
+  for (int i = 0; i < num_of_insns; i++) {
+    if (insns[i].type == kInsnLabel && insns[i].label > max_label)
+      max_label = insns[i].label;
+  }
+  int *label_to_insn = malloc(sizeof(int) * (max_label + 1));
+  assert(label_to_insn);
+  int n = 0;
+  for (int i = 0; i < num_of_insns; i++) {
+    if (i == 0 || insns[i].type == kInsnLabel ||
+        IsBlockTerminator(&insns[i - 1]))
+      n++;
+    block_of_insn[i] = n - 1;
+    if (insns[i].type == kInsnLabel) label_to_insn[insns[i].label] = i;
+  }
+  struct BasicBlock *blocks = calloc(n, sizeof(struct BasicBlock));
+  assert(blocks || !n);
+  for (int i = 0; i < num_of_insns; i++) {
+    struct BasicBlock *b = &blocks[block_of_insn[i]];
+    if (i == 0 || block_of_insn[i - 1] != block_of_insn[i]) b->begin = i;
+    b->end = i;
+  }
+  for (int k = 0; k < n; k++) {
+    struct BasicBlock *b = &blocks[k];
+    struct MachineInsn *last = &insns[b->end];
+    if (last->type == kInsnJump) {
+      assert(last->label <= max_label);
+      b->succs[b->num_of_succs++] = block_of_insn[label_to_insn[last->label]];
+      if (strcmp(last->text, "jmp") == 0) continue;
+    }
+    if (last->type == kInsnReturn) continue;
+    if (k + 1 < n) b->succs[b->num_of_succs++] = k + 1;
+  }
+  free(label_to_insn);
+  *num_of_blocks = n;
+  return blocks;
+}
+
+#define BITS_PER_WORD 64
+#define WORDS_FOR_BITS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+static bool IsBitSet(const unsigned long long *bits, int i) {
+  return (bits[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+static void SetBit(unsigned long long *bits, int i) {
+  bits[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+}
+
+// Returns intervals indexed by vreg. Vregs which appear in a single basic
+// block get [first occurrence, last occurrence]. Others are widened to cover
+// every block where they are live, which is found by the usual backward
+// dataflow over the blocks they appear in.
+static struct LiveInterval *CalcLiveIntervals() {
+  struct LiveInterval *intervals =
+      malloc(sizeof(struct LiveInterval) * (num_of_vregs + 1));
+  int *block_of_vreg = malloc(sizeof(int) * (num_of_vregs + 1));
+  int *global_index = malloc(sizeof(int) * (num_of_vregs + 1));
+  int *block_of_insn = malloc(sizeof(int) * (num_of_insns + 1));
+  assert(intervals && block_of_vreg && global_index && block_of_insn);
+  int num_of_blocks;
+  struct BasicBlock *blocks = SplitIntoBasicBlocks(block_of_insn,
+                                                   &num_of_blocks);
+  for (int v = 0; v <= num_of_vregs; v++) {
+    intervals[v] = (struct LiveInterval){.vreg = v, .start = -1, .end = -1};
+    block_of_vreg[v] = -1;
+    global_index[v] = -1;
+  }
+  int num_of_globals = 0;
+  for (int i = 0; i < num_of_insns; i++) {
+    for (int k = 0; k < insns[i].num_of_operands; k++) {
+      int v = insns[i].operands[k].vreg;
+      if (intervals[v].start < 0) intervals[v].start = i;
+      intervals[v].end = i;
+      if (block_of_vreg[v] < 0) block_of_vreg[v] = block_of_insn[i];
+      if (block_of_vreg[v] != block_of_insn[i] && global_index[v] < 0)
+        global_index[v] = num_of_globals++;
+    }
+  }
+  if (num_of_globals) {
+    int words = WORDS_FOR_BITS(num_of_globals);
+    unsigned long long *use = calloc(num_of_blocks * words, 8);
+    unsigned long long *def = calloc(num_of_blocks * words, 8);
+    unsigned long long *live_in = calloc(num_of_blocks * words, 8);
+    unsigned long long *live_out = calloc(num_of_blocks * words, 8);
+    assert(use && def && live_in && live_out);
+    for (int i = 0; i < num_of_insns; i++) {
+      int b = block_of_insn[i];
+      struct MachineInsn *insn = &insns[i];
+      for (int k = 0; k < insn->num_of_operands; k++) {
+        int g = global_index[insn->operands[k].vreg];
+        if (g < 0 || !(insn->operands[k].flags & OPERAND_USE)) continue;
+        if (!IsBitSet(&def[b * words], g)) SetBit(&use[b * words], g);
+      }
+      for (int k = 0; k < insn->num_of_operands; k++) {
+        int g = global_index[insn->operands[k].vreg];
+        if (g < 0 || !(insn->operands[k].flags & OPERAND_DEF)) continue;
+        SetBit(&def[b * words], g);
+      }
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int b = num_of_blocks - 1; b >= 0; b--) {
+        unsigned long long *out = &live_out[b * words];
+        unsigned long long *in = &live_in[b * words];
+        for (int s = 0; s < blocks[b].num_of_succs; s++) {
+          unsigned long long *succ_in = &live_in[blocks[b].succs[s] * words];
+          for (int w = 0; w < words; w++) out[w] |= succ_in[w];
+        }
+        for (int w = 0; w < words; w++) {
+          unsigned long long new_in =
+              use[b * words + w] | (out[w] & ~def[b * words + w]);
+          if (new_in == in[w]) continue;
+          in[w] = new_in;
+          changed = true;
+        }
+      }
+    }
+    for (int v = 1; v <= num_of_vregs; v++) {
+      int g = global_index[v];
+      if (g < 0) continue;
+      for (int b = 0; b < num_of_blocks; b++) {
+        if (IsBitSet(&live_in[b * words], g) &&
+            blocks[b].begin < intervals[v].start)
+          intervals[v].start = blocks[b].begin;
+        if (IsBitSet(&live_out[b * words], g) &&
+            blocks[b].end > intervals[v].end)
+          intervals[v].end = blocks[b].end;
+      }
+    }
+    free(use);
+    free(def);
+    free(live_in);
+    free(live_out);
+  }
+  free(blocks);
+  free(block_of_insn);
+  free(global_index);
+  free(block_of_vreg);
+  return intervals;
+}
+
+// Linear scan
+
+static int *vreg_to_reg;   // index of reg_names_*, -1 if spilled
+static int *vreg_to_slot;  // byte offset from rbp of the spill slot
+static int num_of_spill_slots;
+static bool used_regs[NUM_OF_ALLOCATABLE_REGS];
+static int spill_slot_base;
+static int *vector_sizes;  // indexed by vreg: largest size used, 0 if not
+
+static int CompareIntervalsByStart(const void *a, const void *b) {
+  const struct LiveInterval *l = a, *r = b;
+  if (l->start != r->start) return l->start - r->start;
+  return l->vreg - r->vreg;
+}
+
+static void Spill(int vreg) {
+  vreg_to_reg[vreg] = -1;
+  num_of_spill_slots += vector_sizes[vreg] ? vector_sizes[vreg] / 8 : 1;
+  vreg_to_slot[vreg] = spill_slot_base + 8 * num_of_spill_slots;
+}
+
+// Vregs used as xmm or ymm are vectors, which live in another set of regs.
+static void FindVectorVRegs() {
+  vector_sizes = realloc(vector_sizes, sizeof(int) * (num_of_vregs + 1));
+  assert(vector_sizes);
+  memset(vector_sizes, 0, sizeof(int) * (num_of_vregs + 1));
+  for (int i = 0; i < num_of_insns; i++) {
+    for (int k = 0; k < insns[i].num_of_operands; k++) {
+      struct MachineOperand *o = &insns[i].operands[k];
+      if (o->size < 16) continue;
+      if (o->size > vector_sizes[o->vreg]) vector_sizes[o->vreg] = o->size;
+    }
+  }
+}
+
+// Spills the active interval which ends last and returns its reg, or spills
+// cur and returns -1 if cur ends later.
+static int SpillLastEndingInterval(const int *active, int num_of_regs,
+                                   struct LiveInterval *intervals,
+                                   struct LiveInterval *cur) {
+  int victim_reg = 0;
+  for (int r = 1; r < num_of_regs; r++) {
+    if (intervals[active[r]].end > intervals[active[victim_reg]].end)
+      victim_reg = r;
+  }
+  if (intervals[active[victim_reg]].end <= cur->end) {
+    Spill(cur->vreg);
+    return -1;
+  }
+  Spill(active[victim_reg]);
+  return victim_reg;
+}
+
+// Args of calls prefer the allocatable reg which is also their param reg,
+// so that most of the moves before the call become no-ops.
+static int *CalcRegHints() {
+  int *hints = malloc(sizeof(int) * (num_of_vregs + 1));
+  assert(hints);
+  for (int v = 0; v <= num_of_vregs; v++) hints[v] = -1;
+  int reg_of_param[NUM_OF_PARAM_REGISTERS];
+  for (int i = 0; i < NUM_OF_PARAM_REGISTERS; i++) {
+    reg_of_param[i] = -1;
+    for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+      if (strcmp(reg_names_64[r], param_reg_names_64[i]) == 0)
+        reg_of_param[i] = r;
+    }
+  }
+  for (int i = 0; i < num_of_insns; i++) {
+    // The same goes for params of the function.
+    int first_param = insns[i].type == kInsnCall     ? 2
+                      : insns[i].type == kInsnParams ? 0
+                                                     : -1;
+    if (first_param < 0) continue;
+    for (int k = first_param; k < insns[i].num_of_operands &&
+                              k - first_param < NUM_OF_PARAM_REGISTERS;
+         k++) {
+      hints[insns[i].operands[k].vreg] = reg_of_param[k - first_param];
+    }
+  }
+  return hints;
+}
+
+static int FindFreeReg(const int *active, bool callee_saved) {
+  for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+    if (!active[r] && is_callee_saved_reg[r] == callee_saved) return r;
+  }
+  return -1;
+}
+
+// Values live across calls prefer callee-saved regs, which are saved once in
+// the prologue. Others prefer caller-saved regs, which cost nothing unless
+// they are live across a call.
+static void AllocRegsByLinearScan(struct LiveInterval *intervals) {
+  vreg_to_reg = realloc(vreg_to_reg, sizeof(int) * (num_of_vregs + 1));
+  vreg_to_slot = realloc(vreg_to_slot, sizeof(int) * (num_of_vregs + 1));
+  assert(vreg_to_reg && vreg_to_slot);
+  num_of_spill_slots = 0;
+  memset(used_regs, 0, sizeof(used_regs));
+
+  struct LiveInterval *sorted =
+      malloc(sizeof(struct LiveInterval) * (num_of_vregs + 1));
+  assert(sorted);
+  int n = 0;
+  for (int v = 1; v <= num_of_vregs; v++) {
+    vreg_to_reg[v] = -1;
+    vreg_to_slot[v] = 0;
+    if (intervals[v].start >= 0) sorted[n++] = intervals[v];
+  }
+  qsort(sorted, n, sizeof(*sorted), CompareIntervalsByStart);
+
+  // calls_before[i]: number of calls in insns[0...i-1]
+  int *calls_before = malloc(sizeof(int) * (num_of_insns + 1));
+  int *call_insns = malloc(sizeof(int) * (num_of_insns + 1));
+  assert(calls_before && call_insns);
+  int num_of_calls = 0;
+  for (int i = 0; i < num_of_insns; i++) {
+    calls_before[i] = num_of_calls;
+    if (insns[i].type == kInsnCall) call_insns[num_of_calls++] = i;
+  }
+  calls_before[num_of_insns] = num_of_calls;
+  int *hints = CalcRegHints();
+
+  // active[reg] holds the vreg currently assigned to reg, or 0.
+  int active[NUM_OF_ALLOCATABLE_REGS] = {0};
+  int active_vectors[NUM_OF_VECTOR_REGS] = {0};
+  for (int i = 0; i < n; i++) {
+    struct LiveInterval *cur = &sorted[i];
+    // The result of a call may reuse the reg of an arg since args are read
+    // before the call.
+    int expire_before = insns[cur->start].type == kInsnCall ? cur->start + 1
+                                                           : cur->start;
+    for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+      if (active[r] && intervals[active[r]].end < expire_before)
+        active[r] = 0;
+    }
+    for (int r = 0; r < NUM_OF_VECTOR_REGS; r++) {
+      if (active_vectors[r] && intervals[active_vectors[r]].end < expire_before)
+        active_vectors[r] = 0;
+    }
+    // Args and results of a call are not live across it.
+    bool across_call = calls_before[cur->end] > calls_before[cur->start + 1];
+    if (vector_sizes[cur->vreg]) {
+      if (across_call) {
+        Spill(cur->vreg);
+        continue;
+      }
+      int reg = 0;
+      while (reg < NUM_OF_VECTOR_REGS && active_vectors[reg]) reg++;
+      if (reg == NUM_OF_VECTOR_REGS)
+        reg = SpillLastEndingInterval(active_vectors, NUM_OF_VECTOR_REGS,
+                                      intervals, cur);
+      if (reg < 0) continue;
+      active_vectors[reg] = cur->vreg;
+      vreg_to_reg[cur->vreg] = reg;
+      continue;
+    }
+    int reg = hints[cur->vreg];
+    if (reg >= 0 && (active[reg] || across_call)) reg = -1;
+    if (reg < 0) reg = FindFreeReg(active, across_call);
+    if (reg < 0) reg = FindFreeReg(active, !across_call);
+    if (reg < 0) {
+      reg = SpillLastEndingInterval(active, NUM_OF_ALLOCATABLE_REGS, intervals,
+                                    cur);
+      if (reg < 0) continue;
+    }
+    active[reg] = cur->vreg;
+    vreg_to_reg[cur->vreg] = reg;
+    used_regs[reg] = true;
+  }
+  for (int v = 1; v <= num_of_vregs; v++) {
+    int reg = vreg_to_reg[v];
+    if (reg < 0 || vector_sizes[v] || is_callee_saved_reg[reg] ||
+        intervals[v].start < 0)
+      continue;
+    for (int c = calls_before[intervals[v].start + 1];
+         c < calls_before[intervals[v].end]; c++) {
+      insns[call_insns[c]].live_regs |= 1u << reg;
+    }
+  }
+  free(hints);
+  free(call_insns);
+  free(calls_before);
+  free(sorted);
+}
+
+// Output
+
+static const char *label_prefix;
+static int callee_saved_slot_base;
+
+static void PrintCalleeSavedRegs(FILE *fp, bool restore) {
+  int ofs = callee_saved_slot_base;
+  for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+    if (!used_regs[r] || !is_callee_saved_reg[r]) continue;
+    ofs += 8;
+    if (restore) {
+      fprintf(fp, "mov %s, [rbp - %d]\n", reg_names_64[r], ofs);
+    } else {
+      fprintf(fp, "mov [rbp - %d], %s\n", ofs, reg_names_64[r]);
+    }
+  }
+}
+
+static const char *GetRegName(int reg, int size) {
+  if (size == 32) return ymm_names[reg];
+  if (size == 16) return xmm_names[reg];
+  if (size == 8) return reg_names_64[reg];
+  if (size == 4) return reg_names_32[reg];
+  assert(size == 1);
+  return reg_names_8[reg];
+}
+
+static const char *GetSpillRegName(int index, int size) {
+  if (size >= 16) return GetRegName(NUM_OF_VECTOR_REGS + index, size);
+  if (size == 8) return spill_reg_names_64[index];
+  if (size == 4) return spill_reg_names_32[index];
+  assert(size == 1);
+  return spill_reg_names_8[index];
+}
+
+static void PrintPushOperand(FILE *fp, int vreg) {
+  if (vreg_to_reg[vreg] < 0) {
+    fprintf(fp, "push qword ptr [rbp - %d]\n", vreg_to_slot[vreg]);
+    return;
+  }
+  fprintf(fp, "push %s\n", reg_names_64[vreg_to_reg[vreg]]);
+}
+
+struct RegMove {
+  const char *dst;
+  const char *src;  // NULL if the value is in memory at [rbp + src_ofs]
+  int src_ofs;
+};
+
+static struct RegMove CreateRegMove(const char *dst, int vreg) {
+  int reg = vreg_to_reg[vreg];
+  if (reg < 0)
+    return (struct RegMove){.dst = dst, .src_ofs = -vreg_to_slot[vreg]};
+  return (struct RegMove){.dst = dst, .src = reg_names_64[reg]};
+}
+
+static void PrintMoveFromMemory(FILE *fp, const char *dst, int ofs) {
+  if (ofs < 0) {
+    fprintf(fp, "mov %s, [rbp - %d]\n", dst, -ofs);
+    return;
+  }
+  fprintf(fp, "mov %s, [rbp + %d]\n", dst, ofs);
+}
+
+static bool IsReadByPendingMove(struct RegMove *moves, bool *done, int n,
+                                const char *reg) {
+  for (int i = 0; i < n; i++) {
+    if (!done[i] && moves[i].src && strcmp(moves[i].src, reg) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Prints moves as if all of them happen at once: a move is printed only
+// after every other move which reads its destination. Cycles like
+// rdi <- rsi, rsi <- rdi are broken through a spill reg.
+static void PrintParallelMoves(FILE *fp, struct RegMove *moves, int n) {
+  bool done[NUM_OF_ALLOCATABLE_REGS + 1] = {false};
+  assert(n <= NUM_OF_ALLOCATABLE_REGS + 1);
+  int num_of_done = 0;
+  for (int i = 0; i < n; i++) {
+    if (!moves[i].src || strcmp(moves[i].dst, moves[i].src) != 0) continue;
+    done[i] = true;
+    num_of_done++;
+  }
+  while (num_of_done < n) {
+    bool progress = false;
+    for (int i = 0; i < n; i++) {
+      if (done[i] || IsReadByPendingMove(moves, done, n, moves[i].dst))
+        continue;
+      if (moves[i].src) {
+        fprintf(fp, "mov %s, %s\n", moves[i].dst, moves[i].src);
+      } else {
+        PrintMoveFromMemory(fp, moves[i].dst, moves[i].src_ofs);
+      }
+      done[i] = true;
+      num_of_done++;
+      progress = true;
+    }
+    if (progress) continue;
+    // Every pending move is blocked by another one, so they form cycles.
+    const char *tmp = spill_reg_names_64[0];
+    assert(!IsReadByPendingMove(moves, done, n, tmp));
+    int i = 0;
+    while (done[i] || !moves[i].src) i++;
+    const char *src = moves[i].src;
+    fprintf(fp, "mov %s, %s\n", tmp, src);
+    for (int k = 0; k < n; k++) {
+      if (!done[k] && moves[k].src && strcmp(moves[k].src, src) == 0)
+        moves[k].src = tmp;
+    }
+  }
+}
+
+static void PrintCallInsn(FILE *fp, struct MachineInsn *insn) {
+  int num_of_args = insn->num_of_operands - 2;
+  int num_of_reg_args = num_of_args < NUM_OF_PARAM_REGISTERS
+                            ? num_of_args
+                            : NUM_OF_PARAM_REGISTERS;
+  int num_of_stack_args = num_of_args - num_of_reg_args;
+  // Caller-saved registers are not preserved by the callee.
+  int num_of_saved = 0;
+  for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+    if (!(insn->live_regs & (1u << r))) continue;
+    fprintf(fp, "push %s\n", reg_names_64[r]);
+    num_of_saved++;
+  }
+  // rsp should be aligned to 16 bytes at the call.
+  int num_of_pads = (num_of_saved + num_of_stack_args) & 1;
+  if (num_of_pads) fprintf(fp, "sub rsp, 8\n");
+  for (int i = num_of_args - 1; i >= num_of_reg_args; i--) {
+    PrintPushOperand(fp, insn->operands[2 + i].vreg);
+  }
+  struct RegMove moves[NUM_OF_PARAM_REGISTERS + 1];
+  for (int i = 0; i < num_of_reg_args; i++) {
+    moves[i] =
+        CreateRegMove(param_reg_names_64[i], insn->operands[2 + i].vreg);
+  }
+  moves[num_of_reg_args] = CreateRegMove("rax", insn->operands[1].vreg);
+  PrintParallelMoves(fp, moves, num_of_reg_args + 1);
+  fprintf(fp, "call rax\n");
+  if (num_of_stack_args + num_of_pads)
+    fprintf(fp, "add rsp, %d\n", 8 * (num_of_stack_args + num_of_pads));
+  for (int r = NUM_OF_ALLOCATABLE_REGS - 1; r >= 0; r--) {
+    if (!(insn->live_regs & (1u << r))) continue;
+    fprintf(fp, "pop %s\n", reg_names_64[r]);
+  }
+  int dst = insn->operands[0].vreg;
+  if (vreg_to_reg[dst] < 0) {
+    fprintf(fp, "movsxd %s, eax\n", spill_reg_names_64[0]);
+    fprintf(fp, "mov [rbp - %d], %s\n", vreg_to_slot[dst],
+            spill_reg_names_64[0]);
+    return;
+  }
+  fprintf(fp, "movsxd %s, eax\n", reg_names_64[vreg_to_reg[dst]]);
+}
+
+// Args beyond the param regs are on the stack above the return address and
+// the saved rbp.
+static int GetStackParamOffset(int index) {
+  return 16 + 8 * (index - NUM_OF_PARAM_REGISTERS);
+}
+
+static void PrintParamsInsn(FILE *fp, struct MachineInsn *insn) {
+  // Spilled params are stored first since it does not overwrite any reg.
+  for (int i = 0; i < insn->num_of_operands; i++) {
+    int v = insn->operands[i].vreg;
+    if (vreg_to_reg[v] >= 0) continue;
+    const char *src;
+    if (i < NUM_OF_PARAM_REGISTERS) {
+      src = param_reg_names_64[i];
+    } else {
+      src = spill_reg_names_64[0];
+      PrintMoveFromMemory(fp, src, GetStackParamOffset(i));
+    }
+    fprintf(fp, "mov [rbp - %d], %s\n", vreg_to_slot[v], src);
+  }
+  struct RegMove *moves =
+      malloc(sizeof(struct RegMove) * (insn->num_of_operands + 1));
+  assert(moves);
+  int n = 0;
+  for (int i = 0; i < insn->num_of_operands; i++) {
+    int reg = vreg_to_reg[insn->operands[i].vreg];
+    if (reg < 0) continue;
+    moves[n] = (struct RegMove){.dst = reg_names_64[reg]};
+    if (i < NUM_OF_PARAM_REGISTERS) {
+      moves[n].src = param_reg_names_64[i];
+    } else {
+      moves[n].src_ofs = GetStackParamOffset(i);
+    }
+    n++;
+  }
+  PrintParallelMoves(fp, moves, n);
+  free(moves);
+}
+
+// Moves a spilled vreg between its slot and the index-th spill reg.
+static void PrintSpillMove(FILE *fp, int vreg, int index, bool store) {
+  int size = vector_sizes[vreg] ? vector_sizes[vreg] : 8;
+  const char *mnemonic = size == 32 ? "vmovdqu" : size == 16 ? "movdqu" : "mov";
+  const char *reg = GetSpillRegName(index, size);
+  if (store) {
+    fprintf(fp, "%s [rbp - %d], %s\n", mnemonic, vreg_to_slot[vreg], reg);
+    return;
+  }
+  fprintf(fp, "%s %s, [rbp - %d]\n", mnemonic, reg, vreg_to_slot[vreg]);
+}
+
+static void PrintTextInsn(FILE *fp, struct MachineInsn *insn) {
+  // Spilled vregs are loaded into spill regs before and stored after.
+  // Vectors have their own spill regs.
+  int spilled[2 * NUM_OF_SPILL_REGS];
+  int spill_flags[2 * NUM_OF_SPILL_REGS] = {0};
+  int spill_regs[2 * NUM_OF_SPILL_REGS];
+  int num_of_spilled = 0;
+  int num_of_spill_regs_used[2] = {0, 0};
+  int spill_reg_of_operand[10];
+  for (int k = 0; k < insn->num_of_operands; k++) {
+    struct MachineOperand *o = &insn->operands[k];
+    spill_reg_of_operand[k] = -1;
+    if (vreg_to_reg[o->vreg] >= 0) continue;
+    int s;
+    for (s = 0; s < num_of_spilled; s++) {
+      if (spilled[s] == o->vreg) break;
+    }
+    if (s == num_of_spilled) {
+      int *used = &num_of_spill_regs_used[vector_sizes[o->vreg] ? 1 : 0];
+      assert(*used < NUM_OF_SPILL_REGS);
+      spill_regs[s] = (*used)++;
+      spilled[num_of_spilled++] = o->vreg;
+    }
+    spill_flags[s] |= o->flags;
+    spill_reg_of_operand[k] = spill_regs[s];
+  }
+  for (int s = 0; s < num_of_spilled; s++) {
+    if (spill_flags[s] & OPERAND_USE)
+      PrintSpillMove(fp, spilled[s], spill_regs[s], false);
+  }
+  for (const char *p = insn->text; *p; p++) {
+    if (*p != '\x01') {
+      fputc(*p, fp);
+      continue;
+    }
+    int k = *++p - '0';
+    struct MachineOperand *o = &insn->operands[k];
+    fputs(spill_reg_of_operand[k] >= 0
+              ? GetSpillRegName(spill_reg_of_operand[k], o->size)
+              : GetRegName(vreg_to_reg[o->vreg], o->size),
+          fp);
+  }
+  for (int s = 0; s < num_of_spilled; s++) {
+    if (spill_flags[s] & OPERAND_DEF)
+      PrintSpillMove(fp, spilled[s], spill_regs[s], true);
+  }
+}
+
+static void PrintInsn(FILE *fp, struct MachineInsn *insn) {
+  if (insn->type == kInsnLabel) {
+    fprintf(fp, "L%s_%d:\n", label_prefix, insn->label);
+    return;
+  }
+  if (insn->type == kInsnJump) {
+    fprintf(fp, "%s L%s_%d\n", insn->text, label_prefix, insn->label);
+    return;
+  }
+  if (insn->type == kInsnCall) {
+    PrintCallInsn(fp, insn);
+    return;
+  }
+  if (insn->type == kInsnParams) {
+    PrintParamsInsn(fp, insn);
+    return;
+  }
+  if (insn->type == kInsnReturn) {
+    PrintCalleeSavedRegs(fp, true);
+    fprintf(fp, "mov rsp, rbp\n");
+    fprintf(fp, "pop rbp\n");
+    fprintf(fp, "ret\n");
+    return;
+  }
+  PrintTextInsn(fp, insn);
+}
+
+// Allocates registers for the instructions emitted since InitMachineCode()
+// and prints them with the prologue of the function.
+void PrintMachineCode(FILE *fp, const char *func_label_prefix,
+                      int local_var_size) {
+  label_prefix = func_label_prefix;
+  spill_slot_base = (local_var_size + 7) & ~7;
+  FindVectorVRegs();
+  struct LiveInterval *intervals = CalcLiveIntervals();
+  AllocRegsByLinearScan(intervals);
+  free(intervals);
+  callee_saved_slot_base = spill_slot_base + 8 * num_of_spill_slots;
+  int frame_size = callee_saved_slot_base;
+  for (int r = 0; r < NUM_OF_ALLOCATABLE_REGS; r++) {
+    if (used_regs[r] && is_callee_saved_reg[r]) frame_size += 8;
+  }
+  frame_size = (frame_size + 0xF) & ~0xF;
+
+  fprintf(fp, "push rbp\n");
+  fprintf(fp, "mov rbp, rsp\n");
+  if (frame_size) fprintf(fp, "sub rsp, %d\n", frame_size);
+  PrintCalleeSavedRegs(fp, false);
+  for (int i = 0; i < num_of_insns; i++) {
+    PrintInsn(fp, &insns[i]);
+    free(insns[i].operands);
+    if (insns[i].type == kInsnText) free((void *)insns[i].text);
+  }
+  num_of_insns = 0;
+}
@@ -0,0 +1,260 @@
+#include "compilium.h"
+
+// Sparse conditional constant propagation (Wegman and Zadeck) on SSA form
+//
+// Each vreg starts as undetermined and is lowered to a constant or to
+// varying while only the blocks reachable through executable edges are
+// evaluated. Vregs found constant are then defined by kIRConst, branches on
+// constants become jumps and the blocks never executed are removed.
+
+enum LatticeState {
+  kLatticeUndetermined,
+  kLatticeConst,
+  kLatticeVarying,
+};
+
+struct LatticeValue {
+  enum LatticeState state;
+  long value;
+};
+
+struct UseList {
+  struct IRInsn **insns;
+  struct IRBlock **blocks;
+  int size;
+  int capacity;
+};
+
+static struct IRFunc *func;
+static struct LatticeValue *values;  // indexed by vreg
+static struct UseList *uses;         // indexed by vreg
+static bool *is_block_executable;    // indexed by rpo_index
+static bool **is_edge_executable;    // [rpo_index of block][index of pred]
+static struct IRBlock **flow_worklist;
+static int flow_worklist_size;
+static int *ssa_worklist;
+static int ssa_worklist_size;
+static int ssa_worklist_capacity;
+
+static void AddUse(int vreg, struct IRInsn *insn, struct IRBlock *b) {
+  struct UseList *list = &uses[vreg];
+  if (list->size >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 4;
+    list->insns =
+        realloc(list->insns, sizeof(struct IRInsn *) * list->capacity);
+    list->blocks =
+        realloc(list->blocks, sizeof(struct IRBlock *) * list->capacity);
+    assert(list->insns && list->blocks);
+  }
+  list->insns[list->size] = insn;
+  list->blocks[list->size++] = b;
+}
+
+// Values only go down the lattice. A vreg which is found to have two
+// different constants is varying.
+static void SetValue(int vreg, struct LatticeValue v) {
+  struct LatticeValue *cur = &values[vreg];
+  if (v.state == kLatticeUndetermined || cur->state == kLatticeVarying) return;
+  if (cur->state == kLatticeConst) {
+    if (v.state == kLatticeConst && v.value == cur->value) return;
+    v.state = kLatticeVarying;
+  }
+  *cur = v;
+  if (ssa_worklist_size >= ssa_worklist_capacity) {
+    ssa_worklist_capacity = ssa_worklist_capacity * 2 + 16;
+    ssa_worklist = realloc(ssa_worklist, sizeof(int) * ssa_worklist_capacity);
+    assert(ssa_worklist);
+  }
+  ssa_worklist[ssa_worklist_size++] = vreg;
+}
+
+static void MarkEdgeExecutable(struct IRBlock *from, struct IRBlock *to) {
+  for (int k = 0; k < to->num_of_preds; k++) {
+    if (to->preds[k] != from) continue;
+    if (is_edge_executable[to->rpo_index][k]) return;
+    is_edge_executable[to->rpo_index][k] = true;
+    flow_worklist[flow_worklist_size++] = to;
+    return;
+  }
+  assert(false);
+}
+
+static bool IsEdgeExecutable(struct IRBlock *from, struct IRBlock *to) {
+  for (int k = 0; k < to->num_of_preds; k++) {
+    if (to->preds[k] == from && is_edge_executable[to->rpo_index][k])
+      return true;
+  }
+  return false;
+}
+
+static struct LatticeValue EvaluatePhi(struct IRInsn *phi, struct IRBlock *b) {
+  struct LatticeValue result = {kLatticeUndetermined, 0};
+  for (int s = 0; s < phi->num_of_srcs; s++) {
+    if (!IsEdgeExecutable(phi->src_blocks[s], b)) continue;
+    struct LatticeValue v = values[phi->srcs[s]];
+    if (v.state == kLatticeUndetermined) continue;
+    if (v.state == kLatticeVarying ||
+        (result.state == kLatticeConst && result.value != v.value))
+      return (struct LatticeValue){kLatticeVarying, 0};
+    result = v;
+  }
+  return result;
+}
+
+static bool IsFoldableIROp(enum IROp op) {
+  return op == kIRCopy || op == kIRSext || (kIRAdd <= op && op <= kIRNot);
+}
+
+static struct LatticeValue EvaluateInsn(struct IRInsn *insn) {
+  if (insn->op == kIRConst)
+    return (struct LatticeValue){kLatticeConst, insn->imm};
+  if (!IsFoldableIROp(insn->op))
+    return (struct LatticeValue){kLatticeVarying, 0};
+  long operands[2] = {0, 0};
+  for (int s = 0; s < insn->num_of_srcs; s++) {
+    struct LatticeValue v = values[insn->srcs[s]];
+    if (v.state != kLatticeConst) return v;
+    operands[s] = v.value;
+  }
+  long result;
+  if (!FoldIROp(insn->op, insn->type, operands[0], operands[1], &result))
+    return (struct LatticeValue){kLatticeVarying, 0};
+  return (struct LatticeValue){kLatticeConst, result};
+}
+
+static void VisitInsn(struct IRInsn *insn, struct IRBlock *b) {
+  if (insn->op == kIRPhi) {
+    SetValue(insn->dst, EvaluatePhi(insn, b));
+    return;
+  }
+  if (insn->op == kIRJump) {
+    MarkEdgeExecutable(b, insn->targets[0]);
+    return;
+  }
+  if (insn->op == kIRBranch) {
+    struct LatticeValue cond = values[insn->srcs[0]];
+    if (cond.state == kLatticeUndetermined) return;
+    if (cond.state == kLatticeVarying || cond.value)
+      MarkEdgeExecutable(b, insn->targets[0]);
+    if (cond.state == kLatticeVarying || !cond.value)
+      MarkEdgeExecutable(b, insn->targets[1]);
+    return;
+  }
+  if (insn->dst) SetValue(insn->dst, EvaluateInsn(insn));
+}
+
+static void VisitBlock(struct IRBlock *b, bool phis_only) {
+  for (int k = 0; k < b->num_of_insns; k++) {
+    if (phis_only && b->insns[k]->op != kIRPhi) break;
+    VisitInsn(b->insns[k], b);
+  }
+}
+
+static void Propagate(struct IRBlock *entry) {
+  is_block_executable[entry->rpo_index] = true;
+  VisitBlock(entry, false);
+  while (flow_worklist_size || ssa_worklist_size) {
+    if (flow_worklist_size) {
+      struct IRBlock *b = flow_worklist[--flow_worklist_size];
+      bool is_first_visit = !is_block_executable[b->rpo_index];
+      is_block_executable[b->rpo_index] = true;
+      VisitBlock(b, !is_first_visit);
+      continue;
+    }
+    struct UseList *list = &uses[ssa_worklist[--ssa_worklist_size]];
+    for (int i = 0; i < list->size; i++) {
+      if (!is_block_executable[list->blocks[i]->rpo_index]) continue;
+      VisitInsn(list->insns[i], list->blocks[i]);
+    }
+  }
+}
+
+// Moves phis turned into constants after the remaining phis.
+static void SortPhisFirst(struct IRBlock *b) {
+  int num_of_phis = 0;
+  for (int k = 0; k < b->num_of_insns; k++) {
+    if (b->insns[k]->op != kIRPhi) continue;
+    struct IRInsn *phi = b->insns[k];
+    memmove(&b->insns[num_of_phis + 1], &b->insns[num_of_phis],
+            sizeof(struct IRInsn *) * (k - num_of_phis));
+    b->insns[num_of_phis++] = phi;
+  }
+}
+
+static void Rewrite() {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    if (!is_block_executable[b->rpo_index]) continue;
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!insn->dst || insn->op == kIRConst) continue;
+      struct LatticeValue v = values[insn->dst];
+      if (v.state == kLatticeConst) ReplaceIRInsnWithConst(insn, v.value);
+    }
+    SortPhisFirst(b);
+    struct IRInsn *t = GetIRTerminator(b);
+    if (t->op != kIRBranch) continue;
+    struct LatticeValue cond = values[t->srcs[0]];
+    if (cond.state != kLatticeConst) continue;
+    struct IRBlock *taken = t->targets[cond.value ? 0 : 1];
+    struct IRBlock *not_taken = t->targets[cond.value ? 1 : 0];
+    if (taken != not_taken) RemoveIRPhiSrcsFrom(not_taken, b);
+    ReplaceIRTerminatorWithJump(b, taken);
+  }
+}
+
+void RunSCCP(struct IRFunc *f) {
+  func = f;
+  CalcIRDominators(f);
+  int num_of_vregs = f->num_of_vregs;
+  values = calloc(num_of_vregs + 1, sizeof(struct LatticeValue));
+  uses = calloc(num_of_vregs + 1, sizeof(struct UseList));
+  is_block_executable = calloc(f->num_of_blocks, sizeof(bool));
+  is_edge_executable = calloc(f->num_of_blocks, sizeof(bool *));
+  int num_of_edges = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    num_of_edges += f->blocks[i]->num_of_preds;
+  }
+  flow_worklist = malloc(sizeof(struct IRBlock *) * (num_of_edges + 1));
+  assert(values && uses && is_block_executable && is_edge_executable &&
+         flow_worklist);
+  bool *has_def = calloc(num_of_vregs + 1, sizeof(bool));
+  assert(has_def);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    assert(b->rpo_index >= 0);
+    is_edge_executable[b->rpo_index] =
+        calloc(b->num_of_preds + 1, sizeof(bool));
+    assert(is_edge_executable[b->rpo_index]);
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      has_def[insn->dst] = true;
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        AddUse(insn->srcs[s], insn, b);
+      }
+    }
+  }
+  // Vregs without any def are undefined and can be anything.
+  for (int v = 1; v <= num_of_vregs; v++) {
+    if (!has_def[v]) values[v].state = kLatticeVarying;
+  }
+  free(has_def);
+  flow_worklist_size = 0;
+  ssa_worklist_size = 0;
+  Propagate(f->blocks[0]);
+  Rewrite();
+  for (int i = 0; i < f->num_of_blocks; i++) free(is_edge_executable[i]);
+  for (int v = 0; v <= num_of_vregs; v++) {
+    free(uses[v].insns);
+    free(uses[v].blocks);
+  }
+  free(ssa_worklist);
+  ssa_worklist = NULL;
+  ssa_worklist_capacity = 0;
+  free(flow_worklist);
+  free(is_edge_executable);
+  free(is_block_executable);
+  free(uses);
+  free(values);
+  RemoveUnreachableIRBlocks(f);
+}
@@ -0,0 +1,493 @@
+#include "compilium.h"
+
+// SSA form
+//
+// ConvertIRToSSA() gives a new vreg to each def of the vregs which are
+// defined more than once or used across blocks, and places phis at the
+// iterated dominance frontiers of their defs where they are live (pruned
+// SSA). ConvertIRFromSSA() replaces phis by copies at the end of the preds,
+// splitting critical edges.
+
+// Sets rpo_index of the reachable blocks and returns them in reverse
+// postorder. Successors are visited so that the first target of a branch
+// comes first in the order.
+static struct IRBlock **CalcReversePostorder(struct IRFunc *f,
+                                             int *num_of_reachable) {
+  int n = f->num_of_blocks;
+  struct IRBlock **postorder = malloc(sizeof(struct IRBlock *) * n);
+  struct IRBlock **stack = malloc(sizeof(struct IRBlock *) * n);
+  int *num_of_succs_left = malloc(sizeof(int) * n);
+  assert(postorder && stack && num_of_succs_left);
+  for (int i = 0; i < n; i++) f->blocks[i]->rpo_index = -1;
+  int num_of_visited = 0;
+  int sp = 0;
+  f->blocks[0]->rpo_index = 0;
+  stack[sp] = f->blocks[0];
+  num_of_succs_left[sp++] = GetNumOfIRSuccs(f->blocks[0]);
+  while (sp) {
+    struct IRBlock *b = stack[sp - 1];
+    if (!num_of_succs_left[sp - 1]) {
+      postorder[num_of_visited++] = b;
+      sp--;
+      continue;
+    }
+    struct IRBlock *succ = GetIRSucc(b, --num_of_succs_left[sp - 1]);
+    if (succ->rpo_index >= 0) continue;
+    succ->rpo_index = 0;
+    stack[sp] = succ;
+    num_of_succs_left[sp++] = GetNumOfIRSuccs(succ);
+  }
+  for (int i = 0; i < num_of_visited / 2; i++) {
+    struct IRBlock *t = postorder[i];
+    postorder[i] = postorder[num_of_visited - 1 - i];
+    postorder[num_of_visited - 1 - i] = t;
+  }
+  for (int i = 0; i < num_of_visited; i++) postorder[i]->rpo_index = i;
+  free(num_of_succs_left);
+  free(stack);
+  *num_of_reachable = num_of_visited;
+  return postorder;
+}
+
+static struct IRBlock *IntersectDominators(struct IRBlock *a,
+                                           struct IRBlock *b) {
+  while (a != b) {
+    while (a->rpo_index > b->rpo_index) a = a->idom;
+    while (b->rpo_index > a->rpo_index) b = b->idom;
+  }
+  return a;
+}
+
+// Sets dom_pre and dom_post of the reachable blocks to their preorder and
+// postorder numbers in the dominator tree, so that a dominates b iff the
+// interval of a contains that of b.
+static void NumberDominatorTree(struct IRBlock **rpo, int n) {
+  // Children lists of the dominator tree, indexed by rpo_index
+  int *first_child = malloc(sizeof(int) * n);
+  int *next_sibling = malloc(sizeof(int) * n);
+  int *stack = malloc(sizeof(int) * n);
+  assert(first_child && next_sibling && stack);
+  for (int i = 0; i < n; i++) first_child[i] = -1;
+  for (int i = n - 1; i > 0; i--) {
+    int parent = rpo[i]->idom->rpo_index;
+    next_sibling[i] = first_child[parent];
+    first_child[parent] = i;
+  }
+  int clock = 0;
+  int sp = 0;
+  stack[sp++] = 0;
+  rpo[0]->dom_pre = clock++;
+  while (sp) {
+    int i = stack[sp - 1];
+    int child = first_child[i];
+    if (child < 0) {
+      rpo[i]->dom_post = clock++;
+      sp--;
+      continue;
+    }
+    first_child[i] = next_sibling[child];
+    rpo[child]->dom_pre = clock++;
+    stack[sp++] = child;
+  }
+  free(stack);
+  free(next_sibling);
+  free(first_child);
+}
+
+// Computes immediate dominators by the iterative algorithm of Cooper, Harvey
+// and Kennedy. The entry is its own idom.
+void CalcIRDominators(struct IRFunc *f) {
+  CalcIRPreds(f);
+  int n;
+  struct IRBlock **rpo = CalcReversePostorder(f, &n);
+  for (int i = 0; i < f->num_of_blocks; i++) f->blocks[i]->idom = NULL;
+  rpo[0]->idom = rpo[0];
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < n; i++) {
+      struct IRBlock *b = rpo[i];
+      struct IRBlock *new_idom = NULL;
+      for (int k = 0; k < b->num_of_preds; k++) {
+        struct IRBlock *p = b->preds[k];
+        if (!p->idom) continue;
+        new_idom = new_idom ? IntersectDominators(p, new_idom) : p;
+      }
+      if (b->idom == new_idom) continue;
+      b->idom = new_idom;
+      changed = true;
+    }
+  }
+  NumberDominatorTree(rpo, n);
+  free(rpo);
+}
+
+// Returns whether a dominates b in O(1). Blocks which were unreachable or
+// added after CalcIRDominators() dominate nothing but themselves.
+bool DominatesIRBlock(struct IRBlock *a, struct IRBlock *b) {
+  if (a == b) return true;
+  if (!a->idom || !b->idom) return false;
+  return a->dom_pre <= b->dom_pre && b->dom_post <= a->dom_post;
+}
+
+// Dominance frontiers as lists of rpo indices
+struct BlockList {
+  int *indices;
+  int size;
+  int capacity;
+};
+
+static void AddToBlockList(struct BlockList *list, int index) {
+  for (int i = 0; i < list->size; i++) {
+    if (list->indices[i] == index) return;
+  }
+  if (list->size >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 4;
+    list->indices = realloc(list->indices, sizeof(int) * list->capacity);
+    assert(list->indices);
+  }
+  list->indices[list->size++] = index;
+}
+
+static struct BlockList *CalcDominanceFrontiers(struct IRBlock **rpo, int n) {
+  struct BlockList *frontiers = calloc(n, sizeof(struct BlockList));
+  assert(frontiers);
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = rpo[i];
+    if (b->num_of_preds < 2) continue;
+    for (int k = 0; k < b->num_of_preds; k++) {
+      for (struct IRBlock *runner = b->preds[k]; runner != b->idom;
+           runner = runner->idom) {
+        AddToBlockList(&frontiers[runner->rpo_index], i);
+      }
+    }
+  }
+  return frontiers;
+}
+
+#define BITS_PER_WORD 64
+#define WORDS_FOR_BITS(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+static bool IsBitSet(const unsigned long long *bits, int i) {
+  return (bits[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+static void SetBit(unsigned long long *bits, int i) {
+  bits[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+}
+
+// Returns live-in sets of the blocks in rpo order, as bitsets over the
+// indices given by candidate_index.
+static unsigned long long *CalcLiveIns(struct IRBlock **rpo, int n,
+                                       const int *candidate_index,
+                                       int num_of_candidates) {
+  int words = WORDS_FOR_BITS(num_of_candidates);
+  unsigned long long *use = calloc((size_t)n * words, 8);
+  unsigned long long *def = calloc((size_t)n * words, 8);
+  unsigned long long *live_in = calloc((size_t)n * words, 8);
+  assert(use && def && live_in);
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = rpo[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        int c = candidate_index[insn->srcs[s]];
+        if (c >= 0 && !IsBitSet(&def[i * words], c))
+          SetBit(&use[i * words], c);
+      }
+      int c = insn->dst ? candidate_index[insn->dst] : -1;
+      if (c >= 0) SetBit(&def[i * words], c);
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = n - 1; i >= 0; i--) {
+      struct IRBlock *b = rpo[i];
+      for (int w = 0; w < words; w++) {
+        unsigned long long live_out = 0;
+        for (int k = 0; k < GetNumOfIRSuccs(b); k++) {
+          live_out |= live_in[GetIRSucc(b, k)->rpo_index * words + w];
+        }
+        unsigned long long new_live_in =
+            use[i * words + w] | (live_out & ~def[i * words + w]);
+        if (new_live_in == live_in[i * words + w]) continue;
+        live_in[i * words + w] = new_live_in;
+        changed = true;
+      }
+    }
+  }
+  free(use);
+  free(def);
+  return live_in;
+}
+
+// Vregs which are defined more than once or used outside of the block of
+// their def need to be renamed. Returns their indices, or -1 for the others.
+static int *FindRenameCandidates(struct IRFunc *f, struct IRBlock **rpo,
+                                 int n, int *num_of_candidates) {
+  int num_of_vregs = f->num_of_vregs;
+  int *num_of_defs = calloc(num_of_vregs + 1, sizeof(int));
+  int *def_block = malloc(sizeof(int) * (num_of_vregs + 1));
+  bool *is_used_outside = calloc(num_of_vregs + 1, sizeof(bool));
+  int *candidate_index = malloc(sizeof(int) * (num_of_vregs + 1));
+  assert(num_of_defs && def_block && is_used_outside && candidate_index);
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < rpo[i]->num_of_insns; k++) {
+      int dst = rpo[i]->insns[k]->dst;
+      if (!dst) continue;
+      num_of_defs[dst]++;
+      def_block[dst] = i;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < rpo[i]->num_of_insns; k++) {
+      struct IRInsn *insn = rpo[i]->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        int v = insn->srcs[s];
+        if (num_of_defs[v] && def_block[v] != i) is_used_outside[v] = true;
+      }
+    }
+  }
+  *num_of_candidates = 0;
+  for (int v = 0; v <= num_of_vregs; v++) {
+    bool is_candidate =
+        num_of_defs[v] > 1 || (num_of_defs[v] == 1 && is_used_outside[v]);
+    candidate_index[v] = is_candidate ? (*num_of_candidates)++ : -1;
+  }
+  free(num_of_defs);
+  free(def_block);
+  free(is_used_outside);
+  return candidate_index;
+}
+
+static void PlacePhis(struct IRFunc *f, struct IRBlock **rpo, int n,
+                      const int *candidate_index, int num_of_candidates,
+                      int num_of_vregs) {
+  struct BlockList *frontiers = CalcDominanceFrontiers(rpo, n);
+  unsigned long long *live_in =
+      CalcLiveIns(rpo, n, candidate_index, num_of_candidates);
+  int words = WORDS_FOR_BITS(num_of_candidates);
+  // def_blocks[v] lists the blocks which define v.
+  struct BlockList *def_blocks = calloc(num_of_vregs + 1,
+                                        sizeof(struct BlockList));
+  int *has_phi_for = malloc(sizeof(int) * n);
+  int *is_in_worklist_for = malloc(sizeof(int) * n);
+  assert(def_blocks && has_phi_for && is_in_worklist_for);
+  for (int i = 0; i < n; i++) {
+    has_phi_for[i] = -1;
+    is_in_worklist_for[i] = -1;
+    for (int k = 0; k < rpo[i]->num_of_insns; k++) {
+      int dst = rpo[i]->insns[k]->dst;
+      if (dst && candidate_index[dst] >= 0) AddToBlockList(&def_blocks[dst], i);
+    }
+  }
+  for (int v = 1; v <= num_of_vregs; v++) {
+    struct BlockList *worklist = &def_blocks[v];
+    for (int w = 0; w < worklist->size; w++) {
+      is_in_worklist_for[worklist->indices[w]] = v;
+    }
+    for (int w = 0; w < worklist->size; w++) {
+      struct BlockList *frontier = &frontiers[worklist->indices[w]];
+      for (int k = 0; k < frontier->size; k++) {
+        int y = frontier->indices[k];
+        if (has_phi_for[y] == v) continue;
+        if (!IsBitSet(&live_in[y * words], candidate_index[v])) continue;
+        has_phi_for[y] = v;
+        InsertIRInsn(rpo[y], 0, kIRPhi, f->vreg_types[v], v)->imm = v;
+        if (is_in_worklist_for[y] == v) continue;
+        is_in_worklist_for[y] = v;
+        AddToBlockList(worklist, y);
+      }
+    }
+    free(worklist->indices);
+  }
+  for (int i = 0; i < n; i++) free(frontiers[i].indices);
+  free(frontiers);
+  free(def_blocks);
+  free(has_phi_for);
+  free(is_in_worklist_for);
+  free(live_in);
+}
+
+// Current names of the renamed vregs. Defs are logged so that the names can
+// be restored when the walk over the dominator tree leaves a block.
+static int *cur_names;
+static int *name_log;  // pairs of (vreg, previous name)
+static int name_log_size;
+static int name_log_capacity;
+
+static void PushName(int vreg, int name) {
+  if (name_log_size + 2 > name_log_capacity) {
+    name_log_capacity = (name_log_size + 2) * 2;
+    name_log = realloc(name_log, sizeof(int) * name_log_capacity);
+    assert(name_log);
+  }
+  name_log[name_log_size++] = vreg;
+  name_log[name_log_size++] = cur_names[vreg];
+  cur_names[vreg] = name;
+}
+
+static void RestoreNames(int log_size) {
+  while (name_log_size > log_size) {
+    int prev_name = name_log[--name_log_size];
+    int vreg = name_log[--name_log_size];
+    cur_names[vreg] = prev_name;
+  }
+}
+
+static void RenameInBlock(struct IRFunc *f, struct IRBlock *b,
+                          const int *candidate_index, int num_of_vregs) {
+  for (int k = 0; k < b->num_of_insns; k++) {
+    struct IRInsn *insn = b->insns[k];
+    if (insn->op != kIRPhi) {
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        insn->srcs[s] = cur_names[insn->srcs[s]];
+      }
+    }
+    int dst = insn->dst;
+    if (!dst || dst > num_of_vregs || candidate_index[dst] < 0) continue;
+    insn->dst = AllocIRVReg(f, f->vreg_types[dst]);
+    PushName(dst, insn->dst);
+  }
+  for (int k = 0; k < GetNumOfIRSuccs(b); k++) {
+    struct IRBlock *succ = GetIRSucc(b, k);
+    if (k && succ == GetIRSucc(b, 0)) continue;
+    for (int i = 0; i < succ->num_of_insns && succ->insns[i]->op == kIRPhi;
+         i++) {
+      struct IRInsn *phi = succ->insns[i];
+      AddIRPhiSrc(phi, cur_names[phi->imm], b);
+    }
+  }
+}
+
+// Walks the dominator tree in preorder without recursion.
+static void RenameVRegs(struct IRFunc *f, struct IRBlock **rpo, int n,
+                        const int *candidate_index, int num_of_vregs) {
+  int *first_child = malloc(sizeof(int) * n);
+  int *next_sibling = malloc(sizeof(int) * n);
+  struct {
+    int index;
+    int log_size;  // -1 until the block is renamed
+  } *stack = malloc(sizeof(*stack) * n);
+  cur_names = malloc(sizeof(int) * (num_of_vregs + 1));
+  assert(first_child && next_sibling && stack && cur_names);
+  for (int i = 0; i < n; i++) first_child[i] = -1;
+  for (int i = n - 1; i > 0; i--) {
+    int parent = rpo[i]->idom->rpo_index;
+    next_sibling[i] = first_child[parent];
+    first_child[parent] = i;
+  }
+  // Uses without any def see the original vreg, which stays undefined.
+  for (int v = 0; v <= num_of_vregs; v++) cur_names[v] = v;
+  name_log_size = 0;
+  int sp = 0;
+  stack[sp].index = 0;
+  stack[sp++].log_size = -1;
+  while (sp) {
+    int index = stack[sp - 1].index;
+    if (stack[sp - 1].log_size >= 0) {
+      RestoreNames(stack[--sp].log_size);
+      continue;
+    }
+    stack[sp - 1].log_size = name_log_size;
+    RenameInBlock(f, rpo[index], candidate_index, num_of_vregs);
+    for (int c = first_child[index]; c >= 0; c = next_sibling[c]) {
+      stack[sp].index = c;
+      stack[sp++].log_size = -1;
+    }
+  }
+  free(cur_names);
+  free(name_log);
+  name_log = NULL;
+  name_log_capacity = 0;
+  free(stack);
+  free(next_sibling);
+  free(first_child);
+}
+
+void ConvertIRToSSA(struct IRFunc *f) {
+  RemoveUnreachableIRBlocks(f);
+  CalcIRDominators(f);
+  int n;
+  struct IRBlock **rpo = CalcReversePostorder(f, &n);
+  assert(n == f->num_of_blocks);
+  int num_of_vregs = f->num_of_vregs;
+  int num_of_candidates;
+  int *candidate_index = FindRenameCandidates(f, rpo, n, &num_of_candidates);
+  PlacePhis(f, rpo, n, candidate_index, num_of_candidates, num_of_vregs);
+  RenameVRegs(f, rpo, n, candidate_index, num_of_vregs);
+  free(candidate_index);
+  free(rpo);
+}
+
+// Inserts copies which behave as if they were done at once before the
+// terminator of b. Srcs which are overwritten by another copy are saved to
+// temporaries first.
+static void InsertParallelCopies(struct IRFunc *f, struct IRBlock *b,
+                                 int num_of_copies, const int *dsts,
+                                 int *srcs) {
+  int pos = b->num_of_insns - 1;
+  for (int i = 0; i < num_of_copies; i++) {
+    if (dsts[i] == srcs[i]) continue;
+    for (int k = 0; k < num_of_copies; k++) {
+      if (k == i || dsts[k] != srcs[i]) continue;
+      int tmp = AllocIRVReg(f, f->vreg_types[srcs[i]]);
+      AddIRSrc(InsertIRInsn(b, pos++, kIRCopy, f->vreg_types[tmp], tmp),
+               srcs[i]);
+      srcs[i] = tmp;
+      break;
+    }
+  }
+  for (int i = 0; i < num_of_copies; i++) {
+    if (dsts[i] == srcs[i]) continue;
+    AddIRSrc(InsertIRInsn(b, pos++, kIRCopy, f->vreg_types[dsts[i]], dsts[i]),
+             srcs[i]);
+  }
+}
+
+// Places a block on the edge from pred to b just before b.
+static struct IRBlock *SplitIREdge(struct IRFunc *f, struct IRBlock *pred,
+                                   struct IRBlock *b, int index_of_b) {
+  struct IRBlock *e = AllocIRBlock(f);
+  AppendIRInsn(e, kIRJump, kIRTypeNone, 0)->targets[0] = b;
+  struct IRInsn *t = GetIRTerminator(pred);
+  for (int k = 0; k < GetNumOfIRSuccs(pred); k++) {
+    if (t->targets[k] == b) t->targets[k] = e;
+  }
+  InsertIRBlock(f, index_of_b, e);
+  return e;
+}
+
+void ConvertIRFromSSA(struct IRFunc *f) {
+  CalcIRPreds(f);
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    int num_of_phis = 0;
+    while (num_of_phis < b->num_of_insns &&
+           b->insns[num_of_phis]->op == kIRPhi)
+      num_of_phis++;
+    if (!num_of_phis) continue;
+    int *dsts = malloc(sizeof(int) * num_of_phis);
+    int *srcs = malloc(sizeof(int) * num_of_phis);
+    assert(dsts && srcs);
+    for (int p = 0; p < b->num_of_preds; p++) {
+      struct IRBlock *pred = b->preds[p];
+      if (p && pred == b->preds[p - 1]) continue;
+      for (int k = 0; k < num_of_phis; k++) {
+        struct IRInsn *phi = b->insns[k];
+        dsts[k] = phi->dst;
+        srcs[k] = phi->dst;
+        for (int s = 0; s < phi->num_of_srcs; s++) {
+          if (phi->src_blocks[s] == pred) srcs[k] = phi->srcs[s];
+        }
+      }
+      if (GetNumOfIRSuccs(pred) > 1) pred = SplitIREdge(f, pred, b, i++);
+      InsertParallelCopies(f, pred, num_of_phis, dsts, srcs);
+    }
+    free(dsts);
+    free(srcs);
+    while (num_of_phis--) RemoveIRInsn(b, 0);
+  }
+  CalcIRPreds(f);
+}
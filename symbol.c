@@ -1,12 +1,5 @@
 #include "compilium.h"
 
-struct SymbolEntry {
-  enum SymbolType type;
-  struct SymbolEntry *prev;
-  const char *key;
-  struct Node *value;
-};
-
 static void PushSymbol(struct SymbolEntry **prev, struct SymbolEntry *sym) {
   sym->prev = *prev;
   *prev = sym;
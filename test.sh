@@ -1,25 +1,230 @@
 #!/bin/bash -e
 
+# Assembles out.S and runs it. It should return expected, and print
+# expected_stdout if it is given.
+function check_result {
+  expected="$1"
+  testname="$2"
+  gcc out.S || return 1
+  actual=0
+  ./a.out > out.stdout || actual=$?
+  if [ $expected != $actual ]; then
+    echo "FAIL $testname: expected $expected but got $actual"; return 1;
+  fi
+  if [ $# -ge 3 ]; then
+    printf "$3" > expected.stdout
+    diff -u expected.stdout out.stdout || { \
+      echo "FAIL $testname: stdout diff"; return 1; }
+  fi
+  echo "PASS $testname returns $expected"
+}
+
 function test_result {
   input="$1"
   expected="$2"
   expected_stdout="$3"
   testname="$4"
-  printf "$expected_stdout" > expected.stdout
   ./compilium --target-os `uname` <<< "$input" > out.S || { \
     echo "$input" > failcase.c; \
     echo "Compilation failed."; \
     exit 1; }
-  gcc out.S
-  actual=0
-  ./a.out > out.stdout || actual=$?
-  if [ $expected = $actual ]; then
-      diff -u expected.stdout out.stdout \
-        && echo "PASS $testname returns $expected" \
-        || { echo "FAIL $testname: stdout diff"; exit 1; }
-  else
-    echo "FAIL $testname: expected $expected but got $actual"; echo $input > failcase.c; exit 1; 
+  check_result $expected "$testname" "$expected_stdout" || { \
+    echo "$input" > failcase.c; exit 1; }
+}
+
+function test_pch_result {
+  header="$1"
+  input="$2"
+  expected="$3"
+  expected_stdout="$4"
+  ./compilium --target-os `uname` --emit-pch prefix.pch <<< "$header" \
+    > /dev/null || { echo "$header" > failcase.c; echo "PCH emission failed."; exit 1; }
+  ./compilium --target-os `uname` --include-pch prefix.pch <<< "$input" \
+    > out.S || { echo "$input" > failcase.c; echo "Compilation failed."; exit 1; }
+  rm prefix.pch
+  check_result $expected "(pch) $input" "$expected_stdout"
+}
+
+# Breaks the image emitted for header with break_cmd, which edits prefix.pch.
+# The image should be ignored with a warning, and input compiled without it.
+function test_bad_pch_result {
+  header="$1"
+  input="$2"
+  expected="$3"
+  break_cmd="$4"
+  ./compilium --target-os `uname` --emit-pch prefix.pch <<< "$header" \
+    > /dev/null 2> /dev/null || { echo "PCH emission failed."; exit 1; }
+  eval "$break_cmd"
+  ./compilium --target-os `uname` --include-pch prefix.pch <<< "$input" \
+    > out.S 2> out.stderr || { echo "$input" > failcase.c; \
+    echo "FAIL (bad pch) $break_cmd: Compilation failed."; exit 1; }
+  rm prefix.pch
+  grep -q "PCH: ignoring prefix.pch" out.stderr || { \
+    echo "FAIL (bad pch) $break_cmd: no warning"; exit 1; }
+  rm out.stderr
+  check_result $expected "(bad pch) $break_cmd"
+}
+
+# Compiles with a small C stack so that deep recursion in the compiler fails
+function test_small_stack_result {
+  input="$1"
+  expected="$2"
+  testname="$3"
+  ( ulimit -s 512; ./compilium --target-os `uname` <<< "$input" > out.S 2> /dev/null ) || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed."; \
+    exit 1; }
+  check_result $expected "$testname"
+}
+
+# Compiles within a time limit so that superlinear passes fail
+function test_time_limit_result {
+  input="$1"
+  expected="$2"
+  seconds="$3"
+  testname="$4"
+  timeout $seconds ./compilium --target-os `uname` <<< "$input" > out.S || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed or took over $seconds s."; \
+    exit 1; }
+  check_result $expected "$testname"
+}
+
+# Vector insns in the IR dump should come after the branch on has_avx2, so
+# that each of them runs only on the path which the check selects
+function test_avx2_dispatch_result {
+  input="$1"
+  expected="$2"
+  testname="$3"
+  ./compilium --target-os `uname` --dump=ir <<< "$input" > out.S \
+    2> out.stderr || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed."; \
+    exit 1; }
+  awk '/^function/ { is_dispatched = 0 }
+       /= has_avx2/ { is_checking = 1; num_of_checks++ }
+       /:i(8|32)x[0-9]+ =|\.i(8|32)x[0-9]+ / && (is_checking || !is_dispatched) {
+         print "line " NR ": " $0; bad = 1 }
+       /^  br / && is_checking { is_checking = 0; is_dispatched = 1 }
+       END { exit bad || !num_of_checks }' out.stderr || { \
+    echo "FAIL $testname: vector insns before the branch on has_avx2"; \
+    exit 1; }
+  rm out.stderr
+  check_result $expected "$testname"
+}
+
+# AVX insns, including vzeroupper, should be only on the AVX2 path: after the
+# cpuid check and up to the vzeroupper at the end of the AVX2 loop
+function test_avx2_path_result {
+  input="$1"
+  expected="$2"
+  testname="$3"
+  ./compilium --target-os `uname` <<< "$input" > out.S || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed."; \
+    exit 1; }
+  awk '/cpuid/ { on_avx2_path = 1 }
+       /ymm|^v/ && !on_avx2_path { print "line " NR ": " $0; bad = 1 }
+       /^vzeroupper/ { on_avx2_path = 0; num_of_exits++ }
+       END { exit bad || !num_of_exits }' out.S || { \
+    echo "FAIL $testname: AVX insns outside of the AVX2 path"; exit 1; }
+  check_result $expected "$testname"
+}
+
+# Output should not depend on the number of parser threads
+function test_parse_threads_result {
+  input="$1"
+  expected="$2"
+  testname="$3"
+  ./compilium --target-os `uname` --parse-threads 1 <<< "$input" > out1.S && \
+  ./compilium --target-os `uname` --parse-threads 8 <<< "$input" > out.S || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed."; \
+    exit 1; }
+  diff -u out1.S out.S > /dev/null || { \
+    echo "FAIL $testname: output differs between parser threads"; exit 1; }
+  rm out1.S
+  check_result $expected "$testname"
+}
+
+# Compiles base then modified with the same cache. The result should be the
+# same as compiling modified from scratch. If headers are given, each version
+# is compiled with the PCH emitted for its header.
+function test_incremental_result {
+  base="$1"
+  modified="$2"
+  expected="$3"
+  expected_reused="$4"
+  testname="$5"
+  base_flags="$6"
+  modified_flags="$7"
+  base_header="$8"
+  modified_header="$9"
+  rm -f incremental.cache
+  if [ -n "$base_header" ]; then
+    ./compilium --target-os `uname` --emit-pch prefix.pch \
+      <<< "$base_header" > /dev/null 2> /dev/null
+    base_flags="$base_flags --include-pch prefix.pch"
+  fi
+  ./compilium --target-os `uname` --incremental-cache incremental.cache \
+    $base_flags <<< "$base" > /dev/null 2> /dev/null || { \
+    echo "FAIL $testname: Compilation failed."; exit 1; }
+  if [ -n "$modified_header" ]; then
+    ./compilium --target-os `uname` --emit-pch prefix.pch \
+      <<< "$modified_header" > /dev/null 2> /dev/null
+    modified_flags="$modified_flags --include-pch prefix.pch"
   fi
+  ./compilium --target-os `uname` --incremental-cache incremental.cache \
+    $modified_flags <<< "$modified" > out.S 2> out.stderr || { \
+    echo "FAIL $testname: Incremental compilation failed."; exit 1; }
+  ./compilium --target-os `uname` $modified_flags <<< "$modified" > out1.S \
+    2> /dev/null
+  rm -f incremental.cache prefix.pch
+  grep -q "reused $expected_reused of" out.stderr || { \
+    echo "FAIL $testname: expected $expected_reused functions reused"; \
+    grep "reused" out.stderr; exit 1; }
+  diff -u out1.S out.S > /dev/null || { \
+    echo "FAIL $testname: output differs from a full compilation"; exit 1; }
+  rm out1.S out.stderr
+  check_result $expected "$testname"
+}
+
+# Compiles with the IR dump. The dump should contain the expected lines, and
+# should not contain the ones prefixed with '!'. Lines prefixed with 'N*'
+# should appear exactly N times. For lines of the form 'a << b', the first
+# line containing a should come before the first line containing b.
+function test_ir_dump_result {
+  input="$1"
+  expected="$2"
+  expected_ir="$3"
+  testname="$4"
+  flags="$5"
+  ./compilium --target-os `uname` --dump=ir $flags <<< "$input" > out.S \
+    2> out.stderr || { \
+    echo "$input" > failcase.c; \
+    echo "FAIL $testname: Compilation failed."; \
+    exit 1; }
+  while read -r line; do
+    if [ "${line:0:1}" = "!" ]; then
+      ! grep -qF -- "${line:1}" out.stderr || { \
+        echo "FAIL $testname: IR dump contains: ${line:1}"; exit 1; }
+    elif [[ "$line" == *" << "* ]]; then
+      first=`grep -nF -- "${line%% << *}" out.stderr | head -1 | cut -d: -f1`
+      second=`grep -nF -- "${line#* << }" out.stderr | head -1 | cut -d: -f1`
+      [ -n "$first" ] && [ -n "$second" ] && [ "$first" -lt "$second" ] || { \
+        echo "FAIL $testname: IR dump is not in the order: $line"; exit 1; }
+    elif [[ "$line" =~ ^([0-9]+)\*(.*)$ ]]; then
+      count=`grep -cF -- "${BASH_REMATCH[2]}" out.stderr`
+      [ "$count" = "${BASH_REMATCH[1]}" ] || { \
+        echo "FAIL $testname: IR dump contains $count of: ${BASH_REMATCH[2]}"; \
+        exit 1; }
+    else
+      grep -qF -- "$line" out.stderr || { \
+        echo "FAIL $testname: IR dump does not contain: $line"; exit 1; }
+    fi
+  done <<< "$expected_ir"
+  rm out.stderr
+  check_result $expected "$testname"
 }
 
 function test_expr_result {
@@ -172,4 +377,993 @@ test_expr_result '1 - -2' 3
 test_stmt_result '; ; return 0;' 0
 test_stmt_result '; return 2; return 0;' 2
 
+# Expressions which need more registers than available are spilled
+test_expr_result '1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+13)))))))))))' 91
+test_expr_result '(1+(2+(3+(4+(5+(6+(7+8))))))) * (1+(2+(3+(4+(5+(6+(7+8)))))))' 16
+
+# Operands which need more registers are evaluated first
+test_expr_result '1-(2-(3-(4-(5-(6-(7-(8-(9-(10-(11-12))))))))))' 250
+test_expr_result '3 < (1+(2+3))' 1
+test_expr_result '(1+(2+3)) < 3' 0
+test_expr_result '3 >= (1+(2+3))' 0
+test_expr_result '10 / (1+(1+(1+2)))' 2
+test_expr_result '100 % (3*(1+(2+(3+4))))' 10
+test_expr_result '1 << (1+(1+1))' 8
+test_src_result "`cat << EOS
+int f(int a, int b, int c) { return a * 100 + b * 10 + c; }
+int main() {
+  int a[3];
+  a[0] = 1;
+  a[1] = 2;
+  a[2] = 3;
+  return f(a[0], a[(a[0]+(a[1]-a[2]))+1] * (1+(1+1)) - 4, a[2]) - a[a[1]-1];
+}
+EOS
+`" 121 ""
+
+# Values live across calls survive
+test_src_result "`cat << EOS
+int f(int a, int b) { return a * 10 + b; }
+int main() {
+  int x;
+  x = 1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+13)))))))))));
+  return x + f(x, 2) - f(1+(2+(3+(4+(5+(6+(7+(8+(9+(10+(11+(12+13))))))))))), x);
+}
+EOS
+`" 2 ""
+
+test_src_result "`cat << EOS
+int id(int x) { return x; }
+int f(int a, int b, int c, int d, int e, int g) {
+  return a + b * 2 + c * 3 + d * 4 + e * 5 + g * 6;
+}
+int main() {
+  return f(id(1), id(2), id(3), id(4), id(5),
+           f(id(1), id(1), id(1), id(1), id(1), id(1)));
+}
+EOS
+`" 181 ""
+
+# Args beyond the param regs are passed on the stack
+test_src_result "`cat << EOS
+int f(int a, int b, int c, int d, int e, int x, int y, int z) {
+  return a + b * 2 + c * 3 + d * 4 + e * 5 + x * 6 + y * 7 + z * 8;
+}
+int g(int a, int b, int c, int d, int e, int x, int y) {
+  return f(y, f(a, b, c, d, e, x, y, 0) - 139, a, b, c, d, e, x) - 132;
+}
+int main() {
+  return g(1, 2, 3, 4, 5, 6, 7);
+}
+EOS
+`" 10 ""
+
+# Args are moved to param regs at once
+test_src_result "`cat << EOS
+int sub(int a, int b) { return a - b; }
+int swap(int a, int b) { return sub(b, a); }
+int c(char x) { return x; }
+int main() {
+  return swap(3, 10) * 10 + c(2);
+}
+EOS
+`" 72 ""
+
+# Locals whose address is not taken are kept in registers
+test_src_result "`cat << EOS
+int inc(int *p) { *p = *p + 1; return 0; }
+int main() {
+  int a;
+  int b;
+  char c;
+  int *p;
+  int i;
+  a = 7;
+  b = 3;
+  c = 120;
+  c += 10;
+  b *= a;
+  b -= 1;
+  b /= 3;
+  b %= 4;
+  b <<= 3;
+  b >>= 1;
+  p = &a;
+  inc(p);
+  for (i = 0; i < 5; i++) a += i;
+  return a + b + (c + 126) + (i == 5);
+}
+EOS
+`" 27 ""
+test_src_result "`cat << EOS
+int main() {
+  int x;
+  x = 2147483647;
+  x += 1;
+  return x < 0;
+}
+EOS
+`" 1 ""
+
+# Constant exprs are folded before code generation.
+test_expr_result '(3 + 4) * 2 - 10 / 5 + (1 << 3) % 5 + sizeof(1) + !0' 20
+test_expr_result "-(-2) + ~0 + (7 > 3) * 10 + ('a' == 97) + (1 ? 4 : 1/0)" 16
+test_expr_result '(0 && 1 / 0) + (1 || 1 / 0) + (2 && 3) + (0 || 0)' 2
+test_expr_result '-2147483647 - 1 < 0' 1
+test_stmt_result 'int x; x = 5; return x * 1 + x * 0 + (x - x) + (0 + x) + (x << 0);' 15
+test_stmt_result 'char c; c = 127; return (c + 0) + (c * 1) - (c ^ c);' 254
+test_stmt_result 'int x; x = 3; if (!!x) return !!(x > 2) + !!x; return 9;' 2
+
+# Members of struct locals which do not escape are kept in registers
+test_src_result "`cat << EOS
+struct Range {
+  int begin;
+  char step;
+  int *p;
+  int end;
+};
+int main() {
+  struct Range r;
+  struct Range e;
+  int i;
+  int s;
+  int *q;
+  r.begin = 2;
+  r.end = 7;
+  r.step = 1;
+  r.p = &s;
+  s = 0;
+  for (i = r.begin; i < r.end; i += r.step) *r.p += i;
+  e.begin = s;
+  q = &e.end;
+  *q = 5;
+  return e.begin + e.end;
+}
+EOS
+`" 25 ""
+
+# long generated code must not depend on the depth of the C stack
+test_small_stack_result "int main(){return `printf '1+%.0s' {1..20000}`0;}" \
+  32 "20000 terms of left-assoc chain"
+test_small_stack_result "`
+  echo 'int f(int v) {'
+  echo '  if (v == 0) return 0;'
+  for i in {1..5000}; do echo "  else if (v == $i) return $i;"; done
+  echo '  else return 255;'
+  echo '}'
+  echo 'int main() { return f(4999); }'
+`" 135 "5000 else-if chain"
+
+# precompiled header
+test_pch_result "`cat << EOS
+int puts(char *s);
+struct Pair {
+  int a;
+  int b;
+};
+EOS
+`" "`cat << EOS
+int main() {
+  struct Pair p;
+  p.a = 3;
+  p.b = 4;
+  puts("pch");
+  return p.a + p.b + sizeof(p);
+}
+EOS
+`" 15 'pch\n'
+
+bad_pch_header="`cat << EOS
+int puts(char *s);
+struct Pair { int a; int b; };
+EOS
+`"
+bad_pch_input="`cat << EOS
+struct Pair { int a; int b; };
+int main() { struct Pair p; p.a = 3; p.b = 4; return p.a + p.b; }
+EOS
+`"
+test_bad_pch_result "$bad_pch_header" "$bad_pch_input" 7 \
+  'head -c 100 prefix.pch > bad.pch && mv bad.pch prefix.pch'
+test_bad_pch_result "$bad_pch_header" "$bad_pch_input" 7 \
+  'head -c 512 /dev/zero | tr "\\0" "\\377" | \
+   dd of=prefix.pch bs=1 seek=64 conv=notrunc 2> /dev/null'
+test_bad_pch_result "$bad_pch_header" "$bad_pch_input" 7 \
+  'printf "XPCH" | dd of=prefix.pch bs=1 conv=notrunc 2> /dev/null'
+
+test_parse_threads_result "`
+  for i in {0..199}; do
+    echo "int f$i(int a) { int b; b = a + $i; if (b > 100) { return b - 100; } return b; }"
+  done
+  echo 'struct Pair { int a; int b; };'
+  echo 'int main() { struct Pair p; p.a = 1; p.b = 92; return f199(f7(p.a) + p.b); }'
+`" 199 "200 funcs with 8 parser threads"
+
+# Only g changes. h refers to the struct, which does not change.
+test_incremental_result "`cat << EOS
+struct Pair { int a; int b; };
+int f(int a) { return a + 1; }
+__attribute__((noinline))
+int g(int a) { return a * 2; }
+int h() { struct Pair p; p.a = 3; return p.a; }
+int main() { return g(f(h())); }
+EOS
+`" "`cat << EOS
+struct Pair { int a; int b; };
+int f(int a) { return a + 1; }
+__attribute__((noinline))
+int g(int a) { if (a > 3) { return a * 3; } return a * 2; }
+int h() { struct Pair p; p.a = 3; return p.a; }
+int main() { return g(f(h())); }
+EOS
+`" 12 3 "incremental rebuild of a changed function"
+
+# Changing the struct invalidates its users.
+test_incremental_result "`cat << EOS
+int puts(char *s);
+struct Pair { int a; int b; };
+__attribute__((noinline)) int h() { struct Pair p; p.b = 5; return p.b; }
+int main() { puts("inc"); return h(); }
+EOS
+`" "`cat << EOS
+int puts(char *s);
+struct Pair { int b; int a; };
+__attribute__((noinline)) int h() { struct Pair p; p.b = 5; return p.b; }
+int main() { puts("inc"); return h(); }
+EOS
+`" 5 1 "incremental rebuild of struct users"
+
+test_ir_dump_result "`cat << EOS
+__attribute__((noinline))
+int f(int a) { if (a > 3) { return a * 3; } return a; }
+int main() { return f(5); }
+EOS
+`" 15 "`cat << EOS
+function f
+= param 0
+= cmp_gt
+= mul
+function main
+= call
+EOS
+`" "IR dump"
+
+test_ir_dump_result "`cat << EOS
+int puts(char *s);
+int main() {
+  int size;
+  int mask;
+  int i;
+  size = 32;
+  mask = size - 1;
+  if (0) puts("never");
+  for (i = 0; i < 0; i++) puts("never");
+  if (mask == 31) return mask + 1;
+  return 3;
+}
+EOS
+`" 32 "`cat << EOS
+= const 32
+!br
+!str_addr
+!= call
+EOS
+`" "constants propagated through vars and branches"
+
+test_ir_dump_result "`cat << EOS
+int f(int x) { char c; return (x + 0) * (3 * 4 + 1) + x * 0 + (sizeof(c) - 1); }
+int main() { return f(2); }
+EOS
+`" 26 "`cat << EOS
+= const 13
+= mul
+!= add
+!= sub
+EOS
+`" "constant exprs folded in the AST"
+
+test_ir_dump_result "`cat << EOS
+int f(int a) {
+  int x;
+  int arr[2];
+  a * 3;
+  a + 1 == 2;
+  arr[0] = a;
+  arr[1] = 5;
+  arr[1] = a + 8;
+  x = 9;
+  *&x = arr[0] + 1;
+  return arr[1] + *&x;
+  a = a / 0;
+}
+int main() { return f(2); }
+EOS
+`" 13 "`cat << EOS
+!store
+!= load
+!= mul
+!= cmp_eq
+!= div
+!const 5
+!const 9
+EOS
+`" "dead code and dead stores removed"
+
+test_ir_dump_result "`cat << EOS
+int f(int a, int b) {
+  if (a > 1 && b > 2) return 1;
+  else if (a == 0 || b == 0) return 2;
+  else {}
+  return 3;
+}
+int main() { return f(2, 3) * 100 + f(0, 5) * 10 + f(1, 1); }
+EOS
+`" 123 "`cat << EOS
+function f
+!jmp
+EOS
+`" "branches threaded through && and ||"
+
+test_ir_dump_result "`cat << EOS
+int putchar(int c);
+__attribute__((noinline))
+int f(int *p, int y, int x) {
+  int m[4][4];
+  m[y][x] = *p + 1;
+  int s;
+  s = m[y][x] + (y * 4 + x) * (x + y * 4) + *p;
+  putchar(s + 35);
+  return s + m[y][x];
+}
+int main() { int v; v = 3; putchar(10); return f(&v, 2, 1); }
+EOS
+`" 92 "`cat << EOS
+2*= load %1
+3*= load
+2*i32 = mul
+EOS
+`" "common subexprs and loads reused"
+
+test_ir_dump_result "`cat << EOS
+int f(int n, int size) {
+  int t[2];
+  int m[4][8];
+  int i;
+  int j;
+  int s;
+  t[1] = 5;
+  s = 0;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < size - 1; j++) {
+      m[i][j] = t[1] + (size - 1) * 3;
+      s = s + m[i][j] + size / 2;
+    }
+  }
+  return s;
+}
+int main() { return f(2, 4); }
+EOS
+`" 96 "`cat << EOS
+i32 = mul << cmp_lt
+= div << cmp_lt
+= load << cmp_lt
+EOS
+`" "loop invariants hoisted out of nested loops"
+
+test_ir_dump_result "`cat << EOS
+int f(int *p, int *q, int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i + 1 <= *p; i++) s = s + 2;
+  for (i = 0; i < n - 4; i++) s = s + 100 / (n - 4);
+  for (i = 0; i < n; i++) {
+    s = s + *p;
+    *q = i;
+  }
+  return s;
+}
+int main() { int v; v = 3; return f(&v, &v, 4); }
+EOS
+`" 12 "`cat << EOS
+= load << = add
+EOS
+`" "loads hoisted only if not clobbered"
+
+test_ir_dump_result "`cat << EOS
+int f() {
+  int a[16];
+  int b[16];
+  int m[4][8];
+  int i;
+  int j;
+  for (i = 0; i < 16; i++) a[i] = i * 3;
+  for (i = 0; i < 16; i++) b[i] = a[i];
+  for (i = 0; i < 4; i++)
+    for (j = 0; j < 8; j++) m[i][j] = a[j];
+  return m[3][7] + b[5] + b[15];
+}
+int main() { return f(); }
+EOS
+`" 81 "`cat << EOS
+!= mul
+!= sext
+EOS
+`" "array indexing in loops reduced to pointer bumps"
+
+test_result "`cat << EOS
+int putchar(int c);
+int g(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i = i + 2) s = s + i * 5;
+  return s + i;
+}
+int f(int n) {
+  int a[16];
+  char c[8];
+  int i;
+  int s;
+  for (i = 15; i >= 0; i = i - 1) a[i] = i * 2 + 1;
+  s = 0;
+  for (i = 15; i >= 0; i = i - 1) s = s + a[i] * (i + 1);
+  for (i = 0; i < 8; i++) c[i] = 'a' + i;
+  for (i = 0; i < 8; i++) putchar(c[i]);
+  for (i = 1; i <= n; i++) s = s + a[i - 1];
+  i = 0;
+  while (i < 16) {
+    s = s - a[i];
+    i = i + 3;
+  }
+  return s + i;
+}
+int main() { return (f(5) + g(7)) % 256; }
+EOS
+`" 55 "abcdefgh" "induction vars with other steps and uses"
+
+# The value from the latch is a const, not a step from the phi.
+test_result "`cat << EOS
+int f(int n) {
+  int x;
+  int i;
+  x = n;
+  for (i = 0; i < n; i++) {
+    x = 5;
+  }
+  return x;
+}
+int main() { return f(3); }
+EOS
+`" 5 "" "loop phis assigned a const"
+
+test_ir_dump_result "`cat << EOS
+int f(int x) {
+  int a[4];
+  int i;
+  int s;
+  for (i = 0; i < 4; i++) a[i] = x + i;
+  s = 0;
+  for (i = 3; i >= 0; i = i - 1) s = s * 2 + a[i];
+  return s;
+}
+int main() { return f(5); }
+EOS
+`" 109 "`cat << EOS
+!br %
+!cmp_
+EOS
+`" "small const trip count loops fully unrolled"
+
+test_ir_dump_result "`cat << EOS
+__attribute__((noinline))
+int f(int n) {
+  int a[16];
+  int i;
+  int s;
+  for (i = 0; i < 16; i++) a[i] = i + 1;
+  s = 0;
+  for (i = 0; i < n; i++) s = s + a[i] * i;
+  return s;
+}
+int main() {
+  int n;
+  int t;
+  t = 0;
+  for (n = 0; n <= 16; n++) t = t + f(n) * n;
+  return t % 256;
+}
+EOS
+`" 144 "`cat << EOS
+5*= load
+EOS
+`" "loops unrolled with remainder loops"
+
+test_ir_dump_result "`cat << EOS
+__attribute__((noinline))
+int f(int n) {
+  int i;
+  int s;
+  s = 0;
+#pragma unroll(3)
+  for (i = 0; i < n; i++) s = s + i * i;
+  return s;
+}
+__attribute__((noinline))
+int g() {
+  int i;
+  int s;
+  s = 0;
+  #pragma unroll // fully, beyond the default budget
+  for (i = 0; i < 40; i++) s = s + i * i;
+  return s;
+}
+__attribute__((noinline))
+int h(int x) {
+  int i;
+  i = 0;
+#pragma unroll(1)
+  while (i < 2) {
+    x = x * x + 1;
+    i++;
+  }
+  return x;
+}
+int main() { return (f(10) + g() + h(1)) % 256; }
+EOS
+`" 94 "`cat << EOS
+5*= mul
+3*br %
+= const 20540
+EOS
+`" "loops unrolled by pragma"
+
+test_incremental_result "`cat << EOS
+__attribute__((noinline))
+int f() {
+  int i;
+  int s;
+  s = 0;
+#pragma unroll(1)
+  for (i = 0; i < 4; i++) s = s + i;
+  return s;
+}
+int main() { return f(); }
+EOS
+`" "`cat << EOS
+__attribute__((noinline))
+int f() {
+  int i;
+  int s;
+  s = 0;
+#pragma unroll(2)
+  for (i = 0; i < 4; i++) s = s + i;
+  return s;
+}
+int main() { return f(); }
+EOS
+`" 6 1 "incremental rebuild of a changed pragma"
+
+test_ir_dump_result "`cat << EOS
+int add(int *a, int *b, int *c, int n) {
+  int i;
+  for (i = 0; i < n; i++) *(c + i * 4) = *(a + i * 4) + *(b + i * 4) * 3;
+  return 0;
+}
+int main() {
+  int x[40];
+  int y[40];
+  int i;
+  int s;
+  for (i = 0; i < 40; i++) {
+    x[i] = i;
+    y[i] = i - 20;
+  }
+  add(x, y, y, 37); // in place
+  add(x, y, x + 4, 30); // overlapping, runs the scalar loop
+  s = 0;
+  for (i = 0; i < 40; i++) s = s + x[i] * (i + 1) - y[i];
+  return s % 256;
+}
+EOS
+`" 118 "`cat << EOS
+has_avx2
+i32x8 = load
+i32x8 = mul
+store.i32x8
+store.i32x4
+store.i32x8 << store.i32x4
+EOS
+`" "loops over arrays vectorized for AVX2 and SSE2"
+
+test_ir_dump_result "`cat << EOS
+int min(char *p, int n) {
+  int i;
+  char m;
+  m = 127;
+  for (i = 0; i < n; i++) m = *(p + i) < m ? *(p + i) : m;
+  return m;
+}
+int main() {
+  char c[100];
+  int a[64];
+  int i;
+  int s;
+  for (i = 0; i < 100; i++) c[i] = i * 37 % 101 - 50;
+  for (i = 0; i < 64; i++) a[i] = i * 29 % 61;
+  s = 0;
+  for (i = 0; i < 64; i++) {
+    if (a[i] > s) s = a[i];
+  }
+  for (i = 0; i < 63; i++) a[i] = a[i + 1] - a[i]; // not vectorized
+  return s + a[62] + a[0] - min(c, 100);
+}
+EOS
+`" 168 "`cat << EOS
+i8x32 = min
+i8x16 = min
+reduce_min
+i32x8 = max
+reduce_max
+1*i32x8 = load
+EOS
+`" "reductions vectorized"
+
+test_ir_dump_result "`cat << EOS
+int main() {
+  int a[64][64];
+  int b[64][64];
+  int i;
+  int j;
+  int s;
+  for (i = 0; i < 64; i++) {
+    for (j = 0; j < 64; j++) b[i][j] = i * 3 + j;
+  }
+  for (i = 0; i < 64; i++) {
+    for (j = 0; j < 64; j++) a[j][i] = b[j][i] * 5;
+  }
+  for (i = 1; i < 64; i++) {
+    for (j = 0; j < 63; j++) b[j][i] = b[j + 1][i - 1] + 1; // not interchanged
+  }
+  s = 0;
+  for (i = 0; i < 64; i++) {
+    for (j = 0; j < 64; j++) s = s + a[i][j] * (j + 1) + b[j][i];
+  }
+  return s % 251;
+}
+EOS
+`" 233 "`cat << EOS
+i32x8 = load
+store.i32x8
+EOS
+`" "loop nests interchanged"
+
+test_ir_dump_result "`cat << EOS
+int main() {
+  char a[512][512];
+  char b[512][512];
+  int i;
+  int j;
+  int s;
+  for (i = 0; i < 512; i++) {
+    for (j = 0; j < 512; j++) a[i][j] = i * 7 + j;
+  }
+  for (i = 0; i < 512; i++) {
+    for (j = 0; j < 512; j++) b[j][i] = a[i][j];
+  }
+  s = 0;
+  for (i = 0; i < 512; i++) s = s + b[i][i * 3 % 512] * i;
+  return s % 251;
+}
+EOS
+`" 220 "`cat << EOS
+i32 = const 128
+i64 = const 65536
+EOS
+`" "loop nests tiled"
+
+test_ir_dump_result "`cat << EOS
+__attribute__((noinline))
+int sum(int *a, int n) {
+  int i;
+  int s;
+  s = 0;
+#pragma prefetch(8)
+  for (i = 0; i < n; i++) s = s + *(a + i * 256) + *(a + i * 256 + 4);
+  return s;
+}
+__attribute__((noinline))
+int copy(char *p, char *q, int n) {
+  int i;
+#pragma prefetch
+  for (i = n - 1; i >= 0; i = i - 1) *(p + i) = *(q + i * 2) + 1;
+  return 0;
+}
+int main() {
+  int a[1024];
+  char p[64];
+  char q[128];
+  int i;
+  for (i = 0; i < 1024; i++) a[i] = i;
+  for (i = 0; i < 128; i++) q[i] = i;
+  copy(p, q, 64);
+  return (sum(a, 4) + p[63] + p[10]) % 256;
+}
+EOS
+`" 152 "`cat << EOS
+6*prefetch.t0
+= const 2048
+2*= const -64
+EOS
+`" "loops prefetched by pragma"
+
+test_ir_dump_result "`cat << EOS
+__attribute__((noinline))
+int f(int *a, int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) s = s + *(a + i * 64) * i;
+  return s;
+}
+__attribute__((noinline))
+int g(int *a, int n) {
+  int i;
+  int s;
+  s = 0;
+#pragma prefetch(0)
+  for (i = 0; i < n; i++) s = s + *(a + i * 64);
+  return s;
+}
+int main() {
+  int a[512];
+  int i;
+  for (i = 0; i < 512; i++) a[i] = i;
+  return (f(a, 30) + g(a, 30)) % 256;
+}
+EOS
+`" 224 "`cat << EOS
+function f << prefetch.t0
+5*prefetch.t0
+EOS
+`" "loops prefetched by --prefetch" --prefetch
+
+test_ir_dump_result "`cat << EOS
+int puts(char *s);
+int clamp(int x, int lo, int hi) {
+  if (x < lo) return lo;
+  if (x > hi) return hi;
+  return x;
+}
+void report(int *p, int v) {
+  if (v > 3) {
+    *p = v;
+    return;
+  }
+  puts("small");
+  *p = 0;
+}
+inline int poly(int x) {
+  int y;
+  y = x * x * x + 2 * x * x + 3 * x + 4;
+  y = y * x + (y >> 1) + (y & 7) + (y | 3);
+  return y % 101;
+}
+__attribute__((always_inline)) int sum(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) {
+    s = s + i * i + (i & 3) * (i | 5) + (i ^ 9);
+    s = s + (s >> 3) * 7 + (i * 2 - n) * (i + n);
+    s = s % 10007 + (s & 15) * (n - i) + (s | 1) * 3;
+    s = s % 10007;
+  }
+  return s;
+}
+__attribute__((noinline)) int kept(int x) { return x + 1; }
+int main() {
+  int v;
+  int s;
+  report(&v, 5);
+  s = clamp(v * 50, 0, 200) + poly(v) + sum(20) + kept(4);
+  report(&v, 1);
+  return (s + v) % 256;
+}
+EOS
+`" 15 "`cat << EOS
+!sym_addr clamp
+!sym_addr report
+!sym_addr poly
+!sym_addr sum
+sym_addr kept
+2*sym_addr puts
+EOS
+`" "functions inlined with a cost model"
+
+# Only main changes. The functions which it may inline are generated again
+# for inlining, but their code is reused.
+test_incremental_result "`cat << EOS
+int f(int a) { return a * 2; }
+int g(int a) { return f(a) + 1; }
+int main() { return g(3); }
+EOS
+`" "`cat << EOS
+int f(int a) { return a * 2; }
+int g(int a) { return f(a) + 1; }
+int main() { return g(4); }
+EOS
+`" 9 2 "incremental rebuild of a caller of inlined functions"
+
+# Every statement kind the parser dispatches on its first token, and
+# declarations led by each decl-spec keyword including a struct tag.
+test_result "`cat << EOS
+struct P { int x; char y; };
+int add(int a, int b) { return a + b; }
+int main() {
+  int n;
+  char c;
+  struct P p;
+  void *q;
+  n = 0;
+  add(n, 1);
+  ;
+  if (n) n = 100; else n = 2;
+  for (int i = 0; i < 3; i = i + 1) n = n + i;
+  while (n < 10) { n = n + 1; }
+  {
+    struct P r;
+    r.x = n;
+    p.x = r.x;
+  }
+  c = 3;
+  p.y = c;
+  q = &p;
+  return add(p.x, p.y) + (q != 0);
+}
+EOS
+`" 14 "" "statements and declarations dispatched on their first token"
+
+# Dominance queries of the loop passes must not walk the idom chain
+test_time_limit_result "`
+  echo 'int f(int v) {'
+  echo '  if (v == 0) return 0;'
+  for i in {1..8000}; do echo "  else if (v == $i) return $i;"; done
+  echo '  else return 255;'
+  echo '}'
+  echo 'int main() { return f(7999); }'
+`" 63 4 "8000 else-if chain within 4 s"
+
+# Broadcasts of vars invariant in the outer loops stay after the dispatch.
+test_avx2_dispatch_result "`cat << EOS
+int main() {
+  int a[16][64];
+  char c[16][64];
+  int i;
+  int j;
+  int k;
+  int s;
+  k = 3;
+  for (i = 0; i < 16; i++) {
+    for (j = 0; j < 64; j++) {
+      a[i][j] = i + j;
+      c[i][j] = i - j;
+    }
+  }
+  for (i = 0; i < 16; i++) {
+    for (j = 0; j < 64; j++) a[i][j] = a[i][j] * k;
+    for (j = 0; j < 64; j++) c[i][j] = c[i][j] + k;
+  }
+  s = 0;
+  for (i = 0; i < 16; i++) s = s + a[i][i * 3] + c[i][63 - i];
+  return s % 256;
+}
+EOS
+`" 208 "no vector insns hoisted above the AVX2 dispatch"
+
+# Calls and returns after vector loops run on CPUs without AVX, too.
+test_avx2_path_result "`cat << EOS
+int putchar(int c);
+int max(int *p, int n) {
+  int i;
+  int m;
+  m = 0;
+  for (i = 0; i < n; i++) m = *(p + i * 4) > m ? *(p + i * 4) : m;
+  putchar(m);
+  return m;
+}
+int main() {
+  int a[64];
+  char c[64];
+  int i;
+  for (i = 0; i < 64; i++) a[i] = i * 29 % 61;
+  for (i = 0; i < 64; i++) c[i] = a[i] + 3;
+  putchar(c[7]);
+  return max(a, 64) - c[0];
+}
+EOS
+`" 57 "no AVX insns outside of the AVX2 path"
+
+# Turning on --prefetch between builds changes the code of every function.
+test_incremental_result "`cat << EOS
+int f(int *a, int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) s = s + *(a + i * 64);
+  return s;
+}
+int main() {
+  int a[512];
+  int i;
+  for (i = 0; i < 512; i++) a[i] = i;
+  return f(a, 30) % 256;
+}
+EOS
+`" "`cat << EOS
+int f(int *a, int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) s = s + *(a + i * 64);
+  return s;
+}
+int main() {
+  int a[512];
+  int i;
+  for (i = 0; i < 512; i++) a[i] = i;
+  return f(a, 30) % 256;
+}
+EOS
+`" 48 0 "incremental rebuild with --prefetch turned on" "" --prefetch
+
+# big is too large to inline, so main is reused when only big changes.
+test_incremental_result "`cat << EOS
+int small(int a) { return a + 1; }
+int big(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) {
+    s = s + i * i + (i & 3) * (i | 5) + (i ^ 9);
+    s = s + (s >> 3) * 7 + (i * 2 - n) * (i + n);
+    s = s % 10007 + (s & 15) * (n - i) + (s | 1) * 3;
+    s = s + (s >> 5) * 11 + (i * 3 - n) * (i + 7) + (i ^ s);
+    s = s - (s & 255) * (i | 3) + (n ^ i) * (s >> 2) - (i & n);
+    s = s % 9973 + (i * i - n) * (s & 7) + (s >> 4) * (n | i);
+  }
+  return s;
+}
+int main() { return (big(small(4)) + small(2)) % 256; }
+EOS
+`" "`cat << EOS
+int small(int a) { return a + 1; }
+int big(int n) {
+  int i;
+  int s;
+  s = 0;
+  for (i = 0; i < n; i++) {
+    s = s + i * i + (i & 3) * (i | 5) + (i ^ 9);
+    s = s + (s >> 3) * 7 + (i * 2 - n) * (i + n);
+    s = s % 10007 + (s & 15) * (n - i) + (s | 1) * 5;
+    s = s + (s >> 5) * 11 + (i * 3 - n) * (i + 7) + (i ^ s);
+    s = s - (s & 255) * (i | 3) + (n ^ i) * (s >> 2) - (i & n);
+    s = s % 9973 + (i * i - n) * (s & 7) + (s >> 4) * (n | i);
+  }
+  return s;
+}
+int main() { return (big(small(4)) + small(2)) % 256; }
+EOS
+`" 41 2 "incremental rebuild of a function too large to inline"
+
+# The same sources are compiled against a PCH of a changed struct.
+pch_src="`cat << EOS
+int f() { struct Pair p; return sizeof(p); }
+int main() { struct Pair q; return f() * 10 + sizeof(q); }
+EOS
+`"
+test_incremental_result "$pch_src" "$pch_src" 132 0 \
+  "incremental rebuild with a regenerated PCH" "" "" \
+  "struct Pair { int a; int b; };" "struct Pair { int a[2]; int b; };"
+
 echo "All tests passed."
@@ -23,8 +23,11 @@ const char *CreateTokenStr(struct Node *t) {
 }
 
 int IsEqualTokenWithCStr(struct Node *t, const char *s) {
-  return strlen(s) == (unsigned)t->length &&
-         strncmp(t->begin, s, t->length) == 0;
+  // Token chars are never NUL, so a shorter s stops the loop by mismatch.
+  for (int i = 0; i < t->length; i++) {
+    if (t->begin[i] != s[i]) return 0;
+  }
+  return s[t->length] == 0;
 }
 
 void PrintTokenSequence(struct Node *t) {
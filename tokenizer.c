@@ -32,6 +32,7 @@ static struct Node *CreateNextToken(const char *p, const char *src, int *line) {
     if (IsEqualTokenWithCStr(t, "else")) t->token_type = kTokenKwElse;
     if (IsEqualTokenWithCStr(t, "for")) t->token_type = kTokenKwFor;
     if (IsEqualTokenWithCStr(t, "if")) t->token_type = kTokenKwIf;
+    if (IsEqualTokenWithCStr(t, "inline")) t->token_type = kTokenKwInline;
     if (IsEqualTokenWithCStr(t, "int")) t->token_type = kTokenKwInt;
     if (IsEqualTokenWithCStr(t, "return")) t->token_type = kTokenKwReturn;
     if (IsEqualTokenWithCStr(t, "sizeof")) t->token_type = kTokenKwSizeof;
@@ -171,6 +172,8 @@ static struct Node *CreateNextToken(const char *p, const char *src, int *line) {
     return AllocToken(src, *line, p, 1, kTokenPunctuator);
   } else if (']' == *p) {
     return AllocToken(src, *line, p, 1, kTokenPunctuator);
+  } else if ('#' == *p) {
+    return AllocToken(src, *line, p, 1, kTokenPunctuator);
   }
   Error("Unexpected char %c", *p);
 }
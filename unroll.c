@@ -0,0 +1,202 @@
+#include "compilium.h"
+
+// Loop unrolling before SSA form is built
+//
+// Until SSA form is built, vars are vregs which may be defined more than
+// once, so the blocks of a loop can be copied as they are. Innermost loops
+// are unrolled if the header leaves the loop when a compare of a counter and
+// a loop invariant limit fails, and the counter is incremented by a const
+// once in each iteration. Loops with a small const trip count are fully
+// unrolled, i.e. replaced by a copy of the blocks for each iteration. Other
+// small loops are partially unrolled: a loop of several copies of the
+// iteration runs while enough iterations remain, and the original loop runs
+// the rest as the remainder loop.
+//
+// #pragma unroll(N) before a loop unrolls it N times, or fully if the trip
+// count is const and at most N. #pragma unroll asks for full unrolling, and
+// #pragma unroll(1) disables unrolling. Loops unrolled by pragmas may be
+// larger than the others, but are still limited in size.
+
+#define MAX_FULLY_UNROLLED_SIZE 128  // insns
+#define DEFAULT_UNROLL_FACTOR 4
+#define MAX_PARTIALLY_UNROLLED_SIZE 80
+#define MAX_UNROLLED_SIZE_BY_PRAGMA 4096
+
+static struct IRFunc *func;
+
+static int GetIndexInLoop(struct IRLoop *loop, struct IRBlock *b) {
+  int i = 0;
+  while (loop->blocks[i] != b) i++;
+  return i;
+}
+
+static int GetIndexInFunc(struct IRBlock *b) {
+  int i = 0;
+  while (func->blocks[i] != b) i++;
+  return i;
+}
+
+// Places a copy of the header before the index-th block.
+static struct IRBlock *CopyHeader(struct IRCountedLoop *c, int index) {
+  struct IRBlock *copy = AllocIRBlock(func);
+  InsertIRBlock(func, index, copy);
+  struct IRBlock *header = c->loop->header;
+  for (int k = 0; k < header->num_of_insns; k++) {
+    AppendIRInsnCopy(copy, header->insns[k]);
+  }
+  return copy;
+}
+
+// Makes a copy of the header jump to target. The test is removed if only the
+// branch used it.
+static void SkipTestOfHeader(struct IRCountedLoop *c, struct IRBlock *copy,
+                             struct IRBlock *target) {
+  ReplaceIRTerminatorWithJump(copy, target);
+  if (!c->is_test_used) RemoveIRInsn(copy, c->test_index);
+}
+
+// Places a copy of the loop blocks for an iteration before the index-th
+// block. The copy goes to next instead of repeating the loop, and does not
+// test whether the iteration runs. Returns the copy of the header.
+static struct IRBlock *CopyIteration(struct IRCountedLoop *c,
+                                     struct IRBlock *next, int index) {
+  struct IRLoop *loop = c->loop;
+  int n = loop->num_of_blocks;
+  struct IRBlock **copies = malloc(sizeof(struct IRBlock *) * n);
+  assert(copies);
+  for (int i = 0; i < n; i++) {
+    copies[i] = AllocIRBlock(func);
+    InsertIRBlock(func, index + i, copies[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = AppendIRInsnCopy(copies[i], b->insns[k]);
+      for (int t = 0; t < 2; t++) {
+        struct IRBlock *target = insn->targets[t];
+        if (target == loop->header) {
+          insn->targets[t] = next;
+        } else if (target && IsIRBlockInLoop(loop, target)) {
+          insn->targets[t] = copies[GetIndexInLoop(loop, target)];
+        }
+      }
+    }
+  }
+  struct IRBlock *header = copies[0];
+  free(copies);
+  SkipTestOfHeader(c, header, GetIRTerminator(header)->targets[0]);
+  return header;
+}
+
+// Places copies of n iterations which go to next after the last one, and
+// returns the first one.
+static struct IRBlock *CopyIterations(struct IRCountedLoop *c,
+                                      struct IRBlock *next, long n,
+                                      int index) {
+  for (long i = 0; i < n; i++) next = CopyIteration(c, next, index);
+  return next;
+}
+
+static void EnterLoopAt(struct IRLoop *loop, struct IRBlock *b) {
+  GetIRTerminator(loop->preheader)->targets[0] = b;
+}
+
+// The last copy of the header runs the insns of the failing test.
+static void UnrollFully(struct IRCountedLoop *c) {
+  struct IRLoop *loop = c->loop;
+  int index = GetIndexInFunc(loop->header);
+  struct IRBlock *last = CopyHeader(c, index);
+  SkipTestOfHeader(c, last, GetIRTerminator(loop->header)->targets[1]);
+  EnterLoopAt(loop, CopyIterations(c, last, c->trip_count, index));
+}
+
+// The unrolled loop is guarded by a copy of the header whose test compares
+// with limit - (factor - 1) * step, so that it continues only if the test
+// of the original loop holds for the next factor iterations. The compare is
+// done in 64 bits so that the subtraction does not overflow. If the factor
+// divides the trip count, the test is kept and no remainder loop is needed.
+static void UnrollPartially(struct IRCountedLoop *c, int factor) {
+  struct IRLoop *loop = c->loop;
+  int index = GetIndexInFunc(loop->header);
+  struct IRBlock *guard = CopyHeader(c, index);
+  struct IRInsn *t = GetIRTerminator(guard);
+  guard->unroll_hint = 1;
+  guard->prefetch_hint = ScalePrefetchHint(loop->header->prefetch_hint, factor);
+  if (c->trip_count >= 0 && c->trip_count % factor == 0) {
+    t->targets[0] = CopyIterations(c, guard, factor, index + 1);
+    EnterLoopAt(loop, guard);
+    return;
+  }
+  int k = c->test_index;
+  int delta = AllocIRVReg(func, kIRTypeI64);
+  int limit = AllocIRVReg(func, kIRTypeI64);
+  InsertIRInsn(guard, k++, kIRConst, kIRTypeI64, delta)->imm =
+      (factor - 1) * c->step;
+  struct IRInsn *sub = InsertIRInsn(guard, k++, kIRSub, kIRTypeI64, limit);
+  AddIRSrc(sub, c->test->srcs[c->limit]);
+  AddIRSrc(sub, delta);
+  guard->insns[k]->srcs[c->limit] = limit;
+  t->targets[0] = CopyIterations(c, guard, factor, index + 1);
+  t->targets[1] = loop->header;
+  // The remainder loop runs too few iterations to gain from prefetches.
+  loop->header->prefetch_hint = PREFETCH_HINT_OFF;
+  EnterLoopAt(loop, guard);
+}
+
+static bool UnrollLoop(struct IRLoop *loop) {
+  int hint = loop->header->unroll_hint;
+  struct IRCountedLoop c;
+  if (hint == 1 || !AnalyzeIRCountedLoop(func, loop, &c)) return false;
+  long max_size = hint ? MAX_UNROLLED_SIZE_BY_PRAGMA : MAX_FULLY_UNROLLED_SIZE;
+  if (c.trip_count >= 0 && (hint <= 0 || c.trip_count <= hint) &&
+      c.trip_count <= max_size / c.size) {
+    UnrollFully(&c);
+    return true;
+  }
+  int factor = DEFAULT_UNROLL_FACTOR;
+  if (hint > 1) {
+    factor = hint < MAX_UNROLLED_SIZE_BY_PRAGMA / c.size
+                 ? hint
+                 : MAX_UNROLLED_SIZE_BY_PRAGMA / c.size;
+  } else if (c.has_call) {
+    return false;
+  } else {
+    while (factor * c.size > MAX_PARTIALLY_UNROLLED_SIZE) factor /= 2;
+  }
+  // Factors which divide the trip count need no remainder loop.
+  if (c.trip_count >= 0 && hint <= 1) {
+    int f = factor;
+    while (f > 1 && c.trip_count % f) f--;
+    if (f > 1) factor = f;
+  }
+  if (factor < 2 || (c.trip_count >= 0 && c.trip_count < factor))
+    return false;
+  UnrollPartially(&c, factor);
+  return true;
+}
+
+static bool IsInnermostLoop(struct IRLoop *loops, int num_of_loops, int i) {
+  for (int k = 0; k < num_of_loops; k++) {
+    if (k != i && IsIRBlockInLoop(&loops[i], loops[k].header)) return false;
+  }
+  return true;
+}
+
+// Loops are found again after each unrolling. Loops which have been tried
+// are marked not to be unrolled again, including the remainder loops.
+void UnrollLoops(struct IRFunc *f) {
+  func = f;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int num_of_loops;
+    struct IRLoop *loops = FindIRLoops(f, &num_of_loops);
+    for (int i = 0; i < num_of_loops && !changed; i++) {
+      if (!IsInnermostLoop(loops, num_of_loops, i)) continue;
+      changed = UnrollLoop(&loops[i]);
+      loops[i].header->unroll_hint = 1;
+    }
+    FreeIRLoops(loops, num_of_loops);
+    if (changed) RemoveUnreachableIRBlocks(f);
+  }
+}
@@ -0,0 +1,940 @@
+#include "compilium.h"
+
+// Loop vectorization before SSA form
+//
+// Innermost counted loops whose counter goes up by 1 are vectorized if they
+// access consecutive elements of int or char arrays. An iteration is
+// evaluated symbolically: each value is uniform, i.e. the same in all the
+// lanes and the iterations, affine in the counter, or computed lane by lane
+// from loads. Branches in the loop are allowed only if they select the min
+// or max of the operands of their compare. Vars carried to the next
+// iteration must be sums, mins or maxes, which are computed in the lanes of
+// an accumulator and reduced after the vector loop.
+//
+// The vector loop runs while enough iterations remain for all the lanes, and
+// the original loop runs the rest. A store and another access to the same
+// array must be the same element or far enough apart for the lanes, which
+// is checked before the loop if they may alias through pointers. The loop is
+// vectorized both for SSE2 and AVX2, and the CPU decides which one runs.
+// Loops with unroll pragmas are left as they are.
+
+#define MAX_VALUES 512
+#define MAX_LOOP_BLOCKS 16
+#define MAX_REDUCTIONS 8
+#define MAX_ALIAS_CHECKS 8
+#define MIN_ALIAS_DISTANCE 32  // bytes in a vector of AVX2
+
+enum ValueKind {
+  kValueInvalid,
+  kValueUniform,
+  kValueAffine,
+  kValueLanes,
+  kValueInit,
+  kValueStore,
+};
+
+// Uniform values are vars defined outside the loop (op is kIRCopy), consts
+// and addrs (op is kIRConst, kIRFrameAddr, kIRSymAddr or kIRStrAddr), and
+// ops on uniform values. Affine values are srcs[0] + imm * counter. Lanes
+// are ops on lanes, loads from affine addrs, compares of lanes which are
+// used only by branches, and kIRSext to i8, which only tells that the lanes
+// of i8 hold exact values. Init is the value of a var at the beginning of
+// an iteration.
+struct Value {
+  enum ValueKind kind;
+  enum IROp op;
+  enum IRType type;
+  int num_of_srcs;
+  int srcs[2];
+  long imm;
+  const char *sym;
+  int vreg;             // uniform var or init
+  int mem_version;      // loads: the number of stores before
+  bool is_exact;        // lanes of i8: the values fit in i8
+  bool is_unconditional;  // loads: run in every iteration
+  bool is_needed;
+};
+
+struct Reduction {
+  int var;
+  enum IROp op;  // kIRAdd, kIRMin or kIRMax
+  int value;     // the value of the var at the end of an iteration
+  int operand;   // the value which is added to the var, or compared with it
+  int acc;       // vector vreg
+};
+
+static struct IRFunc *func;
+static struct IRCountedLoop counted;
+static struct IRLoop *loop;
+static struct IRBlock *latch;
+static int counter;
+static enum IRType lane_type;
+static bool is_failed;
+static bool *is_defined_in_loop;    // indexed by vreg
+static bool *is_defined_in_header;  // indexed by vreg
+static int *envs[MAX_LOOP_BLOCKS];  // vreg -> value at the end of each block
+static int mem_versions[MAX_LOOP_BLOCKS];
+static int conds[MAX_LOOP_BLOCKS];  // the compare which each block branches on
+static struct Value values[MAX_VALUES];  // values[0] is not used
+static int num_of_values;
+static int invalid;
+static struct Reduction reductions[MAX_REDUCTIONS];
+static int num_of_reductions;
+static int alias_checks[MAX_ALIAS_CHECKS][2];  // pairs of base addrs
+static int num_of_alias_checks;
+
+// Generated code
+static struct IRBlock *guard;    // uniform values and alias checks
+static struct IRBlock *vector_preheader;  // broadcasts
+static int *scalar_vregs;        // indexed by value
+static int *vector_vregs;        // indexed by value
+static int *broadcast_vregs;     // indexed by value
+
+static bool IsSameValue(struct Value *a, struct Value *b) {
+  if (a->kind != b->kind || a->op != b->op || a->type != b->type ||
+      a->num_of_srcs != b->num_of_srcs || a->imm != b->imm ||
+      a->vreg != b->vreg || a->mem_version != b->mem_version)
+    return false;
+  for (int s = 0; s < a->num_of_srcs; s++) {
+    if (a->srcs[s] != b->srcs[s]) return false;
+  }
+  return a->sym == b->sym || (a->sym && b->sym && !strcmp(a->sym, b->sym));
+}
+
+// Values are numbered so that the same computation is the same value, except
+// stores. Values are added after their srcs, i.e. in the order to run them.
+static int AddValue(struct Value v) {
+  if (v.kind != kValueStore) {
+    for (int i = 1; i < num_of_values; i++) {
+      if (!IsSameValue(&values[i], &v)) continue;
+      values[i].is_unconditional |= v.is_unconditional;
+      return i;
+    }
+  }
+  if (num_of_values >= MAX_VALUES) {
+    is_failed = true;
+    return invalid;
+  }
+  values[num_of_values] = v;
+  return num_of_values++;
+}
+
+static bool IsUniform(int v) { return values[v].kind == kValueUniform; }
+
+static bool IsConst(int v) {
+  return IsUniform(v) && values[v].op == kIRConst;
+}
+
+static bool IsCompare(int v) {
+  return values[v].kind == kValueLanes && kIRCmpEq <= values[v].op &&
+         values[v].op <= kIRCmpGe;
+}
+
+static bool IsLanes(int v) {
+  return (values[v].kind == kValueLanes && !IsCompare(v)) ||
+         values[v].kind == kValueInit;
+}
+
+static int MakeConst(enum IRType type, long imm) {
+  return AddValue((struct Value){.kind = kValueUniform, .op = kIRConst,
+                                 .type = type, .imm = imm});
+}
+
+// Consts are added to the other operand as the offset from it.
+static int MakeUniformOp(enum IROp op, enum IRType type, int a, int b) {
+  long result;
+  if (op == kIRAdd && IsConst(a) && !IsConst(b)) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  if (op == kIRAdd && IsConst(b) && !values[b].imm) return a;
+  if (IsConst(a) && (!b || IsConst(b)) &&
+      FoldIROp(op, type, values[a].imm, b ? values[b].imm : 0, &result))
+    return MakeConst(type, result);
+  return AddValue((struct Value){.kind = kValueUniform, .op = op,
+                                 .type = type, .num_of_srcs = b ? 2 : 1,
+                                 .srcs = {a, b}});
+}
+
+static int MakeAffine(enum IRType type, long scale, int base) {
+  return AddValue((struct Value){
+      .kind = kValueAffine, .type = type, .num_of_srcs = 1, .srcs = {base},
+      .imm = scale});
+}
+
+static int MakeLanes(enum IROp op, enum IRType type, int a, int b,
+                     bool is_exact) {
+  return AddValue((struct Value){.kind = kValueLanes, .op = op, .type = type,
+                                 .num_of_srcs = b ? 2 : 1, .srcs = {a, b},
+                                 .is_exact = is_exact});
+}
+
+// Returns whether the lanes of i8 hold exact values.
+static bool IsExact(int v) {
+  struct Value *x = &values[v];
+  if (lane_type != kIRTypeI8) return true;
+  if (x->kind == kValueLanes) return x->is_exact;
+  if (x->kind == kValueInit || (x->kind == kValueUniform && x->op == kIRCopy))
+    return func->vreg_types[x->vreg] == kIRTypeI8;
+  if (x->kind != kValueUniform) return false;
+  if (x->op == kIRSext) return x->type == kIRTypeI8;
+  return x->op == kIRConst && -128 <= x->imm && x->imm < 128;
+}
+
+static int LookUp(int *env, int vreg) {
+  if (env[vreg]) return env[vreg];
+  enum IRType type = func->vreg_types[vreg];
+  if (vreg == counter) return MakeAffine(type, 1, MakeConst(type, 0));
+  if (is_defined_in_loop[vreg])
+    return AddValue((struct Value){.kind = kValueInit, .vreg = vreg});
+  return AddValue(
+      (struct Value){.kind = kValueUniform, .op = kIRCopy, .vreg = vreg});
+}
+
+// Affine values are used only in addrs.
+static int EvalAffineOp(enum IROp op, enum IRType type, int a, int b) {
+  if (values[b].kind == kValueAffine && op != kIRSub) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  if (values[a].kind != kValueAffine || !IsUniform(b)) return invalid;
+  long scale = values[a].imm;
+  int base = values[a].srcs[0];
+  switch (op) {
+    case kIRAdd:
+    case kIRSub:
+      return MakeAffine(type, scale, MakeUniformOp(op, type, base, b));
+    case kIRMul:
+      if (!IsConst(b)) return invalid;
+      return MakeAffine(type, scale * values[b].imm,
+                        MakeUniformOp(op, type, base, b));
+    case kIRShl:
+      if (!IsConst(b) || values[b].imm < 0 || values[b].imm > 31)
+        return invalid;
+      return MakeAffine(type, scale << values[b].imm,
+                        MakeUniformOp(op, type, base, b));
+    default:
+      return invalid;
+  }
+}
+
+static int EvalLanesOp(enum IROp op, enum IRType type, int a, int b) {
+  if (!IsLanes(a) && !IsUniform(a)) return invalid;
+  if (b && !IsLanes(b) && !IsUniform(b)) return invalid;
+  // Lanes hold i32 or the low bits of i8.
+  if (type != kIRTypeI32 && (type != kIRTypeI8 || lane_type != kIRTypeI8))
+    return invalid;
+  bool is_exact = lane_type != kIRTypeI8;
+  switch (op) {
+    case kIRCmpLt:
+    case kIRCmpLe:
+    case kIRCmpGt:
+    case kIRCmpGe:
+      if (!IsExact(a) || !IsExact(b)) return invalid;
+      break;
+    case kIRMul:
+      if (lane_type == kIRTypeI8) return invalid;
+      break;
+    case kIRShl:
+    case kIRSar:
+      if (lane_type == kIRTypeI8 || !IsLanes(a) || !IsConst(b) ||
+          values[b].imm < 0 || values[b].imm > 31)
+        return invalid;
+      break;
+    case kIRAnd:
+    case kIROr:
+    case kIRXor:
+      is_exact = IsExact(a) && IsExact(b);
+      break;
+    case kIRNot:
+      is_exact = IsExact(a);
+      break;
+    case kIRAdd:
+    case kIRSub:
+    case kIRNeg:
+      break;
+    default:
+      return invalid;
+  }
+  return MakeLanes(op, type, a, b, is_exact);
+}
+
+static int EvalOp(enum IROp op, enum IRType type, int a, int b) {
+  if (values[a].kind == kValueInvalid || IsCompare(a) ||
+      (b && (values[b].kind == kValueInvalid || IsCompare(b))) ||
+      op == kIRDiv || op == kIRMod)
+    return invalid;
+  if (IsUniform(a) && (!b || IsUniform(b)))
+    return MakeUniformOp(op, type, a, b);
+  if (values[a].kind == kValueAffine || values[b].kind == kValueAffine)
+    return b ? EvalAffineOp(op, type, a, b) : invalid;
+  return EvalLanesOp(op, type, a, b);
+}
+
+static int EvalSext(enum IRType type, int a) {
+  struct Value *x = &values[a];
+  if (x->kind == kValueUniform) return MakeUniformOp(kIRSext, type, a, 0);
+  if (x->kind == kValueAffine) return type == kIRTypeI8 ? invalid : a;
+  if (!IsLanes(a)) return invalid;
+  if (lane_type == kIRTypeI32) return type == kIRTypeI32 ? a : invalid;
+  if (type != kIRTypeI8 || IsExact(a)) return a;
+  return MakeLanes(kIRSext, type, a, 0, true);
+}
+
+// Returns whether addr is an affine addr of consecutive elements.
+static bool IsConsecutiveAddr(int addr) {
+  return values[addr].kind == kValueAffine &&
+         values[addr].type == kIRTypePtr &&
+         values[addr].imm == GetSizeOfIRType(lane_type);
+}
+
+static void EvalInsn(int *env, int bi, struct IRInsn *insn) {
+  struct IRBlock *b = loop->blocks[bi];
+  int a = insn->num_of_srcs > 0 ? LookUp(env, insn->srcs[0]) : 0;
+  int v = 0;
+  switch (insn->op) {
+    case kIRConst:
+    case kIRFrameAddr:
+    case kIRSymAddr:
+    case kIRStrAddr:
+      v = AddValue((struct Value){.kind = kValueUniform, .op = insn->op,
+                                  .type = insn->type, .imm = insn->imm,
+                                  .sym = insn->sym});
+      break;
+    case kIRCopy:
+      v = a;
+      break;
+    case kIRSext:
+      v = EvalSext(insn->type, a);
+      break;
+    case kIRLoad:
+      if (!IsConsecutiveAddr(a)) {
+        v = invalid;
+        break;
+      }
+      v = AddValue((struct Value){.kind = kValueLanes, .op = kIRLoad,
+                                  .type = insn->type, .num_of_srcs = 1,
+                                  .srcs = {a}, .mem_version = mem_versions[bi],
+                                  .is_exact = true,
+                                  .is_unconditional =
+                                      DominatesIRBlock(b, latch)});
+      break;
+    case kIRStore: {
+      int value = LookUp(env, insn->srcs[1]);
+      if (!IsConsecutiveAddr(a) || !DominatesIRBlock(b, latch) ||
+          (!IsLanes(value) && !IsUniform(value))) {
+        is_failed = true;
+        return;
+      }
+      AddValue((struct Value){.kind = kValueStore, .op = kIRStore,
+                              .type = insn->type, .num_of_srcs = 2,
+                              .srcs = {a, value}});
+      mem_versions[bi]++;
+      return;
+    }
+    case kIRBranch:
+      conds[bi] = a;
+      if (!IsCompare(a)) is_failed = true;
+      return;
+    case kIRJump:
+      return;
+    default:
+      if (insn->op < kIRAdd || insn->op > kIRNot) {
+        is_failed = true;
+        return;
+      }
+      v = EvalOp(insn->op, insn->type, a,
+                 insn->num_of_srcs > 1 ? LookUp(env, insn->srcs[1]) : 0);
+      break;
+  }
+  env[insn->dst] = v;
+}
+
+// A branch selecting an operand of its compare selects the min or max.
+static int Select(int cond, int if_true, int if_false) {
+  if (if_true == if_false) return if_true;
+  int x = values[cond].srcs[0];
+  int y = values[cond].srcs[1];
+  bool is_less = values[cond].op == kIRCmpLt || values[cond].op == kIRCmpLe;
+  bool is_greater =
+      values[cond].op == kIRCmpGt || values[cond].op == kIRCmpGe;
+  if (!is_less && !is_greater) return invalid;
+  if (if_true == x && if_false == y)
+    return MakeLanes(is_less ? kIRMin : kIRMax, kIRTypeI32, x, y, true);
+  if (if_true == y && if_false == x)
+    return MakeLanes(is_less ? kIRMax : kIRMin, kIRTypeI32, x, y, true);
+  return invalid;
+}
+
+static int GetIndexInLoop(struct IRBlock *b) {
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    if (loop->blocks[i] == b) return i;
+  }
+  return -1;
+}
+
+// Returns whether control from pred to b comes through the target of the
+// branch at the end of d.
+static bool IsFromTarget(struct IRBlock *d, struct IRBlock *target,
+                         struct IRBlock *pred, struct IRBlock *b) {
+  if (pred == d) return target == b;
+  return target != b && DominatesIRBlock(target, pred);
+}
+
+// The values of vars at a merge of two preds are selected by the branch at
+// the end of the idom.
+static void MergeEnvs(int bi) {
+  struct IRBlock *b = loop->blocks[bi];
+  struct IRBlock *d = b->idom;
+  int di = GetIndexInLoop(d);
+  int pi[2] = {GetIndexInLoop(b->preds[0]), GetIndexInLoop(b->preds[1])};
+  if (di < 0 || !conds[di] || pi[0] < 0 || pi[1] < 0 ||
+      mem_versions[pi[0]] != mem_versions[pi[1]]) {
+    is_failed = true;
+    return;
+  }
+  struct IRInsn *branch = GetIRTerminator(d);
+  int from_true = -1;
+  for (int p = 0; p < 2; p++) {
+    if (IsFromTarget(d, branch->targets[0], b->preds[p], b) &&
+        IsFromTarget(d, branch->targets[1], b->preds[1 - p], b))
+      from_true = p;
+  }
+  if (from_true < 0) {
+    is_failed = true;
+    return;
+  }
+  int *env_true = envs[pi[from_true]];
+  int *env_false = envs[pi[1 - from_true]];
+  for (int v = 1; v <= func->num_of_vregs; v++) {
+    if (env_true[v] == env_false[v]) {
+      envs[bi][v] = env_true[v];
+      continue;
+    }
+    envs[bi][v] =
+        Select(conds[di], LookUp(env_true, v), LookUp(env_false, v));
+  }
+  mem_versions[bi] = mem_versions[pi[0]];
+}
+
+static void EvalLoop() {
+  for (int i = 0; i < loop->num_of_blocks && !is_failed; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    envs[i] = calloc(func->num_of_vregs + 1, sizeof(int));
+    assert(envs[i]);
+    int p = i && b->num_of_preds == 1 ? GetIndexInLoop(b->preds[0]) : -1;
+    if (p >= 0) {
+      memcpy(envs[i], envs[p], sizeof(int) * (func->num_of_vregs + 1));
+      mem_versions[i] = mem_versions[p];
+    } else if (i && b->num_of_preds == 2) {
+      MergeEnvs(i);
+    } else if (i) {
+      is_failed = true;  // entered from outside or merging more than two
+    }
+    for (int k = 0; k < b->num_of_insns && !is_failed; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (!i && (insn == counted.test || insn->op == kIRBranch)) continue;
+      EvalInsn(envs[i], i, insn);
+    }
+  }
+}
+
+static bool IsUsedOutsideLoop(int vreg) {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    if (IsIRBlockInLoop(loop, b)) continue;
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      for (int s = 0; s < insn->num_of_srcs; s++) {
+        if (insn->srcs[s] == vreg) return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Vars defined in the header are defined again when the loop is left.
+static void FindReductions() {
+  int *env = envs[GetIndexInLoop(latch)];
+  num_of_reductions = 0;
+  for (int var = 1; var <= func->num_of_vregs && !is_failed; var++) {
+    if (!is_defined_in_loop[var] || is_defined_in_header[var] ||
+        var == counter)
+      continue;
+    int init = LookUp(env, var);
+    if (values[init].kind == kValueInit) continue;
+    struct Value *x = &values[init];
+    init = AddValue((struct Value){.kind = kValueInit, .vreg = var});
+    bool is_reduction =
+        x->kind == kValueLanes &&
+        (x->op == kIRAdd || x->op == kIRMin || x->op == kIRMax) &&
+        (x->srcs[0] == init) != (x->srcs[1] == init) &&
+        func->vreg_types[var] == lane_type &&
+        (x->op != kIRAdd || lane_type == kIRTypeI32);
+    if (!is_reduction) {
+      if (IsUsedOutsideLoop(var)) is_failed = true;
+      continue;
+    }
+    if (num_of_reductions >= MAX_REDUCTIONS) {
+      is_failed = true;
+      return;
+    }
+    struct Reduction *r = &reductions[num_of_reductions++];
+    r->var = var;
+    r->op = x->op;
+    r->value = x - values;
+    r->operand = x->srcs[x->srcs[0] == init ? 1 : 0];
+  }
+}
+
+// Marks the values which v is computed from. Values of the previous
+// iteration are needed only by reductions, and loads which do not run in
+// every iteration may be out of bounds.
+static void MarkNeeded(int v) {
+  struct Value *x = &values[v];
+  if (x->is_needed) return;
+  x->is_needed = true;
+  if (x->kind == kValueInvalid || x->kind == kValueInit || IsCompare(v) ||
+      (x->op == kIRLoad && !x->is_unconditional))
+    is_failed = true;
+  for (int s = 0; s < x->num_of_srcs; s++) MarkNeeded(x->srcs[s]);
+}
+
+// Returns the root of a uniform addr and adds the const offset from it.
+static int GetRootAddr(int v, long *ofs) {
+  struct Value *x = &values[v];
+  if (x->kind == kValueUniform && (x->op == kIRAdd || x->op == kIRSub) &&
+      x->type == kIRTypePtr && IsConst(x->srcs[1])) {
+    *ofs += x->op == kIRAdd ? values[x->srcs[1]].imm : -values[x->srcs[1]].imm;
+    return GetRootAddr(x->srcs[0], ofs);
+  }
+  return v;
+}
+
+static bool IsObjectAddr(int v) {
+  enum IROp op = values[v].op;
+  return IsUniform(v) &&
+         (op == kIRFrameAddr || op == kIRSymAddr || op == kIRStrAddr);
+}
+
+// Accesses in the same iteration are safe if they are to the same element,
+// and accesses in other iterations are if they are in other vectors.
+static void CheckDependence(int store, int access) {
+  int a = values[values[store].srcs[0]].srcs[0];
+  int b = values[values[access].srcs[0]].srcs[0];
+  long a_ofs = 0;
+  long b_ofs = 0;
+  int a_root = GetRootAddr(a, &a_ofs);
+  int b_root = GetRootAddr(b, &b_ofs);
+  if (a_root == b_root) {
+    long d = b_ofs - a_ofs;
+    if (d && -MIN_ALIAS_DISTANCE < d && d < MIN_ALIAS_DISTANCE)
+      is_failed = true;
+    return;
+  }
+  if (IsObjectAddr(a_root) && IsObjectAddr(b_root)) return;
+  for (int i = 0; i < num_of_alias_checks; i++) {
+    if (alias_checks[i][0] == a && alias_checks[i][1] == b) return;
+  }
+  if (num_of_alias_checks >= MAX_ALIAS_CHECKS) {
+    is_failed = true;
+    return;
+  }
+  alias_checks[num_of_alias_checks][0] = a;
+  alias_checks[num_of_alias_checks++][1] = b;
+}
+
+static void CheckDependences() {
+  num_of_alias_checks = 0;
+  for (int i = 1; i < num_of_values; i++) {
+    if (values[i].kind != kValueStore) continue;
+    for (int k = 1; k < num_of_values && !is_failed; k++) {
+      if (k == i || !values[k].is_needed) continue;
+      if (values[k].op == kIRLoad || (values[k].kind == kValueStore && k > i))
+        CheckDependence(i, k);
+    }
+  }
+}
+
+// Returns the size of the loads and stores, or 0 if they differ or are not
+// of ints or chars.
+static int GetAccessSize() {
+  int size = 0;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      struct IRInsn *insn = b->insns[k];
+      if (insn->op != kIRLoad && insn->op != kIRStore) continue;
+      if (insn->type != kIRTypeI8 && insn->type != kIRTypeI32) return 0;
+      if (size && size != GetSizeOfIRType(insn->type)) return 0;
+      size = GetSizeOfIRType(insn->type);
+    }
+  }
+  return size;
+}
+
+// The header is the only exit, and the latch is the only block which goes
+// back to the header.
+static bool FindLatch() {
+  latch = NULL;
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    struct IRInsn *t = GetIRTerminator(b);
+    if (!t || t->op == kIRReturn) return false;
+    for (int s = 0; s < GetNumOfIRSuccs(b); s++) {
+      struct IRBlock *succ = GetIRSucc(b, s);
+      if (succ == loop->header) {
+        if (latch) return false;
+        latch = b;
+      } else if (i && !IsIRBlockInLoop(loop, succ)) {
+        return false;
+      }
+    }
+  }
+  return latch != NULL;
+}
+
+static void FindDefinedVRegs() {
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    struct IRBlock *b = loop->blocks[i];
+    for (int k = 0; k < b->num_of_insns; k++) {
+      int dst = b->insns[k]->dst;
+      is_defined_in_loop[dst] = true;
+      if (!i) is_defined_in_header[dst] = true;
+    }
+  }
+}
+
+static bool AnalyzeLoop() {
+  is_failed = false;
+  num_of_values = 1;
+  invalid = AddValue((struct Value){.kind = kValueInvalid});
+  for (int i = 0; i < loop->num_of_blocks; i++) {
+    envs[i] = NULL;
+    mem_versions[i] = 0;
+    conds[i] = 0;
+  }
+  FindDefinedVRegs();
+  EvalLoop();
+  if (!is_failed) FindReductions();
+  if (is_failed) return false;
+  bool has_store = false;
+  for (int i = 1; i < num_of_values; i++) {
+    if (values[i].kind != kValueStore) continue;
+    MarkNeeded(i);
+    has_store = true;
+  }
+  for (int i = 0; i < num_of_reductions; i++) {
+    MarkNeeded(reductions[i].operand);
+    values[reductions[i].value].is_needed = true;
+  }
+  if (is_failed || (!has_store && !num_of_reductions)) return false;
+  CheckDependences();
+  return !is_failed;
+}
+
+// Code generation
+
+static int MaterializeScalar(int v) {
+  if (scalar_vregs[v]) return scalar_vregs[v];
+  struct Value *x = &values[v];
+  assert(x->kind == kValueUniform);
+  if (x->op == kIRCopy) return scalar_vregs[v] = x->vreg;
+  int srcs[2];
+  for (int s = 0; s < x->num_of_srcs; s++) {
+    srcs[s] = MaterializeScalar(x->srcs[s]);
+  }
+  int dst = AllocIRVReg(func, x->type);
+  struct IRInsn *insn = AppendIRInsn(guard, x->op, x->type, dst);
+  insn->imm = x->imm;
+  insn->sym = x->sym;
+  for (int s = 0; s < x->num_of_srcs; s++) AddIRSrc(insn, srcs[s]);
+  return scalar_vregs[v] = dst;
+}
+
+static int GetConstVReg(enum IRType type, long imm) {
+  int dst = AllocIRVReg(func, type);
+  AppendIRInsn(guard, kIRConst, type, dst)->imm = imm;
+  return dst;
+}
+
+static int GetVector(int v, enum IRType vector_type) {
+  if (!IsUniform(v)) {
+    assert(vector_vregs[v]);
+    return vector_vregs[v];
+  }
+  if (broadcast_vregs[v]) return broadcast_vregs[v];
+  int dst = AllocIRVReg(func, vector_type);
+  AddIRSrc(AppendIRInsn(vector_preheader, kIRBroadcast, vector_type, dst),
+           MaterializeScalar(v));
+  return broadcast_vregs[v] = dst;
+}
+
+// Lane i of a vector is the iteration where the counter is counter + i.
+static void EmitValue(struct IRBlock *body, int v, enum IRType vector_type) {
+  struct Value *x = &values[v];
+  if (x->kind == kValueAffine) {
+    int ofs = AllocIRVReg(func, kIRTypeI64);
+    struct IRInsn *mul = AppendIRInsn(body, kIRMul, kIRTypeI64, ofs);
+    AddIRSrc(mul, counter);
+    AddIRSrc(mul, GetConstVReg(kIRTypeI64, x->imm));
+    vector_vregs[v] = AllocIRVReg(func, kIRTypePtr);
+    struct IRInsn *add =
+        AppendIRInsn(body, kIRAdd, kIRTypePtr, vector_vregs[v]);
+    AddIRSrc(add, MaterializeScalar(x->srcs[0]));
+    AddIRSrc(add, ofs);
+    return;
+  }
+  if (x->kind == kValueStore) {
+    struct IRInsn *store = AppendIRInsn(body, kIRStore, vector_type, 0);
+    AddIRSrc(store, vector_vregs[x->srcs[0]]);
+    AddIRSrc(store, GetVector(x->srcs[1], vector_type));
+    return;
+  }
+  if (x->kind != kValueLanes) return;
+  if (x->op == kIRSext) {
+    vector_vregs[v] = GetVector(x->srcs[0], vector_type);
+    return;
+  }
+  int dst = 0;
+  for (int i = 0; i < num_of_reductions; i++) {
+    if (reductions[i].value == v) dst = reductions[i].acc;
+  }
+  if (!dst) dst = AllocIRVReg(func, vector_type);
+  vector_vregs[v] = dst;
+  struct IRInsn *insn = AppendIRInsn(body, x->op, vector_type, dst);
+  if (x->op == kIRLoad) {
+    AddIRSrc(insn, vector_vregs[x->srcs[0]]);
+    return;
+  }
+  AddIRSrc(insn, GetVector(x->srcs[0], vector_type));
+  if (x->op == kIRShl || x->op == kIRSar) {
+    AddIRSrc(insn, MaterializeScalar(x->srcs[1]));
+  } else if (x->num_of_srcs > 1) {
+    AddIRSrc(insn, GetVector(x->srcs[1], vector_type));
+  }
+}
+
+// Places a copy of the header which continues while counter + lanes - 1
+// passes the test. The compare is done in 64 bits so that the subtraction
+// does not overflow.
+static struct IRBlock *CopyHeader(int index, int num_of_lanes) {
+  struct IRBlock *copy = AllocIRBlock(func);
+  InsertIRBlock(func, index, copy);
+  struct IRBlock *header = loop->header;
+  for (int k = 0; k < header->num_of_insns; k++) {
+    AppendIRInsnCopy(copy, header->insns[k]);
+  }
+  int k = counted.test_index;
+  int delta = AllocIRVReg(func, kIRTypeI64);
+  int limit = AllocIRVReg(func, kIRTypeI64);
+  InsertIRInsn(copy, k++, kIRConst, kIRTypeI64, delta)->imm = num_of_lanes - 1;
+  struct IRInsn *sub = InsertIRInsn(copy, k++, kIRSub, kIRTypeI64, limit);
+  AddIRSrc(sub, counted.test->srcs[counted.limit]);
+  AddIRSrc(sub, delta);
+  copy->insns[k]->srcs[counted.limit] = limit;
+  copy->unroll_hint = 1;
+  copy->prefetch_hint = ScalePrefetchHint(header->prefetch_hint, num_of_lanes);
+  return copy;
+}
+
+static struct IRBlock *AddBlock(int index) {
+  struct IRBlock *b = AllocIRBlock(func);
+  InsertIRBlock(func, index, b);
+  return b;
+}
+
+static void EmitJump(struct IRBlock *b, struct IRBlock *target) {
+  AppendIRInsn(b, kIRJump, kIRTypeNone, 0)->targets[0] = target;
+}
+
+// The vector loop for vector_type is placed before the index-th block, and
+// goes to next when it ends. Returns its preheader.
+static struct IRBlock *EmitVectorLoop(int index, enum IRType vector_type,
+                                      struct IRBlock *next) {
+  int num_of_lanes =
+      GetSizeOfIRType(vector_type) / GetSizeOfIRType(lane_type);
+  struct IRBlock *preheader = AddBlock(index++);
+  struct IRBlock *header = CopyHeader(index++, num_of_lanes);
+  struct IRBlock *body = AddBlock(index++);
+  struct IRBlock *exit = AddBlock(index++);
+  vector_preheader = preheader;
+  for (int i = 0; i < num_of_values; i++) {
+    vector_vregs[i] = 0;
+    broadcast_vregs[i] = 0;
+  }
+  for (int i = 0; i < num_of_reductions; i++) {
+    struct Reduction *r = &reductions[i];
+    r->acc = AllocIRVReg(func, vector_type);
+    // The lanes start from 0 for sums, and from the var for mins and maxes.
+    int init = r->op == kIRAdd ? GetConstVReg(lane_type, 0) : r->var;
+    AddIRSrc(AppendIRInsn(preheader, kIRBroadcast, vector_type, r->acc), init);
+    vector_vregs[AddValue((struct Value){.kind = kValueInit,
+                                         .vreg = r->var})] = r->acc;
+  }
+  for (int i = 1; i < num_of_values; i++) {
+    if (values[i].is_needed) EmitValue(body, i, vector_type);
+  }
+  enum IRType type = func->vreg_types[counter];
+  int incremented = AllocIRVReg(func, type);
+  struct IRInsn *add = AppendIRInsn(body, kIRAdd, type, incremented);
+  AddIRSrc(add, counter);
+  AddIRSrc(add, GetConstVReg(type, num_of_lanes));
+  AddIRSrc(AppendIRInsn(body, kIRSext, type, counter), incremented);
+  EmitJump(body, header);
+  for (int i = 0; i < num_of_reductions; i++) {
+    struct Reduction *r = &reductions[i];
+    enum IRType var_type = func->vreg_types[r->var];
+    int lanes = AllocIRVReg(func, var_type);
+    enum IROp op = r->op == kIRAdd   ? kIRReduceAdd
+                   : r->op == kIRMin ? kIRReduceMin
+                                     : kIRReduceMax;
+    AddIRSrc(AppendIRInsn(exit, op, var_type, lanes), r->acc);
+    if (r->op == kIRAdd) {
+      int sum = AllocIRVReg(func, var_type);
+      struct IRInsn *insn = AppendIRInsn(exit, kIRAdd, var_type, sum);
+      AddIRSrc(insn, r->var);
+      AddIRSrc(insn, lanes);
+      lanes = sum;
+    }
+    AddIRSrc(AppendIRInsn(exit, kIRSext, var_type, r->var), lanes);
+  }
+  // Dirty upper halves of ymm regs slow down the SSE insns which follow.
+  // They are cleared here, on the AVX2 path only, since vzeroupper is
+  // itself an AVX insn.
+  if (GetSizeOfIRType(vector_type) == 32)
+    AppendIRInsn(exit, kIRZeroUpper, kIRTypeNone, 0);
+  EmitJump(exit, next);
+  EmitJump(preheader, header);
+  struct IRInsn *t = GetIRTerminator(header);
+  t->targets[0] = body;
+  t->targets[1] = exit;
+  return preheader;
+}
+
+static int MergeConds(enum IROp op, int a, int b) {
+  int dst = AllocIRVReg(func, kIRTypeI32);
+  struct IRInsn *insn = AppendIRInsn(guard, op, kIRTypeI32, dst);
+  AddIRSrc(insn, a);
+  AddIRSrc(insn, b);
+  return dst;
+}
+
+// The guard checks the distance of the accesses which may alias, and the
+// dispatch chooses the vector loop by the CPU.
+static void Vectorize() {
+  int index = 0;
+  while (func->blocks[index] != loop->header) index++;
+  guard = AddBlock(index++);
+  struct IRBlock *dispatch = AddBlock(index++);
+  int n = num_of_values;
+  scalar_vregs = calloc(n, sizeof(int));
+  vector_vregs = calloc(n, sizeof(int));
+  broadcast_vregs = calloc(n, sizeof(int));
+  assert(scalar_vregs && vector_vregs && broadcast_vregs);
+  // If the lanes divide the const trip count, no iterations remain after the
+  // vector loop, which leaves the loop through a copy of the header without
+  // the test.
+  struct IRBlock *next = loop->header;
+  if (counted.trip_count >= 0 &&
+      counted.trip_count % (32 / GetSizeOfIRType(lane_type)) == 0) {
+    next = AddBlock(index++);
+    for (int k = 0; k < loop->header->num_of_insns; k++) {
+      AppendIRInsnCopy(next, loop->header->insns[k]);
+    }
+    ReplaceIRTerminatorWithJump(next,
+                                GetIRTerminator(loop->header)->targets[1]);
+    RemoveIRInsn(next, counted.test_index);
+  }
+  struct IRBlock *avx2 =
+      EmitVectorLoop(index, GetVectorIRType(lane_type, 32), next);
+  struct IRBlock *sse2 =
+      EmitVectorLoop(index + 4, GetVectorIRType(lane_type, 16), next);
+  int has_avx2 = AllocIRVReg(func, kIRTypeI32);
+  AppendIRInsn(dispatch, kIRHasAVX2, kIRTypeI32, has_avx2);
+  struct IRInsn *branch = AppendIRInsn(dispatch, kIRBranch, kIRTypeNone, 0);
+  AddIRSrc(branch, has_avx2);
+  branch->targets[0] = avx2;
+  branch->targets[1] = sse2;
+  int ok = 0;
+  for (int i = 0; i < num_of_alias_checks; i++) {
+    int a = MaterializeScalar(alias_checks[i][0]);
+    int b = MaterializeScalar(alias_checks[i][1]);
+    int d = AllocIRVReg(func, kIRTypeI64);
+    struct IRInsn *sub = AppendIRInsn(guard, kIRSub, kIRTypeI64, d);
+    AddIRSrc(sub, a);
+    AddIRSrc(sub, b);
+    // d == 0 || d >= MIN_ALIAS_DISTANCE || d <= -MIN_ALIAS_DISTANCE
+    static const enum IROp ops[3] = {kIRCmpEq, kIRCmpGe, kIRCmpLe};
+    static const long limits[3] = {0, MIN_ALIAS_DISTANCE,
+                                   -MIN_ALIAS_DISTANCE};
+    int is_far = 0;
+    for (int k = 0; k < 3; k++) {
+      int limit = GetConstVReg(kIRTypeI64, limits[k]);
+      int t = AllocIRVReg(func, kIRTypeI32);
+      struct IRInsn *cmp = AppendIRInsn(guard, ops[k], kIRTypeI32, t);
+      AddIRSrc(cmp, d);
+      AddIRSrc(cmp, limit);
+      is_far = is_far ? MergeConds(kIROr, is_far, t) : t;
+    }
+    ok = ok ? MergeConds(kIRAnd, ok, is_far) : is_far;
+  }
+  if (ok) {
+    branch = AppendIRInsn(guard, kIRBranch, kIRTypeNone, 0);
+    AddIRSrc(branch, ok);
+    branch->targets[0] = dispatch;
+    branch->targets[1] = loop->header;
+  } else {
+    EmitJump(guard, dispatch);
+  }
+  GetIRTerminator(loop->preheader)->targets[0] = guard;
+  loop->header->unroll_hint = 1;
+  free(broadcast_vregs);
+  free(vector_vregs);
+  free(scalar_vregs);
+}
+
+static bool IsInnermostLoop(struct IRLoop *loops, int num_of_loops, int i) {
+  for (int k = 0; k < num_of_loops; k++) {
+    if (k != i && IsIRBlockInLoop(&loops[i], loops[k].header)) return false;
+  }
+  return true;
+}
+
+static void VectorizeLoop(struct IRLoop *l) {
+  loop = l;
+  if (loop->header->unroll_hint || loop->num_of_blocks > MAX_LOOP_BLOCKS ||
+      !AnalyzeIRCountedLoop(func, loop, &counted) || counted.step != 1 ||
+      counted.is_test_used || counted.has_call || !FindLatch())
+    return;
+  counter = counted.test->srcs[1 - counted.limit];
+  enum IRType counter_type = func->vreg_types[counter];
+  int size = GetAccessSize();
+  if (!size || (counter_type != kIRTypeI32 && counter_type != kIRTypeI64))
+    return;
+  lane_type = size == 1 ? kIRTypeI8 : kIRTypeI32;
+  // The vector loop would not run for less iterations than the SSE2 lanes.
+  if (counted.trip_count >= 0 && counted.trip_count < 16 / size) return;
+  is_defined_in_loop = calloc(func->num_of_vregs + 1, sizeof(bool));
+  is_defined_in_header = calloc(func->num_of_vregs + 1, sizeof(bool));
+  assert(is_defined_in_loop && is_defined_in_header);
+  if (AnalyzeLoop()) Vectorize();
+  for (int i = 0; i < loop->num_of_blocks; i++) free(envs[i]);
+  free(is_defined_in_header);
+  free(is_defined_in_loop);
+}
+
+// Innermost loops are disjoint, so they are vectorized one by one with the
+// loops found at first. Dominators stay valid for the blocks of the loops.
+void VectorizeLoops(struct IRFunc *f) {
+  func = f;
+  int num_of_loops;
+  struct IRLoop *loops = FindIRLoops(f, &num_of_loops);
+  for (int i = 0; i < num_of_loops; i++) {
+    if (IsInnermostLoop(loops, num_of_loops, i)) VectorizeLoop(&loops[i]);
+  }
+  FreeIRLoops(loops, num_of_loops);
+  RemoveUnreachableIRBlocks(f);
+}